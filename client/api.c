@@ -32,8 +32,11 @@
 
 #include <client/internal.h>
 #include <client/remctl.h>
+#include <util/compress.h>
 #include <util/macros.h>
 #include <util/network.h>
+#include <util/protocol.h>
+#include <util/tokens.h>
 
 
 /*
@@ -65,71 +68,138 @@ internal_fail(struct remctl *r, struct remctl_result *result)
 }
 
 
+/* Minimum size to allocate for output buffers in a struct remctl_result. */
+#define RESULT_MIN_SIZE 1024
+
+/* Used to accumulate output into a struct remctl_result. */
+struct internal_result {
+    struct remctl_result *result;
+    size_t stdout_size;         /* Allocated size of stdout_buf. */
+    size_t stderr_size;         /* Allocated size of stderr_buf. */
+    bool failed;                /* Whether appending output failed. */
+};
+
+
 /*
- * Given a struct remctl_result into which we're accumulating output and a
- * struct remctl_output that contains a fragment of output, append the output
- * to the appropriate slot in the result.  This is not particularly efficient.
- * Returns false if something fails and tries to set result->error; if we
+ * Given the state for a struct remctl_result into which we're accumulating
+ * output and a struct remctl_output that contains a fragment of output,
+ * append the output to the appropriate slot in the result.  Output buffers
+ * grow geometrically so that large output doesn't cost a reallocation per
+ * token.  Called via remctl_output_callback, so returns true to continue and
+ * false to stop.  If something fails, tries to set result->error; if we
  * can't even do that, make sure it's set to NULL.
  */
-static bool
-internal_output_append(struct remctl_result *result,
-                       struct remctl_output *output)
+static int
+internal_output_append(const struct remctl_output *output, void *data)
 {
+    struct internal_result *state = data;
+    struct remctl_result *result = state->result;
     char **buffer = NULL;
     size_t *length = NULL;
-    char *old, *newbuf;
-    size_t oldlen, newlen;
+    size_t *size = NULL;
+    char *newbuf;
+    size_t oldlen, newlen, newsize;
     int status;
 
-    if (output->type == REMCTL_OUT_ERROR)
+    if (output->type == REMCTL_OUT_STATUS) {
+        result->status = output->status;
+        return true;
+    } else if (output->type == REMCTL_OUT_ERROR)
         buffer = &result->error;
     else if (output->type == REMCTL_OUT_OUTPUT && output->stream == 1) {
         buffer = &result->stdout_buf;
         length = &result->stdout_len;
+        size = &state->stdout_size;
     } else if (output->type == REMCTL_OUT_OUTPUT && output->stream == 2) {
         buffer = &result->stderr_buf;
         length = &result->stderr_len;
+        size = &state->stderr_size;
     } else if (output->type == REMCTL_OUT_OUTPUT) {
         free(result->error);
         status = asprintf(&result->error, "bad output stream %d",
                           output->stream);
         if (status < 0)
             result->error = NULL;
+        state->failed = true;
         return false;
     } else {
         free(result->error);
         result->error = strdup("internal error: bad output type");
+        state->failed = true;
         return false;
     }
 
-    /* We've done our setup, so now we can do the actual manipulation. */
-    old = *buffer;
-    if (length != NULL)
+    /*
+     * The error message only arrives once, so allocate it exactly.  Output
+     * may arrive in any number of pieces, so at least double the size of its
+     * buffer when it has to grow.
+     */
+    if (length == NULL) {
+        oldlen = (*buffer == NULL) ? 0 : strlen(*buffer);
+        newlen = oldlen + output->length + 1;
+        newsize = newlen;
+    } else {
         oldlen = *length;
-    else if (old == NULL)
-        oldlen = 0;
-    else
-        oldlen = strlen(old);
-    newlen = oldlen + output->length;
-    if (output->type == REMCTL_OUT_ERROR)
-        newlen++;
-    newbuf = realloc(*buffer, newlen);
-    if (newbuf == NULL) {
-        free(result->error);
-        result->error = strdup("cannot allocate memory");
-        return false;
+        newlen = oldlen + output->length;
+        newsize = *size;
+        if (newlen > newsize) {
+            newsize = (newsize < RESULT_MIN_SIZE) ? RESULT_MIN_SIZE : newsize;
+            while (newsize < newlen && newsize <= SIZE_MAX / 2)
+                newsize *= 2;
+            if (newsize < newlen)
+                newsize = newlen;
+        }
     }
-    *buffer = newbuf;
+    if (length == NULL || newsize != *size) {
+        newbuf = realloc(*buffer, newsize);
+        if (newbuf == NULL) {
+            free(result->error);
+            result->error = strdup("cannot allocate memory");
+            state->failed = true;
+            return false;
+        }
+        *buffer = newbuf;
+        if (size != NULL)
+            *size = newsize;
+    }
+    if (output->length > 0)
+        memcpy(*buffer + oldlen, output->data, output->length);
     if (length != NULL)
         *length = newlen;
-    memcpy(*buffer + oldlen, output->data, output->length);
-    if (output->type == REMCTL_OUT_ERROR)
+    else
         (*buffer)[newlen - 1] = '\0';
     return true;
 }
 
 
+/*
+ * Run a command on an open connection and accumulate its output in a struct
+ * remctl_result.  An error from the remote command is stored in
+ * result->error and is not a failure.  Returns false on any other failure, in
+ * which case the connection may no longer be usable and result->error is set
+ * to the error if possible.
+ */
+bool
+internal_run(struct remctl *r, const char **command,
+             struct remctl_result *result)
+{
+    struct internal_result state;
+
+    memset(&state, 0, sizeof(state));
+    state.result = result;
+    if (!remctl_command(r, command)) {
+        result->error = strdup(remctl_error(r));
+        return false;
+    }
+    if (!remctl_output_callback(r, internal_output_append, &state)) {
+        if (!state.failed)
+            result->error = strdup(remctl_error(r));
+        return false;
+    }
+    return true;
+}
+
+
 /*
  * The simplified interface.  Given a host, a port, and a command (as a
  * null-terminated argv-style vector), run the command on that host and port
@@ -142,41 +212,22 @@ remctl(const char *host, unsigned short port, const char *principal,
 {
     struct remctl *r = NULL;
     struct remctl_result *result;
-    enum remctl_output_type type;
 
     result = calloc(1, sizeof(struct remctl_result));
     if (result == NULL)
         return NULL;
     r = remctl_new();
-    if (r == NULL)
-        return internal_fail(r, result);
+    if (r == NULL) {
+        free(result);
+        return NULL;
+    }
     if (!remctl_open(r, host, port, principal))
         return internal_fail(r, result);
-    if (!remctl_command(r, command))
-        return internal_fail(r, result);
-    do {
-        struct remctl_output *output;
-
-        output = remctl_output(r);
-        if (output == NULL)
-            return internal_fail(r, result);
-        type = output->type;
-        if (type == REMCTL_OUT_OUTPUT || type == REMCTL_OUT_ERROR) {
-            if (!internal_output_append(result, output)) {
-                if (result->error != NULL)
-                    return result;
-                else {
-                    remctl_result_free(result);
-                    return NULL;
-                }
-            }
-        } else if (type == REMCTL_OUT_STATUS) {
-            result->status = output->status;
-        } else {
-            remctl_close(r);
-            return result;
-        }
-    } while (type == REMCTL_OUT_OUTPUT);
+    if (!internal_run(r, command, result) && result->error == NULL) {
+        remctl_close(r);
+        remctl_result_free(result);
+        return NULL;
+    }
     remctl_close(r);
     return result;
 }
@@ -215,6 +266,7 @@ remctl_new(void)
         return NULL;
     r->fd = INVALID_SOCKET;
     r->context = GSS_C_NO_CONTEXT;
+    r->max_data = TOKEN_MAX_DATA;
     return r;
 }
 
@@ -313,18 +365,96 @@ remctl_set_timeout(struct remctl *r, time_t timeout)
 }
 
 
+/*
+ * Set the maximum token data size to ask the server for when opening a
+ * connection, which may be 0 to use the protocol default (the default).
+ * Larger tokens reduce per-token overhead for commands with large arguments
+ * or output.  Returns true on success, false on a size outside the range the
+ * protocol allows.
+ */
+int
+remctl_set_token_size(struct remctl *r, size_t size)
+{
+    if (size != 0 && (size < TOKEN_MAX_DATA || size > TOKEN_MAX_DATA_LIMIT)) {
+        internal_set_error(r, "invalid token size %lu (must be between %lu"
+                           " and %lu)", (unsigned long) size,
+                           (unsigned long) TOKEN_MAX_DATA,
+                           (unsigned long) TOKEN_MAX_DATA_LIMIT);
+        return 0;
+    }
+    r->token_size = size;
+    return 1;
+}
+
+
+/*
+ * Set whether to ask the server to compress output and to compress commands
+ * sent to the server, which only takes effect on the next connection.  Returns
+ * true on success, false if compression was requested but this library was
+ * built without support for any compression method.
+ */
+int
+remctl_set_compression(struct remctl *r, int compress)
+{
+    if (compress && compress_methods() == 0) {
+        internal_set_error(r, "compression not supported");
+        return 0;
+    }
+    r->compress = compress ? true : false;
+    return 1;
+}
+
+
+/*
+ * Set whether remctl_open should look up _remctl._tcp SRV records for the
+ * host when not given a port.  Returns true on success, false if lookups were
+ * requested but this library was built without a resolver that supports them.
+ */
+int
+remctl_set_srv_lookup(struct remctl *r, int lookup)
+{
+#ifdef HAVE_RES_SEARCH
+    r->srv_lookup = lookup ? true : false;
+    return 1;
+#else
+    if (lookup) {
+        internal_set_error(r, "SRV lookups not supported");
+        return 0;
+    }
+    r->srv_lookup = false;
+    return 1;
+#endif
+}
+
+
+/*
+ * Set whether to allow the server to send output with integrity protection
+ * only, without encryption, for commands configured that way.  This only
+ * takes effect on the next connection.  Always returns true.
+ */
+int
+remctl_set_integrity_only(struct remctl *r, int allow)
+{
+    r->integrity = allow ? true : false;
+    return 1;
+}
+
+
 static void
 internal_reset(struct remctl *r)
 {
     if (r->fd != -1) {
-        if (r->protocol > 1)
+        if (r->protocol > 1
+            && (r->async == NULL || r->async->state == ASYNC_OPEN))
             internal_v2_quit(r);
         socket_close(r->fd);
+        r->fd = INVALID_SOCKET;
     }
+    internal_async_free(r);
     free(r->error);
     r->error = NULL;
     if (r->output != NULL) {
-        internal_output_wipe(r->output);
+        internal_output_wipe(r);
         free(r->output);
         r->output = NULL;
     }
@@ -341,6 +471,7 @@ remctl_open(struct remctl *r, const char *host, unsigned short port,
 {
     bool port_fallback = false;
     socket_type fd = INVALID_SOCKET;
+    const char *target;
     char *old_error;
 
     /* Reset and reconfigure the client object. */
@@ -349,6 +480,20 @@ remctl_open(struct remctl *r, const char *host, unsigned short port,
     r->port = port;
     r->principal = principal;
 
+    /*
+     * If port is 0 and SRV lookups are enabled, connect to a server found
+     * through SRV records if there are any.  The default principal is then
+     * based on the name of the server rather than the name that was looked
+     * up, since that's the host that will have the keytab.
+     */
+    if (port == 0 && r->srv_lookup
+        && internal_srv_connect(r, host, &fd, &target)) {
+        if (fd == INVALID_SOCKET)
+            return false;
+        r->fd = fd;
+        return internal_open(r, target, principal);
+    }
+
     /*
      * If port is 0, default to trying the standard port and then falling back
      * on the old port.
@@ -382,6 +527,24 @@ remctl_open(struct remctl *r, const char *host, unsigned short port,
 }
 
 
+/*
+ * Start opening a new persistant remctl connection to a server without
+ * waiting, given the host, port, and principal.  The rest of the work of
+ * opening the connection is done by remctl_step.  Returns true on success and
+ * false on failure.
+ */
+int
+remctl_open_async(struct remctl *r, const char *host, unsigned short port,
+                  const char *principal)
+{
+    internal_reset(r);
+    r->host = host;
+    r->port = port;
+    r->principal = principal;
+    return internal_async_open(r, host, port, principal);
+}
+
+
 /*
  * Open a new remctl connection to a server, given the hostname, address
  * information, and principal.  At least one of host or principal is required.
@@ -463,7 +626,8 @@ remctl_close(struct remctl *r)
         return;
 
     /* If we have an open connection, shut it down. */
-    if (r->protocol > 1 && r->fd != -1)
+    if (r->protocol > 1 && r->fd != -1
+        && (r->async == NULL || r->async->state == ASYNC_OPEN))
         internal_v2_quit(r);
     if (r->fd != INVALID_SOCKET) {
         shutdown(r->fd, SHUT_RDWR);
@@ -471,6 +635,18 @@ remctl_close(struct remctl *r)
     }
     if (r->context != GSS_C_NO_CONTEXT)
         gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+    if (r->output != NULL) {
+        internal_output_wipe(r);
+        free(r->output);
+    }
+    internal_async_free(r);
+    internal_srv_free(r);
+    token_reader_free(r->reader);
+    compressor_free(r->compressor);
+    decompressor_free(r->decompressor);
+    free(r->send_buffer);
+    free(r->compress_buffer);
+    free(r->inflate_buffer);
 
     /* If we have a registered ticket cache, free those resources. */
 #ifdef HAVE_KRB5
@@ -485,10 +661,6 @@ remctl_close(struct remctl *r)
     free(r->source);
     free(r->ccache);
     free(r->error);
-    if (r->output != NULL) {
-        free(r->output->data);
-        free(r->output);
-    }
     free(r);
 
     /*
@@ -502,20 +674,25 @@ remctl_close(struct remctl *r)
 /*
  * Internal function to reopen the connection if it was closed and verify that
  * we have an open connection, and reset the error message.  Used by
- * remctl_commandv and remctl_noop.  Returns true on success and false on
+ * remctl_commandv and remctl_noop.  Asynchronous connections are never
+ * reopened, since that would block.  Returns true on success and false on
  * failure.
  */
 static bool
 internal_reopen(struct remctl *r)
 {
     if (r->fd == INVALID_SOCKET) {
-        if (r->host == NULL) {
+        if (r->host == NULL || r->async != NULL) {
             internal_set_error(r, "no connection open");
             return false;
         }
         if (!remctl_open(r, r->host, r->port, r->principal))
             return false;
     }
+    if (r->async != NULL && r->async->state != ASYNC_OPEN) {
+        internal_set_error(r, "connection not yet open");
+        return false;
+    }
     free(r->error);
     r->error = NULL;
     return true;
@@ -589,6 +766,14 @@ remctl_noop(struct remctl *r)
         internal_set_error(r, "NOOP message not supported");
         return 0;
     }
+    if (r->async != NULL) {
+        internal_set_error(r, "NOOP not supported on asynchronous"
+                           " connections");
+        return 0;
+    }
+
+    /* Output data may point into buffers that reading the reply reuses. */
+    internal_output_wipe(r);
     return internal_noop(r);
 }
 
@@ -596,15 +781,20 @@ remctl_noop(struct remctl *r)
 /*
  * Helper function for remctl_output implementations.  Free and reset the
  * elements of the output struct, but don't free the output struct itself.
+ * Protocol v2 output data points into the token it came from, which is held
+ * in the remctl struct until now, so release that token instead.
  */
 void
-internal_output_wipe(struct remctl_output *output)
+internal_output_wipe(struct remctl *r)
 {
-    if (output == NULL)
+    if (r->output == NULL)
         return;
-    free(output->data);
-    memset(output, 0, sizeof(*output));
-    output->type = REMCTL_OUT_DONE;
+    if (r->output_token.value != NULL)
+        internal_v2_release_token(r, &r->output_token);
+    else
+        free(r->output->data);
+    memset(r->output, 0, sizeof(*r->output));
+    r->output->type = REMCTL_OUT_DONE;
 }
 
 
@@ -631,6 +821,10 @@ remctl_output(struct remctl *r)
     }
     free(r->error);
     r->error = NULL;
+    if (r->async != NULL && r->ready && !token_reader_buffered(r->reader)) {
+        internal_set_error(r, "output not yet available");
+        return NULL;
+    }
     if (r->protocol == 1)
         return internal_v1_output(r);
     else
@@ -638,6 +832,39 @@ remctl_output(struct remctl *r)
 }
 
 
+/*
+ * Pass all output from the current command to a callback, until and
+ * including the REMCTL_OUT_STATUS or REMCTL_OUT_ERROR output that ends it.
+ * The output struct and its data are only valid during the call, which
+ * avoids the caller needing any buffering of its own.  Returns true on
+ * success and false on failure, including if the callback returns false.
+ */
+int
+remctl_output_callback(struct remctl *r, remctl_output_func callback,
+                       void *data)
+{
+    struct remctl_output *output;
+
+    if (r->async != NULL) {
+        internal_set_error(r, "output callback not supported on asynchronous"
+                           " connections");
+        return 0;
+    }
+    do {
+        output = remctl_output(r);
+        if (output == NULL)
+            return 0;
+        if (output->type == REMCTL_OUT_DONE)
+            return 1;
+        if (!callback(output, data)) {
+            internal_set_error(r, "output callback failed");
+            return 0;
+        }
+    } while (output->type == REMCTL_OUT_OUTPUT);
+    return 1;
+}
+
+
 /*
  * Returns the internal error message after a failure or "no error" if the
  * last command completed successfully.  This should generally only be called
@@ -0,0 +1,510 @@
+/*
+ * Asynchronous interface to remctl connections.
+ *
+ * Opening a connection with remctl_open_async starts a non-blocking connect
+ * and returns immediately.  From then on, all network I/O for the connection
+ * is done by remctl_step, which does whatever it can without waiting and
+ * then returns.  The caller waits for the events returned by remctl_events
+ * on the descriptor returned by remctl_fd with its own event loop, so a
+ * single thread can drive any number of connections.
+ *
+ * Outgoing tokens are queued in memory and written as the socket accepts
+ * them, and incoming tokens are collected in the buffered token reader until
+ * a complete token is available, at which point the normal blocking parsing
+ * code can process it without touching the network.  Only protocol version 2
+ * and later are supported, since protocol version 1 requires a MIC exchange
+ * in the middle of sending and receiving each token.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <util/fdflag.h>
+#include <util/network.h>
+#include <util/protocol.h>
+#include <util/tokens.h>
+
+
+/*
+ * Free the state for an asynchronous connection, including anything left
+ * over from an incomplete open.  The connection itself is closed by the
+ * caller.
+ */
+void
+internal_async_free(struct remctl *r)
+{
+    OM_uint32 minor;
+
+    if (r->async == NULL)
+        return;
+    if (r->async->addresses != NULL)
+        freeaddrinfo(r->async->addresses);
+    if (r->async->name != GSS_C_NO_NAME)
+        gss_release_name(&minor, &r->async->name);
+    if (r->async->cred != GSS_C_NO_CREDENTIAL)
+        gss_release_cred(&minor, &r->async->cred);
+    free(r->async->pending);
+    free(r->async);
+    r->async = NULL;
+}
+
+
+/*
+ * Fail an asynchronous connection, closing it and discarding the GSS-API
+ * context.  The error must already be set.  The rest of the asynchronous
+ * state is kept so that later calls report that no connection is open rather
+ * than reopening it.  Always returns REMCTL_STEP_ERROR for the convenience of
+ * the caller.
+ */
+static enum remctl_step_status
+async_fail(struct remctl *r)
+{
+    OM_uint32 minor;
+
+    if (r->fd != INVALID_SOCKET) {
+        socket_close(r->fd);
+        r->fd = INVALID_SOCKET;
+    }
+    if (r->context != GSS_C_NO_CONTEXT)
+        gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+    r->ready = false;
+    return REMCTL_STEP_ERROR;
+}
+
+
+/*
+ * Queue a token to send on an asynchronous connection, adding the token
+ * framing.  The queued data is written by remctl_step.  Returns true on
+ * success and false on memory allocation failure, setting the error.
+ */
+bool
+internal_async_queue(struct remctl *r, int flags, const void *data,
+                     size_t length)
+{
+    struct internal_async *async = r->async;
+    size_t needed, size;
+    char *pending;
+
+    /* Discard data that has already been sent before adding more. */
+    if (async->pending_start == async->pending_end) {
+        async->pending_start = 0;
+        async->pending_end = 0;
+    }
+    needed = async->pending_end + TOKEN_HEADER_SIZE + length;
+    if (needed < length) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(ENOMEM));
+        return false;
+    }
+    if (async->pending_size < needed) {
+        size = (async->pending_size == 0) ? 1024 : async->pending_size;
+        while (size < needed)
+            size *= 2;
+        pending = realloc(async->pending, size);
+        if (pending == NULL) {
+            internal_set_error(r, "cannot allocate memory: %s",
+                               strerror(errno));
+            return false;
+        }
+        async->pending = pending;
+        async->pending_size = size;
+    }
+    if (!token_frame(async->pending + async->pending_end, flags, length)) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    if (length > 0)
+        memcpy(async->pending + async->pending_end + TOKEN_HEADER_SIZE, data,
+               length);
+    async->pending_end = needed;
+    return true;
+}
+
+
+/*
+ * Write as much of the queued data as the socket will take without blocking.
+ * Returns true on success (whether or not everything was written) and false
+ * on a network error, setting the error.
+ */
+static bool
+async_flush(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+    ssize_t status;
+
+    while (async->pending_start < async->pending_end) {
+        status = socket_write(r->fd, async->pending + async->pending_start,
+                              async->pending_end - async->pending_start);
+        if (status < 0) {
+            if (socket_errno == EINTR)
+                continue;
+            if (socket_errno == EAGAIN)
+                return true;
+            internal_set_error(r, "error sending token: %s",
+                               socket_strerror(socket_errno));
+            return false;
+        }
+        async->pending_start += (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * Start a non-blocking connect to the next address to try, falling back on
+ * the legacy port if we run out of addresses for the standard one.  err is
+ * the error from the previous attempt, if any.  Returns true if a connect is
+ * in progress or complete and false if there are no more addresses to try,
+ * in which case the error is set.
+ */
+static bool
+async_connect(struct remctl *r, int err)
+{
+    struct internal_async *async = r->async;
+    struct addrinfo hints, *ai;
+    char portbuf[16];
+    socket_type fd;
+    int status;
+
+    for (;;) {
+        while (async->next != NULL) {
+            ai = async->next;
+            async->next = ai->ai_next;
+            fd = network_client_create(ai->ai_family, SOCK_STREAM, r->source);
+            if (fd == INVALID_SOCKET) {
+                err = socket_errno;
+                continue;
+            }
+            if (!fdflag_nonblocking(fd, true)) {
+                err = socket_errno;
+                socket_close(fd);
+                continue;
+            }
+            status = connect(fd, ai->ai_addr, ai->ai_addrlen);
+            if (status == 0 || socket_errno == EINPROGRESS) {
+                r->fd = fd;
+                return true;
+            }
+            err = socket_errno;
+            socket_close(fd);
+        }
+
+        /*
+         * Out of addresses.  If we're going to fall back on the legacy port,
+         * report the error for the standard port by preference, as
+         * remctl_open does.
+         */
+        if (r->error == NULL)
+            internal_set_error(r, "cannot connect to %s (port %hu): %s",
+                               r->host, async->port, socket_strerror(err));
+        if (!async->fallback)
+            return false;
+        async->fallback = false;
+        async->port = REMCTL_PORT_OLD;
+        freeaddrinfo(async->addresses);
+        async->addresses = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(portbuf, sizeof(portbuf), "%hu", async->port);
+        if (getaddrinfo(r->host, portbuf, &hints, &async->addresses) != 0) {
+            async->addresses = NULL;
+            return false;
+        }
+        async->next = async->addresses;
+    }
+}
+
+
+/*
+ * Check whether a non-blocking connect has completed.  Sets done and returns
+ * true if the connect succeeded or is still in progress.  If it failed, move
+ * on to the next address, returning false only if there are no more.
+ */
+static bool
+async_connected(struct remctl *r, bool *done)
+{
+    struct sockaddr_storage addr;
+    socklen_t length;
+    int err = 0;
+
+    *done = false;
+    length = sizeof(err);
+    if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &length) < 0)
+        err = socket_errno;
+    if (err == 0) {
+        length = sizeof(addr);
+        if (getpeername(r->fd, (struct sockaddr *) &addr, &length) == 0)
+            *done = true;
+        return true;
+    }
+    socket_close(r->fd);
+    r->fd = INVALID_SOCKET;
+    return async_connect(r, err);
+}
+
+
+/*
+ * Take the next step in establishing the GSS-API context, given the token
+ * from the server or GSS_C_NO_BUFFER to start.  Queues any token we have to
+ * send in reply.  Once the context is complete, queues the capabilities
+ * request if there is anything to negotiate.  Returns true on success and
+ * false on failure, setting the error.
+ */
+static bool
+async_context(struct remctl *r, gss_buffer_t token)
+{
+    struct internal_async *async = r->async;
+    gss_buffer_desc send_tok;
+    OM_uint32 major, minor, init_minor, gss_flags;
+    bool okay;
+
+    major = gss_init_sec_context(&init_minor, async->cred, &r->context,
+                async->name, (const gss_OID) GSS_KRB5_MECHANISM,
+                INTERNAL_GSS_FLAGS, 0, NULL, token, NULL, &send_tok,
+                &gss_flags, NULL);
+    if (send_tok.length != 0) {
+        okay = internal_async_queue(r, TOKEN_CONTEXT | TOKEN_PROTOCOL,
+                                    send_tok.value, send_tok.length);
+        gss_release_buffer(&minor, &send_tok);
+        if (!okay)
+            return false;
+    }
+    if (major == GSS_S_CONTINUE_NEEDED)
+        return true;
+    if (major != GSS_S_COMPLETE) {
+        internal_gssapi_error(r, "initializing context", major, init_minor);
+        return false;
+    }
+    if ((gss_flags & INTERNAL_GSS_FLAGS_REQUIRED)
+        != INTERNAL_GSS_FLAGS_REQUIRED) {
+        internal_set_error(r, "server did not negotiate acceptable GSS-API"
+                           " flags");
+        return false;
+    }
+
+    /* The context is complete.  Negotiate capabilities if needed. */
+    gss_release_name(&minor, &async->name);
+    if (async->cred != GSS_C_NO_CREDENTIAL)
+        gss_release_cred(&minor, &async->cred);
+    r->ready = false;
+    if (r->token_size > TOKEN_MAX_DATA || r->compress || r->integrity) {
+        async->state = ASYNC_CAPABILITIES;
+        return internal_capabilities_request(r);
+    }
+    async->state = ASYNC_OPEN;
+    return true;
+}
+
+
+/*
+ * Start opening a connection asynchronously.  Resolves the host, which may
+ * block if it isn't given as an address, and starts a non-blocking connect
+ * to the first address.  If port is 0, the standard port is tried first and
+ * then the legacy port.  Returns true on success and false on failure,
+ * setting the error.
+ */
+bool
+internal_async_open(struct remctl *r, const char *host, unsigned short port,
+                    const char *principal)
+{
+    struct internal_async *async;
+    struct addrinfo hints;
+    char portbuf[16];
+    int status;
+    OM_uint32 minor;
+
+    /* Discard any context left over from a previous connection. */
+    if (r->context != GSS_C_NO_CONTEXT)
+        gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+    async = calloc(1, sizeof(struct internal_async));
+    if (async == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    async->state = ASYNC_CONNECT;
+    async->name = GSS_C_NO_NAME;
+    async->cred = GSS_C_NO_CREDENTIAL;
+    r->async = async;
+
+    /* Look up the remote host. */
+    if (port == 0) {
+        port = REMCTL_PORT;
+        async->fallback = true;
+    }
+    async->port = port;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(portbuf, sizeof(portbuf), "%hu", port);
+    status = getaddrinfo(host, portbuf, &hints, &async->addresses);
+    if (status != 0) {
+        async->addresses = NULL;
+        internal_set_error(r, "unknown host %s: %s", host,
+                           gai_strerror(status));
+        return false;
+    }
+    async->next = async->addresses;
+
+    /* Get the server name and client credentials ready. */
+    if (!internal_import_name(r, host, principal, &async->name))
+        return false;
+    if (r->ccache != NULL)
+        if (!internal_set_cred(r, &async->cred))
+            return false;
+
+    /* Start the connection. */
+    return async_connect(r, 0);
+}
+
+
+/*
+ * Return the file descriptor of the connection, or INVALID_SOCKET if there
+ * is no open connection.  During an asynchronous open, this may change after
+ * each call to remctl_step.
+ */
+socket_type
+remctl_fd(struct remctl *r)
+{
+    return r->fd;
+}
+
+
+/*
+ * Return the events that remctl_step is waiting for on the connection, as a
+ * combination of REMCTL_WANT_READ and REMCTL_WANT_WRITE.  Returns 0 if there
+ * is nothing to wait for, either because remctl_step can make progress right
+ * away or because it has nothing more to do.
+ */
+int
+remctl_events(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+
+    if (async == NULL || r->fd == INVALID_SOCKET)
+        return 0;
+    if (async->state == ASYNC_CONNECT)
+        return REMCTL_WANT_WRITE;
+    if (async->pending_start < async->pending_end)
+        return REMCTL_WANT_WRITE;
+    if (async->state == ASYNC_OPEN && !r->ready)
+        return 0;
+    if (token_reader_buffered(r->reader))
+        return 0;
+    return REMCTL_WANT_READ;
+}
+
+
+/*
+ * Do whatever network I/O is possible on an asynchronous connection without
+ * waiting.  Returns REMCTL_STEP_DONE when the connection is open, any queued
+ * command has been sent, and, if output is expected, the next output from
+ * the server is available to remctl_output without blocking.  Returns
+ * REMCTL_STEP_AGAIN if the caller should wait for remctl_events on remctl_fd
+ * and then call this function again, and REMCTL_STEP_ERROR on failure, after
+ * which the connection is closed.
+ */
+enum remctl_step_status
+remctl_step(struct remctl *r)
+{
+    struct internal_async *async = r->async;
+    gss_buffer_desc token;
+    enum token_status status;
+    bool ready;
+    size_t max;
+    int flags;
+
+    if (async == NULL || r->fd == INVALID_SOCKET) {
+        internal_set_error(r, "no connection open");
+        return REMCTL_STEP_ERROR;
+    }
+
+    /*
+     * Wait for the connection and then start establishing the context.  The
+     * error from a failed connection to the standard port is kept while
+     * trying the legacy port so that it can be reported by preference.
+     */
+    if (async->state == ASYNC_CONNECT) {
+        if (!async_connected(r, &ready))
+            return async_fail(r);
+        if (!ready)
+            return REMCTL_STEP_AGAIN;
+        free(r->error);
+        r->error = NULL;
+        if (!internal_open_prepare(r))
+            return async_fail(r);
+        flags = TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL;
+        if (!internal_async_queue(r, flags, "", 0))
+            return async_fail(r);
+        async->state = ASYNC_CONTEXT;
+        if (!async_context(r, GSS_C_NO_BUFFER))
+            return async_fail(r);
+    }
+
+    free(r->error);
+    r->error = NULL;
+
+    /*
+     * Send whatever we have queued and then process tokens from the server
+     * until we need to wait or have nothing more to do.
+     */
+    for (;;) {
+        if (!async_flush(r))
+            return async_fail(r);
+        if (async->pending_start < async->pending_end)
+            return REMCTL_STEP_AGAIN;
+        if (async->state == ASYNC_OPEN && !r->ready)
+            return REMCTL_STEP_DONE;
+        if (async->state == ASYNC_CONTEXT)
+            max = TOKEN_MAX_LENGTH;
+        else
+            max = TOKEN_MAX_LENGTH_FOR(r->max_data);
+        status = token_reader_poll(r->reader, max, &ready);
+        if (status != TOKEN_OK) {
+            internal_token_error(r, "receiving token", status, 0, 0);
+            return async_fail(r);
+        }
+        if (!ready)
+            return REMCTL_STEP_AGAIN;
+
+        /* A complete token is buffered, so none of this will block. */
+        switch (async->state) {
+        case ASYNC_OPEN:
+            return REMCTL_STEP_DONE;
+        case ASYNC_CAPABILITIES:
+            if (!internal_capabilities_reply(r))
+                return async_fail(r);
+            async->state = ASYNC_OPEN;
+            break;
+        case ASYNC_CONTEXT:
+            status = token_reader_recv(r->reader, &flags, &token, max, 0);
+            if (status != TOKEN_OK) {
+                internal_token_error(r, "receiving token", status, 0, 0);
+                return async_fail(r);
+            }
+            if ((flags & TOKEN_PROTOCOL) != TOKEN_PROTOCOL) {
+                internal_set_error(r, "server does not support protocol"
+                                   " version 2");
+                return async_fail(r);
+            }
+            if (!async_context(r, &token))
+                return async_fail(r);
+            break;
+        case ASYNC_CONNECT:
+        default:
+            internal_set_error(r, "internal error: unexpected state %d",
+                               (int) async->state);
+            return async_fail(r);
+        }
+    }
+}
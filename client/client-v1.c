@@ -121,7 +121,7 @@ internal_v1_output(struct remctl *r)
         if (r->output->type == REMCTL_OUT_STATUS)
             r->output->type = REMCTL_OUT_DONE;
         else {
-            internal_output_wipe(r->output);
+            internal_output_wipe(r);
             r->output->type = REMCTL_OUT_STATUS;
         }
         r->output->status = r->status;
@@ -129,8 +129,9 @@ internal_v1_output(struct remctl *r)
     }
 
     /* Otherwise, we have to read the token from the server. */
-    status = token_recv_priv(r->fd, r->context, &flags, &token,
-                             TOKEN_MAX_LENGTH, r->timeout, &major, &minor);
+    status = token_reader_recv_priv(r->reader, r->context, &flags, &token,
+                                    TOKEN_MAX_LENGTH, r->timeout, NULL,
+                                    &major, &minor);
     if (status != TOKEN_OK) {
         internal_token_error(r, "receiving token", status, major, minor);
         if (status == TOKEN_FAIL_EOF || status == TOKEN_FAIL_TIMEOUT) {
@@ -23,10 +23,81 @@
 
 #include <client/internal.h>
 #include <client/remctl.h>
+#include <util/compress.h>
 #include <util/gss-tokens.h>
 #include <util/protocol.h>
 
 
+/*
+ * Send a token made up of the data in an array of iovecs.  If compression was
+ * negotiated and the token is large enough, first try to compress it, sending
+ * it as a MESSAGE_COMPRESSED message instead if that makes it smaller.  On
+ * an asynchronous connection, the token is queued instead of sent.  Returns
+ * true on success, false on failure.
+ */
+static bool
+internal_v2_send_iov(struct remctl *r, const struct iovec *iov, size_t count)
+{
+    struct iovec compressed;
+    size_t i, length, size;
+    OM_uint32 data, major, minor;
+    int status;
+
+    length = 0;
+    for (i = 0; i < count; i++)
+        length += iov[i].iov_len;
+    if (r->compressor != NULL && length >= COMPRESSION_MIN_SIZE) {
+        if (r->compress_size < length) {
+            free(r->compress_buffer);
+            r->compress_size = 0;
+            r->compress_buffer = malloc(length);
+            if (r->compress_buffer == NULL) {
+                internal_set_error(r, "cannot allocate memory: %s",
+                                   strerror(errno));
+                return false;
+            }
+            r->compress_size = length;
+        }
+
+        /* Only use the result if it saves at least one octet. */
+        size = length - COMPRESSION_HEADER_SIZE - 1;
+        if (compressor_compress(r->compressor, iov, count,
+                                r->compress_buffer + COMPRESSION_HEADER_SIZE,
+                                &size)) {
+            r->compress_buffer[0] = 4;
+            r->compress_buffer[1] = MESSAGE_COMPRESSED;
+            r->compress_buffer[2] = (char) compressor_method(r->compressor);
+            data = htonl((OM_uint32) length);
+            memcpy(r->compress_buffer + 3, &data, 4);
+            compressed.iov_base = r->compress_buffer;
+            compressed.iov_len = COMPRESSION_HEADER_SIZE + size;
+            iov = &compressed;
+            count = 1;
+        }
+    }
+
+    /* Asynchronous connections queue the token to be sent by remctl_step. */
+    if (r->async != NULL) {
+        status = token_wrap_priv_iov(r->context, iov, count, &r->send_buffer,
+                                     &r->send_size, &size, &major, &minor);
+        if (status == TOKEN_OK)
+            return internal_async_queue(r, TOKEN_DATA | TOKEN_PROTOCOL,
+                                        r->send_buffer + TOKEN_HEADER_SIZE,
+                                        size);
+    } else {
+        status = token_send_priv_iov(r->fd, r->context,
+                                     TOKEN_DATA | TOKEN_PROTOCOL, iov, count,
+                                     &r->send_buffer, &r->send_size,
+                                     r->timeout, &major, &minor);
+    }
+    if (status != TOKEN_OK) {
+        internal_token_error(r, "sending token", status, major, minor);
+        return false;
+    }
+    return true;
+}
+
+
 /*
  * Send a command to the server using protocol v2.  Returns true on success,
  * false on failure.
@@ -39,16 +110,22 @@
  * don't, for instance, ever split numbers across token boundaries), but we do
  * use this to handle commands where all the data is longer than
  * TOKEN_MAX_DATA.
+ *
+ * Rather than assembling each token in a separate buffer, we describe its
+ * contents as iovecs pointing at the header, the argument lengths, and the
+ * caller's argument data, and let token_send_priv_iov copy them once into
+ * the reusable send buffer for wrapping (or compress them from there, if
+ * compression was negotiated).
  */
 bool
 internal_v2_commandv(struct remctl *r, const struct iovec *command,
                      size_t count)
 {
-    size_t length, iov, offset, sent, left, delta;
-    gss_buffer_desc token;
-    char *p;
-    OM_uint32 data, major, minor;
-    int status;
+    size_t length, iov, offset, sent, left, delta, tokenlen, n;
+    char header[8];
+    struct iovec *pieces = NULL;
+    OM_uint32 *lengths = NULL;
+    OM_uint32 data;
 
     /* Check that the number of arguments isn't too high to represent. */
     if (count > UINT32_MAX) {
@@ -58,8 +135,27 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
 
     /* Determine the total length of the message. */
     length = 4;
-    for (iov = 0; iov < count; iov++)
+    for (iov = 0; iov < count; iov++) {
+        if (command[iov].iov_len > UINT32_MAX) {
+            internal_set_error(r, "command component too long");
+            return false;
+        }
         length += 4 + command[iov].iov_len;
+    }
+
+    /*
+     * Each token needs at most one iovec for the header and two for each
+     * argument (length and data).  Argument lengths are stored in network
+     * byte order in lengths so that the iovecs can point to them.
+     */
+    pieces = calloc(2 * count + 1, sizeof(struct iovec));
+    lengths = calloc(count + 1, sizeof(OM_uint32));
+    if (pieces == NULL || lengths == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        goto fail;
+    }
+    for (iov = 0; iov < count; iov++)
+        lengths[iov] = htonl((OM_uint32) command[iov].iov_len);
 
     /*
      * Now, loop until we've conveyed the entire message.  Each token we send
@@ -68,7 +164,8 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
      * command consists of pairs of argument length and argument data.
      *
      * If the entire message length plus the overhead for the header is less
-     * than TOKEN_MAX_DATA, we send it in one go.  Otherwise, each time
+     * than the maximum token data size (TOKEN_MAX_DATA unless we negotiated
+     * something larger), we send it in one go.  Otherwise, each time
      * through this loop, we pull off as much data as we can.  We break the
      * tokens either in the middle of an argument or just before an argument
      * length; we never send part of the argument length number and we always
@@ -84,43 +181,37 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
     offset = 0;
     sent = 0;
     while (sent < length) {
-        if (length - sent > TOKEN_MAX_DATA - 4)
-            token.length = TOKEN_MAX_DATA;
+        if (length - sent > r->max_data - 4)
+            tokenlen = r->max_data;
         else
-            token.length = length - sent + 4;
-        token.value = malloc(token.length);
-        if (token.value == NULL) {
-            internal_set_error(r, "cannot allocate memory: %s",
-                               strerror(errno));
-            return false;
-        }
-        left = token.length - 4;
+            tokenlen = length - sent + 4;
+        left = tokenlen - 4;
+        n = 0;
 
         /* Each token begins with the protocol version and message type. */
-        p = token.value;
-        p[0] = 2;
-        p[1] = MESSAGE_COMMAND;
-        p += 2;
+        header[0] = 2;
+        header[1] = MESSAGE_COMMAND;
 
         /* Keep-alive flag.  Always set to true for now. */
-        *p = 1;
-        p++;
+        header[2] = 1;
 
         /* Continue status. */
-        if (token.length == length - sent + 4)
-            *p = (sent == 0) ? 0 : 3;
+        if (tokenlen == length - sent + 4)
+            header[3] = (sent == 0) ? 0 : 3;
         else
-            *p = (sent == 0) ? 1 : 2;
-        p++;
+            header[3] = (sent == 0) ? 1 : 2;
+        pieces[n].iov_base = header;
+        pieces[n].iov_len = 4;
 
         /* Argument count if we haven't sent anything yet. */
         if (sent == 0) {
             data = htonl((OM_uint32) count);
-            memcpy(p, &data, 4);
-            p += 4;
+            memcpy(header + 4, &data, 4);
+            pieces[n].iov_len += 4;
             sent += 4;
             left -= 4;
         }
+        n++;
 
         /*
          * Now, as many arguments as will fit.  If offset is 0, we're at the
@@ -133,14 +224,9 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
             if (offset == 0) {
                 if (left < 4 || (left < 5 && command[iov].iov_len > 0))
                     break;
-                if (command[iov].iov_len > UINT32_MAX) {
-                    internal_set_error(r, "command component too long");
-                    free(token.value);
-                    return false;
-                }
-                data = htonl((OM_uint32) command[iov].iov_len);
-                memcpy(p, &data, 4);
-                p += 4;
+                pieces[n].iov_base = &lengths[iov];
+                pieces[n].iov_len = 4;
+                n++;
                 sent += 4;
                 left -= 4;
             }
@@ -148,8 +234,11 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
                 delta = command[iov].iov_len - offset;
             else
                 delta = left;
-            memcpy(p, (char *) command[iov].iov_base + offset, delta);
-            p += delta;
+            if (delta > 0) {
+                pieces[n].iov_base = (char *) command[iov].iov_base + offset;
+                pieces[n].iov_len = delta;
+                n++;
+            }
             sent += delta;
             offset += delta;
             left -= delta;
@@ -159,19 +248,18 @@ internal_v2_commandv(struct remctl *r, const struct iovec *command,
         }
 
         /* Send the result. */
-        token.length -= left;
-        status = token_send_priv(r->fd, r->context,
-                                 TOKEN_DATA | TOKEN_PROTOCOL, &token,
-                                 r->timeout, &major, &minor);
-        if (status != TOKEN_OK) {
-            internal_token_error(r, "sending token", status, major, minor);
-            free(token.value);
-            return false;
-        }
-        free(token.value);
+        if (!internal_v2_send_iov(r, pieces, n))
+            goto fail;
     }
+    free(pieces);
+    free(lengths);
     r->ready = true;
     return true;
+
+fail:
+    free(pieces);
+    free(lengths);
+    return false;
 }
 
 
@@ -199,6 +287,95 @@ internal_v2_quit(struct remctl *r)
 }
 
 
+/*
+ * Release a token returned by internal_v2_read_token.  Decompressed tokens
+ * point into our reusable buffer, so only tokens from GSS-API are freed.
+ */
+void
+internal_v2_release_token(struct remctl *r, gss_buffer_t token)
+{
+    OM_uint32 minor;
+
+    if (token->value != NULL && token->value == r->inflate_buffer) {
+        token->value = NULL;
+        token->length = 0;
+    } else {
+        gss_release_buffer(&minor, token);
+    }
+}
+
+
+/*
+ * Given a MESSAGE_COMPRESSED token from the server, decompress it into the
+ * reusable buffer in the remctl struct and replace the token with the
+ * message it contained.  The decompression state is also kept in the remctl
+ * struct and reused for each token.  On failure, releases the token, sets the
+ * error, and returns false.
+ */
+static bool
+internal_v2_decompress(struct remctl *r, gss_buffer_t token)
+{
+    const char *p = token->value;
+    OM_uint32 data, minor;
+    size_t length;
+    int method;
+
+    /* Check the header. */
+    if (token->length < COMPRESSION_HEADER_SIZE || p[0] < 4) {
+        internal_set_error(r, "malformed compressed token from server");
+        goto fail;
+    }
+    method = (unsigned char) p[2];
+    if (method == 0 || compress_choose(r->compression & method) != method) {
+        internal_set_error(r, "unexpected compression method %d from server",
+                           method);
+        goto fail;
+    }
+    memcpy(&data, p + 3, 4);
+    length = ntohl(data);
+    if (length < 2 || length > r->max_data) {
+        internal_set_error(r, "malformed compressed token from server");
+        goto fail;
+    }
+
+    /* Decompress into our buffer, growing it if needed. */
+    if (r->decompressor == NULL) {
+        r->decompressor = decompressor_new();
+        if (r->decompressor == NULL) {
+            internal_set_error(r, "cannot allocate memory: %s",
+                               strerror(errno));
+            goto fail;
+        }
+    }
+    if (r->inflate_size < length) {
+        free(r->inflate_buffer);
+        r->inflate_size = 0;
+        r->inflate_buffer = malloc(length);
+        if (r->inflate_buffer == NULL) {
+            internal_set_error(r, "cannot allocate memory: %s",
+                               strerror(errno));
+            goto fail;
+        }
+        r->inflate_size = length;
+    }
+    if (!decompressor_decompress(r->decompressor, method,
+                                 p + COMPRESSION_HEADER_SIZE,
+                                 token->length - COMPRESSION_HEADER_SIZE,
+                                 r->inflate_buffer, length)) {
+        internal_set_error(r, "cannot decompress token from server");
+        goto fail;
+    }
+    gss_release_buffer(&minor, token);
+    token->value = r->inflate_buffer;
+    token->length = length;
+    return true;
+
+fail:
+    gss_release_buffer(&minor, token);
+    return false;
+}
+
+
 /*
  * Read a token from the server connection and store it in the provided
  * buffer.  Return true on success and false on any failure.
@@ -208,10 +385,12 @@ internal_v2_read_token(struct remctl *r, gss_buffer_t token)
 {
     int status, flags;
     OM_uint32 major, minor;
+    bool encrypted;
     char *p;
 
-    status = token_recv_priv(r->fd, r->context, &flags, token,
-                             TOKEN_MAX_LENGTH, r->timeout, &major, &minor);
+    status = token_reader_recv_priv(r->reader, r->context, &flags, token,
+                                    TOKEN_MAX_LENGTH_FOR(r->max_data),
+                                    r->timeout, &encrypted, &major, &minor);
     if (status != TOKEN_OK) {
         internal_token_error(r, "receiving token", status, major, minor);
         if (status == TOKEN_FAIL_EOF || status == TOKEN_FAIL_TIMEOUT) {
@@ -230,21 +409,33 @@ internal_v2_read_token(struct remctl *r, gss_buffer_t token)
         goto fail;
     }
     p = token->value;
-    if (p[0] != 2 && p[0] != 3) {
+    if (p[1] == MESSAGE_COMPRESSED) {
+        if (!internal_v2_decompress(r, token))
+            return false;
+        p = token->value;
+    }
+    if (p[0] < 2 || p[0] > PROTOCOL_VERSION) {
         internal_set_error(r, "unexpected protocol %d from server", p[0]);
         goto fail;
     }
+
+    /* Only output may be unencrypted, and only if we agreed to that. */
+    if (!encrypted && (!r->integrity_ok || p[1] != MESSAGE_OUTPUT)) {
+        internal_set_error(r, "unencrypted token from server");
+        goto fail;
+    }
     return true;
 
 fail:
-    gss_release_buffer(&minor, token);
+    internal_v2_release_token(r, token);
     return false;
 }
 
 
 /*
  * Read a string from a server token, with its length starting at the given
- * offset, and store it in newly allocated memory in the remctl struct.
+ * offset, and point the output data in the remctl struct at it.  The data is
+ * not copied, so the caller must keep the token until the output is wiped.
  * Returns true on success and false on any failure (also setting the error).
  */
 static bool
@@ -262,12 +453,7 @@ internal_v2_read_string(struct remctl *r, gss_buffer_t token, size_t offset)
         internal_set_error(r, "malformed result token from server");
         return false;
     }
-    r->output->data = malloc(size);
-    if (r->output->data == NULL) {
-        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
-        return false;
-    }
-    memcpy(r->output->data, p, size);
+    r->output->data = (char *) p;
     r->output->length = size;
     return true;
 }
@@ -284,7 +470,7 @@ struct remctl_output *
 internal_v2_output(struct remctl *r)
 {
     gss_buffer_desc token = GSS_C_EMPTY_BUFFER;
-    OM_uint32 data, minor;
+    OM_uint32 data;
     char *p;
     int type;
 
@@ -301,7 +487,7 @@ internal_v2_output(struct remctl *r)
         }
         r->output->data = NULL;
     }
-    internal_output_wipe(r->output);
+    internal_output_wipe(r);
     if (!r->ready)
         return r->output;
 
@@ -356,12 +542,18 @@ internal_v2_output(struct remctl *r)
         goto fail;
     }
 
-    /* We've finished analyzing the packet.  Return the results. */
-    gss_release_buffer(&minor, &token);
+    /*
+     * We've finished analyzing the packet.  Output data points into the
+     * token, so keep it until the output is wiped.
+     */
+    if (r->output->data != NULL)
+        r->output_token = token;
+    else
+        internal_v2_release_token(r, &token);
     return r->output;
 
 fail:
-    gss_release_buffer(&minor, &token);
+    internal_v2_release_token(r, &token);
     return NULL;
 }
 
@@ -397,11 +589,160 @@ internal_noop(struct remctl *r)
     p = token.value;
     if (p[1] != MESSAGE_NOOP) {
         internal_set_error(r, "unexpected message type %d from server", p[1]);
-        gss_release_buffer(&minor, &token);
+        internal_v2_release_token(r, &token);
         return false;
     }
-    gss_release_buffer(&minor, &token);
+    internal_v2_release_token(r, &token);
 
     /* Everything looks good. */
     return true;
 }
+
+
+/*
+ * Send the capabilities request to the server using protocol v4.  We ask for
+ * a larger maximum token data size, for compression, and to allow output with
+ * integrity protection only, if any of those were requested.  Returns true on
+ * success, false on failure.
+ */
+bool
+internal_capabilities_request(struct remctl *r)
+{
+    struct iovec token;
+    char buffer[2 + 4 + 8 * 3];
+    OM_uint32 data;
+    size_t count;
+    char *p;
+
+    /* Build and send the CAPABILITIES token. */
+    buffer[0] = PROTOCOL_VERSION;
+    buffer[1] = MESSAGE_CAPABILITIES;
+    count = 0;
+    p = buffer + 2 + 4;
+    if (r->token_size > TOKEN_MAX_DATA) {
+        data = htonl(CAPABILITY_MAX_DATA);
+        memcpy(p, &data, 4);
+        data = htonl((OM_uint32) r->token_size);
+        memcpy(p + 4, &data, 4);
+        p += 8;
+        count++;
+    }
+    if (r->compress) {
+        data = htonl(CAPABILITY_COMPRESSION);
+        memcpy(p, &data, 4);
+        data = htonl((OM_uint32) compress_methods());
+        memcpy(p + 4, &data, 4);
+        p += 8;
+        count++;
+    }
+    if (r->integrity) {
+        data = htonl(CAPABILITY_INTEGRITY);
+        memcpy(p, &data, 4);
+        data = htonl(1);
+        memcpy(p + 4, &data, 4);
+        p += 8;
+        count++;
+    }
+    data = htonl((OM_uint32) count);
+    memcpy(buffer + 2, &data, 4);
+    token.iov_base = buffer;
+    token.iov_len = 2 + 4 + 8 * count;
+    return internal_v2_send_iov(r, &token, 1);
+}
+
+
+/*
+ * Read the server's reply to a capabilities request and apply the
+ * capabilities that it agreed to.  Servers that don't support protocol v4
+ * reply with MESSAGE_VERSION, in which case we just keep the protocol
+ * defaults.  Returns true on success, false on failure.
+ */
+bool
+internal_capabilities_reply(struct remctl *r)
+{
+    gss_buffer_desc token;
+    OM_uint32 data, capability, value;
+    size_t count, i;
+    char *p;
+
+    /* Read the reply.  An older server will reply with MESSAGE_VERSION. */
+    token.length = 0;
+    token.value = NULL;
+    if (!internal_v2_read_token(r, &token))
+        return false;
+    p = token.value;
+    if (p[1] == MESSAGE_VERSION) {
+        internal_v2_release_token(r, &token);
+        return true;
+    }
+    if (p[1] != MESSAGE_CAPABILITIES || token.length < 2 + 4) {
+        internal_set_error(r, "unexpected message type %d from server", p[1]);
+        goto fail;
+    }
+    memcpy(&data, p + 2, 4);
+    count = ntohl(data);
+    if (count > CAPABILITY_MAX_COUNT || token.length != 2 + 4 + 8 * count) {
+        internal_set_error(r, "malformed capabilities token from server");
+        goto fail;
+    }
+
+    /* Apply the capabilities that the server agreed to. */
+    for (i = 0, p += 2 + 4; i < count; i++, p += 8) {
+        memcpy(&data, p, 4);
+        capability = ntohl(data);
+        memcpy(&data, p + 4, 4);
+        value = ntohl(data);
+        if (capability == CAPABILITY_MAX_DATA) {
+            if (value < TOKEN_MAX_DATA || value > r->token_size) {
+                internal_set_error(r, "invalid token size %lu from server",
+                                   (unsigned long) value);
+                goto fail;
+            }
+            r->max_data = value;
+        } else if (capability == CAPABILITY_COMPRESSION) {
+            if (!r->compress || (value & ~compress_methods()) != 0) {
+                internal_set_error(r, "invalid compression methods %lu from"
+                                   " server", (unsigned long) value);
+                goto fail;
+            }
+            r->compression = value;
+        } else if (capability == CAPABILITY_INTEGRITY) {
+            if (!r->integrity || value > 1) {
+                internal_set_error(r, "invalid integrity setting %lu from"
+                                   " server", (unsigned long) value);
+                goto fail;
+            }
+            r->integrity_ok = (value == 1);
+        }
+    }
+
+    /* Set up compression of the commands we send, if agreed to. */
+    if (r->compression != 0) {
+        r->compressor = compressor_new(compress_choose(r->compression));
+        if (r->compressor == NULL) {
+            internal_set_error(r, "cannot allocate memory: %s",
+                               strerror(errno));
+            goto fail;
+        }
+    }
+    internal_v2_release_token(r, &token);
+    return true;
+
+fail:
+    internal_v2_release_token(r, &token);
+    return false;
+}
+
+
+/*
+ * Negotiate capabilities with the server using protocol v4, sending the
+ * request and waiting for the reply.  Returns true on success, false on
+ * failure.
+ */
+bool
+internal_capabilities(struct remctl *r)
+{
+    if (!internal_capabilities_request(r))
+        return false;
+    return internal_capabilities_reply(r);
+}
@@ -23,8 +23,62 @@
 #include <portable/stdbool.h>
 #include <sys/types.h>
 
-/* Forward declaration to avoid unnecessary includes. */
+/* Forward declarations to avoid unnecessary includes. */
+struct addrinfo;
+struct compressor;
+struct decompressor;
 struct iovec;
+struct remctl_result;
+struct token_reader;
+
+/* GSS-API flags to ask for when establishing a context. */
+#define INTERNAL_GSS_FLAGS                                                  \
+    (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG                 \
+     | GSS_C_REPLAY_FLAG | GSS_C_SEQUENCE_FLAG)
+
+/* GSS-API flags that the server must agree to for protocol v2 and later. */
+#define INTERNAL_GSS_FLAGS_REQUIRED                                         \
+    (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG)
+
+/* Where a connection opened with remctl_open_async is in opening. */
+enum internal_async_state {
+    ASYNC_CONNECT,              /* Waiting for the TCP connection. */
+    ASYNC_CONTEXT,              /* Establishing the GSS-API context. */
+    ASYNC_CAPABILITIES,         /* Waiting for the capabilities reply. */
+    ASYNC_OPEN                  /* Open and ready for commands. */
+};
+
+/* Extra state for a connection opened with remctl_open_async. */
+struct internal_async {
+    enum internal_async_state state;
+    unsigned short port;        /* Port currently being tried. */
+    bool fallback;              /* Whether to fall back on the old port. */
+    struct addrinfo *addresses; /* Resolved addresses for host and port. */
+    struct addrinfo *next;      /* Next address to try connecting to. */
+    gss_name_t name;            /* Server name during context setup. */
+    gss_cred_id_t cred;         /* Client credentials during context setup. */
+    char *pending;              /* Queued outgoing tokens. */
+    size_t pending_size;        /* Allocated size of pending. */
+    size_t pending_start;       /* Offset of the first unsent byte. */
+    size_t pending_end;         /* Offset just past the last queued byte. */
+};
+
+/* A server found through an SRV record. */
+struct internal_srv_target {
+    char *host;
+    unsigned short port;
+    unsigned short priority;
+    unsigned short weight;
+};
+
+/* Cached results of the last SRV lookup done by remctl_open. */
+struct internal_srv {
+    char *name;                 /* Host the lookup was done for. */
+    time_t expires;             /* When to do the lookup again. */
+    struct internal_srv_target *targets; /* Sorted by priority. */
+    size_t count;               /* Number of targets, 0 if no records. */
+    unsigned long seed;         /* Random state for weighted selection. */
+};
 
 /* Private structure that holds the details of an open remctl connection. */
 struct remctl {
@@ -36,11 +90,30 @@ struct remctl {
     time_t timeout;
     char *ccache;               /* Path to client ticket cache. */
     socket_type fd;
+    struct token_reader *reader; /* Buffered reader for tokens from fd. */
+    char *send_buffer;          /* Reusable buffer for outgoing tokens. */
+    size_t send_size;           /* Allocated size of send_buffer. */
+    size_t token_size;          /* Token data size to ask the server for. */
+    size_t max_data;            /* Negotiated maximum token data size. */
+    bool compress;              /* Whether to ask for compression. */
+    unsigned long compression;  /* Negotiated compression methods. */
+    struct compressor *compressor; /* State for compressing commands. */
+    char *compress_buffer;      /* Reusable buffer for compressed tokens. */
+    size_t compress_size;       /* Allocated size of compress_buffer. */
+    struct decompressor *decompressor; /* State for decompressing output. */
+    char *inflate_buffer;       /* Reusable buffer for decompressed tokens. */
+    size_t inflate_size;        /* Allocated size of inflate_buffer. */
+    bool integrity;             /* Whether to accept integrity-only output. */
+    bool integrity_ok;          /* Whether the server agreed to send it. */
     gss_ctx_id_t context;
     char *error;
     struct remctl_output *output;
+    gss_buffer_desc output_token; /* Token that output->data points into. */
     int status;
     bool ready;                 /* If true, we are expecting server output. */
+    struct internal_async *async; /* Non-NULL if opened asynchronously. */
+    bool srv_lookup;            /* Whether to look up SRV records. */
+    struct internal_srv *srv;   /* Cached SRV lookup results. */
 
     /* Used to hold state for remctl_set_ccache. */
 #ifdef HAVE_KRB5
@@ -66,8 +139,8 @@ void internal_krb5_error(struct remctl *, const char *error,
 void internal_token_error(struct remctl *, const char *error, int status,
                           OM_uint32 major, OM_uint32 minor);
 
-/* Wipe and free the output token. */
-void internal_output_wipe(struct remctl_output *);
+/* Wipe the output struct, freeing its data. */
+void internal_output_wipe(struct remctl *);
 
 /* Establish a network connection */
 socket_type internal_connect(struct remctl *, const char *, unsigned short);
@@ -75,6 +148,45 @@ socket_type internal_connect(struct remctl *, const char *, unsigned short);
 /* General connection opening and negotiation function. */
 bool internal_open(struct remctl *, const char *host, const char *principal);
 
+/*
+ * Look up SRV records for host and connect to one of the targets, storing the
+ * connection in fd and the name of the target host in target.  Returns false
+ * if there were no SRV records, in which case the caller should connect to
+ * host directly.  Otherwise, returns true, and fd is INVALID_SOCKET with the
+ * error set if no connection could be made.  The lookup results are cached in
+ * the remctl struct and freed by internal_srv_free.
+ */
+bool internal_srv_connect(struct remctl *, const char *host, socket_type *fd,
+                          const char **target);
+void internal_srv_free(struct remctl *);
+
+/*
+ * Pieces of opening a connection shared with the asynchronous interface:
+ * importing the server name, importing the client credentials, and resetting
+ * negotiated state and creating the token reader for a new connection.
+ */
+bool internal_import_name(struct remctl *, const char *host,
+                          const char *principal, gss_name_t *);
+bool internal_set_cred(struct remctl *, gss_cred_id_t *);
+bool internal_open_prepare(struct remctl *);
+
+/*
+ * Start opening a connection asynchronously, queue a token to send on an
+ * asynchronous connection, and free the asynchronous connection state.
+ */
+bool internal_async_open(struct remctl *, const char *host,
+                         unsigned short port, const char *principal);
+bool internal_async_queue(struct remctl *, int flags, const void *data,
+                          size_t length);
+void internal_async_free(struct remctl *);
+
+/*
+ * Run a command on an open connection and collect its output, shared by the
+ * simple interface and connection pools.
+ */
+bool internal_run(struct remctl *, const char **command,
+                  struct remctl_result *);
+
 /* Send a protocol v1 command. */
 bool internal_v1_commandv(struct remctl *, const struct iovec *command,
                           size_t count);
@@ -89,12 +201,23 @@ bool internal_v2_commandv(struct remctl *, const struct iovec *command,
 /* Send a protocol v3 NOOP command. */
 bool internal_noop(struct remctl *);
 
+/*
+ * Negotiate protocol v4 capabilities with the server.  The request and reply
+ * halves are also available separately for the asynchronous interface.
+ */
+bool internal_capabilities(struct remctl *);
+bool internal_capabilities_request(struct remctl *);
+bool internal_capabilities_reply(struct remctl *);
+
 /* Send a protocol v2 QUIT command. */
 bool internal_v2_quit(struct remctl *);
 
 /* Read a protocol v2 response. */
 struct remctl_output *internal_v2_output(struct remctl *);
 
+/* Release a token read by the protocol v2 code. */
+void internal_v2_release_token(struct remctl *, gss_buffer_t);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
@@ -26,6 +26,7 @@
 
 #include <client/internal.h>
 #include <client/remctl.h>
+#include <util/compress.h>
 #include <util/macros.h>
 #include <util/network.h>
 #include <util/protocol.h>
@@ -82,7 +83,7 @@ internal_connect(struct remctl *r, const char *host, unsigned short port)
  *
  * Returns true on success and false on failure.
  */
-static bool
+bool
 internal_import_name(struct remctl *r, const char *host,
                      const char *principal, gss_name_t *name)
 {
@@ -134,7 +135,7 @@ internal_import_name(struct remctl *r, const char *host,
  * default is.  The other cases are handled in remctl_set_ccache.
  */
 #if defined(HAVE_GSS_KRB5_IMPORT_CRED) && defined(HAVE_KRB5)
-static bool
+bool
 internal_set_cred(struct remctl *r, gss_cred_id_t *gss_cred)
 {
     krb5_error_code code;
@@ -162,7 +163,7 @@ internal_set_cred(struct remctl *r, gss_cred_id_t *gss_cred)
     return true;
 }
 #else /* !HAVE_GSS_KRB5_IMPORT_CRED || !HAVE_KRB5 */
-static bool
+bool
 internal_set_cred(struct remctl *r UNUSED, gss_cred_id_t *gss_cred UNUSED)
 {
     return false;
@@ -170,6 +171,38 @@ internal_set_cred(struct remctl *r UNUSED, gss_cred_id_t *gss_cred UNUSED)
 #endif /* !HAVE_GSS_KRB5_IMPORT_CRED */
 
 
+/*
+ * Reset the state negotiated on any previous connection and create the
+ * buffered token reader for the new connection in r->fd.  Returns true on
+ * success and false on memory allocation failure, setting the error.
+ */
+bool
+internal_open_prepare(struct remctl *r)
+{
+    /*
+     * Default to protocol version two, but if some other protocol is already
+     * set in the remctl struct, don't override.  This facility is used only
+     * for testing currently.
+     */
+    if (r->protocol == 0)
+        r->protocol = 2;
+    r->max_data = TOKEN_MAX_DATA;
+    r->compression = 0;
+    compressor_free(r->compressor);
+    r->compressor = NULL;
+    r->integrity_ok = false;
+
+    /* All tokens from the server are read through a buffered reader. */
+    token_reader_free(r->reader);
+    r->reader = token_reader_new(r->fd);
+    if (r->reader == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
 /*
  * Open a new connection to a server.  Returns true on success, false on
  * failure.  On failure, sets the error message appropriately.
@@ -184,11 +217,6 @@ internal_open(struct remctl *r, const char *host, const char *principal)
     gss_cred_id_t gss_cred = GSS_C_NO_CREDENTIAL;
     gss_ctx_id_t gss_context = GSS_C_NO_CONTEXT;
     OM_uint32 major, minor, init_minor, gss_flags;
-    static const OM_uint32 wanted_gss_flags
-        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG
-           | GSS_C_REPLAY_FLAG | GSS_C_SEQUENCE_FLAG);
-    static const OM_uint32 req_gss_flags
-        = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
 
     /* Import the name. */
     if (!internal_import_name(r, host, principal, &name))
@@ -199,13 +227,9 @@ internal_open(struct remctl *r, const char *host, const char *principal)
         if (!internal_set_cred(r, &gss_cred))
             goto fail;
 
-    /*
-     * Default to protocol version two, but if some other protocol is already
-     * set in the remctl struct, don't override.  This facility is used only
-     * for testing currently.
-     */
-    if (r->protocol == 0)
-        r->protocol = 2;
+    /* Reset negotiated state and set up reading from the connection. */
+    if (!internal_open_prepare(r))
+        goto fail;
 
     /* Send the initial negotiation token. */
     status = token_send(r->fd, TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL,
@@ -236,10 +260,9 @@ internal_open(struct remctl *r, const char *host, const char *principal)
     token_ptr = GSS_C_NO_BUFFER;
     do {
         major = gss_init_sec_context(&init_minor, gss_cred, &gss_context,
-                    name, (const gss_OID) GSS_KRB5_MECHANISM, wanted_gss_flags,
-                    0, NULL, token_ptr, NULL, &send_tok, &gss_flags, NULL);
-        if (token_ptr != GSS_C_NO_BUFFER)
-            free(recv_tok.value);
+                    name, (const gss_OID) GSS_KRB5_MECHANISM,
+                    INTERNAL_GSS_FLAGS, 0, NULL, token_ptr, NULL, &send_tok,
+                    &gss_flags, NULL);
 
         /* If we have anything more to say, send it. */
         if (send_tok.length != 0) {
@@ -264,8 +287,8 @@ internal_open(struct remctl *r, const char *host, const char *principal)
 
         /* If we're still expecting more, retrieve it. */
         if (major == GSS_S_CONTINUE_NEEDED) {
-            status = token_recv(r->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                                r->timeout);
+            status = token_reader_recv(r->reader, &flags, &recv_tok,
+                                       TOKEN_MAX_LENGTH, r->timeout);
             if (status != TOKEN_OK) {
                 internal_token_error(r, "receiving token", status, major,
                                      minor);
@@ -283,7 +306,9 @@ internal_open(struct remctl *r, const char *host, const char *principal)
      * establishing the context, since Heimdal doesn't report all flags until
      * context negotiation is complete.
      */
-    if (r->protocol > 1 && (gss_flags & req_gss_flags) != req_gss_flags) {
+    if (r->protocol > 1
+        && (gss_flags & INTERNAL_GSS_FLAGS_REQUIRED)
+               != INTERNAL_GSS_FLAGS_REQUIRED) {
         internal_set_error(r, "server did not negotiate acceptable GSS-API"
                            " flags");
         goto fail;
@@ -295,6 +320,18 @@ internal_open(struct remctl *r, const char *host, const char *principal)
     gss_release_name(&minor, &name);
     if (gss_cred != GSS_C_NO_CREDENTIAL)
         gss_release_cred(&minor, &gss_cred);
+
+    /* Negotiate larger tokens, compression, or integrity-only output. */
+    if (r->protocol > 1
+        && (r->token_size > TOKEN_MAX_DATA || r->compress || r->integrity))
+        if (!internal_capabilities(r)) {
+            socket_close(r->fd);
+            r->fd = INVALID_SOCKET;
+            if (r->context != GSS_C_NO_CONTEXT)
+                gss_delete_sec_context(&minor, &r->context, GSS_C_NO_BUFFER);
+            r->context = GSS_C_NO_CONTEXT;
+            return false;
+        }
     return true;
 
 fail:
@@ -0,0 +1,495 @@
+/*
+ * Pools of authenticated remctl connections.
+ *
+ * A pool keeps connections open between commands so that programs that run
+ * many commands against the same few servers don't pay for a TCP connection
+ * and a GSS-API context negotiation for each one.  Connections are keyed by
+ * host, port, principal, and credential cache.  An idle connection is checked
+ * for a close from the server, and with a NOOP if it has been idle for a few
+ * seconds, before it is reused, and is closed once it has been idle for too
+ * long or its GSS-API context is close to expiring.
+ *
+ * Pools are not thread-safe; each pool must only be used by one thread at a
+ * time, like the connections it contains.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <time.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+
+/* Close idle connections after this many seconds by default. */
+#define POOL_IDLE 300
+
+/*
+ * Reuse connections idle for less than this many seconds without checking
+ * them with a NOOP first.
+ */
+#define POOL_CHECK 5
+
+/*
+ * Stop using a connection when its GSS-API context has less than this many
+ * seconds left, leaving time for a long-running command to finish.
+ */
+#define POOL_EXPIRE_MARGIN 300
+
+/* A connection in the pool and the key it was opened with. */
+struct pool_entry {
+    char *host;
+    unsigned short port;
+    char *principal;            /* May be NULL for the default. */
+    char *ccache;               /* May be NULL for the default. */
+    struct remctl *r;
+    bool busy;                  /* Whether checked out by remctl_pool_get. */
+    time_t used;                /* When it was last returned to the pool. */
+    time_t expires;             /* When the context expires, or 0. */
+    struct pool_entry *next;
+};
+
+/* Opaque struct representing a pool of connections. */
+struct remctl_pool {
+    struct pool_entry *entries;
+    char *ccache;               /* Credential cache for new connections. */
+    time_t timeout;             /* Network timeout for all connections. */
+    time_t idle;                /* Idle time before closing, or 0. */
+    char *error;
+};
+
+
+/*
+ * Set the error message for a pool, freeing any previous error message.
+ */
+static void __attribute__((__format__(printf, 2, 3)))
+pool_set_error(struct remctl_pool *pool, const char *format, ...)
+{
+    va_list args;
+    int status;
+
+    free(pool->error);
+    va_start(args, format);
+    status = vasprintf(&pool->error, format, args);
+    va_end(args);
+    if (status < 0)
+        pool->error = NULL;
+}
+
+
+/*
+ * Compare two strings that may be NULL.  Returns true if they're equal.
+ */
+static bool
+pool_string_equal(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return (a == b);
+    return (strcmp(a, b) == 0);
+}
+
+
+/*
+ * Close the connection for a pool entry and free it.
+ */
+static void
+pool_entry_free(struct pool_entry *entry)
+{
+    remctl_close(entry->r);
+    free(entry->host);
+    free(entry->principal);
+    free(entry->ccache);
+    free(entry);
+}
+
+
+/*
+ * Remove an entry from the pool and free it.
+ */
+static void
+pool_remove(struct remctl_pool *pool, struct pool_entry *entry)
+{
+    struct pool_entry **p;
+
+    for (p = &pool->entries; *p != NULL; p = &(*p)->next)
+        if (*p == entry) {
+            *p = entry->next;
+            break;
+        }
+    pool_entry_free(entry);
+}
+
+
+/*
+ * Return whether the GSS-API context for a pool entry is too close to
+ * expiring for the connection to be used again.
+ */
+static bool
+pool_expiring(const struct pool_entry *entry, time_t now)
+{
+    return (entry->expires != 0 && now + POOL_EXPIRE_MARGIN >= entry->expires);
+}
+
+
+/*
+ * Return whether the server has closed an idle connection.  The server never
+ * sends anything on an idle connection, so if there is anything to read, the
+ * connection has either been closed or is out of sync, and in either case it
+ * can't be reused.  This doesn't wait.
+ */
+static bool
+pool_closed(const struct remctl *r)
+{
+    fd_set readfds;
+    struct timeval tv;
+
+    if (r->fd == INVALID_SOCKET)
+        return true;
+    FD_ZERO(&readfds);
+    FD_SET(r->fd, &readfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    return (select(r->fd + 1, &readfds, NULL, NULL, &tv) != 0);
+}
+
+
+/*
+ * Close all idle connections that have been idle for too long or whose
+ * contexts are about to expire.
+ */
+static void
+pool_expire(struct remctl_pool *pool, time_t now)
+{
+    struct pool_entry **p, *entry;
+
+    p = &pool->entries;
+    while (*p != NULL) {
+        entry = *p;
+        if (!entry->busy
+            && ((pool->idle > 0 && now - entry->used >= pool->idle)
+                || pool_expiring(entry, now))) {
+            *p = entry->next;
+            pool_entry_free(entry);
+        } else {
+            p = &entry->next;
+        }
+    }
+}
+
+
+/*
+ * Open a new connection for the pool with the given key and add it to the
+ * pool, checked out.  Returns the new entry, or NULL on failure and sets the
+ * pool error.
+ */
+static struct pool_entry *
+pool_open(struct remctl_pool *pool, const char *host, unsigned short port,
+          const char *principal, time_t now)
+{
+    struct pool_entry *entry;
+    OM_uint32 major, minor, lifetime;
+
+    entry = calloc(1, sizeof(struct pool_entry));
+    if (entry == NULL)
+        goto fail;
+    entry->host = strdup(host);
+    if (entry->host == NULL)
+        goto fail;
+    entry->port = port;
+    if (principal != NULL) {
+        entry->principal = strdup(principal);
+        if (entry->principal == NULL)
+            goto fail;
+    }
+    if (pool->ccache != NULL) {
+        entry->ccache = strdup(pool->ccache);
+        if (entry->ccache == NULL)
+            goto fail;
+    }
+    entry->r = remctl_new();
+    if (entry->r == NULL)
+        goto fail;
+
+    /*
+     * Open the connection.  The entry owns the strings passed to remctl_open
+     * since the connection keeps pointers to them for reopening.
+     */
+    if ((entry->ccache != NULL && !remctl_set_ccache(entry->r, entry->ccache))
+        || !remctl_set_timeout(entry->r, pool->timeout)
+        || !remctl_open(entry->r, entry->host, port, entry->principal)) {
+        pool_set_error(pool, "%s", remctl_error(entry->r));
+        pool_entry_free(entry);
+        return NULL;
+    }
+
+    /*
+     * Remember when the context expires.  If we can't tell, assume it
+     * doesn't, since using an expired context just fails the command.
+     */
+    major = gss_context_time(&minor, entry->r->context, &lifetime);
+    if (major == GSS_S_CONTEXT_EXPIRED)
+        entry->expires = now;
+    else if (major == GSS_S_COMPLETE && lifetime != GSS_C_INDEFINITE)
+        entry->expires = now + (time_t) lifetime;
+    entry->busy = true;
+    entry->next = pool->entries;
+    pool->entries = entry;
+    return entry;
+
+fail:
+    pool_set_error(pool, "cannot allocate memory: %s", strerror(errno));
+    if (entry != NULL)
+        pool_entry_free(entry);
+    return NULL;
+}
+
+
+/*
+ * Check out a connection for the given host, port, and principal, opening
+ * one if there isn't a usable idle one in the pool.  Returns the connection
+ * on success and NULL on failure and sets the pool error.
+ */
+static struct pool_entry *
+pool_get(struct remctl_pool *pool, const char *host, unsigned short port,
+         const char *principal)
+{
+    struct pool_entry *entry, *next;
+    time_t now;
+
+    now = time(NULL);
+    pool_expire(pool, now);
+    for (entry = pool->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        if (entry->busy || entry->port != port
+            || strcmp(entry->host, host) != 0
+            || !pool_string_equal(entry->principal, principal)
+            || !pool_string_equal(entry->ccache, pool->ccache))
+            continue;
+
+        /*
+         * The timeout is not part of the key, so apply the current one.  If
+         * the connection has been idle for a while, also make sure the
+         * server is still responding.  NOOP requires protocol version 3, so
+         * connections to older servers only get the first check.
+         */
+        remctl_set_timeout(entry->r, pool->timeout);
+        if (pool_closed(entry->r)
+            || (now - entry->used >= POOL_CHECK && entry->r->protocol >= 3
+                && !remctl_noop(entry->r))) {
+            pool_remove(pool, entry);
+            continue;
+        }
+        entry->busy = true;
+        return entry;
+    }
+    return pool_open(pool, host, port, principal, now);
+}
+
+
+/*
+ * Create a new, empty connection pool.  Returns NULL on memory allocation
+ * failure.
+ */
+struct remctl_pool *
+remctl_pool_new(void)
+{
+    struct remctl_pool *pool;
+
+    pool = calloc(1, sizeof(struct remctl_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->idle = POOL_IDLE;
+    return pool;
+}
+
+
+/*
+ * Set the Kerberos credential cache for new connections from the pool, which
+ * may be NULL to use the default.  Since the credential cache is part of the
+ * key for pooled connections, this also only reuses connections opened with
+ * the same credential cache.  Returns true on success and false on memory
+ * allocation failure.
+ */
+int
+remctl_pool_set_ccache(struct remctl_pool *pool, const char *ccache)
+{
+    char *copy = NULL;
+
+    if (ccache != NULL) {
+        copy = strdup(ccache);
+        if (copy == NULL) {
+            pool_set_error(pool, "cannot allocate memory: %s",
+                           strerror(errno));
+            return 0;
+        }
+    }
+    free(pool->ccache);
+    pool->ccache = copy;
+    return 1;
+}
+
+
+/*
+ * Set the network timeout in seconds for all connections from the pool,
+ * which may be 0 to not use any timeout (the default).  Returns true on
+ * success, false on an invalid timeout.
+ */
+int
+remctl_pool_set_timeout(struct remctl_pool *pool, time_t timeout)
+{
+    if (timeout < 0) {
+        pool_set_error(pool, "invalid timeout %ld", (long) timeout);
+        return 0;
+    }
+    pool->timeout = timeout;
+    return 1;
+}
+
+
+/*
+ * Set how long in seconds a connection may stay idle in the pool before it
+ * is closed, which may be 0 to keep idle connections indefinitely.  Returns
+ * true on success, false on an invalid time.
+ */
+int
+remctl_pool_set_idle(struct remctl_pool *pool, time_t idle)
+{
+    if (idle < 0) {
+        pool_set_error(pool, "invalid idle time %ld", (long) idle);
+        return 0;
+    }
+    pool->idle = idle;
+    return 1;
+}
+
+
+/*
+ * Check out an open connection from the pool for the given host, port, and
+ * principal for use with the persistant interface.  It must be returned with
+ * remctl_pool_put and not closed.  Returns NULL on failure; use
+ * remctl_pool_error to get the error.
+ */
+struct remctl *
+remctl_pool_get(struct remctl_pool *pool, const char *host,
+                unsigned short port, const char *principal)
+{
+    struct pool_entry *entry;
+
+    entry = pool_get(pool, host, port, principal);
+    return (entry == NULL) ? NULL : entry->r;
+}
+
+
+/*
+ * Return a connection checked out with remctl_pool_get to the pool.  The
+ * connection is only kept for reuse if it is still open, all output from the
+ * last command has been read, and nothing has failed since the last command
+ * was sent.  Otherwise, or if the connection didn't come from this pool, it
+ * is closed.
+ */
+void
+remctl_pool_put(struct remctl_pool *pool, struct remctl *r)
+{
+    struct pool_entry *entry;
+    time_t now;
+
+    if (r == NULL)
+        return;
+    for (entry = pool->entries; entry != NULL; entry = entry->next)
+        if (entry->r == r && entry->busy)
+            break;
+    if (entry == NULL) {
+        remctl_close(r);
+        return;
+    }
+    now = time(NULL);
+    if (r->fd == INVALID_SOCKET || r->ready || r->error != NULL
+        || pool_expiring(entry, now)) {
+        pool_remove(pool, entry);
+        return;
+    }
+    entry->busy = false;
+    entry->used = now;
+}
+
+
+/*
+ * The simplified interface using a pooled connection.  Takes the same
+ * arguments as remctl plus the pool and returns a struct remctl_result, which
+ * should be freed with remctl_result_free.  Returns NULL only on memory
+ * allocation failure.
+ */
+struct remctl_result *
+remctl_pool_run(struct remctl_pool *pool, const char *host,
+                unsigned short port, const char *principal,
+                const char **command)
+{
+    struct pool_entry *entry;
+    struct remctl_result *result;
+
+    result = calloc(1, sizeof(struct remctl_result));
+    if (result == NULL)
+        return NULL;
+    entry = pool_get(pool, host, port, principal);
+    if (entry == NULL) {
+        if (pool->error != NULL)
+            result->error = strdup(pool->error);
+        if (result->error == NULL) {
+            free(result);
+            return NULL;
+        }
+        return result;
+    }
+    if (!internal_run(entry->r, command, result) && result->error == NULL) {
+        remctl_pool_put(pool, entry->r);
+        remctl_result_free(result);
+        return NULL;
+    }
+    remctl_pool_put(pool, entry->r);
+    return result;
+}
+
+
+/*
+ * Return the error message from the last failed pool operation.
+ */
+const char *
+remctl_pool_error(struct remctl_pool *pool)
+{
+    return (pool->error != NULL) ? pool->error : "no error";
+}
+
+
+/*
+ * Close all connections in the pool, including any that are checked out, and
+ * free the pool.
+ */
+void
+remctl_pool_free(struct remctl_pool *pool)
+{
+    struct pool_entry *entry, *next;
+
+    if (pool == NULL)
+        return;
+    for (entry = pool->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        pool_entry_free(entry);
+    }
+    free(pool->ccache);
+    free(pool->error);
+    free(pool);
+}
@@ -101,9 +101,30 @@ struct remctl_output {
     int error;                  /* Remote error code. */
 };
 
+/*
+ * Callback for remctl_output_callback.  Takes a piece of output and the data
+ * passed to remctl_output_callback and returns true to continue or false to
+ * stop.
+ */
+typedef int (*remctl_output_func)(const struct remctl_output *, void *);
+
+/* Events to wait for on an asynchronous connection, from remctl_events. */
+#define REMCTL_WANT_READ  1
+#define REMCTL_WANT_WRITE 2
+
+/* The result of remctl_step on an asynchronous connection. */
+enum remctl_step_status {
+    REMCTL_STEP_ERROR = -1,     /* Failed, connection closed. */
+    REMCTL_STEP_AGAIN = 0,      /* Wait for remctl_events and call again. */
+    REMCTL_STEP_DONE  = 1       /* Open, command sent, or output ready. */
+};
+
 /* Opaque struct representing an open remctl connection. */
 struct remctl;
 
+/* Opaque struct representing a pool of open remctl connections. */
+struct remctl_pool;
+
 BEGIN_DECLS
 
 /*
@@ -118,6 +139,38 @@ struct remctl_result *remctl(const char *host, unsigned short port,
                              const char *principal, const char **command);
 void remctl_result_free(struct remctl_result *);
 
+/*
+ * The simple interface with a pool of connections.  remctl_pool_run takes
+ * the same arguments as remctl plus a pool, but uses an open connection from
+ * the pool, or opens one and adds it to the pool, instead of opening and
+ * closing a connection for each command.  Connections are only reused for
+ * the same host, port, principal, and credential cache.  Idle connections
+ * are checked with a NOOP before reuse and are closed when they've been idle
+ * too long (300 seconds by default) or their GSS-API context is about to
+ * expire.  remctl_pool_get and remctl_pool_put check out a connection for
+ * use with the persistant interface and return it to the pool; connections
+ * from a pool must not be closed with remctl_close.  remctl_pool_free closes
+ * all connections in the pool.  A pool must only be used by one thread at a
+ * time.
+ *
+ * The setting functions return true on success and false on failure, and
+ * remctl_pool_get returns NULL on failure.  On failure, use
+ * remctl_pool_error to get the error.
+ */
+struct remctl_pool *remctl_pool_new(void);
+int remctl_pool_set_ccache(struct remctl_pool *, const char *);
+int remctl_pool_set_timeout(struct remctl_pool *, time_t);
+int remctl_pool_set_idle(struct remctl_pool *, time_t);
+struct remctl_result *remctl_pool_run(struct remctl_pool *, const char *host,
+                                      unsigned short port,
+                                      const char *principal,
+                                      const char **command);
+struct remctl *remctl_pool_get(struct remctl_pool *, const char *host,
+                               unsigned short port, const char *principal);
+void remctl_pool_put(struct remctl_pool *, struct remctl *);
+const char *remctl_pool_error(struct remctl_pool *);
+void remctl_pool_free(struct remctl_pool *);
+
 /*
  * Now, the more complex persistant interface.  The basic housekeeping
  * functions.  port may be 0, in which case REMCTL_PORT is used with fallback
@@ -152,6 +205,29 @@ int remctl_open_fd(struct remctl *r, const char *host, int fd,
                    const char *principal);
 #endif
 
+/*
+ * The asynchronous interface.  remctl_open_async resolves the host (which
+ * blocks unless it is an address) and starts a non-blocking connect, but
+ * does no other network I/O.  All further I/O on that connection is done by
+ * remctl_step, which never waits.  Wait with your own event loop for the
+ * events returned by remctl_events (REMCTL_WANT_READ and REMCTL_WANT_WRITE)
+ * on the descriptor returned by remctl_fd, which may change during the
+ * open, and call remctl_step until it returns REMCTL_STEP_DONE.  That means
+ * the connection is open, or after remctl_command or remctl_commandv (which
+ * only queue the command), that the next output is ready for remctl_output.
+ * If remctl_events returns 0, remctl_step does not need to wait.  The
+ * timeout set by remctl_set_timeout is not used, and remctl_noop is not
+ * supported.  Servers must support protocol version 2 or later.
+ */
+int remctl_open_async(struct remctl *, const char *host, unsigned short port,
+                      const char *principal);
+int remctl_events(struct remctl *);
+enum remctl_step_status remctl_step(struct remctl *);
+#ifdef _WIN32
+SOCKET remctl_fd(struct remctl *);
+#else
+int remctl_fd(struct remctl *);
+#endif
 
 /*
  * Set the Kerberos credential cache for client connections.  This must be
@@ -189,6 +265,49 @@ int remctl_set_source_ip(struct remctl *, const char *);
  */
 int remctl_set_timeout(struct remctl *, time_t);
 
+/*
+ * Set the maximum amount of data per protocol token to ask the server for,
+ * which may be 0 to use the protocol default of 64KB (the default).  If
+ * called before remctl_open and the size is larger than the default, the
+ * client will negotiate with the server for tokens of up to that size when
+ * opening the connection.  Larger tokens reduce overhead when sending or
+ * receiving large amounts of data.  Servers that don't support this
+ * negotiation will continue to use the default.  Returns true on success,
+ * false on failure (only possible with an invalid size).  On failure, use
+ * remctl_error to get the error.
+ */
+int remctl_set_token_size(struct remctl *, size_t);
+
+/*
+ * Set whether to negotiate compression with the server (off by default).  If
+ * enabled before remctl_open, the client will ask the server to compress
+ * large output tokens and will compress large command tokens itself, which
+ * helps with highly compressible data over slow networks.  Servers that don't
+ * support compression will send uncompressed data.  Returns true on success,
+ * false on failure (if this library was built without compression support).
+ * On failure, use remctl_error to get the error.
+ */
+int remctl_set_compression(struct remctl *, int);
+
+/*
+ * Set whether to allow the server to send command output with integrity
+ * protection only, without encryption (off by default).  Servers only do this
+ * for commands configured with the integrity-only option, which is intended
+ * for large, non-sensitive output where encryption is only CPU overhead.
+ * Only takes effect on the next remctl_open.  Always returns true.
+ */
+int remctl_set_integrity_only(struct remctl *, int);
+
+/*
+ * Set whether to locate the server with SRV records (off by default).  If
+ * enabled, remctl_open called with a port of 0 first looks up
+ * _remctl._tcp.<host> and, if there are records, connects to the servers they
+ * list in order of priority and weight instead of to host.  Returns true on
+ * success, false on failure (if this library was built without a resolver
+ * that supports SRV lookups).  On failure, use remctl_error to get the error.
+ */
+int remctl_set_srv_lookup(struct remctl *, int);
+
 /*
  * Send a complete remote command.  Returns true on success, false on failure.
  * On failure, use remctl_error to get the error.  There are two forms of this
@@ -228,6 +347,18 @@ int remctl_noop(struct remctl *);
  */
 struct remctl_output *remctl_output(struct remctl *);
 
+/*
+ * Retrieve all output from the current command by passing each piece to a
+ * callback, including the final REMCTL_OUT_STATUS or REMCTL_OUT_ERROR
+ * output.  The output passed to the callback, including its data, is only
+ * valid until the callback returns, so output can be processed or copied
+ * into the caller's own buffers without any intermediate allocation.
+ * Returns true on success and false on failure or if the callback returns
+ * false.  On failure, use remctl_error to get the error.  Not supported on
+ * asynchronous connections.
+ */
+int remctl_output_callback(struct remctl *, remctl_output_func, void *data);
+
 /*
  * Call remctl_error after an error return to retrieve the internal error
  * message.  The returned error string will be invalidated by any subsequent
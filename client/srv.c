@@ -0,0 +1,355 @@
+/*
+ * Locate remctl servers with SRV records.
+ *
+ * If SRV lookups are enabled and remctl_open is called without a port, look
+ * up _remctl._tcp.<host> and connect to the targets in the order given by
+ * their priorities and weights as described in RFC 2782.  The results of the
+ * last lookup are cached in the remctl struct for the lifetime of the records
+ * (but no longer than SRV_CACHE_MAX), so that reopening the connection, which
+ * protocol version one does for every command, doesn't query DNS each time.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#ifdef HAVE_RES_SEARCH
+# include <arpa/nameser.h>
+# include <resolv.h>
+#endif
+#include <errno.h>
+#include <time.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <util/macros.h>
+
+/* The longest time to cache the results of an SRV lookup, in seconds. */
+#define SRV_CACHE_MAX 60
+
+/* The size of the buffer for DNS replies, the largest possible message. */
+#define SRV_BUFFER_SIZE 65536
+
+
+/*
+ * Free the cached SRV lookup results, if any.
+ */
+void
+internal_srv_free(struct remctl *r)
+{
+    size_t i;
+
+    if (r->srv == NULL)
+        return;
+    for (i = 0; i < r->srv->count; i++)
+        free(r->srv->targets[i].host);
+    free(r->srv->targets);
+    free(r->srv->name);
+    free(r->srv);
+    r->srv = NULL;
+}
+
+
+#ifndef HAVE_RES_SEARCH
+
+/*
+ * Without a resolver library that supports SRV queries, there are never any
+ * SRV records and the caller connects to the host directly.
+ * remctl_set_srv_lookup refuses to enable lookups in this case, so this
+ * should never be called.
+ */
+bool
+internal_srv_connect(struct remctl *r UNUSED, const char *host UNUSED,
+                     socket_type *fd, const char **target)
+{
+    *fd = INVALID_SOCKET;
+    *target = NULL;
+    return false;
+}
+
+#else /* HAVE_RES_SEARCH */
+
+/*
+ * Read a 16-bit or 32-bit integer in network byte order from a DNS message.
+ */
+static unsigned short
+srv_get16(const unsigned char *p)
+{
+    return (unsigned short) ((p[0] << 8) | p[1]);
+}
+
+static unsigned long
+srv_get32(const unsigned char *p)
+{
+    return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16)
+           | ((unsigned long) p[2] << 8) | (unsigned long) p[3];
+}
+
+
+/*
+ * Compare two targets by priority, for qsort.
+ */
+static int
+srv_compare(const void *a, const void *b)
+{
+    const struct internal_srv_target *first = a;
+    const struct internal_srv_target *second = b;
+
+    if (first->priority < second->priority)
+        return -1;
+    else if (first->priority > second->priority)
+        return 1;
+    else
+        return 0;
+}
+
+
+/*
+ * Parse the SRV records out of a DNS reply of the given length and store them
+ * in srv, along with the time at which they expire.  A reply that can't be
+ * parsed is treated as containing no records.  Returns false on memory
+ * allocation failure, with errno set, and true otherwise.
+ */
+static bool
+srv_parse(struct internal_srv *srv, const unsigned char *reply, size_t length)
+{
+    const unsigned char *p, *end;
+    struct internal_srv_target *targets, *target;
+    char name[NS_MAXDNAME];
+    unsigned int questions, answers, type, rdlength, i;
+    unsigned long ttl, minttl = SRV_CACHE_MAX;
+    int n;
+
+    if (length < 12)
+        return true;
+    end = reply + length;
+    questions = srv_get16(reply + 4);
+    answers = srv_get16(reply + 6);
+    if (answers == 0)
+        return true;
+    targets = calloc(answers, sizeof(*targets));
+    if (targets == NULL)
+        return false;
+    srv->targets = targets;
+
+    /* Skip over the question section. */
+    p = reply + 12;
+    for (i = 0; i < questions; i++) {
+        n = dn_expand(reply, end, p, name, sizeof(name));
+        if (n < 0 || end - p < n + 4)
+            return true;
+        p += n + 4;
+    }
+
+    /* Pull the SRV records out of the answer section. */
+    for (i = 0; i < answers; i++) {
+        n = dn_expand(reply, end, p, name, sizeof(name));
+        if (n < 0 || end - p < n + 10)
+            break;
+        p += n;
+        type = srv_get16(p);
+        ttl = srv_get32(p + 4);
+        rdlength = srv_get16(p + 8);
+        p += 10;
+        if (end - p < (ptrdiff_t) rdlength)
+            break;
+        if (type != T_SRV || rdlength < 7) {
+            p += rdlength;
+            continue;
+        }
+        n = dn_expand(reply, end, p + 6, name, sizeof(name));
+        if (n < 0)
+            break;
+        target = &srv->targets[srv->count];
+        target->host = strdup(name);
+        if (target->host == NULL)
+            return false;
+        target->priority = srv_get16(p);
+        target->weight = srv_get16(p + 2);
+        target->port = srv_get16(p + 4);
+        srv->count++;
+        if (ttl < minttl)
+            minttl = ttl;
+        p += rdlength;
+    }
+    qsort(srv->targets, srv->count, sizeof(*srv->targets), srv_compare);
+    srv->expires = time(NULL) + (time_t) minttl;
+    return true;
+}
+
+
+/*
+ * Look up the SRV records for host, reusing the cached results if they are
+ * for the same host and haven't expired.  If the lookup fails, cache that
+ * there are no records so that we don't keep waiting for a failing resolver.
+ * Returns false on memory allocation failure, setting the error, and true
+ * otherwise.
+ */
+static bool
+srv_lookup(struct remctl *r, const char *host)
+{
+    struct internal_srv *srv;
+    unsigned char *reply = NULL;
+    char *query = NULL;
+    int length;
+
+    srv = r->srv;
+    if (srv != NULL && strcmp(srv->name, host) == 0 && time(NULL) < srv->expires)
+        return true;
+    internal_srv_free(r);
+    srv = calloc(1, sizeof(struct internal_srv));
+    if (srv == NULL)
+        goto fail;
+    r->srv = srv;
+    srv->name = strdup(host);
+    if (srv->name == NULL)
+        goto fail;
+    srv->expires = time(NULL) + SRV_CACHE_MAX;
+    srv->seed = (unsigned long) srv->expires ^ ((unsigned long) getpid() << 16)
+                ^ (unsigned long) (size_t) srv;
+    if (asprintf(&query, "_remctl._tcp.%s", host) < 0)
+        goto fail;
+    reply = malloc(SRV_BUFFER_SIZE);
+    if (reply == NULL)
+        goto fail;
+
+    /* res_search returns the full length of the reply, even if truncated. */
+    length = res_search(query, C_IN, T_SRV, reply, SRV_BUFFER_SIZE);
+    if (length > SRV_BUFFER_SIZE)
+        length = SRV_BUFFER_SIZE;
+    if (length > 0 && !srv_parse(srv, reply, (size_t) length))
+        goto fail;
+    free(query);
+    free(reply);
+    return true;
+
+fail:
+    internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+    internal_srv_free(r);
+    free(query);
+    free(reply);
+    return false;
+}
+
+
+/*
+ * Return the next value from a simple xorshift random number generator.  We
+ * use our own rather than rand so that we don't disturb the random sequence
+ * of the calling program.
+ */
+static unsigned long
+srv_random(struct internal_srv *srv)
+{
+    unsigned long x = srv->seed & 0xffffffffUL;
+
+    if (x == 0)
+        x = 0x2545f491UL;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    srv->seed = x;
+    return x;
+}
+
+
+/*
+ * Fill in order with pointers to the targets in the order in which to try
+ * them.  Targets are already sorted by priority.  Within each priority, pick
+ * targets at random weighted by their weights, following the algorithm in
+ * RFC 2782: put targets with zero weight first, pick a random number between
+ * zero and the sum of the weights of the remaining targets, and pick the
+ * first target for which the running sum of weights is at least that number.
+ */
+static void
+srv_order(struct internal_srv *srv, struct internal_srv_target **order)
+{
+    struct internal_srv_target *tmp;
+    unsigned long total, sum, pick;
+    size_t start, end, i, j, k;
+
+    for (start = 0; start < srv->count; start = end) {
+        end = start;
+        k = start;
+        for (i = start; i < srv->count; i++) {
+            if (srv->targets[i].priority != srv->targets[start].priority)
+                break;
+            if (srv->targets[i].weight == 0)
+                order[k++] = &srv->targets[i];
+        }
+        end = i;
+        for (i = start; i < end; i++)
+            if (srv->targets[i].weight != 0)
+                order[k++] = &srv->targets[i];
+        for (i = start; i < end; i++) {
+            total = 0;
+            for (j = i; j < end; j++)
+                total += order[j]->weight;
+            pick = srv_random(srv) % (total + 1);
+            sum = 0;
+            for (j = i; j < end - 1; j++) {
+                sum += order[j]->weight;
+                if (sum >= pick)
+                    break;
+            }
+            tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+}
+
+
+/*
+ * Look up SRV records for host and connect to the first target that accepts
+ * a connection.  A target of "." means that the service is deliberately not
+ * available.  If we can't connect to any target, report the error from the
+ * first one, similar to the port fallback in remctl_open.
+ */
+bool
+internal_srv_connect(struct remctl *r, const char *host, socket_type *fd,
+                     const char **target)
+{
+    struct internal_srv_target **order;
+    char *old_error = NULL;
+    size_t i;
+
+    *fd = INVALID_SOCKET;
+    *target = NULL;
+    if (!srv_lookup(r, host))
+        return true;
+    if (r->srv->count == 0)
+        return false;
+    order = calloc(r->srv->count, sizeof(*order));
+    if (order == NULL) {
+        internal_set_error(r, "cannot allocate memory: %s", strerror(errno));
+        return true;
+    }
+    srv_order(r->srv, order);
+    for (i = 0; i < r->srv->count && *fd == INVALID_SOCKET; i++) {
+        if (order[i]->host[0] == '\0' || strcmp(order[i]->host, ".") == 0)
+            continue;
+        *fd = internal_connect(r, order[i]->host, order[i]->port);
+        if (*fd != INVALID_SOCKET)
+            *target = order[i]->host;
+        else if (old_error == NULL) {
+            old_error = r->error;
+            r->error = NULL;
+        }
+    }
+    free(order);
+    if (*fd != INVALID_SOCKET)
+        free(old_error);
+    else if (old_error != NULL) {
+        free(r->error);
+        r->error = old_error;
+    } else
+        internal_set_error(r, "no remctl service for %s", host);
+    return true;
+}
+
+#endif /* HAVE_RES_SEARCH */
@@ -0,0 +1,39 @@
+dnl Check for compiler support for atomic operations.
+dnl
+dnl Provides REMCTL_C_ATOMIC, which checks whether the compiler supports the
+dnl __atomic builtins originally introduced by GCC for the C11 memory model,
+dnl namely:
+dnl
+dnl     __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+dnl
+dnl on 64-bit integers without requiring an additional library.  Sets
+dnl HAVE_ATOMIC_BUILTINS if they're available.
+dnl
+dnl Written by agent <agent@local>
+dnl Copyright 2026 agent <agent@local>
+dnl
+dnl SPDX-License-Identifier: FSFULLR
+
+AC_DEFUN([_REMCTL_C_ATOMIC_SOURCE], [[
+#include <stdint.h>
+
+int
+main(void) {
+    uint64_t counter = 0;
+    uint64_t expected = 1;
+
+    __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+    __atomic_compare_exchange_n(&counter, &expected, 2, 0, __ATOMIC_ACQ_REL,
+                                __ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&counter, __ATOMIC_RELAXED) == 2) ? 0 : 1;
+}
+]])
+
+AC_DEFUN([REMCTL_C_ATOMIC],
+[AC_CACHE_CHECK([for __atomic builtins], [remctl_cv_c_atomic_builtins],
+    [AC_LINK_IFELSE([AC_LANG_SOURCE([_REMCTL_C_ATOMIC_SOURCE])],
+        [remctl_cv_c_atomic_builtins=yes],
+        [remctl_cv_c_atomic_builtins=no])])
+ AS_IF([test x"$remctl_cv_c_atomic_builtins" = xyes],
+    [AC_DEFINE([HAVE_ATOMIC_BUILTINS], 1,
+        [Define if the compiler supports the __atomic builtins.])])])
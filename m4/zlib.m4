@@ -0,0 +1,61 @@
+dnl Find the compiler and linker flags for zlib.
+dnl
+dnl Finds the compiler and linker flags for linking with the zlib library.
+dnl Provides the --with-zlib, --with-zlib-lib, and --with-zlib-include
+dnl configure options to specify non-standard paths to the zlib libraries or
+dnl header files.
+dnl
+dnl Provides the macro RRA_LIB_ZLIB_OPTIONAL and sets the substitution
+dnl variables ZLIB_CPPFLAGS, ZLIB_LDFLAGS, and ZLIB_LIBS.  Also provides
+dnl RRA_LIB_ZLIB_SWITCH to set CPPFLAGS, LDFLAGS, and LIBS to include the
+dnl zlib libraries, saving the current values first, and RRA_LIB_ZLIB_RESTORE
+dnl to restore those settings to before the last RRA_LIB_ZLIB_SWITCH.  Defines
+dnl HAVE_ZLIB and sets rra_use_ZLIB to true if zlib is found.  If it isn't
+dnl found, the substitution variables will be empty.
+dnl
+dnl Depends on the lib-helper.m4 framework.
+dnl
+dnl Written by agent <agent@local>
+dnl Copyright 2026 agent <agent@local>
+dnl
+dnl This file is free software; the authors give unlimited permission to copy
+dnl and/or distribute it, with or without modifications, as long as this
+dnl notice is preserved.
+dnl
+dnl SPDX-License-Identifier: FSFULLR
+
+dnl Save the current CPPFLAGS, LDFLAGS, and LIBS settings and switch to
+dnl versions that include the zlib flags.  Used as a wrapper, with
+dnl RRA_LIB_ZLIB_RESTORE, around tests.
+AC_DEFUN([RRA_LIB_ZLIB_SWITCH], [RRA_LIB_HELPER_SWITCH([ZLIB])])
+
+dnl Restore CPPFLAGS, LDFLAGS, and LIBS to their previous values before
+dnl RRA_LIB_ZLIB_SWITCH was called.
+AC_DEFUN([RRA_LIB_ZLIB_RESTORE], [RRA_LIB_HELPER_RESTORE([ZLIB])])
+
+dnl Checks if zlib is present.  The single argument, if "true", says to fail
+dnl if the zlib library could not be found.
+AC_DEFUN([_RRA_LIB_ZLIB_INTERNAL],
+[RRA_LIB_HELPER_PATHS([ZLIB])
+ RRA_LIB_ZLIB_SWITCH
+ AC_CHECK_HEADER([zlib.h],
+    [AC_CHECK_LIB([z], [deflate], [ZLIB_LIBS="-lz"],
+        [AS_IF([test x"$1" = xtrue],
+            [AC_MSG_ERROR([cannot find usable zlib library])])])],
+    [AS_IF([test x"$1" = xtrue],
+        [AC_MSG_ERROR([cannot find usable zlib library])])])
+ RRA_LIB_ZLIB_RESTORE])
+
+dnl The main macro for packages with optional zlib support.
+AC_DEFUN([RRA_LIB_ZLIB_OPTIONAL],
+[RRA_LIB_HELPER_VAR_INIT([ZLIB])
+ RRA_LIB_HELPER_WITH_OPTIONAL([zlib], [zlib], [ZLIB])
+ AS_IF([test x"$rra_use_ZLIB" != xfalse],
+    [AS_IF([test x"$rra_use_ZLIB" = xtrue],
+        [_RRA_LIB_ZLIB_INTERNAL([true])],
+        [_RRA_LIB_ZLIB_INTERNAL([false])])])
+ AS_IF([test x"$ZLIB_LIBS" = x],
+    [ZLIB_CPPFLAGS=
+     ZLIB_LDFLAGS=],
+    [rra_use_ZLIB=true
+     AC_DEFINE([HAVE_ZLIB], 1, [Define if zlib is available.])])])
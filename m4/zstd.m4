@@ -0,0 +1,61 @@
+dnl Find the compiler and linker flags for zstd.
+dnl
+dnl Finds the compiler and linker flags for linking with the zstd library.
+dnl Provides the --with-zstd, --with-zstd-lib, and --with-zstd-include
+dnl configure options to specify non-standard paths to the zstd libraries or
+dnl header files.
+dnl
+dnl Provides the macro RRA_LIB_ZSTD_OPTIONAL and sets the substitution
+dnl variables ZSTD_CPPFLAGS, ZSTD_LDFLAGS, and ZSTD_LIBS.  Also provides
+dnl RRA_LIB_ZSTD_SWITCH to set CPPFLAGS, LDFLAGS, and LIBS to include the
+dnl zstd libraries, saving the current values first, and RRA_LIB_ZSTD_RESTORE
+dnl to restore those settings to before the last RRA_LIB_ZSTD_SWITCH.  Defines
+dnl HAVE_ZSTD and sets rra_use_ZSTD to true if zstd is found.  If it isn't
+dnl found, the substitution variables will be empty.
+dnl
+dnl Depends on the lib-helper.m4 framework.
+dnl
+dnl Written by agent <agent@local>
+dnl Copyright 2026 agent <agent@local>
+dnl
+dnl This file is free software; the authors give unlimited permission to copy
+dnl and/or distribute it, with or without modifications, as long as this
+dnl notice is preserved.
+dnl
+dnl SPDX-License-Identifier: FSFULLR
+
+dnl Save the current CPPFLAGS, LDFLAGS, and LIBS settings and switch to
+dnl versions that include the zstd flags.  Used as a wrapper, with
+dnl RRA_LIB_ZSTD_RESTORE, around tests.
+AC_DEFUN([RRA_LIB_ZSTD_SWITCH], [RRA_LIB_HELPER_SWITCH([ZSTD])])
+
+dnl Restore CPPFLAGS, LDFLAGS, and LIBS to their previous values before
+dnl RRA_LIB_ZSTD_SWITCH was called.
+AC_DEFUN([RRA_LIB_ZSTD_RESTORE], [RRA_LIB_HELPER_RESTORE([ZSTD])])
+
+dnl Checks if zstd is present.  The single argument, if "true", says to fail
+dnl if the zstd library could not be found.
+AC_DEFUN([_RRA_LIB_ZSTD_INTERNAL],
+[RRA_LIB_HELPER_PATHS([ZSTD])
+ RRA_LIB_ZSTD_SWITCH
+ AC_CHECK_HEADER([zstd.h],
+    [AC_CHECK_LIB([zstd], [ZSTD_compressStream2], [ZSTD_LIBS="-lzstd"],
+        [AS_IF([test x"$1" = xtrue],
+            [AC_MSG_ERROR([cannot find usable zstd library])])])],
+    [AS_IF([test x"$1" = xtrue],
+        [AC_MSG_ERROR([cannot find usable zstd library])])])
+ RRA_LIB_ZSTD_RESTORE])
+
+dnl The main macro for packages with optional zstd support.
+AC_DEFUN([RRA_LIB_ZSTD_OPTIONAL],
+[RRA_LIB_HELPER_VAR_INIT([ZSTD])
+ RRA_LIB_HELPER_WITH_OPTIONAL([zstd], [zstd], [ZSTD])
+ AS_IF([test x"$rra_use_ZSTD" != xfalse],
+    [AS_IF([test x"$rra_use_ZSTD" = xtrue],
+        [_RRA_LIB_ZSTD_INTERNAL([true])],
+        [_RRA_LIB_ZSTD_INTERNAL([false])])])
+ AS_IF([test x"$ZSTD_LIBS" = x],
+    [ZSTD_CPPFLAGS=
+     ZSTD_LDFLAGS=],
+    [rra_use_ZSTD=true
+     AC_DEFINE([HAVE_ZSTD], 1, [Define if zstd is available.])])])
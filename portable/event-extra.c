@@ -47,6 +47,37 @@ bufferevent_read_buffer(struct bufferevent *bufev, struct evbuffer *buf)
 #endif /* !HAVE_BUFFEREVENT_READ_BUFFER */
 
 
+#ifndef HAVE_BUFFEREVENT_SET_TIMEOUTS
+/*
+ * Set the read and write timeouts of a bufferevent, either of which may be
+ * NULL to not use a timeout.  Older versions of libevent only support
+ * timeouts in seconds, so round down, but not to zero since that disables
+ * the timeout.
+ */
+int
+bufferevent_set_timeouts(struct bufferevent *bufev,
+                         const struct timeval *timeout_read,
+                         const struct timeval *timeout_write)
+{
+    int read_secs = 0;
+    int write_secs = 0;
+
+    if (timeout_read != NULL) {
+        read_secs = (int) timeout_read->tv_sec;
+        if (read_secs < 1)
+            read_secs = 1;
+    }
+    if (timeout_write != NULL) {
+        write_secs = (int) timeout_write->tv_sec;
+        if (write_secs < 1)
+            write_secs = 1;
+    }
+    bufferevent_settimeout(bufev, read_secs, write_secs);
+    return 0;
+}
+#endif /* !HAVE_BUFFEREVENT_SET_TIMEOUTS */
+
+
 #ifndef HAVE_BUFFEREVENT_SOCKET_NEW
 /*
  * Create a new bufferevent for a socket and register it with the provided
@@ -74,6 +74,11 @@ typedef void (*event_callback_fn)(evutil_socket_t, short, void *);
 # define bufferevent_get_input(bev) EVBUFFER_INPUT(bev)
 #endif
 
+/* Introduced in 2.0.1-alpha. */
+#ifndef HAVE_BUFFEREVENT_GET_OUTPUT
+# define bufferevent_get_output(bev) EVBUFFER_OUTPUT(bev)
+#endif
+
 /* Introduced in 2.0.1-alpha. */
 #ifndef HAVE_BUFFEREVENT_READ_BUFFER
 int bufferevent_read_buffer(struct bufferevent *, struct evbuffer *);
@@ -89,6 +94,15 @@ struct bufferevent *bufferevent_socket_new(struct event_base *,
                                            evutil_socket_t, int);
 #endif
 
+/*
+ * Introduced in 2.0.4-alpha.  Older versions only support timeouts in whole
+ * seconds.
+ */
+#ifndef HAVE_BUFFEREVENT_SET_TIMEOUTS
+int bufferevent_set_timeouts(struct bufferevent *, const struct timeval *,
+                             const struct timeval *);
+#endif
+
 /* Introduced in 2.1.1-alpha.  Just skip it if we don't have it. */
 #ifndef HAVE_LIBEVENT_GLOBAL_SHUTDOWN
 # define libevent_global_shutdown() /* empty */
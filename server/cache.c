@@ -0,0 +1,1152 @@
+/*
+ * Result cache for remctld commands.
+ *
+ * Commands whose configuration rule sets the cache option have their output
+ * and exit status saved in a spool directory, keyed by the command arguments
+ * and optionally by the identity of the client.  Later runs of the same
+ * command within the cache lifetime are answered from the saved result
+ * without running the program.  Each connection is handled by a separate
+ * process, so a directory is the simplest way to share results between them.
+ * Entries are written to a temporary file and renamed into place so that
+ * readers never see a partial result.  The modification time of each entry
+ * is set to the time at which it expires, so that expired entries can be
+ * found and removed without reading them, and the number of entries is
+ * limited so that clients can't fill the disk by varying the arguments.
+ *
+ * The same directory is used to coordinate commands with the single-flight
+ * option.  The first process to run such a command creates and locks a run
+ * file for it and appends the output of the command to that file as it is
+ * read from the command, followed by the exit status.  Its own client is then
+ * sent the output from the run file, so a slow client doesn't hold up anyone
+ * else.  Other processes asked to run the same command while the lock is held
+ * read the run file instead, sending the output to their clients as it
+ * appears.  When the command finishes, the run file is removed before the
+ * lock is released, so later requests start a new run.
+ *
+ * Each cache entry starts with CACHE_MAGIC, followed by the length of the key
+ * and the key, the exit status, and the length of the rest of the entry, all
+ * lengths and numbers being four octets in network byte order.  The rest of
+ * the entry is the output of the command as a sequence of records, each of
+ * which consists of one octet for the stream, the length of the data, and the
+ * data.  Run files use the same format without the exit status and length,
+ * and end with a record for stream 0 holding the exit status.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/event.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <utime.h>
+
+#include <server/internal.h>
+#include <util/buffer.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/* Identifies a cache entry and the version of its format. */
+#define CACHE_MAGIC "remctl cache 1\n"
+
+/*
+ * The maximum amount of output from a command that we'll cache.  The cache is
+ * meant for small status reports, and commands that produce more output than
+ * this are simply run each time.
+ */
+#define CACHE_MAX_OUTPUT (1024 * 1024)
+
+/*
+ * The maximum number of results kept in the cache.  Before storing a new
+ * result, expired results are removed, and then if there are still too many,
+ * the results that will expire soonest.
+ */
+#define CACHE_MAX_ENTRIES 1024
+
+/*
+ * The minimum and maximum time in milliseconds to wait between checks for
+ * more output from a command being run by another process, and the amount of
+ * output to try to read at a time.
+ */
+#define FLIGHT_POLL_MIN 1
+#define FLIGHT_POLL_MAX 100
+#define FLIGHT_READ_SIZE (64 * 1024)
+
+/*
+ * The byte of a run file locked for writing by the process running the
+ * command, and the byte locked for reading by each process following it.
+ * Locking separate bytes lets anyone check whether the command is still
+ * running and whether anyone is waiting for its output.
+ */
+#define FLIGHT_LEADER   0
+#define FLIGHT_FOLLOWER 1
+
+/* The run file for a single-flight command that this process is running. */
+struct flight {
+    int fd;                     /* Locked file descriptor of the run file. */
+    char *path;                 /* Path to the run file. */
+    off_t written;              /* Length of the run file written so far. */
+    off_t sent;                 /* Offset of output not yet sent to client. */
+    bool failed;                /* Whether writing to the run file failed. */
+    bool finished;              /* Whether the exit status was written. */
+};
+
+/* A result in the cache, used when deciding which results to remove. */
+struct cache_entry {
+    char *path;                 /* Path to the cache entry. */
+    time_t expires;             /* When it expires, from its mtime. */
+};
+
+/* The directory holding the cache, or NULL if caching is disabled. */
+static char *cache_dir = NULL;
+
+
+/*
+ * Set the directory used for the result cache.  The directory is created if
+ * it doesn't exist.  Since anyone who can write to the cache can control the
+ * output of commands, it must be owned by the user running remctld and must
+ * not be writable by anyone else.  Returns true on success and false on
+ * failure, reporting an error message.
+ */
+bool
+server_cache_set_directory(const char *path)
+{
+    struct stat st;
+
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        syswarn("cannot create cache directory %s", path);
+        return false;
+    }
+    if (lstat(path, &st) < 0) {
+        syswarn("cannot stat cache directory %s", path);
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        warn("cache directory %s is not a directory", path);
+        return false;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        warn("cache directory %s must be owned by the remctld user and"
+             " writable only by it", path);
+        return false;
+    }
+    free(cache_dir);
+    cache_dir = xstrdup(path);
+    return true;
+}
+
+
+/*
+ * Warn about any rules in the configuration that use the cache or
+ * single-flight options when no cache directory was configured, since those
+ * options have no effect without one.
+ */
+void
+server_cache_check(const struct config *config)
+{
+    const struct rule *rule;
+    size_t i;
+
+    if (cache_dir != NULL)
+        return;
+    for (i = 0; i < config->count; i++) {
+        rule = config->rules[i];
+        if (rule->cache > 0)
+            warn("%s:%lu: cache has no effect without a cache directory",
+                 rule->file, (unsigned long) rule->lineno);
+        if (rule->single_flight)
+            warn("%s:%lu: single-flight has no effect without a cache"
+                 " directory", rule->file, (unsigned long) rule->lineno);
+    }
+}
+
+
+/*
+ * Return whether results for this client and rule can be cached.  Besides
+ * needing a cache directory and a rule with caching enabled, the protocol
+ * must be able to send output separately from the exit status, which rules
+ * out protocol version one.
+ */
+static bool
+cache_usable(const struct client *client, const struct rule *rule)
+{
+    return cache_dir != NULL && rule->cache > 0 && client->output != NULL;
+}
+
+
+/*
+ * Return whether this command can be shared with other clients running the
+ * same command at the same time.  This has the same requirements as caching.
+ */
+static bool
+flight_usable(const struct client *client, const struct rule *rule)
+{
+    return cache_dir != NULL && rule->single_flight && client->output != NULL;
+}
+
+
+/*
+ * Build the key for a command.  This is the program that will be run, the
+ * user if per_user is true, and then each argument preceded by its length.
+ * Returns a newly allocated buffer.
+ */
+static struct buffer *
+cache_key(const struct client *client, const struct rule *rule,
+          struct iovec **argv, bool per_user)
+{
+    struct buffer *key;
+    uint32_t length;
+    size_t i;
+
+    key = buffer_new();
+    buffer_append_sprintf(key, "%s\n", rule->program);
+    if (per_user)
+        buffer_append_sprintf(key, "user %s\n", client->user);
+    else
+        buffer_append_sprintf(key, "all\n");
+    for (i = 0; argv[i] != NULL; i++) {
+        length = htonl((uint32_t) argv[i]->iov_len);
+        buffer_append(key, (const char *) &length, sizeof(length));
+        buffer_append(key, argv[i]->iov_base, argv[i]->iov_len);
+    }
+    return key;
+}
+
+
+/*
+ * Return the path to the cache entry for a key, which is named after the
+ * 64-bit FNV-1a hash of the key.  Collisions are harmless, since the full key
+ * is stored in the entry and checked before it is used.  The caller is
+ * responsible for freeing the path.
+ */
+static char *
+cache_path(const struct buffer *key)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    size_t i;
+    char *path;
+
+    for (i = 0; i < key->left; i++) {
+        hash ^= (unsigned char) key->data[key->used + i];
+        hash *= UINT64_C(1099511628211);
+    }
+    xasprintf(&path, "%s/%08lx%08lx", cache_dir,
+              (unsigned long) (hash >> 32),
+              (unsigned long) (hash & 0xffffffffUL));
+    return path;
+}
+
+
+/*
+ * Read a four-octet number in network byte order.
+ */
+static uint32_t
+read_uint32(const char *data)
+{
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+
+/*
+ * Append the magic string and the key to a buffer, forming the start of a
+ * cache entry or run file.
+ */
+static void
+append_key(struct buffer *buffer, const struct buffer *key)
+{
+    uint32_t length;
+
+    buffer_append(buffer, CACHE_MAGIC, strlen(CACHE_MAGIC));
+    length = htonl((uint32_t) key->left);
+    buffer_append(buffer, (const char *) &length, sizeof(length));
+    buffer_append(buffer, key->data + key->used, key->left);
+}
+
+
+/*
+ * Check whether data starts with the magic string and the given key, as
+ * written by append_key.  The data must be at least as long as that.
+ */
+static bool
+match_key(const char *data, const struct buffer *key)
+{
+    size_t length = strlen(CACHE_MAGIC);
+
+    if (memcmp(data, CACHE_MAGIC, length) != 0)
+        return false;
+    if (read_uint32(data + length) != key->left)
+        return false;
+    return memcmp(data + length + 4, key->data + key->used, key->left) == 0;
+}
+
+
+/*
+ * Given a cache entry and the key we expect, check that the entry is
+ * well-formed and matches the key.  On success, returns true, sets status to
+ * the cached exit status, and advances the entry past the header to the
+ * output records.  Returns false if the entry doesn't match or is corrupt.
+ */
+static bool
+cache_parse(struct buffer *entry, const struct buffer *key, int *status)
+{
+    const char *data = entry->data + entry->used;
+    size_t left = entry->left;
+    size_t header, length;
+
+    /* Check the magic string and the key. */
+    header = strlen(CACHE_MAGIC) + 4 + key->left;
+    if (left < header + 4 + 4 || !match_key(data, key))
+        return false;
+    *status = (int) (int32_t) read_uint32(data + header);
+    length = read_uint32(data + header + 4);
+    header += 4 + 4;
+
+    /* Check that the output records are complete before using them. */
+    data += header;
+    left -= header;
+    if (left != length)
+        return false;
+    while (left > 0) {
+        if (left < 1 + 4 || (data[0] != 1 && data[0] != 2))
+            return false;
+        length = read_uint32(data + 1);
+        if (left - 1 - 4 < length)
+            return false;
+        data += 1 + 4 + length;
+        left -= 1 + 4 + length;
+    }
+    entry->used += header;
+    entry->left -= header;
+    return true;
+}
+
+
+/*
+ * Send one record of output to the client.  The output may have been recorded
+ * for a client that negotiated a larger token size, so split it as needed.
+ * Returns false if sending the output failed, in which case the output
+ * callback has already reported the error and marked the client as failed.
+ */
+static bool
+send_output(struct client *client, const struct rule *rule, int stream,
+            const char *data, size_t length)
+{
+    size_t chunk, max;
+    struct evbuffer *output;
+    bool okay = true;
+
+    output = evbuffer_new();
+    if (output == NULL)
+        die("internal error: cannot create output buffer");
+    max = TOKEN_MAX_OUTPUT_FOR(client->max_data);
+    while (okay && length > 0) {
+        chunk = (length > max) ? max : length;
+        if (evbuffer_add(output, data, chunk) < 0)
+            die("internal error: cannot add data to output buffer");
+        okay = client->output(client, stream, output, rule->integrity);
+        data += chunk;
+        length -= chunk;
+    }
+    evbuffer_free(output);
+    return okay;
+}
+
+
+/*
+ * Send the output records from a cache entry to the client, stopping if
+ * sending fails.
+ */
+static void
+cache_send(struct client *client, const struct rule *rule,
+           const struct buffer *entry)
+{
+    const char *data = entry->data + entry->used;
+    size_t left = entry->left;
+    size_t length;
+
+    while (left > 0) {
+        length = read_uint32(data + 1);
+        if (!send_output(client, rule, data[0], data + 1 + 4, length))
+            return;
+        data += 1 + 4 + length;
+        left -= 1 + 4 + length;
+    }
+}
+
+
+/*
+ * Remove an expired cache entry, given its path and the results of fstat on
+ * the copy we opened.  Another process may have replaced it with a current
+ * result since we opened it, so only remove it if it's still the same file.
+ */
+static void
+cache_remove(const char *path, const struct stat *old)
+{
+    struct stat st;
+
+    if (lstat(path, &st) < 0)
+        return;
+    if (st.st_dev != old->st_dev || st.st_ino != old->st_ino)
+        return;
+    if (unlink(path) < 0 && errno != ENOENT)
+        syswarn("cannot remove expired cache entry %s", path);
+}
+
+
+/*
+ * Comparison function for qsort to sort cache entries by expiration time.
+ */
+static int
+compare_entries(const void *a, const void *b)
+{
+    const struct cache_entry *first = a;
+    const struct cache_entry *second = b;
+
+    if (first->expires < second->expires)
+        return -1;
+    else if (first->expires > second->expires)
+        return 1;
+    else
+        return 0;
+}
+
+
+/*
+ * Remove expired results from the cache.  If that still leaves at least
+ * CACHE_MAX_ENTRIES results, also remove the results that will expire soonest
+ * until there's room for one more.  Temporary files, run files, and the
+ * limits table have a period in their names and are left alone.
+ */
+static void
+cache_prune(void)
+{
+    DIR *dir;
+    struct dirent *file;
+    struct stat st;
+    struct cache_entry *entries = NULL;
+    size_t count = 0;
+    size_t allocated = 0;
+    size_t i;
+    char *path;
+    time_t now;
+
+    dir = opendir(cache_dir);
+    if (dir == NULL) {
+        syswarn("cannot open cache directory %s", cache_dir);
+        return;
+    }
+    now = time(NULL);
+    while ((file = readdir(dir)) != NULL) {
+        if (strchr(file->d_name, '.') != NULL)
+            continue;
+        xasprintf(&path, "%s/%s", cache_dir, file->d_name);
+        if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (st.st_mtime <= now) {
+            debug("removing expired cache entry %s", path);
+            if (unlink(path) < 0 && errno != ENOENT)
+                syswarn("cannot remove expired cache entry %s", path);
+            free(path);
+            continue;
+        }
+        if (count == allocated) {
+            allocated = (allocated == 0) ? 64 : allocated * 2;
+            entries = xreallocarray(entries, allocated, sizeof(*entries));
+        }
+        entries[count].path = path;
+        entries[count].expires = st.st_mtime;
+        count++;
+    }
+    closedir(dir);
+
+    /* If there are still too many, remove the ones expiring soonest. */
+    if (count >= CACHE_MAX_ENTRIES) {
+        qsort(entries, count, sizeof(*entries), compare_entries);
+        for (i = 0; count - i >= CACHE_MAX_ENTRIES; i++) {
+            debug("removing cache entry %s to make room", entries[i].path);
+            if (unlink(entries[i].path) < 0 && errno != ENOENT)
+                syswarn("cannot remove cache entry %s", entries[i].path);
+        }
+    }
+    for (i = 0; i < count; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+
+/*
+ * Given the client, the rule for a command, and the command arguments, check
+ * the cache for a current result for that command.  If there is one, send
+ * its output to the client, set status to its exit status, and return true.
+ * The caller is then responsible for sending the exit status.  Otherwise,
+ * return false and the command should be run as normal.
+ */
+bool
+server_cache_replay(struct client *client, const struct rule *rule,
+                    struct iovec **argv, int *status)
+{
+    struct buffer *key;
+    struct buffer *entry = NULL;
+    char *path;
+    struct stat st;
+    time_t now;
+    int fd;
+    bool found = false;
+
+    if (!cache_usable(client, rule))
+        return false;
+    key = cache_key(client, rule, argv, rule->cache_per_user);
+    path = cache_path(key);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            syswarn("cannot open cache entry %s", path);
+        goto done;
+    }
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat cache entry %s", path);
+        goto done;
+    }
+    now = time(NULL);
+    if (st.st_mtime <= now || st.st_mtime - now > rule->cache) {
+        debug("cache entry %s has expired", path);
+        cache_remove(path, &st);
+        goto done;
+    }
+    entry = buffer_new();
+    if (!buffer_read_file(entry, fd)) {
+        syswarn("cannot read cache entry %s", path);
+        goto done;
+    }
+    if (!cache_parse(entry, key, status)) {
+        debug("cache entry %s does not match command", path);
+        goto done;
+    }
+    debug("sending cached result from %s", path);
+    cache_send(client, rule, entry);
+    found = true;
+
+done:
+    if (fd >= 0)
+        close(fd);
+    if (entry != NULL)
+        buffer_free(entry);
+    buffer_free(key);
+    free(path);
+    return found;
+}
+
+
+/*
+ * Set or check a lock on one byte of a run file.  Takes the file descriptor,
+ * the fcntl command, the type of lock, and the byte to lock.  Returns the
+ * result of fcntl, updating type with the type of conflicting lock for
+ * F_GETLK.
+ */
+static int
+flight_lock(int fd, int command, short *type, off_t offset)
+{
+    struct flock lock;
+    int status;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = *type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = offset;
+    lock.l_len = 1;
+    status = fcntl(fd, command, &lock);
+    *type = lock.l_type;
+    return status;
+}
+
+
+/*
+ * Check whether another process holds the lock on a run file, meaning that it
+ * is still running the command.
+ */
+static bool
+flight_running(int fd)
+{
+    short type = F_WRLCK;
+
+    if (flight_lock(fd, F_GETLK, &type, FLIGHT_LEADER) < 0) {
+        syswarn("cannot check lock on run file");
+        return false;
+    }
+    return type != F_UNLCK;
+}
+
+
+/*
+ * Open and try to lock the run file for a command.  If we get the lock, we
+ * will run the command and leader is set to true.  Otherwise, another process
+ * is running it, leader is set to false, and we take a shared lock to show
+ * that we're waiting for its output.  Returns the file descriptor of the run
+ * file, or -1 on failure.
+ *
+ * The run file is removed while still locked when a command finishes, so
+ * after getting the lock, make sure that the file we locked is still the one
+ * at that path.  A non-empty file we could lock was left behind by a process
+ * that died while running the command, so remove it and start over.
+ */
+static int
+flight_open(const char *path, bool *leader)
+{
+    struct stat st, current;
+    short type;
+    int fd;
+
+    for (;;) {
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            syswarn("cannot open run file %s", path);
+            return -1;
+        }
+        type = F_WRLCK;
+        if (flight_lock(fd, F_SETLK, &type, FLIGHT_LEADER) < 0) {
+            if (errno != EACCES && errno != EAGAIN) {
+                syswarn("cannot lock run file %s", path);
+                close(fd);
+                return -1;
+            }
+            type = F_RDLCK;
+            if (flight_lock(fd, F_SETLK, &type, FLIGHT_FOLLOWER) < 0)
+                syswarn("cannot lock run file %s", path);
+            *leader = false;
+            return fd;
+        }
+        if (fstat(fd, &st) < 0) {
+            syswarn("cannot stat run file %s", path);
+            close(fd);
+            return -1;
+        }
+        if (stat(path, &current) == 0 && st.st_dev == current.st_dev
+            && st.st_ino == current.st_ino) {
+            if (st.st_size == 0) {
+                *leader = true;
+                return fd;
+            }
+            unlink(path);
+        }
+        close(fd);
+    }
+}
+
+
+/*
+ * Follow a run file written by another process, sending the output of the
+ * command to our client as it appears.  Returns true and sets status once we
+ * see the exit status.  We wait as long as the other process holds its lock
+ * on the run file, however long the command takes.  If the run file is for a
+ * different command, or if the other process releases its lock without
+ * writing the exit status and we haven't sent any output yet, returns false
+ * and the command should be run as normal.  If we've already sent output, or
+ * if our client goes away while we're waiting, set the status to -1 as if the
+ * command had been killed.
+ */
+static bool
+flight_follow(struct client *client, const struct rule *rule, int fd,
+              const char *path, const struct buffer *key, int *status)
+{
+    struct buffer *data;
+    const char *p;
+    size_t header, length;
+    ssize_t count;
+    long wait = FLIGHT_POLL_MIN;
+    bool started = false;
+    bool sent = false;
+    bool stopped = false;
+    bool watch = true;
+
+    data = buffer_new();
+    header = strlen(CACHE_MAGIC) + 4 + key->left;
+    for (;;) {
+        buffer_compact(data);
+        if (data->size - data->left < FLIGHT_READ_SIZE)
+            buffer_resize(data, data->left + FLIGHT_READ_SIZE);
+        count = buffer_read(data, fd);
+        if (count < 0) {
+            syswarn("cannot read run file %s", path);
+            goto fail;
+        }
+
+        /* Check the key once the whole header is available. */
+        if (!started && data->left >= header) {
+            if (!match_key(data->data + data->used, key))
+                goto fail;
+            started = true;
+            data->used += header;
+            data->left -= header;
+        }
+
+        /* Send each complete output record. */
+        while (started && data->left >= 1 + 4) {
+            p = data->data + data->used;
+            length = read_uint32(p + 1);
+            if (data->left - 1 - 4 < length)
+                break;
+            if (p[0] == 0 && length == 4) {
+                *status = (int) (int32_t) read_uint32(p + 1 + 4);
+                buffer_free(data);
+                return true;
+            }
+            if (p[0] != 1 && p[0] != 2) {
+                warn("invalid data in run file %s", path);
+                goto fail;
+            }
+            sent = true;
+            if (!send_output(client, rule, p[0], p + 1 + 4, length)) {
+                *status = -1;
+                buffer_free(data);
+                return true;
+            }
+            data->used += 1 + 4 + length;
+            data->left -= 1 + 4 + length;
+        }
+
+        /*
+         * If there was no new data, check whether the other process is still
+         * running the command.  If it isn't, read one more time in case it
+         * wrote more output and the status before exiting.
+         */
+        if (count > 0) {
+            wait = FLIGHT_POLL_MIN;
+            continue;
+        }
+        if (stopped) {
+            warn("command in %s did not finish", path);
+            goto fail;
+        }
+        if (!flight_running(fd)) {
+            stopped = true;
+            continue;
+        }
+        if (!server_client_wait(client, wait, &watch)) {
+            warn("client went away while waiting for output in %s", path);
+            client->fatal = true;
+            buffer_free(data);
+            *status = -1;
+            return true;
+        }
+        wait = (wait * 2 > FLIGHT_POLL_MAX) ? FLIGHT_POLL_MAX : wait * 2;
+    }
+
+fail:
+    buffer_free(data);
+    if (!sent)
+        return false;
+    *status = -1;
+    return true;
+}
+
+
+/*
+ * Given the client, the rule for a command, and the command arguments, check
+ * whether another process is already running the same command for one of its
+ * clients.  If so, wait for the output from that run, send it to the client
+ * as it appears, set status to the exit status of the command, and return
+ * true.  The caller is then responsible for sending the exit status.
+ *
+ * Otherwise, return false and the command should be run as normal.  If the
+ * command can be shared, we're now responsible for running it, and its
+ * output will be written to the run file for any other process that wants it
+ * until server_cache_end is called.
+ */
+bool
+server_cache_join(struct client *client, const struct rule *rule,
+                  struct iovec **argv, int *status)
+{
+    struct buffer *key;
+    struct buffer *header;
+    struct flight *flight;
+    char *base, *path;
+    int fd;
+    bool leader;
+    bool joined = false;
+
+    if (!flight_usable(client, rule))
+        return false;
+    key = cache_key(client, rule, argv, rule->single_flight_user);
+    base = cache_path(key);
+    xasprintf(&path, "%s.run", base);
+    free(base);
+    fd = flight_open(path, &leader);
+    if (fd < 0)
+        goto done;
+
+    /* If someone else is running the command, follow along. */
+    if (!leader) {
+        debug("waiting for output in %s", path);
+        joined = flight_follow(client, rule, fd, path, key, status);
+        close(fd);
+        goto done;
+    }
+
+    /* Otherwise, we'll run it, so start the run file. */
+    header = buffer_new();
+    append_key(header, key);
+    if (xwrite(fd, header->data, header->left) < 0) {
+        syswarn("cannot write run file %s", path);
+        buffer_free(header);
+        unlink(path);
+        close(fd);
+        goto done;
+    }
+    debug("sharing output in %s", path);
+    flight = xcalloc(1, sizeof(struct flight));
+    flight->fd = fd;
+    flight->path = path;
+    flight->written = (off_t) header->left;
+    flight->sent = flight->written;
+    client->flight = flight;
+    buffer_free(header);
+    path = NULL;
+
+done:
+    buffer_free(key);
+    free(path);
+    return joined;
+}
+
+
+/*
+ * Write a record to the run file of a command we're running for others.  If
+ * this fails, give up on writing anything further and return false.
+ * Processes following the run file will notice that we never wrote the exit
+ * status.
+ */
+static bool
+flight_write(struct flight *flight, const char *header, const char *data,
+             size_t length)
+{
+    struct iovec iov[2];
+
+    if (flight->failed)
+        return false;
+    iov[0].iov_base = (char *) header;
+    iov[0].iov_len = 1 + 4;
+    iov[1].iov_base = (char *) data;
+    iov[1].iov_len = length;
+    if (xwritev(flight->fd, iov, 2) < 0) {
+        syswarn("cannot write run file %s", flight->path);
+        flight->failed = true;
+        return false;
+    }
+    flight->written += (off_t) (1 + 4 + length);
+    return true;
+}
+
+
+/*
+ * Read exactly length octets from the run file at the given offset.  Returns
+ * false and reports an error on failure.
+ */
+static bool
+flight_read(struct flight *flight, char *data, size_t length, off_t offset)
+{
+    ssize_t count;
+
+    while (length > 0) {
+        count = pread(flight->fd, data, length, offset);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR)
+                continue;
+            syswarn("cannot read run file %s", flight->path);
+            return false;
+        }
+        data += count;
+        length -= (size_t) count;
+        offset += count;
+    }
+    return true;
+}
+
+
+/*
+ * Send our own client the output of a command we're running for others from
+ * its run file, picking up where we left off.  Stop once at least limit
+ * octets are queued for the client, or once all of the output written so far
+ * has been sent.  The exit status record ends the output.  Returns false if
+ * sending the output failed.
+ */
+bool
+server_cache_send_shared(struct client *client, const struct rule *rule,
+                         size_t limit)
+{
+    struct flight *flight = client->flight;
+    struct evbuffer *queue;
+    char header[1 + 4];
+    char *data;
+    size_t length;
+    bool okay = true;
+
+    if (flight == NULL)
+        return true;
+    while (okay && flight->sent < flight->written) {
+        if (client->queue != NULL) {
+            queue = bufferevent_get_output(client->queue);
+            if (evbuffer_get_length(queue) >= limit)
+                break;
+        }
+        if (!flight_read(flight, header, sizeof(header), flight->sent))
+            return false;
+        if (header[0] == 0)
+            break;
+        length = read_uint32(header + 1);
+        data = xmalloc(length);
+        okay = flight_read(flight, data, length, flight->sent + 1 + 4);
+        if (okay)
+            okay = send_output(client, rule, header[0], data, length);
+        free(data);
+        flight->sent += (off_t) (1 + 4 + length);
+    }
+    return okay;
+}
+
+
+/*
+ * Given a block of output as it is read from a command we're running for
+ * others, save it to the run file and remove it from the buffer.  This is
+ * done before the output is queued for our own client so that a slow client
+ * doesn't hold up everyone else following the run file.  The caller should
+ * then call server_cache_send_shared to send output to our own client.
+ *
+ * Returns false if the output isn't being shared, including if writing to the
+ * run file fails, in which case the caller should send it directly.  In that
+ * case, any earlier output still in the run file has already been sent.
+ */
+bool
+server_cache_share(struct client *client, const struct rule *rule, int stream,
+                   struct evbuffer *output)
+{
+    struct flight *flight = client->flight;
+    char header[1 + 4];
+    unsigned char *data;
+    size_t length;
+    uint32_t size;
+
+    if (flight == NULL || flight->failed)
+        return false;
+    length = evbuffer_get_length(output);
+    if (length == 0)
+        return true;
+    data = evbuffer_pullup(output, -1);
+    if (data == NULL)
+        die("internal error: cannot get data from output buffer");
+    header[0] = (char) stream;
+    size = htonl((uint32_t) length);
+    memcpy(header + 1, &size, sizeof(size));
+    if (!flight_write(flight, header, (const char *) data, length)) {
+        server_cache_send_shared(client, rule, SIZE_MAX);
+        return false;
+    }
+    evbuffer_drain(output, length);
+    return true;
+}
+
+
+/*
+ * Start recording the output of a command for the cache, if its results can
+ * be cached.
+ */
+void
+server_cache_start(struct client *client, const struct rule *rule)
+{
+    if (client->record != NULL)
+        buffer_free(client->record);
+    client->record = cache_usable(client, rule) ? buffer_new() : NULL;
+}
+
+
+/*
+ * Save a block of output from the running command if we're recording it for
+ * the cache.  If the output grows too large, give up on caching this result.
+ */
+void
+server_cache_record(struct client *client, int stream, const char *data,
+                    size_t length)
+{
+    char header[1 + 4];
+    uint32_t size;
+
+    if (client->record == NULL)
+        return;
+    if (client->record->left + 1 + 4 + length > CACHE_MAX_OUTPUT) {
+        debug("output of command too large to cache");
+        buffer_free(client->record);
+        client->record = NULL;
+        return;
+    }
+    header[0] = (char) stream;
+    size = htonl((uint32_t) length);
+    memcpy(header + 1, &size, sizeof(size));
+    buffer_append(client->record, header, sizeof(header));
+    buffer_append(client->record, data, length);
+}
+
+
+/*
+ * Write the recorded output and the exit status of a command to the cache.
+ * Failure to write the cache entry is reported but otherwise ignored.
+ */
+static void
+cache_write(struct client *client, const struct rule *rule,
+            struct iovec **argv, int status)
+{
+    struct buffer *key;
+    struct buffer *header;
+    struct buffer *record = client->record;
+    char *path, *tmp;
+    struct utimbuf times;
+    uint32_t value;
+    int fd;
+
+    /* Make room for the new entry. */
+    cache_prune();
+
+    /* Build the header of the cache entry. */
+    key = cache_key(client, rule, argv, rule->cache_per_user);
+    header = buffer_new();
+    append_key(header, key);
+    value = htonl((uint32_t) status);
+    buffer_append(header, (const char *) &value, sizeof(value));
+    value = htonl((uint32_t) record->left);
+    buffer_append(header, (const char *) &value, sizeof(value));
+
+    /* Write it to a temporary file and move that into place. */
+    path = cache_path(key);
+    xasprintf(&tmp, "%s/.tmp.XXXXXX", cache_dir);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        syswarn("cannot create temporary cache entry %s", tmp);
+        goto done;
+    }
+    if (xwrite(fd, header->data + header->used, header->left) < 0
+        || xwrite(fd, record->data + record->used, record->left) < 0) {
+        syswarn("cannot write cache entry %s", tmp);
+        close(fd);
+        unlink(tmp);
+        goto done;
+    }
+    if (close(fd) < 0) {
+        syswarn("cannot write cache entry %s", tmp);
+        unlink(tmp);
+        goto done;
+    }
+    times.actime = time(NULL) + rule->cache;
+    times.modtime = times.actime;
+    if (utime(tmp, &times) < 0) {
+        syswarn("cannot set expiration time of cache entry %s", tmp);
+        unlink(tmp);
+        goto done;
+    }
+    if (rename(tmp, path) < 0) {
+        syswarn("cannot rename %s to %s", tmp, path);
+        unlink(tmp);
+        goto done;
+    }
+    debug("cached result in %s", path);
+
+done:
+    buffer_free(key);
+    buffer_free(header);
+    free(path);
+    free(tmp);
+}
+
+
+/*
+ * Given the exit status of a command we're running for others (-1 if it was
+ * killed by a signal), write it to the run file.  This is called as soon as
+ * all of the output of the command has been written to the run file, so that
+ * other processes following it don't have to wait for our own client to read
+ * the rest of the output.
+ */
+void
+server_cache_share_status(struct client *client, int status)
+{
+    char record[1 + 4 + 4];
+    uint32_t value;
+
+    if (client->flight == NULL || client->flight->finished)
+        return;
+    record[0] = 0;
+    value = htonl(4);
+    memcpy(record + 1, &value, sizeof(value));
+    value = htonl((uint32_t) status);
+    memcpy(record + 1 + 4, &value, sizeof(value));
+    flight_write(client->flight, record, record + 1 + 4, 4);
+    client->flight->finished = true;
+}
+
+
+/*
+ * Given the client, the rule for a command that was run, and its exit status
+ * (-1 if it was killed by a signal), finish sharing its output with other
+ * processes.  Write the exit status to the run file if that wasn't already
+ * done and send our own client whatever output from the run file it hasn't
+ * seen yet.  This must be called before server_cache_store so that the
+ * recorded output is complete.
+ */
+void
+server_cache_finish_shared(struct client *client, const struct rule *rule,
+                           int status)
+{
+    if (client->flight == NULL)
+        return;
+    server_cache_share_status(client, status);
+    server_cache_send_shared(client, rule, SIZE_MAX);
+}
+
+
+/*
+ * Given the client and the rule and arguments of a command that exited
+ * normally, and its exit status, store the output and status in the cache if
+ * we were recording it.  Nothing is cached if sending the output to the
+ * client failed, since the recording may then be incomplete.
+ */
+void
+server_cache_store(struct client *client, const struct rule *rule,
+                   struct iovec **argv, int status)
+{
+    if (client->record != NULL && !client->fatal)
+        cache_write(client, rule, argv, status);
+}
+
+
+/*
+ * Clean up after running a command, discarding any recorded output.  If we
+ * were running the command for others, remove the run file before closing it
+ * and releasing the lock so that the next request starts a new run.
+ */
+void
+server_cache_end(struct client *client)
+{
+    if (client->record != NULL) {
+        buffer_free(client->record);
+        client->record = NULL;
+    }
+    if (client->flight != NULL) {
+        if (unlink(client->flight->path) < 0)
+            syswarn("cannot remove run file %s", client->flight->path);
+        close(client->flight->fd);
+        free(client->flight->path);
+        free(client->flight);
+        client->flight = NULL;
+    }
+}
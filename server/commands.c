@@ -16,14 +16,18 @@
 
 #include <config.h>
 #include <portable/event.h>
+#include <portable/socket.h>
 #include <portable/system.h>
 #include <portable/uio.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <sys/select.h>
 #include <sys/wait.h>
 
 #include <server/internal.h>
+#include <util/buffer.h>
 #include <util/fdflag.h>
 #include <util/macros.h>
 #include <util/messages.h>
@@ -67,8 +71,9 @@ line_matches(struct rule *rule, const char *command, const char *subcommand)
  * Takes the configuration, a command, and a subcommand to match against
  * Returns the matching config line or NULL if none match.
  */
-static struct rule *
-find_config_line(struct config *config, char *command, char *subcommand)
+struct rule *
+server_find_rule(struct config *config, const char *command,
+                 const char *subcommand)
 {
     size_t i;
 
@@ -98,6 +103,7 @@ server_send_summary(struct client *client, struct config *config)
     size_t i;
     const char **req_argv = NULL;
     bool ok_any = false;
+    bool permit;
     int status_all = 0;
     struct process process;
     struct evbuffer *output = NULL;
@@ -118,7 +124,10 @@ server_send_summary(struct client *client, struct config *config)
         memset(&process, 0, sizeof(process));
         process.client = client;
         rule = config->rules[i];
-        if (!server_config_acl_permit(rule, client))
+        server_timing_begin(TIMING_ACL);
+        permit = server_config_acl_permit(rule, client);
+        server_timing_end(TIMING_ACL);
+        if (!permit)
             continue;
         if (rule->summary == NULL)
             continue;
@@ -293,6 +302,60 @@ create_argv_help(const char *path, const char *command, const char *subcommand)
 }
 
 
+/*
+ * Answer a command whose rule sets the builtin option, sending the output to
+ * the client.  Protocols that can send output separately from the exit
+ * status get it in as many tokens as needed; otherwise, it's all passed to
+ * the finish callback.  Returns the exit status of the command.
+ */
+static int
+run_builtin(struct client *client, const struct rule *rule)
+{
+    struct buffer *text;
+    struct evbuffer *output;
+    const char *data;
+    size_t chunk, length, max;
+    bool okay = true;
+
+    text = buffer_new();
+    switch (rule->builtin) {
+    case BUILTIN_METRICS:
+        server_metrics_format(text);
+        break;
+    case BUILTIN_SCOREBOARD:
+        server_scoreboard_format(text);
+        break;
+    case BUILTIN_NONE:
+        break;
+    }
+    output = evbuffer_new();
+    if (output == NULL)
+        die("internal error: cannot create output buffer");
+    data = text->data + text->used;
+    length = text->left;
+    if (client->output == NULL) {
+        if (evbuffer_add(output, data, length) < 0)
+            die("internal error: cannot add data to output buffer");
+        client->finish(client, output, 0);
+    } else {
+        max = TOKEN_MAX_OUTPUT_FOR(client->max_data);
+        while (okay && length > 0) {
+            chunk = (length > max) ? max : length;
+            if (evbuffer_add(output, data, chunk) < 0)
+                die("internal error: cannot add data to output buffer");
+            okay = client->output(client, 1, output, rule->integrity);
+            data += chunk;
+            length -= chunk;
+        }
+        if (okay)
+            client->finish(client, NULL, 0);
+    }
+    evbuffer_free(output);
+    buffer_free(text);
+    return 0;
+}
+
+
 /*
  * Process an incoming command.  Check the configuration files and the ACL
  * file, and if appropriate, forks off the command.  Takes the argument vector
@@ -319,10 +382,13 @@ server_run_command(struct client *client, struct config *config,
     int status = -1;
     bool ok = false;
     bool help = false;
+    bool killed, permit;
     const char *user = client->user;
     struct process process;
 
     /* Start with an empty process. */
+    server_timing_start();
+    server_scoreboard_command(argv);
     memset(&process, 0, sizeof(process));
     process.client = client;
 
@@ -358,7 +424,9 @@ server_run_command(struct client *client, struct config *config,
      * specific help command was listed, check for that in the configuration
      * instead.
      */
-    rule = find_config_line(config, command, subcommand);
+    server_timing_begin(TIMING_CONFIG);
+    rule = server_find_rule(config, command, subcommand);
+    server_timing_end(TIMING_CONFIG);
     if (rule == NULL && strcmp(command, "help") == 0) {
 
         /* Error if we have more than a command and possible subcommand. */
@@ -377,7 +445,9 @@ server_run_command(struct client *client, struct config *config,
             if (argv[2] != NULL)
                 helpsubcommand = xstrndup(argv[2]->iov_base,
                                           argv[2]->iov_len);
-            rule = find_config_line(config, subcommand, helpsubcommand);
+            server_timing_begin(TIMING_CONFIG);
+            rule = server_find_rule(config, subcommand, helpsubcommand);
+            server_timing_end(TIMING_CONFIG);
         }
     }
 
@@ -412,9 +482,14 @@ server_run_command(struct client *client, struct config *config,
                (subcommand == NULL) ? "" : " ",
                (subcommand == NULL) ? "" : subcommand, user);
         client->error(client, ERROR_UNKNOWN_COMMAND, "Unknown command");
+        server_metrics_unknown();
         goto done;
     }
-    if (!server_config_acl_permit(rule, client)) {
+    server_timing_begin(TIMING_ACL);
+    permit = server_config_acl_permit(rule, client);
+    server_timing_end(TIMING_ACL);
+    if (!permit) {
+        server_metrics_denied(rule);
         notice("access denied: user %s, command %s%s%s", user, command,
                (subcommand == NULL) ? "" : " ",
                (subcommand == NULL) ? "" : subcommand);
@@ -439,6 +514,49 @@ server_run_command(struct client *client, struct config *config,
         }
     }
 
+    /* Commands answered by remctld itself don't run anything. */
+    if (!help)
+        server_metrics_start(rule, argv);
+    if (!help && rule->builtin != BUILTIN_NONE) {
+        status = run_builtin(client, rule);
+        server_metrics_finish(status);
+        goto done;
+    }
+
+    /*
+     * Answer from the result cache if there is a current result, or from the
+     * output of another process already running the same command.
+     */
+    if (!help) {
+        if (server_cache_replay(client, rule, argv, &status)
+            || server_cache_join(client, rule, argv, &status)) {
+            server_metrics_cached();
+            client->finish(client, NULL, status);
+            server_metrics_finish(status);
+            goto done;
+        }
+    }
+
+    /* Refuse to run the command if the client is over its rate limits. */
+    if (!server_ratelimit_check(client, rule)) {
+        notice("rate limit exceeded: user %s, command %s%s%s", user, command,
+               (subcommand == NULL) ? "" : " ",
+               (subcommand == NULL) ? "" : subcommand);
+        server_metrics_limited();
+        client->error(client, ERROR_RATE_LIMITED, "Rate limit exceeded");
+        goto done;
+    }
+
+    /* Wait for a run slot if the number of simultaneous runs is limited. */
+    if (!server_concurrency_start(client, rule)) {
+        notice("too many concurrent runs: user %s, command %s%s%s", user,
+               command, (subcommand == NULL) ? "" : " ",
+               (subcommand == NULL) ? "" : subcommand);
+        server_metrics_limited();
+        client->error(client, ERROR_BUSY, "Too many concurrent runs");
+        goto done;
+    }
+
     /* Assemble the argv for the command we're about to run. */
     if (help)
         req_argv = create_argv_help(rule->program, subcommand, helpsubcommand);
@@ -449,17 +567,27 @@ server_run_command(struct client *client, struct config *config,
     process.command = command;
     process.argv = (const char **) req_argv;
     process.rule = rule;
+    if (!help)
+        server_cache_start(client, rule);
     ok = server_process_run(&process);
+    server_concurrency_end();
     if (ok) {
-        if (WIFEXITED(process.status))
-            process.status = (signed int) WEXITSTATUS(process.status);
-        else
+        killed = !WIFEXITED(process.status);
+        if (killed)
             process.status = -1;
+        else
+            process.status = (signed int) WEXITSTATUS(process.status);
+        server_cache_finish_shared(client, rule, process.status);
+        if (!killed)
+            server_cache_store(client, rule, argv, process.status);
         client->finish(client, process.output, process.status);
     }
+    server_metrics_finish(ok ? process.status : -1);
     status = process.status;
 
  done:
+    server_timing_finish(client, command, subcommand, status);
+    server_scoreboard_state(WORKER_IDLE);
     free(command);
     free(subcommand);
     free(helpsubcommand);
@@ -472,10 +600,45 @@ server_run_command(struct client *client, struct config *config,
         evbuffer_free(process.input);
     if (process.output != NULL)
         evbuffer_free(process.output);
+    server_cache_end(client);
     return status;
 }
 
 
+/*
+ * Wait for the given number of milliseconds for another process, returning
+ * early if the client sends us something.  Returns false if the client closed
+ * the connection, since then there's no point in waiting any longer.  Anything else the client sent is left for the normal protocol
+ * handling, but we then stop watching the connection so that we don't spin.
+ */
+bool
+server_client_wait(struct client *client, long wait, bool *watch)
+{
+    struct timeval tv;
+    fd_set fds;
+    ssize_t count;
+    char c;
+
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+    if (!*watch) {
+        select(0, NULL, NULL, NULL, &tv);
+        return true;
+    }
+    FD_ZERO(&fds);
+    FD_SET(client->fd, &fds);
+    if (select(client->fd + 1, &fds, NULL, NULL, &tv) <= 0)
+        return true;
+    count = recv(client->fd, &c, 1, MSG_PEEK);
+    if (count == 0)
+        return false;
+    if (count < 0 && errno != EINTR && errno != EAGAIN)
+        return false;
+    *watch = false;
+    return true;
+}
+
+
 /*
  * Free a command, represented as a NULL-terminated array of pointers to iovec
  * structs.
@@ -354,17 +354,295 @@ option_help(struct rule *rule, char *value, const char *name UNUSED,
 }
 
 
+/*
+ * Parse the cache configuration option.  Verifies the lifetime in seconds,
+ * stores it in the configuration rule struct, and returns CONFIG_SUCCESS on
+ * success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_cache(struct rule *rule, char *value, const char *name, size_t lineno)
+{
+    if (!convert_number(value, &rule->cache)) {
+        warn("%s:%lu: invalid cache value %s", name, (unsigned long) lineno,
+             value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the cache-per-user configuration option.  Stores the setting in the
+ * configuration rule struct and returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_cache_per_user(struct rule *rule, char *value, const char *name,
+                      size_t lineno)
+{
+    if (strcmp(value, "yes") == 0)
+        rule->cache_per_user = true;
+    else if (strcmp(value, "no") == 0)
+        rule->cache_per_user = false;
+    else {
+        warn("%s:%lu: invalid cache-per-user value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the single-flight configuration option.  Stores the setting in the
+ * configuration rule struct and returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_single_flight(struct rule *rule, char *value, const char *name,
+                     size_t lineno)
+{
+    if (strcmp(value, "yes") == 0 || strcmp(value, "user") == 0) {
+        rule->single_flight = true;
+        rule->single_flight_user = (strcmp(value, "user") == 0);
+    } else if (strcmp(value, "no") == 0) {
+        rule->single_flight = false;
+        rule->single_flight_user = false;
+    } else {
+        warn("%s:%lu: invalid single-flight value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the coalesce configuration option.  Verifies the size, stores it in
+ * the configuration rule struct, and returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_coalesce(struct rule *rule, char *value, const char *name,
+                size_t lineno)
+{
+    long size;
+
+    if (!convert_number(value, &size)) {
+        warn("%s:%lu: invalid coalesce value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    rule->coalesce = (size_t) size;
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the coalesce-delay configuration option.  Verifies the delay in
+ * milliseconds, stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_coalesce_delay(struct rule *rule, char *value, const char *name,
+                      size_t lineno)
+{
+    if (!convert_number(value, &rule->coalesce_delay)) {
+        warn("%s:%lu: invalid coalesce-delay value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse a rate limit, which is a number of commands followed by a slash and
+ * the number of seconds over which that many commands are allowed.  Stores
+ * the two numbers and returns true on success and false on a syntax error.
+ */
+static bool
+convert_rate(const char *string, long *count, long *period)
+{
+    const char *slash;
+    char *number;
+    bool okay;
+
+    slash = strchr(string, '/');
+    if (slash == NULL)
+        return false;
+    number = xstrndup(string, (size_t) (slash - string));
+    okay = convert_number(number, count) && convert_number(slash + 1, period);
+    free(number);
+    return okay;
+}
+
+
+/*
+ * Parse the rate-limit configuration option.  Verifies the limit, stores it
+ * in the configuration rule struct, and returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_rate_limit(struct rule *rule, char *value, const char *name,
+                  size_t lineno)
+{
+    if (!convert_rate(value, &rule->rate_count, &rule->rate_period)) {
+        warn("%s:%lu: invalid rate-limit value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the user-rate-limit configuration option.  Verifies the limit,
+ * stores it in the configuration rule struct, and returns CONFIG_SUCCESS on
+ * success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_user_rate_limit(struct rule *rule, char *value, const char *name,
+                       size_t lineno)
+{
+    if (!convert_rate(value, &rule->user_rate_count,
+                      &rule->user_rate_period)) {
+        warn("%s:%lu: invalid user-rate-limit value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the max-concurrent configuration option.  Verifies the number of
+ * simultaneous runs, stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_max_concurrent(struct rule *rule, char *value, const char *name,
+                      size_t lineno)
+{
+    if (!convert_number(value, &rule->max_concurrent)
+        || rule->max_concurrent > CONCURRENCY_MAX) {
+        warn("%s:%lu: invalid max-concurrent value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the max-queued configuration option.  Verifies the number of waiting
+ * runs, which may be zero, stores it in the configuration rule struct, and
+ * returns CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_max_queued(struct rule *rule, char *value, const char *name,
+                  size_t lineno)
+{
+    long size;
+
+    if (strcmp(value, "0") == 0)
+        size = 0;
+    else if (!convert_number(value, &size) || size > CONCURRENCY_MAX_QUEUED) {
+        warn("%s:%lu: invalid max-queued value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    rule->max_queued = size;
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the queue-timeout configuration option.  Verifies the timeout in
+ * seconds, stores it in the configuration rule struct, and returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_queue_timeout(struct rule *rule, char *value, const char *name,
+                     size_t lineno)
+{
+    if (!convert_number(value, &rule->queue_timeout)) {
+        warn("%s:%lu: invalid queue-timeout value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the integrity-only configuration option.  If set to yes, output from
+ * the command is sent with integrity protection only, without encryption, to
+ * clients that agree to that.  Returns CONFIG_SUCCESS on success and
+ * CONFIG_ERROR on error.
+ */
+static enum config_status
+option_integrity_only(struct rule *rule, char *value, const char *name,
+                      size_t lineno)
+{
+    if (strcmp(value, "yes") == 0)
+        rule->integrity = true;
+    else if (strcmp(value, "no") == 0)
+        rule->integrity = false;
+    else {
+        warn("%s:%lu: invalid integrity-only value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
+/*
+ * Parse the builtin configuration option.  If set, remctld answers the
+ * command itself instead of running the program, which is ignored.  Returns
+ * CONFIG_SUCCESS on success and CONFIG_ERROR on error.
+ */
+static enum config_status
+option_builtin(struct rule *rule, char *value, const char *name,
+               size_t lineno)
+{
+    if (strcmp(value, "metrics") == 0)
+        rule->builtin = BUILTIN_METRICS;
+    else if (strcmp(value, "scoreboard") == 0)
+        rule->builtin = BUILTIN_SCOREBOARD;
+    else {
+        warn("%s:%lu: invalid builtin value %s", name,
+             (unsigned long) lineno, value);
+        return CONFIG_ERROR;
+    }
+    return CONFIG_SUCCESS;
+}
+
+
 /*
  * The table relating configuration option names to functions.
  */
 static const struct config_option options[] = {
-    { "help",    option_help    },
-    { "logmask", option_logmask },
-    { "stdin",   option_stdin   },
-    { "sudo",    option_sudo    },
-    { "summary", option_summary },
-    { "user",    option_user    },
-    { NULL,      NULL           }
+    { "builtin",         option_builtin         },
+    { "cache",           option_cache           },
+    { "cache-per-user",  option_cache_per_user  },
+    { "coalesce",        option_coalesce        },
+    { "coalesce-delay",  option_coalesce_delay  },
+    { "help",            option_help            },
+    { "integrity-only",  option_integrity_only  },
+    { "logmask",         option_logmask         },
+    { "max-concurrent",  option_max_concurrent  },
+    { "max-queued",      option_max_queued      },
+    { "queue-timeout",   option_queue_timeout   },
+    { "rate-limit",      option_rate_limit      },
+    { "single-flight",   option_single_flight   },
+    { "stdin",           option_stdin           },
+    { "sudo",            option_sudo            },
+    { "summary",         option_summary         },
+    { "user",            option_user            },
+    { "user-rate-limit", option_user_rate_limit },
+    { NULL,              NULL                   }
 };
 
 
@@ -526,6 +804,7 @@ read_conf_file(void *data, const char *name)
         rule->command    = line->strings[0];
         rule->subcommand = line->strings[1];
         rule->program    = line->strings[2];
+        rule->max_queued = -1;
 
         /*
          * Parse config options.
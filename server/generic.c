@@ -24,6 +24,7 @@
 #include <time.h>
 
 #include <server/internal.h>
+#include <util/compress.h>
 #include <util/messages.h>
 #include <util/protocol.h>
 #include <util/tokens.h>
@@ -41,8 +42,7 @@ server_new_client(int fd, gss_cred_id_t creds)
 {
     struct client *client;
     struct sockaddr_storage ss;
-    socklen_t socklen, buflen;
-    char *buffer;
+    socklen_t socklen;
     gss_buffer_desc send_tok, recv_tok, name_buf;
     gss_name_t name = GSS_C_NO_NAME;
     gss_OID doid;
@@ -54,43 +54,41 @@ server_new_client(int fd, gss_cred_id_t creds)
         = (GSS_C_MUTUAL_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
 
     /* Create and initialize a new client struct. */
+    server_timing_connect();
     client = xcalloc(1, sizeof(struct client));
     client->fd = fd;
     client->context = GSS_C_NO_CONTEXT;
+    client->max_data = TOKEN_MAX_DATA;
+    client->reader = token_reader_new(fd);
+    if (client->reader == NULL)
+        sysdie("cannot allocate token reader");
 
-    /* Fill in hostname and IP address. */
+    /*
+     * Fill in the IP address.  The hostname is only looked up if the client
+     * runs a command (see server_client_hostname).
+     */
     socklen = sizeof(ss);
     if (getpeername(fd, (struct sockaddr *) &ss, &socklen) != 0) {
         syswarn("cannot get peer address");
         goto fail;
     }
-    buflen = INET6_ADDRSTRLEN;
-    buffer = xmalloc(buflen);
-    client->ipaddress = buffer;
-    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, buflen,
-                         NULL, 0, NI_NUMERICHOST);
+    client->ipaddress = xmalloc(INET6_ADDRSTRLEN);
+    status = getnameinfo((struct sockaddr *) &ss, socklen, client->ipaddress,
+                         INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST);
     if (status != 0) {
         syswarn("cannot translate IP address of client: %s",
                 gai_strerror(status));
         goto fail;
     }
-    buflen = NI_MAXHOST;
-    buffer = xmalloc(buflen);
-    status = getnameinfo((struct sockaddr *) &ss, socklen, buffer, buflen,
-                         NULL, 0, NI_NAMEREQD);
-    if (status == 0)
-        client->hostname = buffer;
-    else
-        free(buffer);
+    server_scoreboard_connect(client->ipaddress);
 
     /* Accept the initial (worthless) token. */
-    status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                        TIMEOUT);
+    status = token_reader_recv(client->reader, &flags, &recv_tok,
+                               TOKEN_MAX_LENGTH, TIMEOUT);
     if (status != TOKEN_OK) {
         warn_token("receiving initial token", status, major, minor);
         goto fail;
     }
-    free(recv_tok.value);
     if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT | TOKEN_PROTOCOL))
         client->protocol = 2;
     else if (flags == (TOKEN_NOOP | TOKEN_CONTEXT_NEXT))
@@ -102,8 +100,8 @@ server_new_client(int fd, gss_cred_id_t creds)
 
     /* Now, do the real work of negotiating the context. */
     do {
-        status = token_recv(client->fd, &flags, &recv_tok, TOKEN_MAX_LENGTH,
-                            TIMEOUT);
+        status = token_reader_recv(client->reader, &flags, &recv_tok,
+                                   TOKEN_MAX_LENGTH, TIMEOUT);
         if (status != TOKEN_OK) {
             warn_token("receiving context token", status, major, minor);
             goto fail;
@@ -112,15 +110,15 @@ server_new_client(int fd, gss_cred_id_t creds)
             client->protocol = 1;
         else if (flags != (TOKEN_CONTEXT | TOKEN_PROTOCOL)) {
             warn("bad token flags %d in context token", flags);
-            free(recv_tok.value);
             goto fail;
         }
         debug("received context token (size=%lu)",
               (unsigned long) recv_tok.length);
+        server_timing_begin(TIMING_GSS);
         major = gss_accept_sec_context(&acc_minor, &client->context, creds,
                     &recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &name, &doid,
                     &send_tok, &client->flags, &time_rec, NULL);
-        free(recv_tok.value);
+        server_timing_end(TIMING_GSS);
 
         /* Send back a token if we need to. */
         if (send_tok.length != 0) {
@@ -164,6 +162,7 @@ server_new_client(int fd, gss_cred_id_t creds)
         client->setup = server_v2_command_setup;
         client->finish = server_v2_command_finish;
         client->error = server_v2_send_error;
+        client->output = server_v2_send_output;
     }
 
     /* Get the display version of the client name and store it. */
@@ -178,13 +177,16 @@ server_new_client(int fd, gss_cred_id_t creds)
     client->user = xstrndup(name_buf.value, name_buf.length);
     client->expires = time(NULL) + time_rec;
     gss_release_buffer(&minor, &name_buf);
+    server_scoreboard_user(client->user);
     return client;
 
 fail:
+    server_scoreboard_disconnect();
     if (client->context != GSS_C_NO_CONTEXT)
         gss_delete_sec_context(&minor, &client->context, GSS_C_NO_BUFFER);
     if (name != GSS_C_NO_NAME)
         gss_release_name(&minor, &name);
+    token_reader_free(client->reader);
     free(client->ipaddress);
     free(client->hostname);
     free(client);
@@ -202,6 +204,7 @@ server_free_client(struct client *client)
 
     if (client == NULL)
         return;
+    server_scoreboard_disconnect();
     if (client->context != GSS_C_NO_CONTEXT) {
         major = gss_delete_sec_context(&minor, &client->context, NULL);
         if (major != GSS_S_COMPLETE)
@@ -209,6 +212,10 @@ server_free_client(struct client *client)
     }
     if (client->fd >= 0)
         close(client->fd);
+    token_reader_free(client->reader);
+    compressor_free(client->compressor);
+    decompressor_free(client->decompressor);
+    free(client->inflate_buffer);
     free(client->user);
     free(client->hostname);
     free(client->ipaddress);
@@ -0,0 +1,193 @@
+/*
+ * Hand off connections from remctld run by inetd to a running remctld.
+ *
+ * When remctld is run from inetd or tcpserver, each connection starts a new
+ * remctld that has to read its configuration and, with -s, acquire its
+ * credentials before it can do anything.  To avoid that, a stand-alone
+ * remctld can also listen on a UNIX domain socket, and remctld started by
+ * inetd can connect to that socket and pass its connection to the running
+ * server with SCM_RIGHTS, then exit.  The running server handles the
+ * connection exactly as if it had accepted it itself.
+ *
+ * The server acknowledges each connection it receives with a single byte
+ * once it has the file descriptor.  If the remctld started by inetd doesn't
+ * get that acknowledgement, it handles the connection itself, so a server
+ * that isn't running only costs the usual startup time.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/fdpass.h>
+#include <util/messages.h>
+
+/*
+ * How long in seconds to wait for the other side of a handoff.  Both sides
+ * respond immediately, so this only matters if one of them is stuck.
+ */
+#define HANDOFF_TIMEOUT 5
+
+
+/*
+ * Fill in a UNIX domain socket address for the given path.  Returns false if
+ * the path is too long.
+ */
+static bool
+handoff_address(struct sockaddr_un *addr, const char *path)
+{
+    size_t length;
+
+    length = strlen(path);
+    if (length >= sizeof(addr->sun_path))
+        return false;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, length + 1);
+    return true;
+}
+
+
+/*
+ * Create the socket on which to accept handed off connections, replacing any
+ * socket left over at that path.  The socket is only accessible by the user
+ * remctld runs as, since anyone who can connect to it can send remctld
+ * connections.  Dies on failure.
+ */
+socket_type
+server_handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    socket_type fd;
+    mode_t mask;
+
+    if (!handoff_address(&addr, path))
+        die("handoff socket path %s is too long", path);
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            die("%s exists and is not a socket", path);
+        if (unlink(path) < 0)
+            sysdie("cannot remove old handoff socket %s", path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET)
+        sysdie("cannot create handoff socket");
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        sysdie("cannot bind handoff socket %s", path);
+    umask(mask);
+    if (listen(fd, SOMAXCONN) < 0)
+        sysdie("cannot listen on handoff socket %s", path);
+    fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Accept a connection on the handoff socket and receive the client
+ * connection passed over it, storing the client's address in addr.  Returns
+ * the client connection or INVALID_SOCKET on failure, logging an error
+ * message.  The connection is only acknowledged if it can be used, so that
+ * otherwise the other end handles it itself.
+ */
+socket_type
+server_handoff_accept(socket_type listener, struct sockaddr *addr,
+                      socklen_t *addrlen)
+{
+    socket_type conn;
+    int fd;
+
+    conn = accept(listener, NULL, NULL);
+    if (conn == INVALID_SOCKET) {
+        if (errno != EINTR)
+            syswarn("cannot accept on handoff socket");
+        return INVALID_SOCKET;
+    }
+    fd = fdpass_recv(conn, HANDOFF_TIMEOUT);
+    if (fd < 0) {
+        syswarn("cannot receive handed off connection");
+        close(conn);
+        return INVALID_SOCKET;
+    }
+    if (getpeername(fd, addr, addrlen) < 0
+        || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+        warn("handed off connection is not a network connection");
+        close(fd);
+        close(conn);
+        return INVALID_SOCKET;
+    }
+    if (write(conn, "", 1) != 1) {
+        syswarn("cannot acknowledge handed off connection");
+        close(fd);
+        fd = INVALID_SOCKET;
+    }
+    close(conn);
+    return fd;
+}
+
+
+/*
+ * Pass the client connection on fd to the remctld listening on the handoff
+ * socket at path.  Returns true if that remctld acknowledged the connection,
+ * in which case it's responsible for the connection, and false otherwise,
+ * logging an error message.
+ */
+bool
+server_handoff_send(const char *path, int fd)
+{
+    struct sockaddr_un addr;
+    struct timeval tv;
+    fd_set readfds;
+    socket_type sock;
+    char ack;
+    int status;
+
+    if (!handoff_address(&addr, path)) {
+        warn("handoff socket path %s is too long", path);
+        return false;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        syswarn("cannot create handoff socket");
+        return false;
+    }
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        syswarn("cannot connect to handoff socket %s", path);
+        goto fail;
+    }
+    if (!fdpass_send(sock, fd)) {
+        syswarn("cannot hand off connection to %s", path);
+        goto fail;
+    }
+    do {
+        FD_ZERO(&readfds);
+        FD_SET(sock, &readfds);
+        tv.tv_sec = HANDOFF_TIMEOUT;
+        tv.tv_usec = 0;
+        status = select(sock + 1, &readfds, NULL, NULL, &tv);
+    } while (status < 0 && errno == EINTR);
+    if (status <= 0 || read(sock, &ack, 1) != 1) {
+        warn("connection not accepted by %s", path);
+        goto fail;
+    }
+    close(sock);
+    return true;
+
+fail:
+    close(sock);
+    return false;
+}
@@ -0,0 +1,351 @@
+/*
+ * Reverse DNS lookups of client addresses for remctld.
+ *
+ * The hostname of a client is only used to set REMOTE_HOST for the commands
+ * that it runs, so it's looked up when the client first runs a command
+ * rather than when it connects.  Clients that only ask for help, get results
+ * from the cache, or are refused never wait for DNS, and a slow or broken
+ * PTR zone no longer delays authentication.
+ *
+ * Results, including failed lookups, are kept for a few minutes in a table
+ * shared by all remctld processes so that a busy client costs one lookup
+ * every few minutes rather than one per connection.  The table is kept in a
+ * file mapped into memory in the same way as the limits table (see limits.c):
+ * an unlinked temporary file inherited by the children of a daemon, or a
+ * file in the cache directory shared by processes started by inetd.  Entries
+ * are found by hashing the address, looking at a small number of slots, and
+ * replacing the entry that expires first if the address isn't there.  The
+ * table is only locked while reading or updating it, never during a lookup.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Identifies a hostname table and the version of its format. */
+#define HOSTS_MAGIC "remctl hosts 1\n"
+
+/* The number of entries in the table and the number searched for a host. */
+#define HOSTS_SLOTS  1024
+#define HOSTS_PROBES 8
+
+/*
+ * How long in seconds to keep the result of a successful and of a failed
+ * lookup.  getnameinfo doesn't return the TTL of the DNS records, so these
+ * are fixed and short.
+ */
+#define HOSTS_TTL          300
+#define HOSTS_NEGATIVE_TTL 60
+
+/* The longest hostname that will be cached, including the nul. */
+#define HOSTS_NAME_MAX 256
+
+/* The cached result of looking up one address. */
+struct host {
+    uint64_t key;               /* Hash of the address, 0 if unused. */
+    time_t expires;             /* When the result should be discarded. */
+    char name[HOSTS_NAME_MAX];  /* Hostname, empty if the lookup failed. */
+};
+
+/* The layout of the shared table. */
+struct hosts_table {
+    char magic[sizeof(HOSTS_MAGIC)];
+    struct host hosts[HOSTS_SLOTS];
+};
+
+/* The file descriptor and mapping of the shared table, if set up. */
+static int table_fd = -1;
+static struct hosts_table *table = NULL;
+
+/* Whether to look up hostnames at all. */
+static bool lookups = true;
+
+
+/*
+ * Lock or unlock the table, waiting for the lock if necessary.  Takes the
+ * type of lock, which is F_WRLCK or F_UNLCK.  Returns true on success and
+ * false on failure, reporting an error message.
+ */
+static bool
+table_lock(short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    while (fcntl(table_fd, F_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            syswarn("cannot lock hostname table");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Open the file for the hostname table.  If a directory is given, the table
+ * is kept in a file named hosts.state in that directory; otherwise, an
+ * unlinked temporary file is used.  Returns the file descriptor or -1 on
+ * failure, reporting an error message.
+ */
+static int
+table_open(const char *dir)
+{
+    char *path;
+    const char *tmpdir;
+    int fd;
+
+    if (dir != NULL) {
+        xasprintf(&path, "%s/hosts.state", dir);
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            syswarn("cannot open hostname table %s", path);
+    } else {
+        tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL)
+            tmpdir = "/tmp";
+        xasprintf(&path, "%s/remctld-hosts-XXXXXX", tmpdir);
+        fd = mkstemp(path);
+        if (fd < 0)
+            syswarn("cannot create hostname table %s", path);
+        else
+            unlink(path);
+    }
+    free(path);
+    if (fd >= 0)
+        fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Set up hostname lookups.  If lookup is false, clients' hostnames are never
+ * looked up.  Otherwise, set up the shared table of results if it hasn't
+ * already been set up, which has to be done before the processes that will
+ * share it are forked.  Takes the cache directory, which may be NULL.
+ * Returns true on success and false on failure, reporting an error message.
+ * On failure, hostnames are looked up without caching.
+ */
+bool
+server_hosts_setup(const char *dir, bool lookup)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    lookups = lookup;
+    if (!lookup || table != NULL)
+        return true;
+    fd = table_open(dir);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat hostname table");
+        goto fail;
+    }
+    if ((size_t) st.st_size < sizeof(struct hosts_table))
+        if (ftruncate(fd, sizeof(struct hosts_table)) < 0) {
+            syswarn("cannot size hostname table");
+            goto fail;
+        }
+    map = mmap(NULL, sizeof(struct hosts_table), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syswarn("cannot map hostname table");
+        goto fail;
+    }
+    table_fd = fd;
+    table = map;
+
+    /* Start with an empty table if it's new or in some other format. */
+    if (!table_lock(F_WRLCK)) {
+        server_hosts_free();
+        return false;
+    }
+    if (memcmp(table->magic, HOSTS_MAGIC, sizeof(HOSTS_MAGIC)) != 0) {
+        memset(table, 0, sizeof(struct hosts_table));
+        memcpy(table->magic, HOSTS_MAGIC, sizeof(HOSTS_MAGIC));
+    }
+    table_lock(F_UNLCK);
+    return true;
+
+ fail:
+    close(fd);
+    return false;
+}
+
+
+/*
+ * Release the hostname table.  The contents are kept for other processes
+ * sharing it.
+ */
+void
+server_hosts_free(void)
+{
+    if (table != NULL)
+        munmap((void *) table, sizeof(struct hosts_table));
+    if (table_fd >= 0)
+        close(table_fd);
+    table = NULL;
+    table_fd = -1;
+}
+
+
+/*
+ * Compute the key for an address, a 64-bit FNV-1a hash of the string.  Zero
+ * marks an unused slot, so is never returned.
+ */
+static uint64_t
+host_key(const char *address)
+{
+    const unsigned char *p;
+    uint64_t hash = UINT64_C(14695981039346656037);
+
+    for (p = (const unsigned char *) address; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= UINT64_C(1099511628211);
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+
+/*
+ * Find the entry for the given key.  If it isn't in the table, return the
+ * entry that should be replaced to store it instead, which is an unused
+ * entry if there is one and otherwise the entry that expires first.  The
+ * caller has to check the key.
+ */
+static struct host *
+host_find(uint64_t key)
+{
+    struct host *host;
+    struct host *slot = NULL;
+    size_t i, start;
+
+    start = (size_t) (key % HOSTS_SLOTS);
+    for (i = 0; i < HOSTS_PROBES; i++) {
+        host = &table->hosts[(start + i) % HOSTS_SLOTS];
+        if (host->key == key)
+            return host;
+        if (slot == NULL)
+            slot = host;
+        else if (slot->key != 0
+                 && (host->key == 0 || host->expires < slot->expires))
+            slot = host;
+    }
+    return slot;
+}
+
+
+/*
+ * Look up a cached result for an address.  Returns true if there was one,
+ * setting the hostname of the client if the lookup had succeeded, and false
+ * otherwise.
+ */
+static bool
+cache_lookup(struct client *client, uint64_t key, time_t now)
+{
+    struct host *host;
+    bool found = false;
+
+    if (table == NULL || !table_lock(F_WRLCK))
+        return false;
+    host = host_find(key);
+    if (host->key == key && host->expires > now) {
+        if (host->name[0] != '\0')
+            client->hostname = xstrdup(host->name);
+        found = true;
+    }
+    table_lock(F_UNLCK);
+    return found;
+}
+
+
+/*
+ * Store the result of a lookup, which is the hostname or NULL if the lookup
+ * failed.  Names too long for the table aren't stored.
+ */
+static void
+cache_store(uint64_t key, const char *name, time_t now)
+{
+    struct host *host;
+
+    if (table == NULL)
+        return;
+    if (name != NULL && strlen(name) >= sizeof(host->name))
+        return;
+    if (!table_lock(F_WRLCK))
+        return;
+    host = host_find(key);
+    host->key = key;
+    if (name == NULL) {
+        host->name[0] = '\0';
+        host->expires = now + HOSTS_NEGATIVE_TTL;
+    } else {
+        strcpy(host->name, name);
+        host->expires = now + HOSTS_TTL;
+    }
+    table_lock(F_UNLCK);
+}
+
+
+/*
+ * Set the hostname of a client from a reverse DNS lookup of its address if
+ * that hasn't been done already for this client, checking the shared table
+ * first.  If the lookup fails, the hostname is left unset.
+ */
+void
+server_client_hostname(struct client *client)
+{
+    struct addrinfo hints, *result;
+    char name[NI_MAXHOST];
+    uint64_t key;
+    time_t now;
+    int status;
+
+    if (client->resolved)
+        return;
+    client->resolved = true;
+    if (!lookups)
+        return;
+    key = host_key(client->ipaddress);
+    now = time(NULL);
+    if (cache_lookup(client, key, now))
+        return;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    status = getaddrinfo(client->ipaddress, NULL, &hints, &result);
+    if (status != 0)
+        return;
+    status = getnameinfo(result->ai_addr, result->ai_addrlen, name,
+                         sizeof(name), NULL, 0, NI_NAMEREQD);
+    freeaddrinfo(result);
+    if (status == 0)
+        client->hostname = xstrdup(name);
+    else
+        debug("cannot look up hostname of %s: %s", client->ipaddress,
+              gai_strerror(status));
+    cache_store(key, client->hostname, now);
+}
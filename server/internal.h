@@ -24,12 +24,18 @@
 #include <util/protocol.h>
 
 /* Forward declarations to avoid extra includes. */
+struct buffer;
 struct bufferevent;
+struct compressor;
+struct decompressor;
 struct evbuffer;
 struct event;
 struct event_base;
+struct flight;
 struct iovec;
 struct process;
+struct timeval;
+struct token_reader;
 
 /*
  * The maximum size of argc passed to the server (4K arguments), and the
@@ -46,6 +52,21 @@ struct process;
  */
 #define TIMEOUT (60 * 60)
 
+/*
+ * The default maximum time in milliseconds that output from a command will be
+ * held back to coalesce it with further output, for commands with coalesce
+ * set and no coalesce-delay.
+ */
+#define COALESCE_DELAY 10
+
+/*
+ * The maximum values of the max-concurrent and max-queued options, which
+ * bound the number of run slots and the size of the queue kept for each rule
+ * in the table shared by all remctld processes.
+ */
+#define CONCURRENCY_MAX        1024
+#define CONCURRENCY_MAX_QUEUED 64
+
 /*
  * Normally set by the build system, but don't fail to compile if it's not
  * defined since it makes the build rules for the test suite irritating.
@@ -71,11 +92,76 @@ struct client {
 
     /*
      * Callbacks used by generic server code handle the separate protocols,
-     * set up when the client opens the connection.
+     * set up when the client opens the connection.  output, used to send
+     * results from the result cache, is NULL if the protocol can't send
+     * output separately from the exit status.
      */
     void (*setup)(struct process *);
     bool (*finish)(struct client *, struct evbuffer *, int);
     bool (*error)(struct client *, enum error_codes, const char *);
+    bool (*output)(struct client *, int, struct evbuffer *, bool);
+
+    /* Buffered reader for tokens from the client, NULL for remctl-shell. */
+    struct token_reader *reader;
+
+    /* Maximum token data size, larger than TOKEN_MAX_DATA if negotiated. */
+    size_t max_data;
+
+    /* Negotiated compression methods and the state for compressing output. */
+    unsigned long compression;
+    struct compressor *compressor;
+
+    /* State and reusable buffer for decompressing tokens from the client. */
+    struct decompressor *decompressor;
+    char *inflate_buffer;
+    size_t inflate_size;
+
+    /* Whether the client accepts output with integrity protection only. */
+    bool integrity;
+
+    /*
+     * Tokens queued for non-blocking writes to the client while a command is
+     * running (protocol v2 and later), or NULL when writes are done directly.
+     */
+    struct bufferevent *queue;
+
+    /* Output of the running command being saved for the result cache. */
+    struct buffer *record;
+
+    /* Run file for sharing the output of the command with other clients. */
+    struct flight *flight;
+
+    /* Whether hostname has been looked up (see server_client_hostname). */
+    bool resolved;
+};
+
+/* Commands answered by remctld itself, set with the builtin option. */
+enum builtin {
+    BUILTIN_NONE = 0,
+    BUILTIN_METRICS,            /* Counters in Prometheus format. */
+    BUILTIN_SCOREBOARD          /* What each remctld process is doing. */
+};
+
+/* What a remctld process is doing, as shown in the scoreboard. */
+enum worker_state {
+    WORKER_HANDSHAKE = 0,       /* Accepting the GSS-API context. */
+    WORKER_IDLE,                /* Waiting for a command. */
+    WORKER_RUNNING,             /* Running a command. */
+    WORKER_SENDING,             /* Sending output after the command exited. */
+    WORKER_MAX
+};
+
+/* The phases of handling a command that are timed (see timing.c). */
+enum timing_phase {
+    TIMING_GSS = 0,             /* Accepting the GSS-API context. */
+    TIMING_DNS,                 /* Looking up the client hostname. */
+    TIMING_CONFIG,              /* Finding the configuration rule. */
+    TIMING_ACL,                 /* Checking the ACLs. */
+    TIMING_SPAWN,               /* Forking the command. */
+    TIMING_FIRST_OUTPUT,        /* Waiting for its first output. */
+    TIMING_RUN,                 /* Waiting for it to exit. */
+    TIMING_DRAIN,               /* Sending the rest of its output. */
+    TIMING_MAX
 };
 
 /* Holds the configuration for a single command. */
@@ -95,6 +181,21 @@ struct rule {
     char *summary;              /* Argument that gives a command summary. */
     char *help;                 /* Argument that gives help for a command. */
     char **acls;                /* Full file names of ACL files. */
+    bool integrity;             /* Send output with integrity only. */
+    size_t coalesce;            /* Hold output until it reaches this size, */
+    long coalesce_delay;        /*   or for at most this many ms. */
+    long cache;                 /* Seconds to cache the result, if set. */
+    bool cache_per_user;        /* Cache results separately for each user. */
+    bool single_flight;         /* Share one run with concurrent clients, */
+    bool single_flight_user;    /*   but only with the same user. */
+    long rate_count;            /* Commands allowed for all users, */
+    long rate_period;           /*   refilled over this many seconds. */
+    long user_rate_count;       /* Commands allowed for each user, */
+    long user_rate_period;      /*   refilled over this many seconds. */
+    long max_concurrent;        /* Maximum simultaneous runs, if set. */
+    long max_queued;            /* Runs that may wait, -1 for the default, */
+    long queue_timeout;         /*   for at most this many seconds. */
+    enum builtin builtin;       /* Answered by remctld instead of program. */
 };
 
 /* Holds the complete parsed configuration for remctld. */
@@ -135,11 +236,13 @@ struct process {
     struct bufferevent *inout;  /* Input and output from process. */
     struct bufferevent *err;    /* Standard error from process. */
     struct event *sigchld;      /* Handle the SIGCHLD signal for exit. */
+    struct event *flush;        /* Timer to send coalesced output. */
 
     /* State flags. */
     bool reaped;                /* Whether we've reaped the process. */
     bool saw_error;             /* Whether we encountered some error. */
     bool saw_output;            /* Whether we saw process output. */
+    bool throttled;             /* Whether process reads are paused. */
 };
 
 BEGIN_DECLS
@@ -148,6 +251,7 @@ BEGIN_DECLS
 void warn_gssapi(const char *, OM_uint32 major, OM_uint32 minor);
 void warn_token(const char *, int status, OM_uint32 major, OM_uint32 minor);
 void server_log_command(struct iovec **, struct rule *, const char *user);
+bool server_logqueue_start(const char *destination, bool debug);
 
 /* Configuration file functions. */
 struct config *server_config_load(const char *file);
@@ -156,11 +260,91 @@ bool server_config_acl_permit(const struct rule *, const struct client *);
 void server_config_set_gput_file(char *file);
 
 /* Running commands. */
+struct rule *server_find_rule(struct config *, const char *command,
+                              const char *subcommand);
 int server_run_command(struct client *, struct config *, struct iovec **);
 
+/* Waiting for another process while watching the client connection. */
+bool server_client_wait(struct client *, long wait, bool *watch);
+
 /* Freeing the command structure. */
 void server_free_command(struct iovec **);
 
+/* Result cache functions. */
+bool server_cache_set_directory(const char *path);
+void server_cache_check(const struct config *);
+bool server_cache_replay(struct client *, const struct rule *,
+                         struct iovec **, int *status);
+bool server_cache_join(struct client *, const struct rule *, struct iovec **,
+                       int *status);
+bool server_cache_share(struct client *, const struct rule *, int stream,
+                        struct evbuffer *);
+bool server_cache_send_shared(struct client *, const struct rule *,
+                              size_t limit);
+void server_cache_share_status(struct client *, int status);
+void server_cache_start(struct client *, const struct rule *);
+void server_cache_record(struct client *, int stream, const char *,
+                         size_t length);
+void server_cache_finish_shared(struct client *, const struct rule *,
+                                int status);
+void server_cache_store(struct client *, const struct rule *,
+                        struct iovec **, int status);
+void server_cache_end(struct client *);
+
+/* Connection handoff functions. */
+socket_type server_handoff_listen(const char *path);
+socket_type server_handoff_accept(socket_type, struct sockaddr *,
+                                  socklen_t *);
+bool server_handoff_send(const char *path, int fd);
+
+/* Client hostname lookup functions. */
+bool server_hosts_setup(const char *dir, bool lookup);
+void server_hosts_free(void);
+void server_client_hostname(struct client *);
+
+/* Metrics functions. */
+bool server_metrics_setup(const char *dir);
+void server_metrics_free(void);
+void server_metrics_handshake(const struct timeval *start, bool success);
+void server_metrics_refused(void);
+void server_metrics_unknown(void);
+void server_metrics_log_dropped(void);
+void server_metrics_denied(const struct rule *);
+void server_metrics_start(const struct rule *, struct iovec **argv);
+void server_metrics_cached(void);
+void server_metrics_limited(void);
+void server_metrics_output(size_t length);
+void server_metrics_finish(int status);
+void server_metrics_format(struct buffer *);
+void server_metrics_export(const char *path);
+
+/* Scoreboard functions. */
+bool server_scoreboard_setup(const char *dir);
+void server_scoreboard_free(void);
+void server_scoreboard_connect(const char *address);
+void server_scoreboard_user(const char *user);
+void server_scoreboard_command(struct iovec **argv);
+void server_scoreboard_state(enum worker_state);
+void server_scoreboard_output(size_t length);
+void server_scoreboard_disconnect(void);
+void server_scoreboard_format(struct buffer *);
+
+/* Per-command timing functions. */
+void server_timing_setup(long threshold);
+void server_timing_connect(void);
+void server_timing_start(void);
+void server_timing_begin(enum timing_phase);
+void server_timing_end(enum timing_phase);
+void server_timing_finish(const struct client *, const char *command,
+                          const char *subcommand, int status);
+
+/* Rate and concurrency limit functions. */
+bool server_limits_setup(const struct config *, const char *dir);
+void server_limits_free(void);
+bool server_ratelimit_check(const struct client *, const struct rule *);
+bool server_concurrency_start(struct client *, const struct rule *);
+void server_concurrency_end(void);
+
 /* Running processes. */
 bool server_process_run(struct process *process);
 void server_handle_io_event(struct bufferevent *, short, void *);
@@ -180,6 +364,8 @@ void server_v1_handle_messages(struct client *, struct config *);
 /* Protocol v2 functions. */
 void server_v2_command_setup(struct process *);
 bool server_v2_command_finish(struct client *, struct evbuffer *, int status);
+bool server_v2_send_output(struct client *, int stream, struct evbuffer *,
+                           bool integrity);
 bool server_v2_send_error(struct client *, enum error_codes, const char *);
 void server_v2_handle_messages(struct client *, struct config *);
 
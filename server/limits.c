@@ -0,0 +1,623 @@
+/*
+ * Rate and concurrency limits for remctld commands.
+ *
+ * Commands whose configuration rule sets the rate-limit or user-rate-limit
+ * options are limited with token buckets.  Each bucket holds up to the
+ * configured number of tokens and is refilled at a steady rate so that it
+ * becomes full again after the configured number of seconds.  Running a
+ * command takes a token from the bucket for the rule and from the bucket for
+ * the rule and the client's identity, and if either is empty, the command is
+ * refused.
+ *
+ * Commands whose rule sets the max-concurrent option may only be run by that
+ * many processes at a time.  Each rule has that many run slots, which are
+ * bytes of the shared file below locked by the processes running the
+ * command.  Since a process's locks are released when it exits, slots can't
+ * be leaked by a process that dies.  Processes that find no free slot join a
+ * queue for the rule, a list of their PIDs in the shared table, and only the
+ * process at the head of the queue may take a slot, so they run in the order
+ * in which they arrived.  Processes leave the queue when they get a slot,
+ * when they time out, or when their client goes away, and processes that
+ * have exited are removed from the queue by whoever finds them there.
+ *
+ * Each connection is handled by a separate process, so the buckets and queues
+ * are kept in a file mapped into memory that all of those processes share.  When
+ * remctld runs as a daemon, the file is an unlinked temporary file created
+ * before any connections are accepted, and each child inherits the mapping.
+ * When it is given a cache directory, the file is kept in that directory
+ * instead, so that separate remctld processes started by inetd also share
+ * the same limits.  Access to the table is serialized with an fcntl lock on
+ * its first byte, which also works between unrelated processes.
+ *
+ * The table has a fixed number of slots and buckets are found by hashing the
+ * rule and identity, looking at a small number of slots starting at the hash
+ * value.  If none of them hold the bucket and none are free, the bucket that
+ * was used least recently is reused.  That bucket is the most likely to be
+ * full, so forgetting its state gives away little.  Queues are found the same
+ * way, but only queues with no waiting processes are reused.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Identifies a limits table and the version of its format. */
+#define LIMITS_MAGIC "remctl limits 1\n"
+
+/*
+ * The number of buckets in the table and the number of slots searched for a
+ * bucket.  This is enough for a few thousand combinations of rules and users
+ * that are being actively limited at the same time.
+ */
+#define RATELIMIT_SLOTS 4096
+#define RATELIMIT_PROBES 16
+
+/*
+ * The number of queues in the table and the number of slots searched for a
+ * queue.  Only rules with max-concurrent set need a queue.
+ */
+#define QUEUE_SLOTS 256
+#define QUEUE_PROBES 16
+
+/*
+ * The defaults for the number of processes that may wait for a run slot and
+ * the number of seconds that they wait, and the minimum and maximum time in
+ * milliseconds between checks for a free slot.
+ */
+#define QUEUE_DEFAULT_SIZE    16
+#define QUEUE_DEFAULT_TIMEOUT 60
+#define QUEUE_POLL_MIN        1
+#define QUEUE_POLL_MAX        100
+
+/*
+ * The run slots for each rule are CONCURRENCY_MAX bytes of the table file,
+ * past the end of the table, at an offset chosen by hashing the rule into one
+ * of SLOT_REGIONS regions.  Locks past the end of a file are allowed and
+ * don't change its size.  This keeps all offsets below 2GB.
+ */
+#define SLOT_REGIONS (1UL << 20)
+
+/* A single token bucket. */
+struct bucket {
+    uint64_t key;               /* Hash of the rule and user, 0 if unused. */
+    double tokens;              /* Tokens left as of the last update. */
+    double updated;             /* Time of the last update. */
+};
+
+/* The processes waiting for a run slot for a rule. */
+struct queue {
+    uint64_t key;               /* Hash of the rule, 0 if unused. */
+    uint32_t waiting;           /* Number of waiting processes. */
+    pid_t pids[CONCURRENCY_MAX_QUEUED]; /* Waiting processes, oldest first. */
+};
+
+/* The layout of the shared table. */
+struct limits_table {
+    char magic[sizeof(LIMITS_MAGIC)];
+    struct bucket buckets[RATELIMIT_SLOTS];
+    struct queue queues[QUEUE_SLOTS];
+};
+
+/* The file descriptor and mapping of the shared table, if set up. */
+static int table_fd = -1;
+static struct limits_table *table = NULL;
+
+/* The offset of the run slot held by this process, or -1 if none. */
+static off_t held_slot = -1;
+
+
+/*
+ * Return whether any rule in the configuration has a rate or concurrency
+ * limit.
+ */
+static bool
+config_has_limits(const struct config *config)
+{
+    const struct rule *rule;
+    size_t i;
+
+    for (i = 0; i < config->count; i++) {
+        rule = config->rules[i];
+        if (rule->rate_count > 0 || rule->user_rate_count > 0
+            || rule->max_concurrent > 0)
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Lock or unlock the table, waiting for the lock if necessary.  Takes the
+ * type of lock, which is F_WRLCK or F_UNLCK.  Only the first byte is locked,
+ * leaving the rest of the file free for run slots.  Returns true on success
+ * and false on failure, reporting an error message.
+ */
+static bool
+table_lock(short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 1;
+    while (fcntl(table_fd, F_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            syswarn("cannot lock limits table");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Open the file for the limits table.  If a directory is given, the table is
+ * kept in a file named limits.state in that directory; otherwise, an unlinked
+ * temporary file is used.  The name has a period in it so that it
+ * isn't mistaken for a cache entry.  Returns the file descriptor or -1 on
+ * failure, reporting an error message.
+ */
+static int
+table_open(const char *dir)
+{
+    char *path;
+    const char *tmpdir;
+    int fd;
+
+    if (dir != NULL) {
+        xasprintf(&path, "%s/limits.state", dir);
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            syswarn("cannot open limits table %s", path);
+    } else {
+        tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL)
+            tmpdir = "/tmp";
+        xasprintf(&path, "%s/remctld-limits-XXXXXX", tmpdir);
+        fd = mkstemp(path);
+        if (fd < 0)
+            syswarn("cannot create limits table %s", path);
+        else
+            unlink(path);
+    }
+    free(path);
+    if (fd >= 0)
+        fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Set up the shared limits table if any rule in the configuration has a rate
+ * or concurrency limit and it hasn't already been set up.  This has to be called before
+ * the processes that will share the limits are forked.  Takes the
+ * configuration and the cache directory, which may be NULL.  Returns true on
+ * success and false on failure, reporting an error message.  On failure,
+ * commands are run without limits.
+ */
+bool
+server_limits_setup(const struct config *config, const char *dir)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (table != NULL || !config_has_limits(config))
+        return true;
+    fd = table_open(dir);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat limits table");
+        goto fail;
+    }
+    if ((size_t) st.st_size < sizeof(struct limits_table))
+        if (ftruncate(fd, sizeof(struct limits_table)) < 0) {
+            syswarn("cannot size limits table");
+            goto fail;
+        }
+    map = mmap(NULL, sizeof(struct limits_table), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syswarn("cannot map limits table");
+        goto fail;
+    }
+    table_fd = fd;
+    table = map;
+
+    /* Start with an empty table if it's new or in some other format. */
+    if (!table_lock(F_WRLCK)) {
+        server_limits_free();
+        return false;
+    }
+    if (memcmp(table->magic, LIMITS_MAGIC, sizeof(LIMITS_MAGIC)) != 0) {
+        memset(table, 0, sizeof(struct limits_table));
+        memcpy(table->magic, LIMITS_MAGIC, sizeof(LIMITS_MAGIC));
+    }
+    table_lock(F_UNLCK);
+    return true;
+
+ fail:
+    close(fd);
+    return false;
+}
+
+
+/*
+ * Release the limits table.  The contents are kept for other processes
+ * sharing it.
+ */
+void
+server_limits_free(void)
+{
+    if (table != NULL)
+        munmap((void *) table, sizeof(struct limits_table));
+    if (table_fd >= 0)
+        close(table_fd);
+    table = NULL;
+    table_fd = -1;
+    held_slot = -1;
+}
+
+
+/*
+ * Compute the key for a bucket from the rule and the user, or NULL for the
+ * bucket shared by all users of the rule.  This is a 64-bit FNV-1a hash of
+ * the file name and line number of the rule and the user, each including its
+ * terminating nul.  Zero marks an unused slot, so is never returned.
+ */
+static uint64_t
+bucket_key(const struct rule *rule, const char *user)
+{
+    char lineno[32];
+    const char *parts[3];
+    const unsigned char *p;
+    uint64_t hash = UINT64_C(14695981039346656037);
+    size_t i;
+
+    snprintf(lineno, sizeof(lineno), "%lu", (unsigned long) rule->lineno);
+    parts[0] = rule->file;
+    parts[1] = lineno;
+    parts[2] = user;
+    for (i = 0; i < ARRAY_SIZE(parts) && parts[i] != NULL; i++) {
+        p = (const unsigned char *) parts[i];
+        do {
+            hash ^= *p;
+            hash *= UINT64_C(1099511628211);
+        } while (*p++ != '\0');
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+
+/*
+ * Find the bucket with the given key, reusing a free or least recently used
+ * slot if it isn't in the table.  A new bucket starts full.  Takes the key,
+ * the size of the bucket, and the current time.
+ */
+static struct bucket *
+bucket_find(uint64_t key, long count, double now)
+{
+    struct bucket *bucket;
+    struct bucket *slot = NULL;
+    size_t i, start;
+
+    start = (size_t) (key % RATELIMIT_SLOTS);
+    for (i = 0; i < RATELIMIT_PROBES; i++) {
+        bucket = &table->buckets[(start + i) % RATELIMIT_SLOTS];
+        if (bucket->key == key)
+            return bucket;
+        if (slot == NULL)
+            slot = bucket;
+        else if (slot->key != 0
+                 && (bucket->key == 0 || bucket->updated < slot->updated))
+            slot = bucket;
+    }
+    slot->key = key;
+    slot->tokens = (double) count;
+    slot->updated = now;
+    return slot;
+}
+
+
+/*
+ * Take a token from a bucket, first refilling it for the time since it was
+ * last used.  Takes the bucket, the number of tokens it holds when full, the
+ * number of seconds in which it's refilled, and the current time.  Returns
+ * true if there was a token to take and false otherwise.
+ */
+static bool
+bucket_take(struct bucket *bucket, long count, long period, double now)
+{
+    double elapsed;
+
+    elapsed = now - bucket->updated;
+    if (elapsed > 0)
+        bucket->tokens += elapsed * (double) count / (double) period;
+    bucket->updated = now;
+    if (bucket->tokens > (double) count)
+        bucket->tokens = (double) count;
+    if (bucket->tokens < 1)
+        return false;
+    bucket->tokens -= 1;
+    return true;
+}
+
+
+/*
+ * Check the rate limits for a rule and take a token from each of its buckets
+ * on behalf of the client.  Tokens are only taken if all the limits allow the
+ * command.  Returns true if the command may be run and false if it's over one
+ * of its limits.  If the table can't be used, commands are always allowed.
+ */
+bool
+server_ratelimit_check(const struct client *client, const struct rule *rule)
+{
+    struct bucket *user_bucket = NULL;
+    struct bucket *rule_bucket;
+    uint64_t user_key = 0;
+    struct timeval tv;
+    double now;
+    bool allowed = true;
+
+    if (table == NULL || (rule->rate_count == 0 && rule->user_rate_count == 0))
+        return true;
+    if (gettimeofday(&tv, NULL) < 0) {
+        syswarn("cannot get current time");
+        return true;
+    }
+    now = (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+    if (!table_lock(F_WRLCK))
+        return true;
+
+    /*
+     * Take a token for the user first, and if the limit for the rule then
+     * refuses the command, give it back, as long as its bucket is still
+     * there.
+     */
+    if (rule->user_rate_count > 0) {
+        user_key = bucket_key(rule, client->user);
+        user_bucket = bucket_find(user_key, rule->user_rate_count, now);
+        allowed = bucket_take(user_bucket, rule->user_rate_count,
+                              rule->user_rate_period, now);
+    }
+    if (allowed && rule->rate_count > 0) {
+        rule_bucket = bucket_find(bucket_key(rule, NULL), rule->rate_count,
+                                  now);
+        allowed = bucket_take(rule_bucket, rule->rate_count,
+                              rule->rate_period, now);
+        if (!allowed && user_bucket != NULL && user_bucket->key == user_key)
+            user_bucket->tokens += 1;
+    }
+    table_lock(F_UNLCK);
+    return allowed;
+}
+
+
+/*
+ * Return the offset of the first run slot for the rule with the given key.
+ */
+static off_t
+slot_base(uint64_t key)
+{
+    off_t offset;
+
+    offset = (off_t) sizeof(struct limits_table);
+    offset += (off_t) (key % SLOT_REGIONS) * CONCURRENCY_MAX;
+    return offset;
+}
+
+
+/*
+ * Try to take one of the count run slots for the rule with the given key,
+ * without waiting.  Returns true if a slot was taken, recording it so that it
+ * can be released later, and false if they're all held by other processes.
+ * If locking fails for some other reason, warns and returns true without
+ * taking a slot, so that commands are run without the limit.
+ */
+static bool
+slot_take(uint64_t key, long count)
+{
+    struct flock lock;
+    off_t base;
+    long i;
+
+    base = slot_base(key);
+    for (i = 0; i < count; i++) {
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = base + i;
+        lock.l_len = 1;
+        if (fcntl(table_fd, F_SETLK, &lock) == 0) {
+            held_slot = base + i;
+            return true;
+        }
+        if (errno != EACCES && errno != EAGAIN) {
+            syswarn("cannot lock run slot");
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Find the queue for the rule with the given key, reusing a free slot or one
+ * with no waiting processes if it isn't in the table.  Returns NULL if there
+ * is no such slot, in which case the command can't wait for a run slot.
+ */
+static struct queue *
+queue_find(uint64_t key)
+{
+    struct queue *queue;
+    struct queue *slot = NULL;
+    size_t i, start;
+
+    start = (size_t) (key % QUEUE_SLOTS);
+    for (i = 0; i < QUEUE_PROBES; i++) {
+        queue = &table->queues[(start + i) % QUEUE_SLOTS];
+        if (queue->key == key)
+            return queue;
+        if (slot == NULL && (queue->key == 0 || queue->waiting == 0))
+            slot = queue;
+    }
+    if (slot != NULL) {
+        slot->key = key;
+        slot->waiting = 0;
+    }
+    return slot;
+}
+
+
+/*
+ * Remove the process with the given PID from a queue, if it's there.
+ */
+static void
+queue_remove(struct queue *queue, pid_t pid)
+{
+    uint32_t i;
+
+    for (i = 0; i < queue->waiting; i++)
+        if (queue->pids[i] == pid)
+            break;
+    if (i == queue->waiting)
+        return;
+    memmove(&queue->pids[i], &queue->pids[i + 1],
+            (queue->waiting - i - 1) * sizeof(pid_t));
+    queue->waiting--;
+}
+
+
+/*
+ * Remove any processes that no longer exist from a queue, so that a process
+ * that died while waiting doesn't block everyone behind it.
+ */
+static void
+queue_prune(struct queue *queue)
+{
+    uint32_t i = 0;
+
+    while (i < queue->waiting) {
+        if (kill(queue->pids[i], 0) < 0 && errno == ESRCH)
+            queue_remove(queue, queue->pids[i]);
+        else
+            i++;
+    }
+}
+
+
+/*
+ * Take a run slot for a rule with the max-concurrent option before running
+ * the command, waiting in the queue for the rule if none are free.  Gives up
+ * if the queue is full, if the queue timeout passes, or if the client closes
+ * the connection.  Returns true if the command may be run and false
+ * otherwise.  If the table can't be used, commands are always allowed.
+ */
+bool
+server_concurrency_start(struct client *client, const struct rule *rule)
+{
+    struct queue *queue;
+    uint64_t key;
+    uint32_t size;
+    time_t deadline;
+    long wait = QUEUE_POLL_MIN;
+    pid_t pid;
+    bool watch = true;
+    bool okay = false;
+
+    if (table == NULL || rule->max_concurrent == 0)
+        return true;
+    key = bucket_key(rule, NULL);
+    pid = getpid();
+    size = (uint32_t) rule->max_queued;
+    if (rule->max_queued < 0)
+        size = QUEUE_DEFAULT_SIZE;
+    deadline = time(NULL) + rule->queue_timeout;
+    if (rule->queue_timeout == 0)
+        deadline = time(NULL) + QUEUE_DEFAULT_TIMEOUT;
+
+    /* Take a slot if one is free and no one is waiting, or join the queue. */
+    if (!table_lock(F_WRLCK))
+        return true;
+    queue = queue_find(key);
+    if (queue != NULL)
+        queue_prune(queue);
+    if (queue == NULL || queue->waiting == 0)
+        okay = slot_take(key, rule->max_concurrent);
+    if (okay || queue == NULL || queue->waiting >= size) {
+        table_lock(F_UNLCK);
+        return okay;
+    }
+    queue->pids[queue->waiting++] = pid;
+    table_lock(F_UNLCK);
+
+    /* Wait until we're at the head of the queue and a slot is free. */
+    while (!okay && time(NULL) < deadline) {
+        if (!server_client_wait(client, wait, &watch))
+            break;
+        wait = (wait * 2 > QUEUE_POLL_MAX) ? QUEUE_POLL_MAX : wait * 2;
+        if (!table_lock(F_WRLCK))
+            break;
+        queue = queue_find(key);
+        if (queue != NULL) {
+            queue_prune(queue);
+            if (queue->waiting > 0 && queue->pids[0] == pid)
+                okay = slot_take(key, rule->max_concurrent);
+            if (okay)
+                queue_remove(queue, pid);
+        }
+        table_lock(F_UNLCK);
+    }
+
+    /* If we gave up, leave the queue. */
+    if (!okay && table_lock(F_WRLCK)) {
+        queue = queue_find(key);
+        if (queue != NULL)
+            queue_remove(queue, pid);
+        table_lock(F_UNLCK);
+    }
+    return okay;
+}
+
+
+/*
+ * Release the run slot held by this process, if any.  This is safe to call
+ * whether or not a slot was taken.
+ */
+void
+server_concurrency_end(void)
+{
+    struct flock lock;
+
+    if (held_slot < 0)
+        return;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = held_slot;
+    lock.l_len = 1;
+    if (fcntl(table_fd, F_SETLK, &lock) < 0)
+        syswarn("cannot release run slot");
+    held_slot = -1;
+}
@@ -21,10 +21,10 @@
 #include <errno.h>
 
 #include <server/internal.h>
+#include <util/buffer.h>
 #include <util/gss-errors.h>
 #include <util/messages.h>
 #include <util/tokens.h>
-#include <util/vector.h>
 
 
 /*
@@ -86,13 +86,20 @@ warn_token(const char *error, int status, OM_uint32 major, OM_uint32 minor)
 void
 server_log_command(struct iovec **argv, struct rule *rule, const char *user)
 {
-    char *command, *p;
+    static struct buffer *command = NULL;
+    char *p;
+    const char *end;
     unsigned int i;
     unsigned int *j;
-    struct vector *masked;
     const char *arg;
 
-    masked = vector_new();
+    /*
+     * Build the command in a buffer kept between calls, so that logging a
+     * command usually doesn't allocate memory.
+     */
+    if (command == NULL)
+        command = buffer_new();
+    buffer_set(command, NULL, 0);
     for (i = 0; argv[i] != NULL; i++) {
         arg = NULL;
         if (rule != NULL) {
@@ -109,18 +116,24 @@ server_log_command(struct iovec **argv, struct rule *rule, const char *user)
                 arg = "**DATA**";
             }
         }
+        if (i > 0)
+            buffer_append(command, " ", 1);
         if (arg != NULL)
-            vector_add(masked, arg);
-        else
-            vector_addn(masked, argv[i]->iov_base, argv[i]->iov_len);
+            buffer_append(command, arg, strlen(arg));
+        else {
+            end = memchr(argv[i]->iov_base, '\0', argv[i]->iov_len);
+            if (end == NULL)
+                buffer_append(command, argv[i]->iov_base, argv[i]->iov_len);
+            else
+                buffer_append(command, argv[i]->iov_base,
+                              (size_t) (end - (char *) argv[i]->iov_base));
+        }
     }
-    command = vector_join(masked, " ");
-    vector_free(masked);
+    buffer_append(command, "", 1);
 
     /* Replace non-printable characters with . when logging. */
-    for (p = command; *p != '\0'; p++)
+    for (p = command->data; *p != '\0'; p++)
         if (*p < 9 || (*p > 9 && *p < 32) || *p == 127)
             *p = '.';
-    notice("COMMAND from %s: %s", user, command);
-    free(command);
+    notice("COMMAND from %s: %s", user, command->data);
 }
@@ -0,0 +1,566 @@
+/*
+ * Queued logging for remctld.
+ *
+ * Normally, every message remctld logs goes to syslog (or standard output)
+ * as it's logged, so a slow syslog daemon slows down every command.  With -l,
+ * messages are instead queued to a separate writer process that sends them
+ * on to syslog, appends them to a file, or sends them as JSON lines to a
+ * Unix socket, and remctld goes on without waiting.
+ *
+ * The queue is a pipe to the writer process, enlarged where the system
+ * allows.  Each message is formatted into a fixed buffer along with when it
+ * was logged, the process that logged it, and its priority, and is written
+ * to the pipe with a single non-blocking write of at most PIPE_BUF bytes, so
+ * messages from different processes are never interleaved and logging never
+ * allocates memory or blocks.  If the pipe is full, the message is dropped
+ * and counted in the metrics, and the next message from that process carries
+ * the count of messages it dropped so that the writer can log it.  Longer
+ * messages are truncated.  Fatal errors are still logged directly.
+ *
+ * The writer is started by the daemon before it accepts connections, and is
+ * orphaned so that it isn't reaped with the children handling connections.
+ * It ignores the signals that stop the daemon and exits once every process
+ * that could log has exited and it has written all queued messages.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/buffer.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xwrite.h>
+
+/* The size to which to enlarge the pipe, if the system supports that. */
+#define LOGQUEUE_SIZE (1024 * 1024)
+
+/*
+ * How often in seconds to retry connecting to the JSON socket and to check
+ * whether the log file has been rotated.
+ */
+#define LOGQUEUE_RETRY 1
+
+/* Where the writer sends messages. */
+enum sink {
+    SINK_SYSLOG,
+    SINK_FILE,
+    SINK_JSON
+};
+
+/* The header of each message in the queue, followed by its text. */
+struct record {
+    struct timeval time;        /* When the message was logged. */
+    pid_t pid;                  /* Process that logged the message. */
+    int priority;               /* syslog priority of the message. */
+    unsigned long dropped;      /* Messages dropped before this one. */
+    size_t length;              /* Length of the text. */
+};
+
+/* A buffer holding one message, aligned for the header. */
+union message {
+    struct record header;
+    char data[PIPE_BUF];
+};
+
+/* The longest text of a message. */
+#define RECORD_TEXT_MAX (PIPE_BUF - sizeof(struct record))
+
+/* The write end of the queue, and messages dropped since the last write. */
+static int queue_fd = -1;
+static unsigned long dropped = 0;
+
+/* The buffer in which messages are formatted. */
+static union message outgoing;
+
+/* The state of the writer process. */
+static enum sink sink;
+static const char *sink_path;
+static int sink_fd = -1;
+static time_t sink_checked = 0;
+static unsigned long sink_lost = 0;
+
+
+/*
+ * Append a string to the text of a message of the given length, truncating
+ * it if needed, and return the new length.  The text is nul-terminated.
+ */
+static size_t
+append_text(char *text, size_t length, const char *string)
+{
+    size_t size;
+
+    size = strlen(string);
+    if (size > RECORD_TEXT_MAX - 1 - length)
+        size = RECORD_TEXT_MAX - 1 - length;
+    memcpy(text + length, string, size);
+    text[length + size] = '\0';
+    return length + size;
+}
+
+
+/*
+ * Queue a message, given its syslog priority and the arguments passed to a
+ * message handler.  If the writer has gone away, log the message to syslog
+ * directly instead.
+ */
+static void __attribute__((__format__(printf, 2, 0)))
+queue_message(int priority, const char *fmt, va_list args, int err)
+{
+    struct record *header = &outgoing.header;
+    char *text = outgoing.data + sizeof(struct record);
+    size_t length;
+    ssize_t status;
+    int saved_errno = errno;
+    int count;
+
+    count = vsnprintf(text, RECORD_TEXT_MAX, fmt, args);
+    if (count < 0)
+        return;
+    length = (size_t) count;
+    if (length >= RECORD_TEXT_MAX)
+        length = RECORD_TEXT_MAX - 1;
+    if (err != 0) {
+        length = append_text(text, length, ": ");
+        length = append_text(text, length, strerror(err));
+    }
+    if (queue_fd < 0) {
+        syslog(priority, "%s", text);
+        errno = saved_errno;
+        return;
+    }
+    gettimeofday(&header->time, NULL);
+    header->pid = getpid();
+    header->priority = priority;
+    header->dropped = dropped;
+    header->length = length;
+    status = write(queue_fd, outgoing.data, sizeof(struct record) + length);
+    if (status < 0) {
+        dropped++;
+        server_metrics_log_dropped();
+        if (errno == EPIPE) {
+            close(queue_fd);
+            queue_fd = -1;
+            syslog(LOG_WARNING, "log writer exited, logging directly");
+            syslog(priority, "%s", text);
+        }
+    } else {
+        dropped = 0;
+    }
+    errno = saved_errno;
+}
+
+
+/*
+ * The message handlers that queue messages.  notice uses LOG_INFO, as does
+ * remctld when logging to syslog directly.
+ */
+static void __attribute__((__format__(printf, 2, 0)))
+queue_debug(size_t len UNUSED, const char *fmt, va_list args, int err)
+{
+    queue_message(LOG_DEBUG, fmt, args, err);
+}
+
+static void __attribute__((__format__(printf, 2, 0)))
+queue_notice(size_t len UNUSED, const char *fmt, va_list args, int err)
+{
+    queue_message(LOG_INFO, fmt, args, err);
+}
+
+static void __attribute__((__format__(printf, 2, 0)))
+queue_warn(size_t len UNUSED, const char *fmt, va_list args, int err)
+{
+    queue_message(LOG_WARNING, fmt, args, err);
+}
+
+
+/*
+ * Read exactly the given number of bytes from the queue.  Returns false on
+ * end of file or error.
+ */
+static bool
+read_full(int fd, void *data, size_t length)
+{
+    char *p = data;
+    ssize_t status;
+
+    while (length > 0) {
+        status = read(fd, p, length);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return false;
+        p += status;
+        length -= (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * Return the name of a syslog priority, as used in files and JSON.
+ */
+static const char *
+priority_name(int priority)
+{
+    switch (priority) {
+    case LOG_DEBUG:
+        return "debug";
+    case LOG_INFO:
+        return "notice";
+    case LOG_WARNING:
+        return "warning";
+    default:
+        return "error";
+    }
+}
+
+
+/*
+ * Append a time to a buffer in ISO 8601 format in UTC, with microseconds.
+ */
+static void
+append_time(struct buffer *line, const struct timeval *tv)
+{
+    struct tm tm;
+    time_t seconds = tv->tv_sec;
+    char date[32];
+
+    if (gmtime_r(&seconds, &tm) == NULL
+        || strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm) == 0)
+        snprintf(date, sizeof(date), "1970-01-01T00:00:00");
+    buffer_append_sprintf(line, "%s.%06ldZ", date, (long) tv->tv_usec);
+}
+
+
+/*
+ * Append a string to a buffer as a JSON string, with quotes.
+ */
+static void
+append_json(struct buffer *line, const char *text, size_t length)
+{
+    size_t i;
+    unsigned char c;
+
+    buffer_append(line, "\"", 1);
+    for (i = 0; i < length; i++) {
+        c = (unsigned char) text[i];
+        if (c == '"' || c == '\\') {
+            buffer_append(line, "\\", 1);
+            buffer_append(line, text + i, 1);
+        } else if (c < 0x20 || c == 0x7f)
+            buffer_append_sprintf(line, "\\u%04x", (unsigned int) c);
+        else
+            buffer_append(line, text + i, 1);
+    }
+    buffer_append(line, "\"", 1);
+}
+
+
+/*
+ * Open the log file for appending.  Returns the file descriptor or -1 on
+ * failure, reporting an error message.
+ */
+static int
+file_open(const char *path)
+{
+    int fd;
+
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0)
+        syswarn("cannot open log file %s", path);
+    else
+        fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Reopen the log file if it has been renamed or removed, such as by log
+ * rotation, checking at most once every LOGQUEUE_RETRY seconds.
+ */
+static void
+file_check(void)
+{
+    struct stat current, opened;
+    time_t now;
+    int fd;
+
+    now = time(NULL);
+    if (now >= sink_checked && now - sink_checked < LOGQUEUE_RETRY)
+        return;
+    sink_checked = now;
+    if (sink_fd >= 0 && stat(sink_path, &current) == 0
+        && fstat(sink_fd, &opened) == 0 && current.st_dev == opened.st_dev
+        && current.st_ino == opened.st_ino)
+        return;
+    fd = file_open(sink_path);
+    if (fd < 0)
+        return;
+    if (sink_fd >= 0)
+        close(sink_fd);
+    sink_fd = fd;
+}
+
+
+/*
+ * Connect to the JSON socket if not already connected, trying at most once
+ * every LOGQUEUE_RETRY seconds.  Returns true if connected.
+ */
+static bool
+json_connect(void)
+{
+    struct sockaddr_un addr;
+    time_t now;
+    int fd;
+
+    if (sink_fd >= 0)
+        return true;
+    now = time(NULL);
+    if (now >= sink_checked && now - sink_checked < LOGQUEUE_RETRY)
+        return false;
+    sink_checked = now;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, sink_path, strlen(sink_path) + 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        syswarn("cannot create log socket");
+        return false;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        syswarn("cannot connect to log socket %s", sink_path);
+        close(fd);
+        return false;
+    }
+    fdflag_close_exec(fd, true);
+    sink_fd = fd;
+    return true;
+}
+
+
+/*
+ * Send one message to the destination.  Takes the header of the message and
+ * its nul-terminated text.  Messages that can't be sent are counted and
+ * reported once sending works again.
+ */
+static void
+writer_send(const struct record *header, const char *text)
+{
+    static struct buffer *line = NULL;
+    static char ident[64];
+
+    if (sink == SINK_SYSLOG) {
+        snprintf(ident, sizeof(ident), "%s[%lu]", message_program_name,
+                 (unsigned long) header->pid);
+        openlog(ident, LOG_NDELAY, LOG_DAEMON);
+        syslog(header->priority, "%s", text);
+        return;
+    }
+
+    /* Format the message as a line for a file or as a JSON object. */
+    if (line == NULL)
+        line = buffer_new();
+    buffer_set(line, NULL, 0);
+    if (sink == SINK_FILE) {
+        append_time(line, &header->time);
+        buffer_append_sprintf(line, " %s[%lu] %s: %s\n",
+                              message_program_name,
+                              (unsigned long) header->pid,
+                              priority_name(header->priority), text);
+        file_check();
+    } else {
+        buffer_append(line, "{\"time\":\"", 9);
+        append_time(line, &header->time);
+        buffer_append_sprintf(line, "\",\"pid\":%lu,\"level\":\"%s\","
+                              "\"message\":", (unsigned long) header->pid,
+                              priority_name(header->priority));
+        append_json(line, text, header->length);
+        buffer_append(line, "}\n", 2);
+        if (!json_connect()) {
+            sink_lost++;
+            return;
+        }
+    }
+    if (sink_fd < 0 || xwrite(sink_fd, line->data, line->left) < 0) {
+        sink_lost++;
+        if (sink == SINK_JSON && sink_fd >= 0) {
+            close(sink_fd);
+            sink_fd = -1;
+        }
+    }
+}
+
+
+/*
+ * Report messages that were dropped by a process or that the writer couldn't
+ * send, given the header of the message after them.
+ */
+static void
+writer_report(const struct record *header)
+{
+    struct record report;
+    char text[128];
+    unsigned long lost;
+
+    memcpy(&report, header, sizeof(report));
+    report.priority = LOG_WARNING;
+    if (header->dropped > 0) {
+        snprintf(text, sizeof(text), "dropped %lu log messages (queue full)",
+                 header->dropped);
+        report.length = strlen(text);
+        writer_send(&report, text);
+    }
+    if (sink_lost > 0) {
+        lost = sink_lost;
+        sink_lost = 0;
+        snprintf(text, sizeof(text), "lost %lu log messages (write failed)",
+                 lost);
+        report.pid = getpid();
+        report.length = strlen(text);
+        writer_send(&report, text);
+        if (sink_lost > 0)
+            sink_lost += lost;
+    }
+}
+
+
+/*
+ * The main loop of the writer process.  Read messages from the queue and
+ * send them on until all processes that could write to the queue have
+ * exited.
+ */
+static void __attribute__((__noreturn__))
+writer_run(int fd)
+{
+    union message incoming;
+    char *text = incoming.data + sizeof(struct record);
+    struct sigaction sa;
+
+    /* Outlive the daemon long enough to write everything it queued. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (read_full(fd, &incoming.header, sizeof(struct record))) {
+        if (incoming.header.length >= RECORD_TEXT_MAX) {
+            warn("invalid message in log queue");
+            break;
+        }
+        if (!read_full(fd, text, incoming.header.length))
+            break;
+        text[incoming.header.length] = '\0';
+        if (incoming.header.dropped > 0 || sink_lost > 0)
+            writer_report(&incoming.header);
+        writer_send(&incoming.header, text);
+    }
+    if (sink_fd >= 0)
+        close(sink_fd);
+    _exit(0);
+}
+
+
+/*
+ * Start queuing log messages to a separate writer process.  Takes the
+ * destination, which is syslog, file:<path>, or json:<path> for a Unix
+ * socket, and whether debug messages should be logged.  Returns true on
+ * success and false on failure, reporting an error message.
+ */
+bool
+server_logqueue_start(const char *destination, bool debug)
+{
+    struct sockaddr_un addr;
+    int fds[2];
+    pid_t child;
+
+    /* Parse the destination and open a log file. */
+    if (strcmp(destination, "syslog") == 0)
+        sink = SINK_SYSLOG;
+    else if (strncmp(destination, "file:", 5) == 0 && destination[5] != '\0')
+        sink = SINK_FILE;
+    else if (strncmp(destination, "json:", 5) == 0 && destination[5] != '\0')
+        sink = SINK_JSON;
+    else {
+        warn("invalid log destination %s", destination);
+        return false;
+    }
+    sink_path = destination + 5;
+    if (sink == SINK_JSON && strlen(sink_path) >= sizeof(addr.sun_path)) {
+        warn("log socket path %s too long", sink_path);
+        return false;
+    }
+    if (sink == SINK_FILE) {
+        sink_fd = file_open(sink_path);
+        if (sink_fd < 0)
+            return false;
+        sink_checked = time(NULL);
+    }
+
+    /* Create the queue. */
+    if (pipe(fds) < 0) {
+        syswarn("cannot create log queue");
+        return false;
+    }
+    fdflag_close_exec(fds[0], true);
+    fdflag_close_exec(fds[1], true);
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1], F_SETPIPE_SZ, LOGQUEUE_SIZE);
+#endif
+
+    /*
+     * Start the writer, forking twice so that it isn't our child and we don't
+     * reap it along with the processes handling connections.
+     */
+    fflush(stdout);
+    child = fork();
+    if (child < 0) {
+        syswarn("cannot fork log writer");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    } else if (child == 0) {
+        close(fds[1]);
+        child = fork();
+        if (child < 0)
+            sysdie("cannot fork log writer");
+        else if (child == 0)
+            writer_run(fds[0]);
+        _exit(0);
+    }
+    if (waitpid(child, NULL, 0) < 0)
+        syswarn("cannot reap log writer parent");
+    close(fds[0]);
+    if (sink_fd >= 0) {
+        close(sink_fd);
+        sink_fd = -1;
+    }
+
+    /* Queue all messages other than fatal errors from now on. */
+    fdflag_nonblocking(fds[1], true);
+    queue_fd = fds[1];
+    if (debug)
+        message_handlers_debug(1, queue_debug);
+    message_handlers_notice(1, queue_notice);
+    message_handlers_warn(1, queue_warn);
+    return true;
+}
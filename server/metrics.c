@@ -0,0 +1,796 @@
+/*
+ * Counters and histograms of remctld activity.
+ *
+ * remctld keeps counts of connections, GSS-API handshakes, and, for each
+ * configuration rule, the commands run, their results, ACL denials, commands
+ * refused by rate or concurrency limits, answers from the result cache, bytes
+ * received and sent, and a histogram of how long commands took.  These can
+ * be retrieved with a command whose rule sets builtin=metrics, and can be
+ * written periodically to a file for the Prometheus node exporter textfile
+ * collector, both in the Prometheus text exposition format.
+ *
+ * Every process handling a connection updates the same counters, so they are
+ * kept in a file mapped into memory in the same way as the limits table (see
+ * limits.c): an unlinked temporary file inherited by the children of a
+ * daemon, or a file in the cache directory shared by processes started by
+ * inetd.  Unlike the limits table, the counters are updated with atomic
+ * increments rather than under a lock, so that keeping them costs nothing
+ * noticeable on every command.  The table is only locked to claim the slot
+ * for a rule the first time a command for that rule is run.  Rules are
+ * identified by their command and subcommand, so their counters survive
+ * reloading the configuration.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/buffer.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/* Identifies a metrics table and the version of its format. */
+#define METRICS_MAGIC "remctl metrics 2\n"
+
+/*
+ * The number of rules for which counters can be kept.  Once the table is
+ * full, commands for other rules are only counted in the totals.
+ */
+#define METRICS_RULES 512
+
+/* The longest command or subcommand kept as a label, including the nul. */
+#define METRICS_NAME_MAX 64
+
+/* The minimum interval in seconds between rewrites of the metrics file. */
+#define METRICS_EXPORT_INTERVAL 1
+
+/*
+ * The upper bounds of the histogram buckets in microseconds.  There is an
+ * additional bucket for everything longer.
+ */
+#define METRICS_BUCKETS 12
+static const uint64_t bucket_bounds[METRICS_BUCKETS] = {
+    5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+    5000000, 10000000, 60000000
+};
+
+/*
+ * Update and read counters in the shared table.  Without compiler support
+ * for atomic operations, counts may occasionally be lost when several
+ * processes update the same counter at the same time.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+# define counter_add(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+# define counter_get(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+# define counter_add(p, n) (*(p) += (n))
+# define counter_get(p)    (*(p))
+#endif
+
+/* The ways in which a command can end. */
+enum result {
+    RESULT_SUCCESS,             /* Exited with status 0. */
+    RESULT_FAILURE,             /* Exited with non-zero status. */
+    RESULT_ERROR,               /* Killed by a signal or couldn't be run. */
+    RESULT_MAX
+};
+static const char *const result_names[RESULT_MAX] = {
+    "success", "failure", "error"
+};
+
+/* A histogram of durations, with counts per bucket rather than cumulative. */
+struct histogram {
+    uint64_t buckets[METRICS_BUCKETS + 1];
+    uint64_t sum;               /* Sum of all durations in microseconds. */
+};
+
+/* The counters for one configuration rule. */
+struct rule_metrics {
+    uint64_t key;               /* Hash of the rule, 0 if unused. */
+    char command[METRICS_NAME_MAX];
+    char subcommand[METRICS_NAME_MAX];
+    uint64_t commands;          /* Commands accepted for this rule. */
+    uint64_t results[RESULT_MAX];
+    uint64_t denied;            /* Commands refused by the ACL. */
+    uint64_t limited;           /* Commands refused by rate or run limits. */
+    uint64_t cached;            /* Commands answered without running. */
+    uint64_t bytes_in;          /* Bytes of arguments received. */
+    uint64_t bytes_out;         /* Bytes of output sent. */
+    struct histogram duration;
+};
+
+/* The layout of the shared table. */
+struct metrics_table {
+    char magic[sizeof(METRICS_MAGIC)];
+    uint64_t exported;          /* When the metrics file was last written. */
+    uint64_t connections;       /* Connections that completed a handshake. */
+    uint64_t handshake_failures;
+    uint64_t refused;           /* Connections refused by -A, -D, -c, or -L. */
+    uint64_t unknown;           /* Commands matching no rule. */
+    uint64_t log_dropped;       /* Log messages dropped by the log queue. */
+    struct histogram handshake;
+    struct rule_metrics rules[METRICS_RULES];
+};
+
+/* The file descriptor and mapping of the shared table, if set up. */
+static int table_fd = -1;
+static struct metrics_table *table = NULL;
+
+/* The counters for the command being run and when it started. */
+static struct rule_metrics *current = NULL;
+static struct timeval current_start;
+
+
+/*
+ * Lock or unlock the table, waiting for the lock if necessary.  Takes the
+ * type of lock, which is F_WRLCK or F_UNLCK.  Returns true on success and
+ * false on failure, reporting an error message.
+ */
+static bool
+table_lock(short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    while (fcntl(table_fd, F_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            syswarn("cannot lock metrics table");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Open the file for the metrics table.  If a directory is given, the table is
+ * kept in a file named metrics.state in that directory; otherwise, an
+ * unlinked temporary file is used.  Returns the file descriptor or -1 on
+ * failure, reporting an error message.
+ */
+static int
+table_open(const char *dir)
+{
+    char *path;
+    const char *tmpdir;
+    int fd;
+
+    if (dir != NULL) {
+        xasprintf(&path, "%s/metrics.state", dir);
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            syswarn("cannot open metrics table %s", path);
+    } else {
+        tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL)
+            tmpdir = "/tmp";
+        xasprintf(&path, "%s/remctld-metrics-XXXXXX", tmpdir);
+        fd = mkstemp(path);
+        if (fd < 0)
+            syswarn("cannot create metrics table %s", path);
+        else
+            unlink(path);
+    }
+    free(path);
+    if (fd >= 0)
+        fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Set up the shared table of metrics if it hasn't already been set up, which
+ * has to be done before the processes that will share it are forked.  Takes
+ * the cache directory, which may be NULL.  Returns true on success and false
+ * on failure, reporting an error message.  On failure, nothing is counted.
+ */
+bool
+server_metrics_setup(const char *dir)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (table != NULL)
+        return true;
+    fd = table_open(dir);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat metrics table");
+        goto fail;
+    }
+    if ((size_t) st.st_size < sizeof(struct metrics_table))
+        if (ftruncate(fd, sizeof(struct metrics_table)) < 0) {
+            syswarn("cannot size metrics table");
+            goto fail;
+        }
+    map = mmap(NULL, sizeof(struct metrics_table), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syswarn("cannot map metrics table");
+        goto fail;
+    }
+    table_fd = fd;
+    table = map;
+
+    /* Start with an empty table if it's new or in some other format. */
+    if (!table_lock(F_WRLCK)) {
+        server_metrics_free();
+        return false;
+    }
+    if (memcmp(table->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC)) != 0) {
+        memset(table, 0, sizeof(struct metrics_table));
+        memcpy(table->magic, METRICS_MAGIC, sizeof(METRICS_MAGIC));
+    }
+    table_lock(F_UNLCK);
+    return true;
+
+ fail:
+    close(fd);
+    return false;
+}
+
+
+/*
+ * Release the metrics table.  The contents are kept for other processes
+ * sharing it.
+ */
+void
+server_metrics_free(void)
+{
+    if (table != NULL)
+        munmap((void *) table, sizeof(struct metrics_table));
+    if (table_fd >= 0)
+        close(table_fd);
+    table = NULL;
+    table_fd = -1;
+    current = NULL;
+}
+
+
+/*
+ * Return the number of microseconds since the given time, or 0 if the clock
+ * went backwards.
+ */
+static uint64_t
+elapsed(const struct timeval *start)
+{
+    struct timeval now;
+    int64_t usec;
+
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
+    usec = ((int64_t) now.tv_sec - (int64_t) start->tv_sec) * 1000000
+           + ((int64_t) now.tv_usec - (int64_t) start->tv_usec);
+    return (usec < 0) ? 0 : (uint64_t) usec;
+}
+
+
+/*
+ * Add a duration in microseconds to a histogram.
+ */
+static void
+histogram_add(struct histogram *histogram, uint64_t usec)
+{
+    size_t i;
+
+    for (i = 0; i < METRICS_BUCKETS; i++)
+        if (usec <= bucket_bounds[i])
+            break;
+    counter_add(&histogram->buckets[i], 1);
+    counter_add(&histogram->sum, usec);
+}
+
+
+/*
+ * Compute the key for a rule, a 64-bit FNV-1a hash of the command and
+ * subcommand.  Zero marks an unused slot, so is never returned.
+ */
+static uint64_t
+rule_key(const struct rule *rule)
+{
+    const unsigned char *p;
+    uint64_t hash = UINT64_C(14695981039346656037);
+    const char *subcommand;
+
+    subcommand = (rule->subcommand == NULL) ? "" : rule->subcommand;
+    for (p = (const unsigned char *) rule->command; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= UINT64_C(1099511628211);
+    }
+    hash *= UINT64_C(1099511628211);
+    for (p = (const unsigned char *) subcommand; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= UINT64_C(1099511628211);
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+
+/*
+ * Copy a command or subcommand into a label, truncating it if necessary.
+ */
+static void
+copy_name(char *label, const char *name)
+{
+    size_t length;
+
+    if (name == NULL)
+        name = "";
+    length = strlen(name);
+    if (length >= METRICS_NAME_MAX)
+        length = METRICS_NAME_MAX - 1;
+    memcpy(label, name, length);
+    label[length] = '\0';
+}
+
+
+/*
+ * Find the counters for a rule, claiming a free slot for it if it doesn't
+ * have one yet.  Slots are only ever claimed, never released, so a slot with
+ * the right key can be used without locking.  Returns NULL if the table
+ * isn't set up or is full.
+ */
+static struct rule_metrics *
+rule_find(const struct rule *rule)
+{
+    struct rule_metrics *slot;
+    uint64_t key;
+    size_t i, start;
+
+    if (table == NULL)
+        return NULL;
+    key = rule_key(rule);
+    start = (size_t) (key % METRICS_RULES);
+    for (i = 0; i < METRICS_RULES; i++) {
+        slot = &table->rules[(start + i) % METRICS_RULES];
+        if (counter_get(&slot->key) == key)
+            return slot;
+        if (counter_get(&slot->key) == 0)
+            break;
+    }
+    if (i == METRICS_RULES || !table_lock(F_WRLCK))
+        return NULL;
+    for (; i < METRICS_RULES; i++) {
+        slot = &table->rules[(start + i) % METRICS_RULES];
+        if (slot->key == key)
+            break;
+        if (slot->key == 0) {
+            copy_name(slot->command, rule->command);
+            copy_name(slot->subcommand, rule->subcommand);
+#ifdef HAVE_ATOMIC_BUILTINS
+            __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+#else
+            slot->key = key;
+#endif
+            break;
+        }
+    }
+    table_lock(F_UNLCK);
+    return (i == METRICS_RULES) ? NULL : slot;
+}
+
+
+/*
+ * Record the result of a GSS-API handshake with a new client, given when it
+ * started and whether it succeeded.
+ */
+void
+server_metrics_handshake(const struct timeval *start, bool success)
+{
+    if (table == NULL)
+        return;
+    if (success) {
+        counter_add(&table->connections, 1);
+        histogram_add(&table->handshake, elapsed(start));
+    } else {
+        counter_add(&table->handshake_failures, 1);
+    }
+}
+
+
+/*
+ * Record a connection refused before the handshake.
+ */
+void
+server_metrics_refused(void)
+{
+    if (table != NULL)
+        counter_add(&table->refused, 1);
+}
+
+
+/*
+ * Record a command that matched no rule.
+ */
+void
+server_metrics_unknown(void)
+{
+    if (table != NULL)
+        counter_add(&table->unknown, 1);
+}
+
+
+/*
+ * Record a log message dropped because the log queue was full.
+ */
+void
+server_metrics_log_dropped(void)
+{
+    if (table != NULL)
+        counter_add(&table->log_dropped, 1);
+}
+
+
+/*
+ * Record a command refused by the ACL for its rule.
+ */
+void
+server_metrics_denied(const struct rule *rule)
+{
+    struct rule_metrics *metrics;
+
+    metrics = rule_find(rule);
+    if (metrics != NULL)
+        counter_add(&metrics->denied, 1);
+}
+
+
+/*
+ * Start counting a command for a rule, given its arguments.  The counters
+ * for the command's output and result are then updated by the following
+ * functions until server_metrics_finish is called.
+ */
+void
+server_metrics_start(const struct rule *rule, struct iovec **argv)
+{
+    size_t i;
+    uint64_t length = 0;
+
+    current = rule_find(rule);
+    if (current == NULL)
+        return;
+    if (gettimeofday(&current_start, NULL) < 0) {
+        current = NULL;
+        return;
+    }
+    for (i = 0; argv[i] != NULL; i++)
+        length += argv[i]->iov_len;
+    counter_add(&current->commands, 1);
+    counter_add(&current->bytes_in, length);
+}
+
+
+/*
+ * Record that the current command was answered from the result cache or the
+ * output of another process rather than by running it.
+ */
+void
+server_metrics_cached(void)
+{
+    if (current != NULL)
+        counter_add(&current->cached, 1);
+}
+
+
+/*
+ * Record that the current command was refused by a rate or concurrency limit.
+ * It then has no result.
+ */
+void
+server_metrics_limited(void)
+{
+    if (current != NULL)
+        counter_add(&current->limited, 1);
+    current = NULL;
+}
+
+
+/*
+ * Record output sent to the client for the current command.
+ */
+void
+server_metrics_output(size_t length)
+{
+    if (current != NULL)
+        counter_add(&current->bytes_out, length);
+}
+
+
+/*
+ * Record the result of the current command, given its exit status, which is
+ * -1 if it was killed or couldn't be run.
+ */
+void
+server_metrics_finish(int status)
+{
+    enum result result;
+
+    if (current == NULL)
+        return;
+    if (status == 0)
+        result = RESULT_SUCCESS;
+    else if (status > 0)
+        result = RESULT_FAILURE;
+    else
+        result = RESULT_ERROR;
+    counter_add(&current->results[result], 1);
+    histogram_add(&current->duration, elapsed(&current_start));
+    current = NULL;
+}
+
+
+/*
+ * Append a label value to a buffer, escaping it as required by the Prometheus
+ * exposition format.
+ */
+static void
+format_label(struct buffer *output, const char *value)
+{
+    const char *p;
+
+    for (p = value; *p != '\0'; p++) {
+        if (*p == '\\' || *p == '"')
+            buffer_append_sprintf(output, "\\%c", *p);
+        else if (*p == '\n')
+            buffer_append(output, "\\n", 2);
+        else
+            buffer_append(output, p, 1);
+    }
+}
+
+
+/*
+ * Append the help and type lines for a metric to a buffer.
+ */
+static void
+format_header(struct buffer *output, const char *name, const char *type,
+              const char *help)
+{
+    buffer_append_sprintf(output, "# HELP remctld_%s %s\n", name, help);
+    buffer_append_sprintf(output, "# TYPE remctld_%s %s\n", name, type);
+}
+
+
+/*
+ * Append the labels for a rule, without the surrounding braces.
+ */
+static void
+format_rule(struct buffer *output, const struct rule_metrics *metrics)
+{
+    buffer_append_sprintf(output, "command=\"");
+    format_label(output, metrics->command);
+    buffer_append_sprintf(output, "\",subcommand=\"");
+    format_label(output, metrics->subcommand);
+    buffer_append_sprintf(output, "\"");
+}
+
+
+/*
+ * Append one counter for every rule in use to a buffer.  Takes the offset of
+ * the counter in struct rule_metrics.
+ */
+static void
+format_rule_counter(struct buffer *output, const char *name, size_t offset)
+{
+    struct rule_metrics *metrics;
+    size_t i;
+    uint64_t *counter;
+
+    for (i = 0; i < METRICS_RULES; i++) {
+        metrics = &table->rules[i];
+        if (counter_get(&metrics->key) == 0)
+            continue;
+        counter = (uint64_t *) ((char *) metrics + offset);
+        buffer_append_sprintf(output, "remctld_%s{", name);
+        format_rule(output, metrics);
+        buffer_append_sprintf(output, "} %llu\n",
+                              (unsigned long long) counter_get(counter));
+    }
+}
+
+
+/*
+ * Append a histogram to a buffer.  Takes the name of the metric and the
+ * labels of this series, which may be NULL.
+ */
+static void
+format_histogram(struct buffer *output, const char *name,
+                 const struct rule_metrics *metrics,
+                 struct histogram *histogram)
+{
+    uint64_t count = 0;
+    uint64_t sum;
+    size_t i;
+
+    for (i = 0; i <= METRICS_BUCKETS; i++) {
+        count += counter_get(&histogram->buckets[i]);
+        buffer_append_sprintf(output, "remctld_%s_bucket{", name);
+        if (metrics != NULL) {
+            format_rule(output, metrics);
+            buffer_append(output, ",", 1);
+        }
+        if (i < METRICS_BUCKETS)
+            buffer_append_sprintf(output, "le=\"%g\"} %llu\n",
+                                  (double) bucket_bounds[i] / 1000000.0,
+                                  (unsigned long long) count);
+        else
+            buffer_append_sprintf(output, "le=\"+Inf\"} %llu\n",
+                                  (unsigned long long) count);
+    }
+    buffer_append_sprintf(output, "remctld_%s_sum", name);
+    if (metrics != NULL) {
+        buffer_append(output, "{", 1);
+        format_rule(output, metrics);
+        buffer_append(output, "}", 1);
+    }
+    sum = counter_get(&histogram->sum);
+    buffer_append_sprintf(output, " %.6f\n", (double) sum / 1000000.0);
+    buffer_append_sprintf(output, "remctld_%s_count", name);
+    if (metrics != NULL) {
+        buffer_append(output, "{", 1);
+        format_rule(output, metrics);
+        buffer_append(output, "}", 1);
+    }
+    buffer_append_sprintf(output, " %llu\n", (unsigned long long) count);
+}
+
+
+/*
+ * Append all metrics to a buffer in the Prometheus text exposition format.
+ * Appends nothing if the metrics table isn't set up.
+ */
+void
+server_metrics_format(struct buffer *output)
+{
+    struct rule_metrics *metrics;
+    size_t i, j;
+
+    if (table == NULL)
+        return;
+    format_header(output, "connections_total", "counter",
+                  "Connections that completed the GSS-API handshake.");
+    buffer_append_sprintf(output, "remctld_connections_total %llu\n",
+        (unsigned long long) counter_get(&table->connections));
+    format_header(output, "handshake_failures_total", "counter",
+                  "Connections that failed the GSS-API handshake.");
+    buffer_append_sprintf(output, "remctld_handshake_failures_total %llu\n",
+        (unsigned long long) counter_get(&table->handshake_failures));
+    format_header(output, "connections_refused_total", "counter",
+                  "Connections refused before the handshake.");
+    buffer_append_sprintf(output, "remctld_connections_refused_total %llu\n",
+        (unsigned long long) counter_get(&table->refused));
+    format_header(output, "unknown_commands_total", "counter",
+                  "Commands that matched no configuration rule.");
+    buffer_append_sprintf(output, "remctld_unknown_commands_total %llu\n",
+        (unsigned long long) counter_get(&table->unknown));
+    format_header(output, "log_dropped_total", "counter",
+                  "Log messages dropped because the log queue was full.");
+    buffer_append_sprintf(output, "remctld_log_dropped_total %llu\n",
+        (unsigned long long) counter_get(&table->log_dropped));
+    format_header(output, "handshake_seconds", "histogram",
+                  "Time taken by the GSS-API handshake.");
+    format_histogram(output, "handshake_seconds", NULL, &table->handshake);
+
+    /* Per-rule counters. */
+    format_header(output, "commands_total", "counter",
+                  "Commands accepted for each rule.");
+    format_rule_counter(output, "commands_total",
+                        offsetof(struct rule_metrics, commands));
+    format_header(output, "command_results_total", "counter",
+                  "Commands for each rule by how they ended.");
+    for (i = 0; i < METRICS_RULES; i++) {
+        metrics = &table->rules[i];
+        if (counter_get(&metrics->key) == 0)
+            continue;
+        for (j = 0; j < RESULT_MAX; j++) {
+            buffer_append_sprintf(output, "remctld_command_results_total{");
+            format_rule(output, metrics);
+            buffer_append_sprintf(output, ",result=\"%s\"} %llu\n",
+                result_names[j],
+                (unsigned long long) counter_get(&metrics->results[j]));
+        }
+    }
+    format_header(output, "command_denied_total", "counter",
+                  "Commands refused by the ACL for each rule.");
+    format_rule_counter(output, "command_denied_total",
+                        offsetof(struct rule_metrics, denied));
+    format_header(output, "command_limited_total", "counter",
+                  "Commands refused by rate or concurrency limits.");
+    format_rule_counter(output, "command_limited_total",
+                        offsetof(struct rule_metrics, limited));
+    format_header(output, "command_cached_total", "counter",
+                  "Commands answered without running the program.");
+    format_rule_counter(output, "command_cached_total",
+                        offsetof(struct rule_metrics, cached));
+    format_header(output, "command_received_bytes_total", "counter",
+                  "Bytes of command arguments received for each rule.");
+    format_rule_counter(output, "command_received_bytes_total",
+                        offsetof(struct rule_metrics, bytes_in));
+    format_header(output, "command_sent_bytes_total", "counter",
+                  "Bytes of command output sent for each rule.");
+    format_rule_counter(output, "command_sent_bytes_total",
+                        offsetof(struct rule_metrics, bytes_out));
+    format_header(output, "command_duration_seconds", "histogram",
+                  "Time taken by commands for each rule.");
+    for (i = 0; i < METRICS_RULES; i++) {
+        metrics = &table->rules[i];
+        if (counter_get(&metrics->key) == 0)
+            continue;
+        format_histogram(output, "command_duration_seconds", metrics,
+                         &metrics->duration);
+    }
+}
+
+
+/*
+ * Write the metrics to the given file if it hasn't been written recently by
+ * any process sharing the table.  The file is replaced atomically so that a
+ * reader never sees a partial file.  Failures are reported but otherwise
+ * ignored.
+ */
+void
+server_metrics_export(const char *path)
+{
+    struct buffer *output;
+    char *tmp;
+    uint64_t now, last;
+    int fd;
+
+    if (table == NULL || path == NULL)
+        return;
+    now = (uint64_t) time(NULL);
+    last = counter_get(&table->exported);
+    if (now >= last && now - last < METRICS_EXPORT_INTERVAL)
+        return;
+#ifdef HAVE_ATOMIC_BUILTINS
+    if (!__atomic_compare_exchange_n(&table->exported, &last, now, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return;
+#else
+    table->exported = now;
+#endif
+    output = buffer_new();
+    server_metrics_format(output);
+    xasprintf(&tmp, "%s.%lu", path, (unsigned long) getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        syswarn("cannot create %s", tmp);
+        goto done;
+    }
+    if (xwrite(fd, output->data + output->used, output->left) < 0) {
+        syswarn("cannot write %s", tmp);
+        close(fd);
+        unlink(tmp);
+        goto done;
+    }
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        syswarn("cannot replace %s", path);
+        unlink(tmp);
+    }
+
+done:
+    free(tmp);
+    buffer_free(output);
+}
@@ -28,6 +28,7 @@
 #include <util/fdflag.h>
 #include <util/macros.h>
 #include <util/messages.h>
+#include <util/network.h>
 #include <util/protocol.h>
 #include <util/xmalloc.h>
 
@@ -122,6 +123,9 @@ handle_exit(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
     struct process *process = data;
 
     if (waitpid(process->pid, &process->status, WNOHANG) > 0) {
+        server_timing_end(TIMING_RUN);
+        server_timing_begin(TIMING_DRAIN);
+        server_scoreboard_state(WORKER_SENDING);
         process->reaped = true;
         event_del(process->sigchld);
         event_base_loopexit(process->loop, NULL);
@@ -129,6 +133,66 @@ handle_exit(evutil_socket_t sig UNUSED, short what UNUSED, void *data)
 }
 
 
+/*
+ * Returns the exit status of a process that has been reaped, or -1 if it was
+ * killed by a signal.
+ */
+static int
+exit_status(const struct process *process)
+{
+    if (WIFEXITED(process->status))
+        return (int) WEXITSTATUS(process->status);
+    else
+        return -1;
+}
+
+
+/*
+ * Returns the amount of data queued to be written to the client.
+ */
+static size_t
+queue_length(struct client *client)
+{
+    return evbuffer_get_length(bufferevent_get_output(client->queue));
+}
+
+
+/*
+ * Write out anything left in the queue of tokens for the client and stop
+ * queuing, going back to writing tokens directly.  Called after a command has
+ * finished.  Returns true on success, false on failure (and logs a message on
+ * failure).
+ */
+static bool
+queue_finish(struct client *client)
+{
+    struct evbuffer *buf;
+    size_t length;
+    char *data;
+    bool okay = true;
+
+    if (client->queue == NULL)
+        return true;
+    buf = bufferevent_get_output(client->queue);
+    length = evbuffer_get_length(buf);
+    if (length > 0 && !client->fatal) {
+        data = xmalloc(length);
+        if (evbuffer_remove(buf, data, length) < 0)
+            die("internal error: cannot move data from client queue");
+        if (!network_write(client->fd, data, length, TIMEOUT)) {
+            syswarn("cannot send queued output to client");
+            client->fatal = true;
+            okay = false;
+        }
+        free(data);
+    }
+    bufferevent_free(client->queue);
+    client->queue = NULL;
+    fdflag_nonblocking(client->fd, false);
+    return okay;
+}
+
+
 /*
  * Called on fatal errors in the child process before exec.  This callback
  * exists only to change the exit status for fatal internal errors in the
@@ -170,6 +234,7 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
      * separate read-only one for standard error so that we can keep the
      * stream separate.
      */
+    server_timing_begin(TIMING_SPAWN);
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, stdinout_fds) < 0) {
         syswarn("cannot create stdin and stdout socket pair");
         goto fail;
@@ -344,6 +409,9 @@ start(evutil_socket_t junk UNUSED, short what UNUSED, void *data)
 
     /* Set up the event hooks for the different protocols. */
     client->setup(process);
+    server_timing_end(TIMING_SPAWN);
+    server_timing_begin(TIMING_FIRST_OUTPUT);
+    server_timing_begin(TIMING_RUN);
     return;
 
 fail:
@@ -372,11 +440,23 @@ fail:
 bool
 server_process_run(struct process *process)
 {
-    bool success;
+    bool success, flushed, finished;
+    int mode;
     struct event_base *loop;
     struct client *client = process->client;
     const struct timeval immediate = { 0, 0 };
 
+    /*
+     * Look up the client's hostname for REMOTE_HOST, if we haven't already,
+     * before forking so that later commands from the same client can reuse
+     * it.
+     */
+    if (!client->resolved) {
+        server_timing_begin(TIMING_DNS);
+        server_client_hostname(client);
+        server_timing_end(TIMING_DNS);
+    }
+
     /* Create the event base that we use for the event loop. */
     loop = event_base_new();
     process->loop = loop;
@@ -417,18 +497,56 @@ server_process_run(struct process *process)
      * if process->saw_output remains true and we didn't break out of the loop
      * (indicating an error).  The saw_output flag will be set by the event
      * handlers if we see any output from the process.
+     *
+     * If we stopped reading from the process because too much output is
+     * queued for the client, wait for the queue to drain and then check for
+     * output again.  Once there's nothing more, send any output that's being
+     * held back to coalesce it.  At that point, we've seen all of the output
+     * of the process, so let anyone sharing it know the exit status, and then
+     * wait for the rest of the queued output to be sent.
      */
     process->saw_output = true;
-    while (process->saw_output && !event_base_got_break(loop)) {
-        process->saw_output = false;
-        if (event_base_loop(loop, EVLOOP_NONBLOCK) < 0)
+    flushed = (process->flush == NULL);
+    finished = false;
+    while (!event_base_got_break(loop)) {
+        if (process->saw_output) {
+            process->saw_output = false;
+            mode = EVLOOP_NONBLOCK;
+        } else if (process->throttled) {
+            process->saw_output = true;
+            mode = EVLOOP_ONCE;
+        } else if (!flushed) {
+            event_del(process->flush);
+            event_active(process->flush, EV_TIMEOUT, 1);
+            flushed = true;
+            process->saw_output = true;
+            mode = EVLOOP_NONBLOCK;
+        } else if (!finished) {
+            if (process->reaped)
+                server_cache_share_status(client, exit_status(process));
+            finished = true;
+            continue;
+        } else if (client->queue != NULL && queue_length(client) > 0) {
+            mode = EVLOOP_ONCE;
+        } else {
+            break;
+        }
+        if (event_base_loop(loop, mode) < 0)
             die("internal error: process event loop failed");
     }
+    if (!queue_finish(client))
+        process->saw_error = true;
 
-    /* Close down the file descriptors now that we have all the data. */
-    close(process->stdinout_fd);
-    if (client->protocol > 1)
-        close(process->stderr_fd);
+    /*
+     * Close down the file descriptors now that we have all the data.  If we
+     * failed to start the process, start will have already closed them and
+     * we won't have created the bufferevents.
+     */
+    if (process->inout != NULL) {
+        close(process->stdinout_fd);
+        if (client->protocol > 1)
+            close(process->stderr_fd);
+    }
 
     /*
      * If we aborted on error, still wait for the child process to exit.  We
@@ -442,32 +560,37 @@ server_process_run(struct process *process)
      * interrupted.  This approach seems safer, although has the disadvantage
      * of keeping the remctld process around until the child completes.
      */
-    if (event_base_got_break(loop)) {
-        if (!process->reaped)
+    if (event_base_got_break(loop) || process->saw_error) {
+        if (!process->reaped && process->pid > 0)
             waitpid(process->pid, &process->status, 0);
-        return false;
-    }
+        success = false;
+    } else {
+        success = true;
 
-    /*
-     * For protocol version one, if the process sent more than the max output,
-     * we already pulled out the output we care about into process->output.
-     * Otherwise, we need to pull the output from the bufferevent before we
-     * free it.
-     */
-    if (client->protocol == 1 && process->output == NULL) {
-        process->output = evbuffer_new();
-        if (process->output == NULL)
-            die("internal error: cannot create output buffer");
-        if (bufferevent_read_buffer(process->inout, process->output) < 0)
-            die("internal error: cannot read data from output buffer");
+        /*
+         * For protocol version one, if the process sent more than the max
+         * output, we already pulled out the output we care about into
+         * process->output.  Otherwise, we need to pull the output from the
+         * bufferevent before we free it.
+         */
+        if (client->protocol == 1 && process->output == NULL) {
+            process->output = evbuffer_new();
+            if (process->output == NULL)
+                die("internal error: cannot create output buffer");
+            if (bufferevent_read_buffer(process->inout, process->output) < 0)
+                die("internal error: cannot read data from output buffer");
+        }
     }
 
     /* Free resources and return. */
-    success = !event_base_got_break(loop);
-    bufferevent_free(process->inout);
+    if (process->inout != NULL)
+        bufferevent_free(process->inout);
     if (process->err != NULL)
         bufferevent_free(process->err);
     event_free(process->sigchld);
+    if (process->flush != NULL)
+        event_free(process->flush);
     event_base_free(loop);
+    server_timing_end(TIMING_DRAIN);
     return success;
 }
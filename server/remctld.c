@@ -23,6 +23,7 @@
 
 #include <signal.h>
 #include <syslog.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <time.h>
 
@@ -52,21 +53,37 @@ static volatile sig_atomic_t config_signaled = 0;
  */
 static volatile sig_atomic_t exit_signaled = 0;
 
+/*
+ * How often, in seconds, to log a summary of connections refused because the
+ * server is overloaded (only used in standalone mode).
+ */
+#define REFUSED_LOG_INTERVAL 60
+
 /* Usage message. */
 static const char usage_message[] = "\
 Usage: remctld <options>\n\
 \n\
 Options:\n\
+    -A <network>  Only accept connections from network (may be repeated)\n\
     -b <addr>     Bind to a specific address (may be given multiple times)\n\
+    -C <dir>      Directory for cached command results (default: none)\n\
+    -c <count>    Maximum simultaneous connections, only for standalone mode\n\
+    -D <network>  Refuse connections from network (may be repeated)\n\
     -d            Log verbose debugging information\n\
     -F            Run in the foreground instead of forking and exiting\n\
     -f <file>     Config file (default: " CONFIG_FILE ")\n\
+    -H <socket>   Accept connections handed off on socket, or hand off to it\n\
     -h            Display this help\n\
+    -L <load>     Refuse connections above this load, only for standalone mode\n\
+    -l <dest>     Queue logs to syslog, file:<path>, or json:<socket>\n\
+    -M <file>     Write metrics in Prometheus format to file\n\
     -m            Stand-alone daemon mode, meant mostly for testing\n\
+    -N            Don't look up client hostnames for REMOTE_HOST\n\
     -P <file>     Write PID to file, only useful with -m\n\
     -p <port>     Port to use, only for standalone mode (default: 4373)\n\
     -S            Log to standard output/error rather than syslog\n\
     -s <service>  Service principal to use (default: host/<host>)\n\
+    -T <ms>       Log the timing of commands taking at least ms milliseconds\n\
     -v            Display the version of remctld\n\
     -Z            Raise SIGSTOP once ready for connections\n\
 \n\
@@ -77,13 +94,23 @@ struct options {
     bool debug;                 /* -d: log verbose debugging information */
     bool foreground;            /* -F: run in the foreground */
     bool log_stdout;            /* -S: log to standard output and error */
+    bool no_lookups;            /* -N: don't look up client hostnames */
     bool standalone;            /* -m: run in stand-alone daemon mode */
     bool suspend;               /* -Z: raise SIGSTOP when ready */
     unsigned short port;        /* -p: port on which to listen */
+    unsigned long max_conns;    /* -c: maximum simultaneous connections */
+    double max_load;            /* -L: maximum load average */
+    long slow_threshold;        /* -T: log commands slower than this (ms) */
     char *service;              /* -s: service principal to use */
     const char *config_path;    /* -f: path to the configuration file */
     const char *pid_path;       /* -P: path to the PID file to write */
+    const char *cache_path;     /* -C: directory for the result cache */
+    const char *handoff_path;   /* -H: socket for handed off connections */
+    const char *metrics_path;   /* -M: file to which to write metrics */
+    const char *log_path;       /* -l: destination of queued log messages */
     struct vector *bindaddrs;   /* -b: bind to a specific address */
+    struct vector *allow;       /* -A: networks allowed to connect */
+    struct vector *deny;        /* -D: networks refused connections */
 };
 
 
@@ -198,9 +225,12 @@ static void
 handle_connection(int fd, struct config *config, gss_cred_id_t creds)
 {
     struct client *client;
+    struct timeval start;
 
     /* Establish a context with the client. */
+    gettimeofday(&start, NULL);
     client = server_new_client(fd, creds);
+    server_metrics_handshake(&start, client != NULL);
     if (client == NULL) {
         close(fd);
         return;
@@ -246,6 +276,112 @@ log_child(pid_t pid, int status)
 }
 
 
+/*
+ * Reap any children that have exited, logging their exit status and reducing
+ * the count of running children.
+ */
+static void
+reap_children(unsigned long *children)
+{
+    pid_t child;
+    int status;
+
+    while ((child = waitpid(0, &status, WNOHANG)) > 0) {
+        log_child(child, status);
+        if (*children > 0)
+            (*children)--;
+    }
+    if (child < 0 && errno != ECHILD)
+        sysdie("waitpid failed");
+}
+
+
+/*
+ * Given a network in the form <address>[/<mask>] and an address, return true
+ * if the address is in that network.  If the address is NULL, instead return
+ * true if the network is valid.  The mask may be a CIDR length or, for IPv4,
+ * a netmask.
+ */
+static bool
+network_contains(const char *network, const char *ip)
+{
+    char addr[INET6_ADDRSTRLEN];
+    const char *mask;
+    size_t length;
+
+    mask = strchr(network, '/');
+    length = (mask == NULL) ? strlen(network) : (size_t) (mask - network);
+    if (length >= sizeof(addr))
+        return false;
+    memcpy(addr, network, length);
+    addr[length] = '\0';
+    if (mask != NULL)
+        mask++;
+    return network_addr_match((ip == NULL) ? addr : ip, addr, mask);
+}
+
+
+/*
+ * Return true if an address is in any of the networks in a list.
+ */
+static bool
+network_listed(const struct vector *networks, const char *ip)
+{
+    size_t i;
+
+    for (i = 0; i < networks->count; i++)
+        if (network_contains(networks->strings[i], ip))
+            return true;
+    return false;
+}
+
+
+/*
+ * Check whether a new connection from the address ip should be refused,
+ * either because of the -A and -D options or because the server is
+ * overloaded, given the number of children currently running.  Returns a
+ * string describing the reason if so and NULL if the connection should be
+ * accepted.  The load average is checked at most once a second, since it's
+ * only updated every few seconds anyway.
+ */
+static const char *
+admission_refused(const struct options *options, unsigned long children,
+                  const char *ip)
+{
+#ifdef HAVE_GETLOADAVG
+    static time_t checked = 0;
+    static double load = 0;
+    time_t now;
+#endif
+
+    /*
+     * IPv4 clients connecting to an IPv6 socket show up as IPv4-mapped IPv6
+     * addresses, which should match IPv4 networks.
+     */
+    if (strncmp(ip, "::ffff:", 7) == 0 && strchr(ip, '.') != NULL)
+        ip += 7;
+    if (network_listed(options->deny, ip))
+        return "address denied";
+    if (options->allow->count > 0 && !network_listed(options->allow, ip))
+        return "address not allowed";
+    if (options->max_conns > 0 && children >= options->max_conns)
+        return "too many connections";
+#ifdef HAVE_GETLOADAVG
+    if (options->max_load > 0) {
+        now = time(NULL);
+        if (now != checked) {
+            if (getloadavg(&load, 1) < 1)
+                load = 0;
+            checked = now;
+        }
+        if (load > options->max_load)
+            return "load too high";
+    }
+#endif
+    return NULL;
+}
+
+
 /*
  * Given a bind address, return true if it's an IPv6 address.  Otherwise, it's
  * assumed to be an IPv4 address.
@@ -369,9 +505,10 @@ static void
 server_daemon(struct options *options, struct config *config,
               gss_cred_id_t creds)
 {
-    socket_type s;
-    unsigned int nfds, i;
-    socket_type *fds;
+    socket_type s, ready;
+    unsigned int nfds, nlisteners, i;
+    socket_type *fds, *listeners;
+    socket_type handoff = INVALID_SOCKET;
     pid_t child;
     int status;
     struct sigaction sa, oldsa;
@@ -379,6 +516,11 @@ server_daemon(struct options *options, struct config *config,
     socklen_t sslen;
     char ip[INET6_ADDRSTRLEN];
     OM_uint32 minor;
+    unsigned long children = 0;
+    unsigned long refused = 0;
+    time_t now;
+    time_t refused_logged = 0;
+    const char *reason;
 
     /* Set up a SIGCHLD handler so that we know when to reap children. */
     memset(&sa, 0, sizeof(sa));
@@ -401,6 +543,18 @@ server_daemon(struct options *options, struct config *config,
     /* Bind to the network sockets and configure listening addresses. */
     bind_sockets(options, &fds, &nfds);
 
+    /*
+     * Listen for handed off connections if requested.  That socket is waited
+     * on along with the network sockets.
+     */
+    listeners = xcalloc(nfds + 1, sizeof(socket_type));
+    memcpy(listeners, fds, nfds * sizeof(socket_type));
+    nlisteners = nfds;
+    if (options->handoff_path != NULL) {
+        handoff = server_handoff_listen(options->handoff_path);
+        listeners[nlisteners++] = handoff;
+    }
+
     /*
      * Set up our PID file now that we're ready to accept connections, so that
      * the PID file isn't created until clients can connect.
@@ -427,17 +581,18 @@ server_daemon(struct options *options, struct config *config,
      * configuration, and check to see if we're exiting.  Then see if we have
      * a new connection, and if so, fork a child to handle it.
      *
-     * Note that there are no limits here on the number of simultaneous
-     * processes, so you may want to set system resource limits to prevent an
-     * attacker from consuming all available processes.
+     * If the server is overloaded, as set by -c and -L, new connections are
+     * closed as soon as they're accepted without forking, so that the
+     * connections already being handled can finish.  Without those options,
+     * there are no limits here on the number of simultaneous processes, so
+     * you may want to set system resource limits to prevent an attacker from
+     * consuming all available processes.
      */
     while (1) {
         if (child_signaled) {
             child_signaled = 0;
-            while ((child = waitpid(0, &status, WNOHANG)) > 0)
-                log_child(child, status);
-            if (child < 0 && errno != ECHILD)
-                sysdie("waitpid failed");
+            reap_children(&children);
+            server_metrics_export(options->metrics_path);
         }
         if (config_signaled) {
             config_signaled = 0;
@@ -446,43 +601,94 @@ server_daemon(struct options *options, struct config *config,
             config = server_config_load(options->config_path);
             if (config == NULL)
                 die("cannot load configuration file %s", options->config_path);
+            server_cache_check(config);
+            if (!server_limits_setup(config, options->cache_path))
+                warn("running commands without limits");
         }
         if (exit_signaled) {
             notice("signal received, exiting");
             break;
         }
-        sslen = sizeof(ss);
-        s = network_accept_any(fds, nfds, (struct sockaddr *) &ss, &sslen);
-        if (s == INVALID_SOCKET) {
+        ready = network_wait_any(listeners, nlisteners);
+        if (ready == INVALID_SOCKET) {
             if (errno != EINTR)
-                sysdie("error accepting incoming connection");
+                sysdie("error waiting for incoming connection");
             continue;
         }
+        sslen = sizeof(ss);
+        if (ready == handoff) {
+            s = server_handoff_accept(handoff, (struct sockaddr *) &ss,
+                                      &sslen);
+            if (s == INVALID_SOCKET)
+                continue;
+        } else {
+            s = accept(ready, (struct sockaddr *) &ss, &sslen);
+            if (s == INVALID_SOCKET) {
+                if (errno != EINTR)
+                    sysdie("error accepting incoming connection");
+                continue;
+            }
+        }
         fdflag_close_exec(s, true);
+        network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
+
+        /*
+         * Refuse the connection if the client isn't allowed to connect or
+         * we're overloaded.  Children may have exited since we last checked
+         * without our noticing the signal, so reap them first when at the
+         * connection limit.  Only log a summary of refused connections
+         * periodically so that a connection storm doesn't also flood the
+         * logs.
+         */
+        if (options->max_conns > 0 && children >= options->max_conns)
+            reap_children(&children);
+        reason = admission_refused(options, children, ip);
+        if (reason != NULL) {
+            debug("refusing connection from %s: %s", ip, reason);
+            socket_close(s);
+            server_metrics_refused();
+            refused++;
+            now = time(NULL);
+            if (now - refused_logged >= REFUSED_LOG_INTERVAL) {
+                warn("refused %lu connections, most recently from %s: %s"
+                     " (%lu running)", refused, ip, reason, children);
+                refused = 0;
+                refused_logged = now;
+            }
+            continue;
+        }
         child = fork();
         if (child < 0) {
             syswarn("forking a new child failed");
             warn("sleeping ten seconds in the hope we recover...");
             sleep(10);
         } else if (child == 0) {
-            for (i = 0; i < nfds; i++)
-                close(fds[i]);
+            for (i = 0; i < nlisteners; i++)
+                close(listeners[i]);
+            free(listeners);
             network_bind_all_free(fds);
             if (sigaction(SIGCHLD, &oldsa, NULL) < 0)
                 syswarn("cannot reset SIGCHLD handler");
             handle_connection(s, config, creds);
+            server_metrics_export(options->metrics_path);
             if (creds != GSS_C_NO_CREDENTIAL)
                 gss_release_cred(&minor, &creds);
             if (options->log_stdout)
                 fflush(stdout);
             server_config_free(config);
+            server_limits_free();
+            server_hosts_free();
+            server_metrics_free();
+            server_scoreboard_free();
             vector_free(options->bindaddrs);
+            vector_free(options->allow);
+            vector_free(options->deny);
             libevent_global_shutdown();
             message_handlers_reset();
             exit(0);
         } else {
             close(s);
-            network_sockaddr_sprint(ip, sizeof(ip), (struct sockaddr *) &ss);
+            children++;
             debug("child %lu for %s", (unsigned long) child, ip);
         }
     }
@@ -493,8 +699,11 @@ server_daemon(struct options *options, struct config *config,
      */
     if (options->pid_path != NULL)
         unlink(options->pid_path);
-    for (i = 0; i < nfds; i++)
-        close(fds[i]);
+    if (options->handoff_path != NULL)
+        unlink(options->handoff_path);
+    for (i = 0; i < nlisteners; i++)
+        close(listeners[i]);
+    free(listeners);
     network_bind_all_free(fds);
 }
 
@@ -512,6 +721,9 @@ main(int argc, char *argv[])
     int option;
     long tmp_port;
     char *end;
+    long tmp_conns;
+    long tmp_threshold;
+    double tmp_load;
     struct sigaction sa;
     gss_cred_id_t creds = GSS_C_NO_CREDENTIAL;
     OM_uint32 minor;
@@ -534,14 +746,38 @@ main(int argc, char *argv[])
     memset(&options, 0, sizeof(options));
     options.port = 4373;
     options.config_path = CONFIG_FILE;
+    options.slow_threshold = -1;
     options.bindaddrs = vector_new();
+    options.allow = vector_new();
+    options.deny = vector_new();
 
     /* Parse options. */
-    while ((option = getopt(argc, argv, "b:dFf:hk:mP:p:Ss:vZ")) != EOF) {
+    while ((option
+            = getopt(argc, argv, "A:b:C:c:D:dFf:H:hk:L:l:M:mNP:p:Ss:T:vZ"))
+           != EOF) {
         switch (option) {
+        case 'A':
+            if (!network_contains(optarg, NULL))
+                die("invalid network %s", optarg);
+            vector_add(options.allow, optarg);
+            break;
         case 'b':
             vector_add(options.bindaddrs, optarg);
             break;
+        case 'C':
+            options.cache_path = optarg;
+            break;
+        case 'c':
+            tmp_conns = strtol(optarg, &end, 10);
+            if (*end != '\0' || tmp_conns < 1)
+                die("invalid connection limit %s", optarg);
+            options.max_conns = (unsigned long) tmp_conns;
+            break;
+        case 'D':
+            if (!network_contains(optarg, NULL))
+                die("invalid network %s", optarg);
+            vector_add(options.deny, optarg);
+            break;
         case 'd':
             options.debug = true;
             break;
@@ -551,15 +787,36 @@ main(int argc, char *argv[])
         case 'f':
             options.config_path = optarg;
             break;
+        case 'H':
+            options.handoff_path = optarg;
+            break;
         case 'h':
             usage(0);
         case 'k':
             if (setenv("KRB5_KTNAME", optarg, 1) < 0)
                 sysdie("cannot set KRB5_KTNAME");
             break;
+        case 'L':
+#ifndef HAVE_GETLOADAVG
+            die("-L is not supported on this platform");
+#endif
+            tmp_load = strtod(optarg, &end);
+            if (*end != '\0' || end == optarg || tmp_load <= 0)
+                die("invalid load limit %s", optarg);
+            options.max_load = tmp_load;
+            break;
+        case 'l':
+            options.log_path = optarg;
+            break;
+        case 'M':
+            options.metrics_path = optarg;
+            break;
         case 'm':
             options.standalone = true;
             break;
+        case 'N':
+            options.no_lookups = true;
+            break;
         case 'P':
             options.pid_path = optarg;
             break;
@@ -575,6 +832,12 @@ main(int argc, char *argv[])
         case 's':
             options.service = optarg;
             break;
+        case 'T':
+            tmp_threshold = strtol(optarg, &end, 10);
+            if (*end != '\0' || end == optarg || tmp_threshold < 0)
+                die("invalid slow command threshold %s", optarg);
+            options.slow_threshold = tmp_threshold;
+            break;
         case 'v':
             printf("remctld %s\n", PACKAGE_VERSION);
             exit(0);
@@ -591,6 +854,18 @@ main(int argc, char *argv[])
         die("-b only makes sense in combination with -m");
     if (options.suspend && !options.standalone)
         die("-Z only makes sense in combination with -m");
+    if ((options.allow->count > 0 || options.deny->count > 0)
+        && !options.standalone)
+        die("-A and -D only make sense in combination with -m");
+    if (options.max_conns > 0 && !options.standalone)
+        die("-c only makes sense in combination with -m");
+    if (options.max_load > 0 && !options.standalone)
+        die("-L only makes sense in combination with -m");
+    if (options.metrics_path != NULL && !options.standalone
+        && options.cache_path == NULL)
+        die("-M only makes sense in combination with -m or -C");
+    if (options.log_path != NULL && !options.standalone)
+        die("-l only makes sense in combination with -m");
 
     /* Daemonize if told to do so. */
     if (options.standalone && !options.foreground)
@@ -613,10 +888,56 @@ main(int argc, char *argv[])
             message_handlers_debug(1, message_log_syslog_debug);
     }
 
+    /*
+     * If asked to, queue all non-fatal messages to a separate process so that
+     * logging never waits on the destination.  This overrides -S for those
+     * messages.
+     */
+    if (options.log_path != NULL)
+        if (!server_logqueue_start(options.log_path, options.debug))
+            die("cannot start log writer");
+
+    /*
+     * When run from inetd with -H, first try to pass the connection to a
+     * running remctld, which saves loading the configuration and acquiring
+     * credentials.  If that fails, handle the connection ourselves.
+     */
+    if (options.handoff_path != NULL && !options.standalone)
+        if (server_handoff_send(options.handoff_path, STDIN_FILENO)) {
+            vector_free(options.bindaddrs);
+            vector_free(options.allow);
+            vector_free(options.deny);
+            message_handlers_reset();
+            return 0;
+        }
+
+    /* Set up the result cache if requested. */
+    if (options.cache_path != NULL)
+        if (!server_cache_set_directory(options.cache_path))
+            die("cannot use cache directory %s", options.cache_path);
+
     /* Read the configuration file. */
     config = server_config_load(options.config_path);
     if (config == NULL)
         die("cannot read configuration file %s", options.config_path);
+    server_cache_check(config);
+    if (!server_limits_setup(config, options.cache_path))
+        warn("running commands without limits");
+    if (!server_hosts_setup(options.cache_path, !options.no_lookups))
+        warn("looking up client hostnames without caching");
+    server_timing_setup(options.slow_threshold);
+
+    /*
+     * Metrics and the scoreboard are shared through the cache directory or by
+     * the children of a daemon.  Otherwise, each process would only see its
+     * own connection.
+     */
+    if (options.standalone || options.cache_path != NULL) {
+        if (!server_metrics_setup(options.cache_path))
+            warn("running without metrics");
+        if (!server_scoreboard_setup(options.cache_path))
+            warn("running without a scoreboard");
+    }
 
     /*
      * If a service was specified, we should load only those credentials since
@@ -633,16 +954,24 @@ main(int argc, char *argv[])
      * Otherwise, create a socket and listen on the socket, processing each
      * incoming connection.
      */
-    if (!options.standalone)
+    if (!options.standalone) {
         handle_connection(STDIN_FILENO, config, creds);
-    else
+        server_metrics_export(options.metrics_path);
+    } else {
         server_daemon(&options, config, creds);
+    }
 
     /* Clean up and exit. */
     server_config_free(config);
+    server_limits_free();
+    server_hosts_free();
+    server_metrics_free();
+    server_scoreboard_free();
     if (creds != GSS_C_NO_CREDENTIAL)
         gss_release_cred(&minor, &creds);
     vector_free(options.bindaddrs);
+    vector_free(options.allow);
+    vector_free(options.deny);
     libevent_global_shutdown();
     message_handlers_reset();
     return 0;
@@ -0,0 +1,445 @@
+/*
+ * Scoreboard of remctld processes.
+ *
+ * Each remctld process handling a connection claims a slot in a scoreboard
+ * shared by all remctld processes and records in it what it's doing: the
+ * client's address and principal, whether it's negotiating the GSS-API
+ * context, waiting for the next command, running a command, or sending the
+ * rest of a command's output, when the connection and the current state
+ * started, the last command run, and the bytes received and sent.  The
+ * scoreboard can be retrieved with a command whose rule sets
+ * builtin=scoreboard to find stuck or busy commands.
+ *
+ * The scoreboard is kept in a file mapped into memory in the same way as the
+ * limits table (see limits.c): an unlinked temporary file inherited by the
+ * children of a daemon, or a file in the cache directory shared by processes
+ * started by inetd.  It's only locked while claiming a slot.  Each slot is
+ * only written by the process that claimed it, so readers may see a slot
+ * partway through an update but never a slot of another process.  Slots of
+ * processes that died without releasing them are recognized by checking
+ * whether the process still exists and are reused.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/buffer.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Identifies a scoreboard and the version of its format. */
+#define SCOREBOARD_MAGIC "remctl scoreboard 1\n"
+
+/*
+ * The number of slots in the scoreboard.  Processes that can't find a free
+ * slot aren't shown.
+ */
+#define SCOREBOARD_SLOTS 1024
+
+/* The longest principal and command or subcommand kept, including the nul. */
+#define SCOREBOARD_USER_MAX 256
+#define SCOREBOARD_NAME_MAX 64
+
+/* The names of the states, as shown in the scoreboard. */
+static const char *const state_names[WORKER_MAX] = {
+    "handshake", "idle", "running", "sending"
+};
+
+/* The scoreboard slot for one process. */
+struct worker {
+    pid_t pid;                  /* Process using the slot, 0 if unused. */
+    enum worker_state state;    /* What the process is doing. */
+    time_t connected;           /* When the connection was accepted. */
+    time_t changed;             /* When the process entered its state. */
+    unsigned long commands;     /* Commands received on the connection. */
+    uint64_t bytes_in;          /* Bytes of arguments received. */
+    uint64_t bytes_out;         /* Bytes of output sent. */
+    char address[INET6_ADDRSTRLEN];
+    char user[SCOREBOARD_USER_MAX];
+    char command[SCOREBOARD_NAME_MAX];
+    char subcommand[SCOREBOARD_NAME_MAX];
+};
+
+/* The layout of the shared scoreboard. */
+struct scoreboard {
+    char magic[sizeof(SCOREBOARD_MAGIC)];
+    struct worker workers[SCOREBOARD_SLOTS];
+};
+
+/* The file descriptor and mapping of the scoreboard, if set up. */
+static int table_fd = -1;
+static struct scoreboard *table = NULL;
+
+/* The slot of this process, if it has one. */
+static struct worker *self = NULL;
+
+
+/*
+ * Lock or unlock the scoreboard, waiting for the lock if necessary.  Takes
+ * the type of lock, which is F_WRLCK or F_UNLCK.  Returns true on success and
+ * false on failure, reporting an error message.
+ */
+static bool
+table_lock(short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    while (fcntl(table_fd, F_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            syswarn("cannot lock scoreboard");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Open the file for the scoreboard.  If a directory is given, the scoreboard
+ * is kept in a file named scoreboard.state in that directory; otherwise, an
+ * unlinked temporary file is used.  Returns the file descriptor or -1 on
+ * failure, reporting an error message.
+ */
+static int
+table_open(const char *dir)
+{
+    char *path;
+    const char *tmpdir;
+    int fd;
+
+    if (dir != NULL) {
+        xasprintf(&path, "%s/scoreboard.state", dir);
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            syswarn("cannot open scoreboard %s", path);
+    } else {
+        tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL)
+            tmpdir = "/tmp";
+        xasprintf(&path, "%s/remctld-scoreboard-XXXXXX", tmpdir);
+        fd = mkstemp(path);
+        if (fd < 0)
+            syswarn("cannot create scoreboard %s", path);
+        else
+            unlink(path);
+    }
+    free(path);
+    if (fd >= 0)
+        fdflag_close_exec(fd, true);
+    return fd;
+}
+
+
+/*
+ * Set up the shared scoreboard if it hasn't already been set up, which has to
+ * be done before the processes that will share it are forked.  Takes the
+ * cache directory, which may be NULL.  Returns true on success and false on
+ * failure, reporting an error message.  On failure, nothing is recorded.
+ */
+bool
+server_scoreboard_setup(const char *dir)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (table != NULL)
+        return true;
+    fd = table_open(dir);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat scoreboard");
+        goto fail;
+    }
+    if ((size_t) st.st_size < sizeof(struct scoreboard))
+        if (ftruncate(fd, sizeof(struct scoreboard)) < 0) {
+            syswarn("cannot size scoreboard");
+            goto fail;
+        }
+    map = mmap(NULL, sizeof(struct scoreboard), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syswarn("cannot map scoreboard");
+        goto fail;
+    }
+    table_fd = fd;
+    table = map;
+
+    /* Start with an empty scoreboard if it's new or in some other format. */
+    if (!table_lock(F_WRLCK)) {
+        server_scoreboard_free();
+        return false;
+    }
+    if (memcmp(table->magic, SCOREBOARD_MAGIC, sizeof(SCOREBOARD_MAGIC))
+        != 0) {
+        memset(table, 0, sizeof(struct scoreboard));
+        memcpy(table->magic, SCOREBOARD_MAGIC, sizeof(SCOREBOARD_MAGIC));
+    }
+    table_lock(F_UNLCK);
+    return true;
+
+ fail:
+    close(fd);
+    return false;
+}
+
+
+/*
+ * Release the scoreboard, giving up the slot of this process if it has one.
+ */
+void
+server_scoreboard_free(void)
+{
+    server_scoreboard_disconnect();
+    if (table != NULL)
+        munmap((void *) table, sizeof(struct scoreboard));
+    if (table_fd >= 0)
+        close(table_fd);
+    table = NULL;
+    table_fd = -1;
+}
+
+
+/*
+ * Return whether a slot belongs to a running process.
+ */
+static bool
+worker_alive(const struct worker *worker)
+{
+    if (worker->pid == 0)
+        return false;
+    return kill(worker->pid, 0) == 0 || errno != ESRCH;
+}
+
+
+/*
+ * Copy a string into a fixed-size field of a slot, truncating it if needed.
+ */
+static void
+field_set(char *field, size_t size, const char *value, size_t length)
+{
+    if (length >= size)
+        length = size - 1;
+    memcpy(field, value, length);
+    field[length] = '\0';
+}
+
+
+/*
+ * Change the state of this process.
+ */
+void
+server_scoreboard_state(enum worker_state state)
+{
+    if (self == NULL)
+        return;
+    self->state = state;
+    self->changed = time(NULL);
+}
+
+
+/*
+ * Claim a slot for this process when it accepts a connection from the given
+ * address.  The process starts in the handshake state.
+ */
+void
+server_scoreboard_connect(const char *address)
+{
+    struct worker *worker;
+    size_t i;
+
+    if (table == NULL || self != NULL)
+        return;
+    if (!table_lock(F_WRLCK))
+        return;
+    for (i = 0; i < SCOREBOARD_SLOTS; i++) {
+        worker = &table->workers[i];
+        if (!worker_alive(worker)) {
+            memset(worker, 0, sizeof(*worker));
+            worker->pid = getpid();
+            self = worker;
+            break;
+        }
+    }
+    table_lock(F_UNLCK);
+    if (self == NULL) {
+        debug("no free scoreboard slot");
+        return;
+    }
+    field_set(self->address, sizeof(self->address), address,
+              strlen(address));
+    self->connected = time(NULL);
+    server_scoreboard_state(WORKER_HANDSHAKE);
+}
+
+
+/*
+ * Record the authenticated principal of the client once the GSS-API context
+ * has been established.  The process then waits for a command.
+ */
+void
+server_scoreboard_user(const char *user)
+{
+    if (self == NULL)
+        return;
+    field_set(self->user, sizeof(self->user), user, strlen(user));
+    server_scoreboard_state(WORKER_IDLE);
+}
+
+
+/*
+ * Record that a command has been received, given its arguments.  The command
+ * and subcommand may contain anything except nuls, so they're recorded as
+ * given and cleaned up when the scoreboard is formatted.
+ */
+void
+server_scoreboard_command(struct iovec **argv)
+{
+    size_t i;
+    uint64_t length = 0;
+
+    if (self == NULL)
+        return;
+    self->command[0] = '\0';
+    self->subcommand[0] = '\0';
+    if (argv[0] != NULL) {
+        field_set(self->command, sizeof(self->command), argv[0]->iov_base,
+                  argv[0]->iov_len);
+        if (argv[1] != NULL)
+            field_set(self->subcommand, sizeof(self->subcommand),
+                      argv[1]->iov_base, argv[1]->iov_len);
+    }
+    for (i = 0; argv[i] != NULL; i++)
+        length += argv[i]->iov_len;
+    self->commands++;
+    self->bytes_in += length;
+    server_scoreboard_state(WORKER_RUNNING);
+}
+
+
+/*
+ * Record that output was sent to the client.
+ */
+void
+server_scoreboard_output(size_t length)
+{
+    if (self != NULL)
+        self->bytes_out += length;
+}
+
+
+/*
+ * Give up the slot of this process when it's done with its connection.
+ */
+void
+server_scoreboard_disconnect(void)
+{
+    if (self == NULL)
+        return;
+    self->pid = 0;
+    self = NULL;
+}
+
+
+/*
+ * Append a string from a slot to a buffer, replacing whitespace and
+ * unprintable characters with periods so that each process stays on one line
+ * with space-separated fields.  Empty strings are shown as a dash.
+ */
+static void
+append_field(struct buffer *output, const char *field)
+{
+    const char *p;
+
+    buffer_append(output, " ", 1);
+    if (*field == '\0') {
+        buffer_append(output, "-", 1);
+        return;
+    }
+    for (p = field; *p != '\0'; p++)
+        if (isgraph((unsigned char) *p))
+            buffer_append(output, p, 1);
+        else
+            buffer_append(output, ".", 1);
+}
+
+
+/*
+ * Format the scoreboard into the provided buffer.  The first line counts the
+ * processes in each state, followed by a header and one line for each
+ * process with a connection.
+ */
+void
+server_scoreboard_format(struct buffer *output)
+{
+    struct worker worker;
+    struct buffer *lines;
+    unsigned long counts[WORKER_MAX];
+    time_t now;
+    size_t i;
+    int state;
+
+    if (table == NULL)
+        return;
+    memset(counts, 0, sizeof(counts));
+    now = time(NULL);
+    lines = buffer_new();
+    for (i = 0; i < SCOREBOARD_SLOTS; i++) {
+        memcpy(&worker, &table->workers[i], sizeof(worker));
+        if (!worker_alive(&worker))
+            continue;
+        state = (int) worker.state;
+        if (state < 0 || state >= WORKER_MAX)
+            continue;
+        worker.address[sizeof(worker.address) - 1] = '\0';
+        worker.user[sizeof(worker.user) - 1] = '\0';
+        worker.command[sizeof(worker.command) - 1] = '\0';
+        worker.subcommand[sizeof(worker.subcommand) - 1] = '\0';
+        counts[state]++;
+        buffer_append_sprintf(lines, "%-7lu %-9s %7ld %7ld %8lu %10llu"
+                              " %10llu", (unsigned long) worker.pid,
+                              state_names[state],
+                              (long) (now - worker.connected),
+                              (long) (now - worker.changed), worker.commands,
+                              (unsigned long long) worker.bytes_in,
+                              (unsigned long long) worker.bytes_out);
+        append_field(lines, worker.address);
+        append_field(lines, worker.user);
+        append_field(lines, worker.command);
+        if (worker.subcommand[0] != '\0')
+            append_field(lines, worker.subcommand);
+        buffer_append(lines, "\n", 1);
+    }
+    buffer_append_sprintf(output, "%lu handshake, %lu idle, %lu running,"
+                          " %lu sending\n", counts[WORKER_HANDSHAKE],
+                          counts[WORKER_IDLE], counts[WORKER_RUNNING],
+                          counts[WORKER_SENDING]);
+    buffer_append_sprintf(output, "%-7s %-9s %7s %7s %8s %10s %10s %s\n",
+                          "PID", "STATE", "CONN", "SECS", "COMMANDS", "IN",
+                          "OUT", "CLIENT USER COMMAND");
+    buffer_append(output, lines->data + lines->used, lines->left);
+    buffer_free(lines);
+}
@@ -14,7 +14,6 @@
  
 #include <config.h>
 #include <portable/event.h>
-#include <portable/socket.h>
 #include <portable/system.h>
 
 #include <ctype.h>
@@ -156,9 +155,12 @@ handle_output(struct bufferevent *bev, void *data)
     struct process *process = data;
     struct client *client = process->client;
 
+    server_timing_end(TIMING_FIRST_OUTPUT);
     process->saw_output = true;
     fd = (bev == process->inout) ? client->fd : client->stderr_fd;
     buf = bufferevent_get_input(bev);
+    server_metrics_output(evbuffer_get_length(buf));
+    server_scoreboard_output(evbuffer_get_length(buf));
     if (evbuffer_write(buf, fd) < 0) {
         syswarn("error sending output");
         client->fatal = true;
@@ -190,14 +192,26 @@ command_setup(struct process *process)
 
 
 /*
- * Handle the end of the command.  For the ssh protocol, we do nothing, since
- * the main program will collect the exit status and exit with the appropriate
- * status in order to communicate it back to the caller.
+ * Handle the end of the command.  For the ssh protocol, we only send the
+ * output of commands answered by remctl-shell itself, since the output of
+ * programs has already been sent as it was produced.  The main program will
+ * collect the exit status and exit with the appropriate status in order to
+ * communicate it back to the caller.
  */
 static bool
-command_finish(struct client *client UNUSED, struct evbuffer *output UNUSED,
+command_finish(struct client *client, struct evbuffer *output,
                int exit_status UNUSED)
 {
+    if (output == NULL)
+        return true;
+    server_metrics_output(evbuffer_get_length(output));
+    server_scoreboard_output(evbuffer_get_length(output));
+    while (evbuffer_get_length(output) > 0)
+        if (evbuffer_write(output, client->fd) < 0) {
+            syswarn("error sending output");
+            client->fatal = true;
+            return false;
+        }
     return true;
 }
 
@@ -237,10 +251,6 @@ server_ssh_new_client(const char *user)
     struct client *client;
     const char *ssh_client;
     struct vector *client_info;
-    struct addrinfo hints;
-    struct addrinfo *result;
-    char *buffer;
-    int status;
 
     /* Parse client identity from ssh environment variables. */
     if (user == NULL)
@@ -260,22 +270,6 @@ server_ssh_new_client(const char *user)
     client->protocol = 3;
     client->user = xstrdup(user);
 
-    /* Get the remote hostname. */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    status = getaddrinfo(client->ipaddress, NULL, &hints, &result);
-    if (status == 0) {
-        buffer = xmalloc(NI_MAXHOST);
-        status = getnameinfo(result->ai_addr, result->ai_addrlen, buffer,
-                             NI_MAXHOST, NULL, 0, NI_NAMEREQD);
-        if (status == 0)
-            client->hostname = buffer;
-        else
-            free(buffer);
-        freeaddrinfo(result);
-    }
-
     /* Add ssh protocol callbacks. */
     client->setup = command_setup;
     client->finish = command_finish;
@@ -131,7 +131,9 @@ server_v1_send_output(struct client *client, struct evbuffer *output,
     p += 4;
     if (evbuffer_remove(output, p, outlen) < 0)
         die("internal error: cannot move data from output buffer");
-    
+    server_metrics_output(outlen);
+    server_scoreboard_output(outlen);
+
     /* Send the token. */
     status = token_send_priv(client->fd, client->context, TOKEN_DATA, &token,
                              TIMEOUT, &major, &minor);
@@ -182,8 +184,9 @@ server_v1_handle_messages(struct client *client, struct config *config)
     int status, flags;
 
     /* Receive the message. */
-    status = token_recv_priv(client->fd, client->context, &flags, &token,
-                             TOKEN_MAX_LENGTH, TIMEOUT, &major, &minor);
+    status = token_reader_recv_priv(client->reader, client->context, &flags,
+                                    &token, TOKEN_MAX_LENGTH, TIMEOUT, NULL,
+                                    &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("receiving command token", status, major, minor);
         if (status == TOKEN_FAIL_LARGE)
@@ -21,6 +21,8 @@
 #include <portable/uio.h>
 
 #include <server/internal.h>
+#include <util/compress.h>
+#include <util/fdflag.h>
 #include <util/gss-tokens.h>
 #include <util/macros.h>
 #include <util/messages.h>
@@ -28,14 +30,112 @@
 
 
 /*
- * Given the client struct and the stream number the data is from, send a
+ * Given the client struct and a token, wrap it and append it, with the token
+ * framing, to the queue of data to write to the client while a command is
+ * running.  The token is encrypted unless integrity is true.  Returns
+ * TOKEN_OK on success or TOKEN_FAIL_GSSAPI on failure, with the GSS-API
+ * status in major and minor.
+ */
+static enum token_status
+server_v2_queue_token(struct client *client, gss_buffer_t token,
+                      bool integrity, OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_buffer_desc wrapped;
+    char header[TOKEN_HEADER_SIZE];
+    OM_uint32 length;
+    int state;
+
+    *major = gss_wrap(minor, client->context, integrity ? 0 : 1,
+                      GSS_C_QOP_DEFAULT, token, &state, &wrapped);
+    if (*major != GSS_S_COMPLETE)
+        return TOKEN_FAIL_GSSAPI;
+    header[0] = TOKEN_DATA | TOKEN_PROTOCOL;
+    length = htonl((OM_uint32) wrapped.length);
+    memcpy(header + 1, &length, sizeof(length));
+    if (bufferevent_write(client->queue, header, sizeof(header)) < 0)
+        die("internal error: cannot queue token for client");
+    if (bufferevent_write(client->queue, wrapped.value, wrapped.length) < 0)
+        die("internal error: cannot queue token for client");
+    gss_release_buffer(minor, &wrapped);
+    return TOKEN_OK;
+}
+
+
+/*
+ * Send a token to the client.  While a command is running, tokens are added
+ * to the queue and written by the event loop; otherwise, they're written
+ * directly.  The token is encrypted unless integrity is true.  Returns the
+ * same status codes as token_send_priv.
+ */
+static enum token_status
+server_v2_send_token(struct client *client, gss_buffer_t token,
+                     bool integrity, OM_uint32 *major, OM_uint32 *minor)
+{
+    if (client->queue != NULL)
+        return server_v2_queue_token(client, token, integrity, major, minor);
+    else if (integrity)
+        return token_send_integ(client->fd, client->context,
+                                TOKEN_DATA | TOKEN_PROTOCOL, token, TIMEOUT,
+                                major, minor);
+    else
+        return token_send_priv(client->fd, client->context,
+                               TOKEN_DATA | TOKEN_PROTOCOL, token, TIMEOUT,
+                               major, minor);
+}
+
+
+/*
+ * Given the client struct and a token we're about to send, try to compress
+ * it.  If compression makes it smaller, replace the token with a
+ * MESSAGE_COMPRESSED message holding the compressed data, freeing the
+ * original.  Otherwise, leave the token alone.
+ */
+static void
+server_v4_compress_token(struct client *client, gss_buffer_t token)
+{
+    struct iovec iov;
+    char *buffer;
+    size_t length;
+    OM_uint32 tmp;
+
+    /* Only use the result if it saves at least one octet. */
+    iov.iov_base = token->value;
+    iov.iov_len = token->length;
+    length = token->length - COMPRESSION_HEADER_SIZE - 1;
+    buffer = xmalloc(token->length);
+    if (!compressor_compress(client->compressor, &iov, 1,
+                             buffer + COMPRESSION_HEADER_SIZE, &length)) {
+        debug("not compressing %lu byte token", (unsigned long) iov.iov_len);
+        free(buffer);
+        return;
+    }
+    buffer[0] = 4;
+    buffer[1] = MESSAGE_COMPRESSED;
+    buffer[2] = (char) compressor_method(client->compressor);
+    tmp = htonl((OM_uint32) token->length);
+    memcpy(buffer + 3, &tmp, 4);
+    length += COMPRESSION_HEADER_SIZE;
+    debug("compressed %lu byte token to %lu bytes (ratio %.2f)",
+          (unsigned long) token->length, (unsigned long) length,
+          (double) token->length / (double) length);
+    free(token->value);
+    token->value = buffer;
+    token->length = length;
+}
+
+
+/*
+ * Given the client struct, the stream number the data is from, and whether
+ * the command's output may be sent with integrity protection only, send a
  * protocol v2 output token to the client containing the data stored in the
- * buffer in the client struct.  Returns true on success, false on failure
- * (and logs a message on failure).
+ * buffer in the client struct.  Output is only sent without encryption if the
+ * client also agreed to that.  The output is also saved if the result cache
+ * is recording it.  Returns true on success, false on failure (and logs a
+ * message on failure).
  */
-static bool
+bool
 server_v2_send_output(struct client *client, int stream,
-                      struct evbuffer *output)
+                      struct evbuffer *output, bool integrity)
 {
     gss_buffer_desc token;
     size_t outlen;
@@ -70,12 +170,17 @@ server_v2_send_output(struct client *client, int stream,
     p += 4;
     if (evbuffer_remove(output, p, outlen) < 0)
         die("internal error: cannot move data from output buffer");
+    server_cache_record(client, stream, p, outlen);
+    server_metrics_output(outlen);
+    server_scoreboard_output(outlen);
 
-    /* Send the token. */
+    /* Send the token, compressing it first if that was negotiated. */
     debug("sending OUTPUT token (size=%lu)", (unsigned long) token.length);
-    status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+    if (client->compressor != NULL && token.length >= COMPRESSION_MIN_SIZE)
+        server_v4_compress_token(client, &token);
+    status = server_v2_send_token(client, &token,
+                                  integrity && client->integrity, &major,
+                                  &minor);
     if (status != TOKEN_OK) {
         warn_token("sending output token", status, major, minor);
         free(token.value);
@@ -87,6 +192,157 @@ server_v2_send_output(struct client *client, int stream,
 }
 
 
+/*
+ * Returns the amount of output queued for the client at which we stop adding
+ * more, which is two tokens' worth.
+ */
+static size_t
+queue_limit(const struct client *client)
+{
+    return 2 * TOKEN_MAX_LENGTH_FOR(client->max_data);
+}
+
+
+/*
+ * Check whether too much output is queued for the client and, if so, stop
+ * reading output from the process until the queue drains.  The process will
+ * then block writing its output, so a slow client can't make us use an
+ * unbounded amount of memory.
+ */
+static void
+check_queue(struct process *process)
+{
+    struct client *client = process->client;
+
+    if (client->queue == NULL || process->throttled)
+        return;
+    if (evbuffer_get_length(bufferevent_get_output(client->queue))
+        < queue_limit(client))
+        return;
+    bufferevent_disable(process->inout, EV_READ);
+    bufferevent_disable(process->err, EV_READ);
+    process->throttled = true;
+}
+
+
+/*
+ * Callback when the queue of output for the client has drained below the low
+ * water mark.  If the output is being shared with other clients, send more of
+ * it from the run file.  If we stopped reading output from the process, start
+ * again.
+ */
+static void
+handle_queue_drained(struct bufferevent *bev UNUSED, void *data)
+{
+    struct process *process = data;
+    struct client *client = process->client;
+
+    if (!server_cache_send_shared(client, process->rule,
+                                  queue_limit(client))) {
+        process->saw_error = true;
+        event_base_loopbreak(process->loop);
+        return;
+    }
+    if (!process->throttled)
+        return;
+    bufferevent_enable(process->inout, EV_READ);
+    bufferevent_enable(process->err, EV_READ);
+    process->throttled = false;
+}
+
+
+/*
+ * Callback for errors writing queued output to the client.  There's no point
+ * in continuing, so mark the client as failed and break out of the event
+ * loop.
+ */
+static void
+handle_queue_event(struct bufferevent *bev UNUSED, short events, void *data)
+{
+    struct process *process = data;
+
+    if (events & BEV_EVENT_TIMEOUT)
+        warn("timeout sending output to client");
+    else
+        syswarn("cannot send output to client");
+    process->client->fatal = true;
+    process->saw_error = true;
+    event_base_loopbreak(process->loop);
+}
+
+
+/*
+ * Send a block of output from the process to the client.  If the output of
+ * the command is being shared with other clients running the same command,
+ * it goes to the run file first, and our client is sent as much of the run
+ * file as fits in the queue.  In that case, we never stop reading from the
+ * process, since the run file holds the output our client hasn't seen yet.
+ * Otherwise, send the output directly and stop reading from the process if
+ * the queue for the client is full.  On failure, stop the event loop and
+ * return false.
+ */
+static bool
+send_process_output(struct process *process, int stream,
+                    struct evbuffer *buf)
+{
+    struct client *client = process->client;
+    const struct rule *rule = process->rule;
+    bool okay;
+
+    if (server_cache_share(client, rule, stream, buf))
+        okay = server_cache_send_shared(client, rule, queue_limit(client));
+    else {
+        okay = server_v2_send_output(client, stream, buf, rule->integrity);
+        if (okay)
+            check_queue(process);
+    }
+    if (!okay) {
+        process->saw_error = true;
+        event_base_loopbreak(process->loop);
+    }
+    return okay;
+}
+
+
+/*
+ * Send all of the output from a process that we're holding.  Used when
+ * coalescing output.  Only one stream has held output at a time (see
+ * handle_output), so the order in which we check them doesn't matter.  On
+ * failure, stop the event loop.
+ */
+static void
+send_held_output(struct process *process)
+{
+    struct bufferevent *bevs[2];
+    struct evbuffer *buf;
+    int i;
+
+    bevs[0] = process->inout;
+    bevs[1] = process->err;
+    for (i = 0; i < 2; i++) {
+        buf = bufferevent_get_input(bevs[i]);
+        if (evbuffer_get_length(buf) == 0)
+            continue;
+        if (!send_process_output(process, i + 1, buf))
+            return;
+    }
+}
+
+
+/*
+ * Callback for the timer used when coalescing output, called when we've held
+ * output for as long as we're allowed.  Also triggered by the process loop to
+ * send any remaining output after the process has exited.
+ */
+static void
+handle_flush(evutil_socket_t fd UNUSED, short what UNUSED, void *data)
+{
+    struct process *process = data;
+
+    send_held_output(process);
+}
+
+
 /*
  * Callback used to handle output from a process (protocol version two or
  * later).  We use the same handler for both standard output and standard
@@ -94,41 +350,111 @@ server_v2_send_output(struct client *client, int stream,
  *
  * When called, note that we saw some output, which is a flag to continue
  * processing when running the event loop after the child has exited.
+ *
+ * If the command's output is being coalesced, hold small amounts of output
+ * in the bufferevent until either there is enough to fill a token of the
+ * configured size or the flush timer fires.  This cuts down on the number of
+ * tokens, and thus on GSS-API and system call overhead, for commands that
+ * write output a line at a time.  Output held from the other stream is sent
+ * before holding any output from this one so that the client sees output in
+ * the order in which we read it.
  */
 static void
 handle_output(struct bufferevent *bev, void *data)
 {
     int stream;
-    struct evbuffer *buf;
+    size_t size;
+    long wait;
+    struct evbuffer *buf, *held;
     struct process *process = data;
+    struct timeval delay;
 
+    server_timing_end(TIMING_FIRST_OUTPUT);
     process->saw_output = true;
     stream = (bev == process->inout) ? 1 : 2;
     buf = bufferevent_get_input(bev);
-    if (!server_v2_send_output(process->client, stream, buf)) {
-        process->saw_error = true;
-        event_base_loopbreak(process->loop);
+
+    /* Without coalescing, send everything we have now. */
+    if (process->flush == NULL) {
+        send_process_output(process, stream, buf);
+        return;
+    }
+
+    /* Send any output from the other stream to keep the output in order. */
+    held = bufferevent_get_input(stream == 1 ? process->err : process->inout);
+    if (evbuffer_get_length(held) > 0)
+        if (!send_process_output(process, stream == 1 ? 2 : 1, held))
+            return;
+
+    /* Then wait for more output unless we have enough. */
+    size = process->rule->coalesce;
+    if (size > TOKEN_MAX_OUTPUT_FOR(process->client->max_data))
+        size = TOKEN_MAX_OUTPUT_FOR(process->client->max_data);
+    if (evbuffer_get_length(buf) < size) {
+        if (!event_pending(process->flush, EV_TIMEOUT, NULL)) {
+            wait = process->rule->coalesce_delay;
+            if (wait == 0)
+                wait = COALESCE_DELAY;
+            delay.tv_sec = wait / 1000;
+            delay.tv_usec = (wait % 1000) * 1000;
+            if (event_add(process->flush, &delay) < 0)
+                die("internal error: cannot add output flush event");
+        }
+        return;
     }
+    event_del(process->flush);
+    send_held_output(process);
 }
 
 
 /*
  * Set up handling of a child process with the v2 protocol.  Takes the process
  * struct and sets up the necessary event loop hooks.
+ *
+ * While the command is running, tokens to the client are queued and written
+ * as the client socket becomes writable so that a slow client doesn't block
+ * the event loop.  Once more than two tokens' worth of data is queued, we
+ * stop reading from the process until the queue drains to one token, unless
+ * the output is being shared with other clients through a run file.
  */
 void
 server_v2_command_setup(struct process *process)
 {
     bufferevent_data_cb writecb;
+    struct client *client = process->client;
+    struct timeval timeout = { TIMEOUT, 0 };
 
     writecb = (process->input == NULL) ? NULL : server_handle_input_end;
     bufferevent_setcb(process->inout, handle_output, writecb,
                       server_handle_io_event, process);
-    bufferevent_setwatermark(process->inout, EV_READ, 0, TOKEN_MAX_OUTPUT);
+    bufferevent_setwatermark(process->inout, EV_READ, 0,
+                             TOKEN_MAX_OUTPUT_FOR(process->client->max_data));
     bufferevent_enable(process->err, EV_READ);
     bufferevent_setcb(process->err, handle_output, NULL,
                       server_handle_io_event, process);
-    bufferevent_setwatermark(process->err, EV_READ, 0, TOKEN_MAX_OUTPUT);
+    bufferevent_setwatermark(process->err, EV_READ, 0,
+                             TOKEN_MAX_OUTPUT_FOR(process->client->max_data));
+
+    /* Set up the timer for sending coalesced output if configured. */
+    if (process->rule->coalesce > 0) {
+        process->flush = event_new(process->loop, -1, 0, handle_flush,
+                                   process);
+        if (process->flush == NULL)
+            die("internal error: cannot create output flush event");
+    }
+
+    /* Set up the queue for non-blocking writes to the client. */
+    if (!fdflag_nonblocking(client->fd, true))
+        sysdie("cannot make client socket non-blocking");
+    client->queue = bufferevent_socket_new(process->loop, client->fd, 0);
+    if (client->queue == NULL)
+        die("internal error: cannot create client bufferevent");
+    bufferevent_setcb(client->queue, NULL, handle_queue_drained,
+                      handle_queue_event, process);
+    bufferevent_setwatermark(client->queue, EV_WRITE,
+                             TOKEN_MAX_LENGTH_FOR(client->max_data), 0);
+    bufferevent_set_timeouts(client->queue, NULL, &timeout);
+    bufferevent_enable(client->queue, EV_WRITE);
 }
 
 
@@ -205,9 +531,7 @@ server_v2_send_error(struct client *client, enum error_codes code,
 
     /* Send the token. */
     debug("sending ERROR token (size=%lu)", (unsigned long) token.length);
-    status = token_send_priv(client->fd, client->context,
-                             TOKEN_DATA | TOKEN_PROTOCOL, &token, TIMEOUT,
-                             &major, &minor);
+    status = server_v2_send_token(client, &token, false, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("sending error token", status, major, minor);
         free(token.value);
@@ -236,7 +560,7 @@ server_v2_send_version(struct client *client)
     token.length = 1 + 1 + 1;
     buffer[0] = 2;
     buffer[1] = MESSAGE_VERSION;
-    buffer[2] = 3;
+    buffer[2] = PROTOCOL_VERSION;
     token.value = &buffer;
 
     /* Send the token. */
@@ -286,6 +610,203 @@ server_v3_send_noop(struct client *client)
 }
 
 
+/*
+ * Handle a protocol v4 capabilities message from the client.  The message
+ * contains a count followed by pairs of capability and proposed value, all
+ * four-octet numbers in network byte order.  Reply with the capabilities we
+ * support and the values we agree to, in the same format, and then start
+ * using the agreed values.  Unknown capabilities are left out of the reply.
+ * Returns true on success, false on failure (and logs a message on failure).
+ */
+static bool
+server_v4_handle_capabilities(struct client *client, gss_buffer_t token)
+{
+    gss_buffer_desc reply;
+    const char *p;
+    char *q;
+    size_t count, i, agreed;
+    size_t max_data = client->max_data;
+    unsigned long compression = client->compression;
+    bool integrity = client->integrity;
+    OM_uint32 tmp, capability, value, major, minor;
+    int status;
+
+    /* Parse the message. */
+    if (token->length < 2 + 4) {
+        warn("malformed capabilities token");
+        return client->error(client, ERROR_BAD_TOKEN, "Invalid token");
+    }
+    p = (const char *) token->value + 2;
+    memcpy(&tmp, p, 4);
+    count = ntohl(tmp);
+    p += 4;
+    if (count > CAPABILITY_MAX_COUNT || token->length != 2 + 4 + 8 * count) {
+        warn("malformed capabilities token");
+        return client->error(client, ERROR_BAD_TOKEN, "Invalid token");
+    }
+
+    /* Build the reply as we go. */
+    reply.value = xmalloc(2 + 4 + 8 * count);
+    q = reply.value;
+    q[0] = PROTOCOL_VERSION;
+    q[1] = MESSAGE_CAPABILITIES;
+    q += 2 + 4;
+    agreed = 0;
+    for (i = 0; i < count; i++) {
+        memcpy(&tmp, p, 4);
+        capability = ntohl(tmp);
+        memcpy(&tmp, p + 4, 4);
+        value = ntohl(tmp);
+        p += 8;
+        switch (capability) {
+        case CAPABILITY_MAX_DATA:
+            if (value > TOKEN_MAX_DATA_LIMIT)
+                value = TOKEN_MAX_DATA_LIMIT;
+            else if (value < TOKEN_MAX_DATA)
+                value = TOKEN_MAX_DATA;
+            max_data = value;
+            debug("agreed to maximum token data size %lu",
+                  (unsigned long) value);
+            break;
+        case CAPABILITY_COMPRESSION:
+            value &= (OM_uint32) compress_methods();
+            compression = value;
+            debug("agreed to compression methods %#lx",
+                  (unsigned long) value);
+            break;
+        case CAPABILITY_INTEGRITY:
+            value = (value != 0) ? 1 : 0;
+            integrity = (value != 0);
+            debug("agreed to %s integrity-only output",
+                  integrity ? "send" : "not send");
+            break;
+        default:
+            debug("ignoring unknown capability %lu",
+                  (unsigned long) capability);
+            continue;
+        }
+        tmp = htonl(capability);
+        memcpy(q, &tmp, 4);
+        tmp = htonl(value);
+        memcpy(q + 4, &tmp, 4);
+        q += 8;
+        agreed++;
+    }
+    tmp = htonl((OM_uint32) agreed);
+    memcpy((char *) reply.value + 2, &tmp, 4);
+    reply.length = 2 + 4 + 8 * agreed;
+
+    /* Send the reply and then switch to the agreed values. */
+    debug("sending CAPABILITIES token (count=%lu)", (unsigned long) agreed);
+    status = token_send_priv(client->fd, client->context,
+                             TOKEN_DATA | TOKEN_PROTOCOL, &reply, TIMEOUT,
+                             &major, &minor);
+    free(reply.value);
+    if (status != TOKEN_OK) {
+        warn_token("sending capabilities token", status, major, minor);
+        client->fatal = true;
+        return false;
+    }
+    client->max_data = max_data;
+    client->integrity = integrity;
+    if (compression != client->compression) {
+        client->compression = compression;
+        compressor_free(client->compressor);
+        client->compressor = NULL;
+        if (compression != 0) {
+            client->compressor = compressor_new(compress_choose(compression));
+            if (client->compressor == NULL)
+                warn("cannot create compressor, sending uncompressed output");
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Release a token returned by server_v2_read_token.  Decompressed tokens
+ * point into the reusable buffer in the client struct, so only tokens from
+ * GSS-API are freed.
+ */
+static void
+server_v2_release_token(struct client *client, gss_buffer_t token)
+{
+    OM_uint32 minor;
+
+    if (token->value != NULL && token->value == client->inflate_buffer) {
+        token->value = NULL;
+        token->length = 0;
+    } else {
+        gss_release_buffer(&minor, token);
+    }
+}
+
+
+/*
+ * Given a MESSAGE_COMPRESSED token from the client, decompress it into the
+ * reusable buffer in the client struct and replace the token with the
+ * message it contained.  The decompression state is also kept in the client
+ * struct and reused for each token.  On failure, logs a warning, releases the
+ * token, and returns false.
+ */
+static bool
+server_v4_decompress_token(struct client *client, gss_buffer_t token)
+{
+    const char *p = token->value;
+    OM_uint32 tmp, minor;
+    size_t length;
+    int method;
+
+    /* Check the header. */
+    if (token->length < COMPRESSION_HEADER_SIZE || p[0] < 4) {
+        warn("malformed compressed token");
+        goto fail;
+    }
+    method = (unsigned char) p[2];
+    if (method == 0
+        || compress_choose(client->compression & method) != method) {
+        warn("unexpected compression method %d from client", method);
+        goto fail;
+    }
+    memcpy(&tmp, p + 3, 4);
+    length = ntohl(tmp);
+    if (length < 2 || length > client->max_data) {
+        warn("decompressed token length %lu exceeds %lu",
+             (unsigned long) length, (unsigned long) client->max_data);
+        goto fail;
+    }
+
+    /* Decompress into our buffer, growing it if needed. */
+    if (client->decompressor == NULL) {
+        client->decompressor = decompressor_new();
+        if (client->decompressor == NULL)
+            sysdie("cannot allocate decompression state");
+    }
+    if (client->inflate_size < length) {
+        client->inflate_buffer = xrealloc(client->inflate_buffer, length);
+        client->inflate_size = length;
+    }
+    if (!decompressor_decompress(client->decompressor, method,
+                                 p + COMPRESSION_HEADER_SIZE,
+                                 token->length - COMPRESSION_HEADER_SIZE,
+                                 client->inflate_buffer, length)) {
+        warn("cannot decompress token from client");
+        goto fail;
+    }
+    debug("decompressed %lu byte token to %lu bytes (ratio %.2f)",
+          (unsigned long) token->length, (unsigned long) length,
+          (double) length / (double) token->length);
+    gss_release_buffer(&minor, token);
+    token->value = client->inflate_buffer;
+    token->length = length;
+    return true;
+
+fail:
+    gss_release_buffer(&minor, token);
+    return false;
+}
+
+
 /*
  * Receive a new token from the client, handling reporting of errors.  Takes
  * the client struct and a pointer to storage for the token.  Returns TOKEN_OK
@@ -297,14 +818,24 @@ server_v2_read_token(struct client *client, gss_buffer_t token)
 {
     OM_uint32 major, minor;
     int status, flags;
-    
-    status = token_recv_priv(client->fd, client->context, &flags, token,
-                             TOKEN_MAX_LENGTH, TIMEOUT, &major, &minor);
+    const char *p;
+
+    status = token_reader_recv_priv(client->reader, client->context, &flags,
+                                    token,
+                                    TOKEN_MAX_LENGTH_FOR(client->max_data),
+                                    TIMEOUT, NULL, &major, &minor);
     if (status != TOKEN_OK) {
         warn_token("receiving token", status, major, minor);
         if (status != TOKEN_FAIL_EOF && status != TOKEN_FAIL_SOCKET)
             client->error(client, ERROR_BAD_TOKEN, "Invalid token");
+        return status;
     }
+    p = token->value;
+    if (token->length >= 2 && p[1] == MESSAGE_COMPRESSED)
+        if (!server_v4_decompress_token(client, token)) {
+            client->error(client, ERROR_BAD_TOKEN, "Invalid token");
+            return TOKEN_FAIL_INVALID;
+        }
     return status;
 }
 
@@ -331,7 +862,7 @@ server_v2_read_continuation(struct client *client, gss_buffer_t token)
         return false;
     }
     p = token->value;
-    if (p[0] != 2 && p[0] != 3) {
+    if (p[0] < 2 || p[0] > PROTOCOL_VERSION) {
         server_v2_send_version(client);
         return false;
     } else if (p[1] == MESSAGE_QUIT) {
@@ -360,7 +891,6 @@ server_v2_handle_command(struct client *client, struct config *config,
     char *p;
     size_t length, total;
     char *buffer = NULL;
-    OM_uint32 minor;
     struct iovec **argv = NULL;
     bool result = false;
     bool allocated = false;
@@ -378,9 +908,10 @@ server_v2_handle_command(struct client *client, struct config *config,
         client->keepalive = p[2] ? true : false;
 
         /* Check the data size. */
-        if (token->length > TOKEN_MAX_DATA) {
-            warn("command data length %lu exceeds 64KB",
-                 (unsigned long) token->length);
+        if (token->length > client->max_data) {
+            warn("command data length %lu exceeds %lu",
+                 (unsigned long) token->length,
+                 (unsigned long) client->max_data);
             result = client->error(client, ERROR_TOOMUCH_DATA,
                                    "Too much data");
             goto fail;
@@ -425,7 +956,7 @@ server_v2_handle_command(struct client *client, struct config *config,
          * token as the complete buffer.
          */
         if (continued) {
-            gss_release_buffer(&minor, token);
+            server_v2_release_token(client, token);
             if (!server_v2_read_continuation(client, token))
                 goto fail;
         } else if (buffer == NULL) {
@@ -470,7 +1001,7 @@ server_v2_handle_token(struct client *client, struct config *config,
     bool result = true;
 
     p = token->value;
-    if (p[0] != 2 && p[0] != 3)
+    if (p[0] < 2 || p[0] > PROTOCOL_VERSION)
         return server_v2_send_version(client);
     switch (p[1]) {
     case MESSAGE_COMMAND:
@@ -480,6 +1011,15 @@ server_v2_handle_token(struct client *client, struct config *config,
         debug("replying to no-op message");
         result = server_v3_send_noop(client);
         break;
+    case MESSAGE_CAPABILITIES:
+        if (p[0] < 4) {
+            warn("capabilities message with protocol version %d", (int) p[0]);
+            result = client->error(client, ERROR_UNKNOWN_MESSAGE,
+                                   "Unknown message");
+            break;
+        }
+        result = server_v4_handle_capabilities(client, token);
+        break;
     case MESSAGE_QUIT:
         debug("quit received, closing connection");
         client->keepalive = false;
@@ -505,7 +1045,6 @@ void
 server_v2_handle_messages(struct client *client, struct config *config)
 {
     gss_buffer_desc token;
-    OM_uint32 minor;
     int status;
 
     /* Loop receiving messages until we're finished. */
@@ -515,9 +1054,9 @@ server_v2_handle_messages(struct client *client, struct config *config)
         if (status != TOKEN_OK)
             break;
         if (!server_v2_handle_token(client, config, &token)) {
-            gss_release_buffer(&minor, &token);
+            server_v2_release_token(client, &token);
             break;
         }
-        gss_release_buffer(&minor, &token);
+        server_v2_release_token(client, &token);
     } while (client->keepalive);
 }
@@ -0,0 +1,216 @@
+/*
+ * Per-command timing and tracing for remctld.
+ *
+ * The time taken by a command is broken down into phases: accepting the
+ * GSS-API context of the connection, looking up the client's hostname,
+ * finding the configuration rule, checking the ACLs, forking the command,
+ * waiting for its first output, running it, and draining its remaining
+ * output to the client after it exits.  A command can go through a phase
+ * more than once (the summary command checks every ACL and runs several
+ * programs), in which case the times are added together.  The GSS-API
+ * context is only accepted once per connection, so its time is reported
+ * with every command on that connection.
+ *
+ * If a command takes at least as long as the threshold set with -T, the time
+ * spent in each phase that it went through is logged in a single line of
+ * key=value pairs.  If <sys/sdt.h> was found at build time, static probes
+ * for perf, bpftrace, and SystemTap also mark the start and end of each
+ * phase and command.  These cost a single no-op instruction unless traced.
+ *
+ * Each remctld process handles only one connection, so the timing of the
+ * current command is kept in static variables.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+#endif
+
+#include <server/internal.h>
+#include <util/buffer.h>
+#include <util/messages.h>
+
+/*
+ * The static probes, all with the provider remctld.  Without <sys/sdt.h>,
+ * they compile to nothing.
+ */
+#ifdef HAVE_SYS_SDT_H
+# define PROBE0(name)             DTRACE_PROBE(remctld, name)
+# define PROBE1(name, a)          DTRACE_PROBE1(remctld, name, a)
+# define PROBE2(name, a, b)       DTRACE_PROBE2(remctld, name, a, b)
+# define PROBE4(name, a, b, c, d) DTRACE_PROBE4(remctld, name, a, b, c, d)
+#else
+# define PROBE0(name)             /* empty */
+# define PROBE1(name, a)          /* empty */
+# define PROBE2(name, a, b)       /* empty */
+# define PROBE4(name, a, b, c, d) /* empty */
+#endif
+
+/* The names of the phases, used as log keys and as probe arguments. */
+static const char *const phase_names[TIMING_MAX] = {
+    "gss", "dns", "config", "acl", "spawn", "first-output", "run", "drain"
+};
+
+/* The state of one phase for the current command. */
+struct phase {
+    struct timeval start;       /* When the phase was last entered. */
+    uint64_t usec;              /* Total microseconds spent in the phase. */
+    bool running;               /* Whether the phase has been entered. */
+    bool seen;                  /* Whether the phase has ever ended. */
+};
+
+/* The phases of the current command and when the command started. */
+static struct phase phases[TIMING_MAX];
+static struct timeval command_start;
+
+/* Log commands that take at least this many milliseconds, if not -1. */
+static long slow_threshold = -1;
+
+
+/*
+ * Return the number of microseconds since the given time, or 0 if the clock
+ * went backwards.
+ */
+static uint64_t
+elapsed(const struct timeval *start)
+{
+    struct timeval now;
+    int64_t usec;
+
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
+    usec = ((int64_t) now.tv_sec - (int64_t) start->tv_sec) * 1000000
+           + ((int64_t) now.tv_usec - (int64_t) start->tv_usec);
+    return (usec < 0) ? 0 : (uint64_t) usec;
+}
+
+
+/*
+ * Append a time in microseconds to a buffer as key=value, with the value in
+ * milliseconds.
+ */
+static void
+append_time(struct buffer *line, const char *key, uint64_t usec)
+{
+    unsigned long msec, frac;
+
+    msec = (unsigned long) (usec / 1000);
+    frac = (unsigned long) (usec % 1000);
+    buffer_append_sprintf(line, " %s=%lu.%03lums", key, msec, frac);
+}
+
+
+/*
+ * Set the threshold in milliseconds at or above which the timing of a command
+ * is logged.  -1 turns logging off, and 0 logs every command.
+ */
+void
+server_timing_setup(long threshold)
+{
+    slow_threshold = threshold;
+}
+
+
+/*
+ * Start timing a new connection, forgetting the GSS-API time of any previous
+ * one.
+ */
+void
+server_timing_connect(void)
+{
+    memset(&phases[TIMING_GSS], 0, sizeof(phases[TIMING_GSS]));
+}
+
+
+/*
+ * Start timing a new command, clearing all phases except the GSS-API context
+ * negotiation, which belongs to the connection.
+ */
+void
+server_timing_start(void)
+{
+    size_t i;
+
+    for (i = 0; i < TIMING_MAX; i++)
+        if (i != TIMING_GSS)
+            memset(&phases[i], 0, sizeof(phases[i]));
+    gettimeofday(&command_start, NULL);
+    PROBE0(command_start);
+}
+
+
+/*
+ * Enter a phase.  Entering a phase that's already running starts it over.
+ */
+void
+server_timing_begin(enum timing_phase phase)
+{
+    if (gettimeofday(&phases[phase].start, NULL) < 0)
+        return;
+    phases[phase].running = true;
+    PROBE1(phase_start, phase_names[phase]);
+}
+
+
+/*
+ * Leave a phase, adding the time since it was entered to its total.  Does
+ * nothing if the phase isn't running, so this can be called every time the
+ * event that ends a phase may have happened.
+ */
+void
+server_timing_end(enum timing_phase phase)
+{
+    uint64_t usec;
+
+    if (!phases[phase].running)
+        return;
+    usec = elapsed(&phases[phase].start);
+    phases[phase].usec += usec;
+    phases[phase].running = false;
+    phases[phase].seen = true;
+    PROBE2(phase_end, phase_names[phase], usec);
+}
+
+
+/*
+ * Finish timing a command.  Takes the client, the command and subcommand
+ * (either of which may be NULL), and the exit status.  If the command took at
+ * least the slow threshold, log the time spent in each phase that it went
+ * through.
+ */
+void
+server_timing_finish(const struct client *client, const char *command,
+                     const char *subcommand, int status)
+{
+    struct buffer *line;
+    uint64_t total;
+    size_t i;
+
+    total = elapsed(&command_start);
+    PROBE4(command_done, command, subcommand, status, total);
+    if (slow_threshold < 0 || command == NULL)
+        return;
+    if (total < (uint64_t) slow_threshold * 1000)
+        return;
+    line = buffer_new();
+    buffer_append_sprintf(line, "slow command: user=%s command=%s",
+                          client->user, command);
+    if (subcommand != NULL)
+        buffer_append_sprintf(line, " subcommand=%s", subcommand);
+    buffer_append_sprintf(line, " status=%d", status);
+    append_time(line, "total", total);
+    for (i = 0; i < TIMING_MAX; i++)
+        if (phases[i].seen)
+            append_time(line, phase_names[i], phases[i].usec);
+    buffer_append(line, "", 1);
+    notice("%s", line->data);
+    buffer_free(line);
+}
@@ -0,0 +1,489 @@
+/*
+ * Microbenchmarks for remctl protocol and authorization code.
+ *
+ * Times the functions on the hot path of every command: parsing the command
+ * token, sending and receiving tokens, splitting configuration lines, finding
+ * the configuration rule for a command, and checking ACLs.  Each is run on
+ * synthetic inputs of several sizes.
+ *
+ * Each benchmark is first run with increasing iteration counts until one run
+ * takes at least the target time, and then run five times with that count.
+ * The results are printed one per line, separated by tabs, with the name and
+ * input size of the benchmark, the number of iterations, and the median and
+ * minimum time per iteration in nanoseconds, so that runs before and after a
+ * change can be compared with standard tools.
+ *
+ * This is not a test and is not run by make check.  Run it with make bench or
+ * directly, with -t to change the target time in milliseconds and with an
+ * optional argument to run only the benchmarks whose names contain it.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <errno.h>
+#include <sys/time.h>
+
+#include <server/internal.h>
+#include <util/buffer.h>
+#include <util/messages.h>
+#include <util/tokens.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* The number of timed runs of each benchmark, of which the median is used. */
+#define BENCH_RUNS 5
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: bench [-h] [-t <ms>] [<filter>]\n\
+\n\
+Options:\n\
+    -h            Display this help\n\
+    -t <ms>       Target time of each timed run (default: 100)\n";
+
+/* The target time of each run in microseconds and the benchmark filter. */
+static uint64_t target = 100 * 1000;
+static const char *filter = NULL;
+
+/* The state for the vector_split_space benchmark. */
+struct split_data {
+    char *line;
+    struct vector *vector;
+};
+
+/* The state for the server_parse_command benchmark. */
+struct parse_data {
+    struct client client;
+    char *token;
+    size_t length;
+};
+
+/* The state for the token benchmarks. */
+struct token_data {
+    socket_type fds[2];
+    gss_buffer_desc token;
+    struct token_reader *reader;
+};
+
+/* The state for the rule lookup and ACL benchmarks. */
+struct config_data {
+    struct config *config;
+    struct rule *rule;
+    struct client client;
+    char *command;
+};
+
+
+/*
+ * Return the current time in microseconds.
+ */
+static uint64_t
+now(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        sysdie("cannot get current time");
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
+
+
+/*
+ * Run a benchmark function the given number of times and return the time
+ * taken in microseconds.
+ */
+static uint64_t
+run(void (*func)(void *), void *data, unsigned long iterations)
+{
+    uint64_t start;
+    unsigned long i;
+
+    start = now();
+    for (i = 0; i < iterations; i++)
+        func(data);
+    return now() - start;
+}
+
+
+/*
+ * Compare two times for qsort.
+ */
+static int
+compare_times(const void *a, const void *b)
+{
+    const double *x = a;
+    const double *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Measure a benchmark and print the results.  Takes the name and input size
+ * of the benchmark, the function to run, and the data to pass to it.
+ */
+static void
+measure(const char *name, size_t size, void (*func)(void *), void *data)
+{
+    unsigned long iterations = 1;
+    uint64_t elapsed;
+    double times[BENCH_RUNS];
+    size_t i;
+
+    if (filter != NULL && strstr(name, filter) == NULL)
+        return;
+
+    /* Find an iteration count that takes at least the target time. */
+    func(data);
+    while ((elapsed = run(func, data, iterations)) < target) {
+        if (elapsed < target / 100)
+            iterations *= 10;
+        else
+            iterations *= 2;
+    }
+
+    /* Do the timed runs and report the median and the minimum. */
+    for (i = 0; i < BENCH_RUNS; i++) {
+        elapsed = run(func, data, iterations);
+        times[i] = (double) elapsed * 1000 / (double) iterations;
+    }
+    qsort(times, BENCH_RUNS, sizeof(double), compare_times);
+    printf("%s\t%lu\t%lu\t%.1f\t%.1f\n", name, (unsigned long) size,
+           iterations, times[BENCH_RUNS / 2], times[0]);
+    fflush(stdout);
+}
+
+
+/*
+ * Split a configuration line with a given number of words.
+ */
+static void
+bench_split(void *data)
+{
+    struct split_data *split = data;
+
+    split->vector = vector_split_space(split->line, split->vector);
+}
+
+static void
+run_split(size_t words)
+{
+    struct split_data split;
+    struct vector *line;
+    size_t i;
+
+    line = vector_new();
+    for (i = 0; i < words; i++)
+        vector_add(line, "princ:user@EXAMPLE.ORG");
+    split.line = vector_join(line, " \t ");
+    split.vector = NULL;
+    vector_free(line);
+    measure("vector_split_space", words, bench_split, &split);
+    vector_free(split.vector);
+    free(split.line);
+}
+
+
+/*
+ * Parse a command token with a given number of arguments of 16 bytes each.
+ */
+static void
+bench_parse(void *data)
+{
+    struct parse_data *parse = data;
+    struct iovec **argv;
+
+    argv = server_parse_command(&parse->client, parse->token, parse->length);
+    if (argv == NULL)
+        die("cannot parse command");
+    server_free_command(argv);
+}
+
+static void
+run_parse(size_t args)
+{
+    struct parse_data parse;
+    uint32_t tmp;
+    char *p;
+    size_t i;
+
+    memset(&parse, 0, sizeof(parse));
+    parse.length = 4 + args * (4 + 16);
+    parse.token = xmalloc(parse.length);
+    tmp = htonl((uint32_t) args);
+    memcpy(parse.token, &tmp, 4);
+    p = parse.token + 4;
+    for (i = 0; i < args; i++) {
+        tmp = htonl(16);
+        memcpy(p, &tmp, 4);
+        memset(p + 4, 'a', 16);
+        p += 4 + 16;
+    }
+    measure("server_parse_command", args, bench_parse, &parse);
+    free(parse.token);
+}
+
+
+/*
+ * Send a token of a given size over a socket pair and receive it, either
+ * with token_recv or with a buffered reader.
+ */
+static void
+bench_token(void *data)
+{
+    struct token_data *tokens = data;
+    gss_buffer_desc result;
+    int flags;
+
+    if (token_send(tokens->fds[0], 1, &tokens->token, 0) != TOKEN_OK)
+        die("cannot send token");
+    if (token_recv(tokens->fds[1], &flags, &result, tokens->token.length, 0)
+        != TOKEN_OK)
+        die("cannot receive token");
+    free(result.value);
+}
+
+static void
+bench_token_reader(void *data)
+{
+    struct token_data *tokens = data;
+    gss_buffer_desc result;
+    int flags;
+
+    if (token_send(tokens->fds[0], 1, &tokens->token, 0) != TOKEN_OK)
+        die("cannot send token");
+    if (token_reader_recv(tokens->reader, &flags, &result,
+                          tokens->token.length, 0)
+        != TOKEN_OK)
+        die("cannot receive token");
+}
+
+static void
+run_token(size_t size)
+{
+    struct token_data tokens;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, tokens.fds) < 0)
+        sysdie("cannot create socket pair");
+    tokens.token.length = size;
+    tokens.token.value = xmalloc(size);
+    memset(tokens.token.value, 'a', size);
+    tokens.reader = token_reader_new(tokens.fds[1]);
+    if (tokens.reader == NULL)
+        sysdie("cannot create token reader");
+    measure("token_send+token_recv", size, bench_token, &tokens);
+    measure("token_send+token_reader_recv", size, bench_token_reader,
+            &tokens);
+    token_reader_free(tokens.reader);
+    free(tokens.token.value);
+    close(tokens.fds[0]);
+    close(tokens.fds[1]);
+}
+
+
+/*
+ * Write a file with the given contents into a new temporary file and return
+ * its name as a newly allocated string.
+ */
+static char *
+write_temp(const char *contents)
+{
+    const char *tmpdir;
+    char *path;
+    FILE *file;
+    int fd;
+
+    tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    xasprintf(&path, "%s/remctl-bench-XXXXXX", tmpdir);
+    fd = mkstemp(path);
+    if (fd < 0)
+        sysdie("cannot create temporary file %s", path);
+    file = fdopen(fd, "w");
+    if (file == NULL)
+        sysdie("cannot open temporary file %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysdie("cannot write temporary file %s", path);
+    return path;
+}
+
+
+/*
+ * Load a configuration from a string.
+ */
+static struct config *
+load_config(const char *contents)
+{
+    struct config *config;
+    char *path;
+
+    path = write_temp(contents);
+    config = server_config_load(path);
+    if (config == NULL)
+        die("cannot load configuration");
+    unlink(path);
+    free(path);
+    return config;
+}
+
+
+/*
+ * Find the rule for a command in a configuration with a given number of
+ * rules, where the command matches the last rule or none at all.
+ */
+static void
+bench_find(void *data)
+{
+    struct config_data *find = data;
+
+    if (server_find_rule(find->config, find->command, "sub") != find->rule)
+        die("wrong rule found");
+}
+
+static void
+run_find(size_t rules)
+{
+    struct config_data find;
+    struct buffer *contents;
+    size_t i;
+
+    memset(&find, 0, sizeof(find));
+    contents = buffer_new();
+    for (i = 0; i < rules; i++)
+        buffer_append_sprintf(contents, "cmd%lu sub /bin/true ANYUSER\n",
+                              (unsigned long) i);
+    buffer_append(contents, "", 1);
+    find.config = load_config(contents->data);
+    buffer_free(contents);
+    xasprintf(&find.command, "cmd%lu", (unsigned long) rules - 1);
+    find.rule = find.config->rules[rules - 1];
+    measure("server_find_rule/last", rules, bench_find, &find);
+    free(find.command);
+    find.command = xstrdup("unknown");
+    find.rule = NULL;
+    measure("server_find_rule/none", rules, bench_find, &find);
+    free(find.command);
+    server_config_free(find.config);
+}
+
+
+/*
+ * Check an ACL with a given number of entries, matching only the last.  The
+ * entries are either listed in the rule or in an ACL file.
+ */
+static void
+bench_acl(void *data)
+{
+    struct config_data *acl = data;
+
+    if (!server_config_acl_permit(acl->rule, &acl->client))
+        die("user not permitted");
+}
+
+static void
+run_acl(size_t entries)
+{
+    struct config_data acl;
+    struct buffer *contents;
+    char *path;
+    size_t i;
+
+    memset(&acl, 0, sizeof(acl));
+    acl.client.user = xstrdup("user@EXAMPLE.ORG");
+
+    /* A rule listing every principal. */
+    contents = buffer_new();
+    buffer_append_sprintf(contents, "cmd sub /bin/true");
+    for (i = 1; i < entries; i++)
+        buffer_append_sprintf(contents, " princ:user%lu@EXAMPLE.ORG",
+                              (unsigned long) i);
+    buffer_append_sprintf(contents, " princ:user@EXAMPLE.ORG\n");
+    buffer_append(contents, "", 1);
+    acl.config = load_config(contents->data);
+    acl.rule = acl.config->rules[0];
+    measure("acl_permit/princ", entries, bench_acl, &acl);
+    server_config_free(acl.config);
+
+    /* A rule referring to an ACL file listing every principal. */
+    buffer_set(contents, NULL, 0);
+    for (i = 1; i < entries; i++)
+        buffer_append_sprintf(contents, "user%lu@EXAMPLE.ORG\n",
+                              (unsigned long) i);
+    buffer_append_sprintf(contents, "user@EXAMPLE.ORG\n");
+    buffer_append(contents, "", 1);
+    path = write_temp(contents->data);
+    buffer_set(contents, NULL, 0);
+    buffer_append_sprintf(contents, "cmd sub /bin/true file:%s\n", path);
+    buffer_append(contents, "", 1);
+    acl.config = load_config(contents->data);
+    acl.rule = acl.config->rules[0];
+    measure("acl_permit/file", entries, bench_acl, &acl);
+    server_config_free(acl.config);
+    unlink(path);
+    free(path);
+    buffer_free(contents);
+    free(acl.client.user);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int option;
+    long msec;
+    char *end;
+
+    message_program_name = "bench";
+    while ((option = getopt(argc, argv, "ht:")) != EOF) {
+        switch (option) {
+        case 'h':
+            printf("%s", usage_message);
+            exit(0);
+        case 't':
+            errno = 0;
+            msec = strtol(optarg, &end, 10);
+            if (errno != 0 || *end != '\0' || msec <= 0)
+                die("invalid target time %s", optarg);
+            target = (uint64_t) msec * 1000;
+            break;
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (argc - optind > 1) {
+        fprintf(stderr, "%s", usage_message);
+        exit(1);
+    }
+    if (argc - optind == 1)
+        filter = argv[optind];
+
+    /* Run the benchmarks. */
+    printf("# benchmark\tsize\titerations\tmedian_ns\tmin_ns\n");
+    run_split(4);
+    run_split(16);
+    run_split(64);
+    run_parse(2);
+    run_parse(16);
+    run_parse(256);
+    run_token(64);
+    run_token(4096);
+    run_token(65536);
+    run_find(10);
+    run_find(100);
+    run_find(1000);
+    run_acl(1);
+    run_acl(10);
+    run_acl(100);
+    return 0;
+}
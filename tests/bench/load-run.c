@@ -0,0 +1,108 @@
+/*
+ * Run remctl-load against a local remctld.
+ *
+ * Uses the test suite Kerberos configuration, normally set up by load-kdc
+ * with a local KDC, to obtain tickets, starts remctld on port 14373 with the
+ * test configuration, and runs remctl-load against it with the given
+ * arguments.  Unlike the test suite, remctld is run without debugging so
+ * that logging doesn't dominate the results.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/wait.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+
+/* The arguments to remctl-load if none are given. */
+static const char *const default_args[] = {
+    "-c", "4", "-d", "10", "localhost", "test test", NULL
+};
+
+
+int
+main(int argc, char *argv[])
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    char *tmpdir, *pidfile, *confpath;
+    const char *remctld_argv[12];
+    const char **load_argv;
+    const char *const *args;
+    size_t nargs, i;
+    pid_t child;
+    int status;
+
+    /* Get tickets from the local KDC. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    plan(1);
+
+    /* Start remctld. */
+    tmpdir = test_tmpdir();
+    basprintf(&pidfile, "%s/remctld.pid", tmpdir);
+    confpath = test_file_path("data/conf-simple");
+    if (confpath == NULL)
+        bail("cannot find data/conf-simple");
+    i = 0;
+    remctld_argv[i++] = PATH_REMCTLD;
+    remctld_argv[i++] = "-mSF";
+    remctld_argv[i++] = "-p";
+    remctld_argv[i++] = "14373";
+    remctld_argv[i++] = "-s";
+    remctld_argv[i++] = config->principal;
+    remctld_argv[i++] = "-P";
+    remctld_argv[i++] = pidfile;
+    remctld_argv[i++] = "-f";
+    remctld_argv[i++] = confpath;
+    remctld_argv[i] = NULL;
+    remctld = process_start(remctld_argv, pidfile);
+
+    /* Build the remctl-load command line. */
+    if (argc > 1) {
+        args = (const char *const *) argv + 1;
+        nargs = (size_t) argc - 1;
+    } else {
+        args = default_args;
+        nargs = ARRAY_SIZE(default_args) - 1;
+    }
+    load_argv = bcalloc(nargs + 6, sizeof(const char *));
+    load_argv[0] = PATH_REMCTL_LOAD;
+    load_argv[1] = "-p";
+    load_argv[2] = "14373";
+    load_argv[3] = "-s";
+    load_argv[4] = config->principal;
+    for (i = 0; i < nargs; i++)
+        load_argv[i + 5] = args[i];
+    load_argv[nargs + 5] = NULL;
+
+    /* Run the load generator, with its results going to our output. */
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        execv(load_argv[0], (char *const *) load_argv);
+        sysbail("cannot execute %s", load_argv[0]);
+    }
+    if (waitpid(child, &status, 0) < 0)
+        sysbail("cannot wait for %s", load_argv[0]);
+    ok(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+       "remctl-load completed without errors");
+
+    /* Clean up. */
+    process_stop(remctld);
+    free(load_argv);
+    test_file_path_free(confpath);
+    free(pidfile);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,565 @@
+/*
+ * Load generator for remctld.
+ *
+ * Opens a number of concurrent connections to a remctl server, each handled
+ * by its own process, and runs a weighted mix of commands over them for a
+ * given time.  By default, each connection sends its next command as soon
+ * as the previous one finishes (closed loop).  With a target rate, commands
+ * are instead started on a fixed schedule spread across the connections, and
+ * latency is measured from when each command should have started, so a
+ * server that falls behind is charged for the time commands spent waiting.
+ *
+ * At the end, the throughput and latency percentiles over all connections are
+ * printed one per line, separated by tabs, for comparison between runs.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/getopt.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <client/remctl.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: remctl-load <options> <host> <command> [<command> ...]\n\
+\n\
+Each command is a space-separated command line, optionally preceded by a\n\
+weight and a colon, such as \"3:test test\".  Commands are picked at random\n\
+in proportion to their weights (default: 1).\n\
+\n\
+Options:\n\
+    -c <count>    Number of concurrent connections (default: 1)\n\
+    -d <seconds>  How long to run (default: 10)\n\
+    -h            Display this help\n\
+    -o            Open a new connection for every command\n\
+    -p <port>     remctld port (default: 4373 falling back to 4444)\n\
+    -r <rate>     Commands per second over all connections (default: as\n\
+                  many as possible)\n\
+    -s <service>  remctld service principal (default: host/<host>)\n";
+
+/* One command in the mix. */
+struct command {
+    struct vector *words;       /* Arguments of the command. */
+    const char **argv;          /* The same as a NULL-terminated array. */
+    unsigned long weight;       /* Relative frequency of the command. */
+};
+
+/* The options and the command mix. */
+struct options {
+    unsigned long connections;  /* -c: concurrent connections. */
+    unsigned long duration;     /* -d: seconds to run. */
+    bool reconnect;             /* -o: new connection for every command. */
+    unsigned short port;        /* -p: remctld port. */
+    double rate;                /* -r: commands per second, or 0. */
+    const char *principal;      /* -s: remctld service principal. */
+    const char *host;           /* Server to connect to. */
+    struct command *commands;   /* The command mix. */
+    size_t ncommands;           /* Number of commands in the mix. */
+    unsigned long total_weight; /* Sum of the command weights. */
+};
+
+/* The results of one connection, sent from its process to the parent. */
+struct results {
+    unsigned long commands;     /* Commands that completed. */
+    unsigned long errors;       /* Commands that failed with an error. */
+    unsigned long count;        /* Number of latencies that follow. */
+};
+
+
+/*
+ * Display the usage message for remctl-load.
+ */
+static void __attribute__((__noreturn__))
+usage(int status)
+{
+    fprintf((status == 0) ? stdout : stderr, "%s", usage_message);
+    exit(status);
+}
+
+
+/*
+ * Return the current time in microseconds.
+ */
+static uint64_t
+now(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        sysdie("cannot get current time");
+    return (uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec;
+}
+
+
+/*
+ * Sleep until the given time in microseconds.
+ */
+static void
+sleep_until(uint64_t when)
+{
+    struct timeval tv;
+    uint64_t current;
+
+    current = now();
+    while (current < when) {
+        tv.tv_sec = (time_t) ((when - current) / 1000000);
+        tv.tv_usec = (suseconds_t) ((when - current) % 1000000);
+        select(0, NULL, NULL, NULL, &tv);
+        current = now();
+    }
+}
+
+
+/*
+ * Parse an unsigned number from an option, dying if it isn't valid or is
+ * zero.
+ */
+static unsigned long
+parse_number(const char *string, const char *what)
+{
+    unsigned long value;
+    char *end;
+
+    errno = 0;
+    value = strtoul(string, &end, 10);
+    if (errno != 0 || *end != '\0' || *string == '-' || value == 0)
+        die("invalid %s: %s", what, string);
+    return value;
+}
+
+
+/*
+ * Parse a command from the command line into the mix.
+ */
+static void
+parse_command(struct options *options, const char *string)
+{
+    struct command *command;
+    const char *colon, *p;
+    size_t i;
+
+    options->commands = xreallocarray(options->commands,
+                                      options->ncommands + 1,
+                                      sizeof(struct command));
+    command = &options->commands[options->ncommands];
+    command->weight = 1;
+    colon = strchr(string, ':');
+    if (colon != NULL) {
+        for (p = string; p < colon && *p >= '0' && *p <= '9'; p++)
+            ;
+        if (p == colon && p > string) {
+            command->weight = strtoul(string, NULL, 10);
+            if (command->weight == 0)
+                die("invalid weight in command: %s", string);
+            string = colon + 1;
+        }
+    }
+    command->words = vector_split_space(string, NULL);
+    if (command->words->count == 0)
+        die("empty command");
+    command->argv = xcalloc(command->words->count + 1, sizeof(char *));
+    for (i = 0; i < command->words->count; i++)
+        command->argv[i] = command->words->strings[i];
+    options->total_weight += command->weight;
+    options->ncommands++;
+}
+
+
+/*
+ * Pick the next command from the mix, given the state of the random number
+ * generator of this connection.  Uses a simple linear congruential generator
+ * so that each connection runs a repeatable sequence of commands.
+ */
+static const struct command *
+pick_command(const struct options *options, unsigned long *state)
+{
+    unsigned long pick;
+    size_t i;
+
+    *state = (*state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+    pick = (*state >> 8) % options->total_weight;
+    for (i = 0; i < options->ncommands; i++) {
+        if (pick < options->commands[i].weight)
+            return &options->commands[i];
+        pick -= options->commands[i].weight;
+    }
+    return &options->commands[options->ncommands - 1];
+}
+
+
+/*
+ * Open a connection to the server, returning NULL and warning on failure.
+ */
+static struct remctl *
+connect_server(const struct options *options)
+{
+    struct remctl *r;
+
+    r = remctl_new();
+    if (r == NULL)
+        sysdie("cannot initialize remctl connection");
+    if (!remctl_open(r, options->host, options->port, options->principal)) {
+        warn("cannot connect to %s: %s", options->host, remctl_error(r));
+        remctl_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+
+/*
+ * Run a command and read its results, discarding the output.  Returns true
+ * if the command ran (whatever its exit status) and false if the server
+ * returned an error or the connection failed.  On a connection failure, the
+ * connection is closed and set to NULL.
+ */
+static bool
+run_command(struct remctl **r, const struct command *command)
+{
+    struct remctl_output *out;
+
+    if (!remctl_command(*r, command->argv)) {
+        warn("cannot send command: %s", remctl_error(*r));
+        remctl_close(*r);
+        *r = NULL;
+        return false;
+    }
+    do {
+        out = remctl_output(*r);
+        if (out == NULL) {
+            warn("cannot read output: %s", remctl_error(*r));
+            remctl_close(*r);
+            *r = NULL;
+            return false;
+        }
+    } while (out->type == REMCTL_OUT_OUTPUT);
+    if (out->type == REMCTL_OUT_ERROR) {
+        warn("error running command: %.*s", (int) out->length, out->data);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Write all of a buffer to a file descriptor, dying on failure.
+ */
+static void
+write_all(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+    ssize_t status;
+
+    while (length > 0) {
+        status = write(fd, p, length);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            sysdie("cannot write results");
+        p += status;
+        length -= (size_t) status;
+    }
+}
+
+
+/*
+ * Read all of a buffer from a file descriptor, dying on failure.
+ */
+static void
+read_all(int fd, void *data, size_t length)
+{
+    char *p = data;
+    ssize_t status;
+
+    while (length > 0) {
+        status = read(fd, p, length);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            die("cannot read results from connection");
+        p += status;
+        length -= (size_t) status;
+    }
+}
+
+
+/*
+ * Drive one connection until the end time, then write the results and the
+ * latency of each command in microseconds to the given file descriptor.
+ * Takes the index of the connection, which seeds its command mix and offsets
+ * its schedule when running at a target rate.
+ */
+static void __attribute__((__noreturn__))
+run_connection(const struct options *options, unsigned long index,
+               uint64_t start, int fd)
+{
+    struct remctl *r = NULL;
+    struct results results;
+    const struct command *command;
+    uint32_t *latencies = NULL;
+    size_t size = 0;
+    unsigned long state = index + 1;
+    uint64_t end, interval = 0, next, begin, latency;
+
+    memset(&results, 0, sizeof(results));
+    end = start + (uint64_t) options->duration * 1000000;
+    if (options->rate > 0) {
+        interval = (uint64_t) ((double) options->connections * 1000000
+                               / options->rate);
+        if (interval == 0)
+            interval = 1;
+    }
+    next = start + interval * index / options->connections;
+    sleep_until(next);
+    while (next < end) {
+        command = pick_command(options, &state);
+
+        /* Wait until the scheduled start of the command, if any. */
+        if (interval > 0) {
+            sleep_until(next);
+            begin = next;
+            next += interval;
+        } else {
+            begin = now();
+            next = begin;
+        }
+
+        /* Run the command, opening the connection if needed. */
+        if (r == NULL)
+            r = connect_server(options);
+        if (r == NULL || !run_command(&r, command)) {
+            results.errors++;
+            if (r == NULL && interval == 0)
+                sleep_until(now() + 100 * 1000);
+        } else {
+            latency = now() - begin;
+            if (results.count == size) {
+                size = (size == 0) ? 1024 : size * 2;
+                latencies = xreallocarray(latencies, size, sizeof(uint32_t));
+            }
+            if (latency > UINT32_MAX)
+                latency = UINT32_MAX;
+            latencies[results.count++] = (uint32_t) latency;
+            results.commands++;
+        }
+        if (options->reconnect && r != NULL) {
+            remctl_close(r);
+            r = NULL;
+        }
+        if (interval == 0)
+            next = now();
+    }
+    if (r != NULL)
+        remctl_close(r);
+
+    /* Send the results to the parent. */
+    write_all(fd, &results, sizeof(results));
+    if (results.count > 0)
+        write_all(fd, latencies, results.count * sizeof(uint32_t));
+    free(latencies);
+    _exit(0);
+}
+
+
+/*
+ * Compare two latencies for qsort.
+ */
+static int
+compare_latency(const void *a, const void *b)
+{
+    const uint32_t *x = a;
+    const uint32_t *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Print a latency in microseconds in milliseconds.
+ */
+static void
+print_latency(const char *name, uint64_t usec)
+{
+    printf("latency_%s_ms\t%lu.%03lu\n", name, (unsigned long) (usec / 1000),
+           (unsigned long) (usec % 1000));
+}
+
+
+/*
+ * Given the sorted latencies and their count, print the percentile of them.
+ */
+static void
+print_percentile(const char *name, const uint32_t *latencies, size_t count,
+                 double percentile)
+{
+    size_t i;
+
+    i = (size_t) ((double) count * percentile / 100);
+    if (i >= count)
+        i = count - 1;
+    print_latency(name, latencies[i]);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct options options;
+    struct results results, total;
+    struct sigaction sa;
+    uint32_t *latencies = NULL;
+    pid_t *children;
+    int *fds;
+    int option, pipefd[2], status;
+    unsigned long i;
+    uint64_t start, sum;
+    bool failed = false;
+    char *end;
+
+    /* Set up logging and identity. */
+    message_program_name = "remctl-load";
+
+    /*
+     * Ignore SIGPIPE so that a connection closed by the server is reported
+     * as an error rather than killing the process handling it.
+     */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) < 0)
+        sysdie("cannot set SIGPIPE handler");
+
+    /* Parse options. */
+    memset(&options, 0, sizeof(options));
+    options.connections = 1;
+    options.duration = 10;
+    while ((option = getopt(argc, argv, "+c:d:hop:r:s:")) != EOF) {
+        switch (option) {
+        case 'c':
+            options.connections = parse_number(optarg, "connection count");
+            break;
+        case 'd':
+            options.duration = parse_number(optarg, "duration");
+            break;
+        case 'h':
+            usage(0);
+        case 'o':
+            options.reconnect = true;
+            break;
+        case 'p':
+            i = parse_number(optarg, "port");
+            if (i > 65535)
+                die("invalid port: %s", optarg);
+            options.port = (unsigned short) i;
+            break;
+        case 'r':
+            errno = 0;
+            options.rate = strtod(optarg, &end);
+            if (errno != 0 || *end != '\0' || options.rate <= 0)
+                die("invalid rate: %s", optarg);
+            break;
+        case 's':
+            options.principal = optarg;
+            break;
+        default:
+            usage(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 2)
+        usage(1);
+    options.host = argv[0];
+    for (i = 1; i < (unsigned long) argc; i++)
+        parse_command(&options, argv[i]);
+
+    /*
+     * Start a process for each connection.  They all start their first
+     * command at the same time, a moment from now, so that slow process
+     * creation doesn't skew the results.
+     */
+    children = xcalloc(options.connections, sizeof(pid_t));
+    fds = xcalloc(options.connections, sizeof(int));
+    start = now() + 100 * 1000 + options.connections * 1000;
+    fflush(stdout);
+    for (i = 0; i < options.connections; i++) {
+        if (pipe(pipefd) < 0)
+            sysdie("cannot create pipe");
+        children[i] = fork();
+        if (children[i] < 0)
+            sysdie("cannot fork");
+        else if (children[i] == 0) {
+            close(pipefd[0]);
+            run_connection(&options, i, start, pipefd[1]);
+        }
+        close(pipefd[1]);
+        fds[i] = pipefd[0];
+    }
+
+    /* Collect the results. */
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < options.connections; i++) {
+        read_all(fds[i], &results, sizeof(results));
+        total.commands += results.commands;
+        total.errors += results.errors;
+        if (results.count > 0) {
+            latencies = xreallocarray(latencies, total.count + results.count,
+                                      sizeof(uint32_t));
+            read_all(fds[i], latencies + total.count,
+                     results.count * sizeof(uint32_t));
+            total.count += results.count;
+        }
+        close(fds[i]);
+        if (waitpid(children[i], &status, 0) < 0)
+            sysdie("cannot wait for connection %lu", i);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = true;
+    }
+    if (failed)
+        warn("some connections failed");
+
+    /* Report the results. */
+    printf("connections\t%lu\n", options.connections);
+    printf("rate\t%.1f\n", options.rate);
+    printf("duration\t%lu\n", options.duration);
+    printf("commands\t%lu\n", total.commands);
+    printf("errors\t%lu\n", total.errors);
+    printf("throughput\t%.1f\n",
+           (double) total.commands / (double) options.duration);
+    if (total.count > 0) {
+        qsort(latencies, total.count, sizeof(uint32_t), compare_latency);
+        for (sum = 0, i = 0; i < total.count; i++)
+            sum += latencies[i];
+        print_latency("min", latencies[0]);
+        print_latency("mean", sum / total.count);
+        print_percentile("p50", latencies, total.count, 50);
+        print_percentile("p90", latencies, total.count, 90);
+        print_percentile("p99", latencies, total.count, 99);
+        print_percentile("p99.9", latencies, total.count, 99.9);
+        print_latency("max", latencies[total.count - 1]);
+    }
+
+    /* Clean up. */
+    for (i = 0; i < options.ncommands; i++) {
+        vector_free(options.commands[i].words);
+        free(options.commands[i].argv);
+    }
+    free(options.commands);
+    free(latencies);
+    free(children);
+    free(fds);
+    return (failed || total.errors > 0) ? 1 : 0;
+}
@@ -70,6 +70,42 @@ test_command(struct remctl *r)
 }
 
 
+/* Used to collect output in remctl_output_callback tests. */
+struct collect {
+    char buffer[64];
+    size_t length;
+    int status;
+    int calls;
+    int stop;                   /* Fail after this many calls if non-zero. */
+};
+
+
+/*
+ * Callback for remctl_output_callback that copies standard output into a
+ * fixed buffer and records the exit status.
+ */
+static int
+collect_output(const struct remctl_output *output, void *data)
+{
+    struct collect *collect = data;
+    size_t length;
+
+    collect->calls++;
+    if (collect->stop != 0 && collect->calls >= collect->stop)
+        return 0;
+    if (output->type == REMCTL_OUT_STATUS)
+        collect->status = output->status;
+    else if (output->type == REMCTL_OUT_OUTPUT && output->stream == 1) {
+        length = output->length;
+        if (length > sizeof(collect->buffer) - collect->length)
+            length = sizeof(collect->buffer) - collect->length;
+        memcpy(collect->buffer + collect->length, output->data, length);
+        collect->length += length;
+    }
+    return 1;
+}
+
+
 /*
  * Takes the principal and the protocol version and runs a set of tests.  Due
  * to the compatibility layer, we should be able to run the same commands
@@ -223,12 +259,16 @@ main(void)
     char *message, *p;
     static const char *test[] = { "test", "test", NULL };
     static const char *error[] = { "test", "bad-command", NULL };
+    static const char *large[] = { "test", "large-output", "1000000", NULL };
+    struct remctl_output *output;
+    struct collect collect;
+    size_t i;
 
     /* Set up Kerberos and remctld. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
     remctld_start(config, "data/conf-simple", (char *) 0);
 
-    plan(141);
+    plan(161);
 
     /* Run the basic protocol tests. */
     do_tests(config->principal, 1);
@@ -268,6 +308,49 @@ main(void)
                   "...and the right error string");
     remctl_result_free(result);
 
+    /* Large output is accumulated across many tokens. */
+    result = remctl("localhost", 14373, config->principal, large);
+    ok(result != NULL, "remctl API with large output works");
+    if (result == NULL)
+        bail("remctl returned NULL");
+    ok(result->error == NULL, "...with no error");
+    is_int(1000000, result->stdout_len, "...and correct stdout_len");
+    for (i = 0; i < result->stdout_len; i++)
+        if (result->stdout_buf[i] != '1')
+            break;
+    is_int(1000000, i, "...and correct data");
+    remctl_result_free(result);
+
+    /* Retrieve output with a callback. */
+    r = remctl_new();
+    ok(remctl_open(r, "localhost", 14373, config->principal),
+       "remctl_open for output callback");
+    ok(remctl_command(r, test), "...and remctl_command");
+    memset(&collect, 0, sizeof(collect));
+    ok(remctl_output_callback(r, collect_output, &collect),
+       "remctl_output_callback works");
+    is_int(2, collect.calls, "...with the right number of calls");
+    ok(collect.length == 12
+           && memcmp(collect.buffer, "hello world\n", 12) == 0,
+       "...and the right output");
+    is_int(0, collect.status, "...and the right status");
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_DONE,
+       "...and no more output");
+
+    /* Stopping early leaves the rest of the output for remctl_output. */
+    ok(remctl_command(r, test), "remctl_command");
+    memset(&collect, 0, sizeof(collect));
+    collect.stop = 1;
+    ok(!remctl_output_callback(r, collect_output, &collect),
+       "remctl_output_callback fails when stopped");
+    is_string("output callback failed", remctl_error(r), "...with error");
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+           && output->status == 0,
+       "...and remctl_output returns the rest");
+    remctl_close(r);
+
     /* Test opening a connection from a struct sockaddr. */
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
@@ -328,5 +411,32 @@ main(void)
     free(message);
     remctl_close(r);
 
+    /*
+     * With SRV lookups enabled, a host without SRV records is still contacted
+     * directly, and a connection with an explicit port doesn't do a lookup.
+     */
+    r = remctl_new();
+#ifdef HAVE_RES_SEARCH
+    ok(remctl_set_srv_lookup(r, 1), "enable SRV lookups");
+    ok(remctl_set_timeout(r, 1), "...and set one second timeout");
+    ok(!remctl_open(r, "192.0.2.1", 0, config->principal),
+       "remctl_open for 192.0.2.1 fails");
+    message = bstrdup(remctl_error(r));
+    p = strrchr(message, ':');
+    if (p != NULL)
+        *p = '\0';
+    is_string("cannot connect to 192.0.2.1 (port 4373)", message,
+              "...with correct error");
+    free(message);
+    ok(remctl_open(r, "localhost", 14373, config->principal),
+       "remctl_open with a port and SRV lookups works");
+#else
+    ok(!remctl_set_srv_lookup(r, 1), "enabling SRV lookups fails");
+    is_string("SRV lookups not supported", remctl_error(r),
+              "...with correct error");
+    skip_block(3, "SRV lookups not supported");
+#endif
+    remctl_close(r);
+
     return 0;
 }
@@ -0,0 +1,225 @@
+/*
+ * Test suite for the asynchronous client interface.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+
+/* The number of connections to run at the same time. */
+#define CONNECTIONS 8
+
+
+/*
+ * Wait for any of the given connections to be ready for remctl_step, waiting
+ * at most ten seconds.  Connections with no events are ready immediately.
+ */
+static void
+wait_events(struct remctl **r, size_t count)
+{
+    fd_set readfds, writefds;
+    struct timeval tv;
+    socket_type fd, maxfd = 0;
+    int events, status;
+    size_t i;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    for (i = 0; i < count; i++) {
+        if (r[i] == NULL)
+            continue;
+        events = remctl_events(r[i]);
+        if (events == 0)
+            return;
+        fd = remctl_fd(r[i]);
+        if (events & REMCTL_WANT_READ)
+            FD_SET(fd, &readfds);
+        if (events & REMCTL_WANT_WRITE)
+            FD_SET(fd, &writefds);
+        if (fd > maxfd)
+            maxfd = fd;
+    }
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    status = select(maxfd + 1, &readfds, &writefds, NULL, &tv);
+    if (status < 0)
+        sysbail("select failed");
+    else if (status == 0)
+        bail("timed out waiting for asynchronous connection");
+}
+
+
+/*
+ * Call remctl_step on a single connection, waiting for its events, until it
+ * returns something other than REMCTL_STEP_AGAIN.
+ */
+static enum remctl_step_status
+step(struct remctl *r)
+{
+    enum remctl_step_status status;
+
+    while ((status = remctl_step(r)) == REMCTL_STEP_AGAIN)
+        wait_events(&r, 1);
+    return status;
+}
+
+
+/*
+ * Run test test on an open asynchronous connection and check the results,
+ * stepping the connection before each call to remctl_output.  Reports four
+ * tests.
+ */
+static void
+run_test(struct remctl *r)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+
+    ok(remctl_command(r, command), "queue test command");
+    if (step(r) != REMCTL_STEP_DONE)
+        diag("step failed: %s", remctl_error(r));
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_OUTPUT
+           && output->length == 12 && output->stream == 1
+           && memcmp(output->data, "hello world\n", 12) == 0,
+       "...output is correct");
+    if (step(r) != REMCTL_STEP_DONE)
+        diag("step failed: %s", remctl_error(r));
+    output = remctl_output(r);
+    ok(output != NULL && output->type == REMCTL_OUT_STATUS
+           && output->status == 0,
+       "...status is correct");
+    is_int(0, remctl_events(r), "...and nothing left to wait for");
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r, *conns[CONNECTIONS];
+    struct remctl_output *output;
+    enum remctl_step_status status;
+    const char *command[] = { "test", "test", NULL };
+    size_t i, finished;
+    bool sent[CONNECTIONS], okay;
+
+    /* Set up Kerberos and remctld. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", (char *) 0);
+
+    plan(23);
+
+    /* Open a connection and run a command on it. */
+    r = remctl_new();
+    if (r == NULL)
+        bail("cannot create remctl object");
+    ok(remctl_open_async(r, "127.0.0.1", 14373, config->principal),
+       "start asynchronous open");
+    is_int(REMCTL_STEP_DONE, step(r), "...and finish it");
+    run_test(r);
+
+    /* Output isn't available until remctl_step says so. */
+    ok(remctl_command(r, command), "queue another command");
+    ok(remctl_output(r) == NULL, "...output is not available yet");
+    is_string("output not yet available", remctl_error(r), "...with error");
+    while ((output = remctl_output(r)) == NULL
+           || output->type == REMCTL_OUT_OUTPUT)
+        if (output == NULL && step(r) == REMCTL_STEP_ERROR)
+            bail("step failed: %s", remctl_error(r));
+
+    /* NOOP isn't supported. */
+    ok(!remctl_noop(r), "NOOP fails");
+    is_string("NOOP not supported on asynchronous connections",
+              remctl_error(r), "...with the right error");
+    remctl_close(r);
+
+    /* Negotiating capabilities adds another round trip to the open. */
+    r = remctl_new();
+    if (r == NULL)
+        bail("cannot create remctl object");
+    remctl_set_token_size(r, 1024 * 1024);
+    ok(remctl_open_async(r, "127.0.0.1", 14373, config->principal),
+       "start asynchronous open with capabilities");
+    is_int(REMCTL_STEP_DONE, step(r), "...and finish it");
+    run_test(r);
+    remctl_close(r);
+
+    /* Run several connections at once from one loop. */
+    okay = true;
+    for (i = 0; i < CONNECTIONS; i++) {
+        conns[i] = remctl_new();
+        if (conns[i] == NULL)
+            bail("cannot create remctl object");
+        if (!remctl_open_async(conns[i], "127.0.0.1", 14373,
+                               config->principal))
+            okay = false;
+        sent[i] = false;
+    }
+    finished = 0;
+    while (okay && finished < CONNECTIONS) {
+        wait_events(conns, CONNECTIONS);
+        for (i = 0; i < CONNECTIONS; i++) {
+            if (conns[i] == NULL)
+                continue;
+            status = remctl_step(conns[i]);
+            if (status == REMCTL_STEP_ERROR) {
+                diag("step failed: %s", remctl_error(conns[i]));
+                okay = false;
+                break;
+            } else if (status == REMCTL_STEP_AGAIN)
+                continue;
+            if (!sent[i]) {
+                if (!remctl_command(conns[i], command))
+                    okay = false;
+                sent[i] = true;
+                continue;
+            }
+            output = remctl_output(conns[i]);
+            if (output == NULL)
+                okay = false;
+            else if (output->type == REMCTL_OUT_STATUS) {
+                if (output->status != 0)
+                    okay = false;
+                remctl_close(conns[i]);
+                conns[i] = NULL;
+                finished++;
+            } else if (output->type != REMCTL_OUT_OUTPUT)
+                okay = false;
+        }
+    }
+    ok(okay, "%d simultaneous connections", CONNECTIONS);
+    for (i = 0; i < CONNECTIONS; i++)
+        remctl_close(conns[i]);
+
+    /* Connection failures are reported by remctl_step. */
+    r = remctl_new();
+    if (r == NULL)
+        bail("cannot create remctl object");
+    ok(remctl_open_async(r, "127.0.0.1", 14445, config->principal),
+       "start asynchronous open to a closed port");
+    is_int(REMCTL_STEP_ERROR, step(r), "...and it fails");
+    ok(strncmp(remctl_error(r), "cannot connect to 127.0.0.1 (port 14445): ",
+               strlen("cannot connect to 127.0.0.1 (port 14445): "))
+           == 0,
+       "...with the right error");
+    ok(!remctl_command(r, command), "...and commands fail");
+    is_string("no connection open", remctl_error(r), "...with error");
+    remctl_close(r);
+    return 0;
+}
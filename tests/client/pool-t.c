@@ -0,0 +1,172 @@
+/*
+ * Test suite for remctl connection pools.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+
+
+/*
+ * Return the local port of a connection, used to tell whether two
+ * connections are the same.  Returns 0 on any failure.
+ */
+static unsigned short
+local_port(struct remctl *r)
+{
+    struct sockaddr_in sin;
+    socklen_t length = sizeof(sin);
+
+    if (r == NULL || r->fd == INVALID_SOCKET)
+        return 0;
+    if (getsockname(r->fd, (struct sockaddr *) &sin, &length) < 0)
+        return 0;
+    return ntohs(sin.sin_port);
+}
+
+
+/*
+ * Check out a connection from the pool, return its local port, and return it
+ * to the pool.
+ */
+static unsigned short
+pool_port(struct remctl_pool *pool, const char *principal)
+{
+    struct remctl *r;
+    unsigned short port;
+
+    r = remctl_pool_get(pool, "127.0.0.1", 14373, principal);
+    if (r == NULL) {
+        diag("remctl_pool_get failed: %s", remctl_pool_error(pool));
+        return 0;
+    }
+    port = local_port(r);
+    remctl_pool_put(pool, r);
+    return port;
+}
+
+
+/*
+ * Run the test command through the pool and check the results.  Reports
+ * three tests.
+ */
+static void
+run_test(struct remctl_pool *pool, const char *principal, const char *what)
+{
+    struct remctl_result *result;
+    const char *command[] = { "test", "test", NULL };
+
+    result = remctl_pool_run(pool, "127.0.0.1", 14373, principal, command);
+    if (result == NULL) {
+        ok_block(3, false, "%s", what);
+        return;
+    }
+    ok(result->error == NULL, "%s", what);
+    if (result->error != NULL)
+        diag("error: %s", result->error);
+    is_int(0, result->status, "...with status 0");
+    ok(result->stdout_len == 12
+           && memcmp(result->stdout_buf, "hello world\n", 12) == 0,
+       "...and the right output");
+    remctl_result_free(result);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl_pool *pool;
+    struct remctl_result *result;
+    struct remctl *r;
+    unsigned short port;
+    const char *command[] = { "test", "test", NULL };
+    const char *error[] = { "test", "bad-command", NULL };
+    const char *expected = "cannot connect to 127.0.0.1 (port 14445): ";
+
+    /* Set up Kerberos and remctld. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", (char *) 0);
+
+    plan(25);
+
+    /* Run a command and then make sure the connection is reused. */
+    pool = remctl_pool_new();
+    if (pool == NULL)
+        bail("cannot create remctl pool");
+    run_test(pool, config->principal, "remctl_pool_run");
+    port = pool_port(pool, config->principal);
+    ok(port != 0, "connection is in the pool");
+    run_test(pool, config->principal, "second remctl_pool_run");
+    is_int(port, pool_port(pool, config->principal), "...reused connection");
+
+    /* A remote error doesn't stop the connection from being reused. */
+    result = remctl_pool_run(pool, "127.0.0.1", 14373, config->principal,
+                             error);
+    ok(result != NULL, "remctl_pool_run of error command");
+    if (result == NULL)
+        ok(false, "...with the right error");
+    else
+        is_string("Unknown command", result->error, "...with the right error");
+    remctl_result_free(result);
+    is_int(port, pool_port(pool, config->principal), "...reused connection");
+
+    /* A connection returned with output pending is closed. */
+    r = remctl_pool_get(pool, "127.0.0.1", 14373, config->principal);
+    ok(r != NULL && remctl_command(r, command), "send command");
+    remctl_pool_put(pool, r);
+    ok(port != pool_port(pool, config->principal),
+       "...and returning it first closes the connection");
+    port = pool_port(pool, config->principal);
+
+    /* Idle connections are closed. */
+    ok(remctl_pool_set_idle(pool, 1), "set idle time");
+    sleep(2);
+    ok(port != pool_port(pool, config->principal),
+       "...and idle connection is closed");
+    ok(remctl_pool_set_idle(pool, 0), "clear idle time");
+    port = pool_port(pool, config->principal);
+
+    /*
+     * Send garbage to the server, which makes it close the connection, and
+     * make sure the connection isn't reused.
+     */
+    r = remctl_pool_get(pool, "127.0.0.1", 14373, config->principal);
+    if (r == NULL)
+        bail("remctl_pool_get failed: %s", remctl_pool_error(pool));
+    if (socket_write(r->fd, "\xff\0\0\0\0", 5) != 5)
+        sysbail("cannot write to connection");
+    remctl_pool_put(pool, r);
+    sleep(1);
+    run_test(pool, config->principal, "run after server close");
+    ok(port != pool_port(pool, config->principal), "...on a new connection");
+
+    /* Errors. */
+    ok(!remctl_pool_set_timeout(pool, -1), "invalid timeout");
+    is_string("invalid timeout -1", remctl_pool_error(pool), "...with error");
+    ok(remctl_pool_get(pool, "127.0.0.1", 14445, config->principal) == NULL,
+       "connection to a closed port fails");
+    ok(strncmp(remctl_pool_error(pool), expected, strlen(expected)) == 0,
+       "...with the right error");
+    result = remctl_pool_run(pool, "127.0.0.1", 14445, config->principal,
+                             command);
+    ok(result != NULL && result->error != NULL
+           && strcmp(result->error, remctl_pool_error(pool)) == 0,
+       "...and remctl_pool_run reports the error");
+    remctl_result_free(result);
+
+    /* Freeing the pool closes the connections. */
+    remctl_pool_free(pool);
+    return 0;
+}
@@ -1,6 +1,8 @@
 /*
  * Small C program to output three lines, one to stdout, one to stderr, and
- * then one to stdout again.  Used to test remctl streaming support.
+ * then one to stdout again.  If given an argument of stdout after the
+ * subcommand, all three lines go to stdout.  Used to test remctl streaming
+ * support.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2006
@@ -18,17 +20,21 @@
 #include <sys/time.h>
 
 int
-main(void)
+main(int argc, char *argv[])
 {
     struct timeval tv;
+    FILE *second = stderr;
+
+    if (argc > 2 && strcmp(argv[2], "stdout") == 0)
+        second = stdout;
 
     fprintf(stdout, "This is the first line\n");
     fflush(stdout);
     tv.tv_sec = 0;
     tv.tv_usec = 100000;
     select(0, NULL, NULL, NULL, &tv);
-    fprintf(stderr, "This is the second line\n");
-    fflush(stderr);
+    fprintf(second, "This is the second line\n");
+    fflush(second);
     tv.tv_sec = 0;
     tv.tv_usec = 100000;
     select(0, NULL, NULL, NULL, &tv);
@@ -37,7 +37,8 @@ acl_permit(const struct rule *rule, const char *user)
 {
     struct client client = {
         -1, -1, NULL, NULL, 0, NULL, (char *) user, false, 0, 0, false, false,
-        NULL, NULL, NULL
+        NULL, NULL, NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, 0, false, NULL,
+        NULL, NULL, false
     };
     return server_config_acl_permit(rule, &client);
 }
@@ -57,7 +58,8 @@ acl_permit_anonymous(const struct rule *rule)
     static char *pname = NULL;
     struct client client = {
         -1, -1, NULL, NULL, 0, NULL, NULL, true, 0, 0, false, false, NULL,
-        NULL, NULL
+        NULL, NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, 0, false, NULL, NULL,
+        NULL, false
     };
 
     if (pname == NULL)
@@ -73,7 +75,8 @@ main(void)
 {
     struct rule rule = {
         NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, 0, NULL,
-        NULL, NULL
+        NULL, NULL, false, 0, 0, 0, false, false, false,
+        0, 0, 0, 0, 0, 0, 0, BUILTIN_NONE
     };
     const char *acls[5];
 
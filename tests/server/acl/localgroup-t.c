@@ -67,7 +67,8 @@ acl_permit(const struct rule *rule, const char *user)
 {
     struct client client = {
         -1, -1, NULL, NULL, 0, NULL, (char *) user, false, 0, 0, false, false,
-        NULL, NULL, NULL
+        NULL, NULL, NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, 0, false, NULL,
+        NULL, NULL, false
     };
     return server_config_acl_permit(rule, &client);
 }
@@ -81,7 +82,8 @@ main(void)
     const char *acls[5];
     const struct rule rule = {
         (char *) "TEST", 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, 0,
-        NULL, NULL, NULL
+        NULL, NULL, NULL, false, 0, 0, 0, false, false, false,
+        0, 0, 0, 0, 0, 0, 0, BUILTIN_NONE
     };
 
     plan(2);
@@ -127,7 +129,8 @@ main(void)
     const char *acls[5];
     const struct rule rule = {
         (char *) "TEST", 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, 0,
-        NULL, NULL, (char **) acls
+        NULL, NULL, (char **) acls, false, 0, 0, 0, false, false, false,
+        0, 0, 0, 0, 0, 0, 0, BUILTIN_NONE
     };
 
     plan(16);
@@ -0,0 +1,133 @@
+/*
+ * Test suite for remctld admission control of new connections.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+
+
+/*
+ * Run the test command on an open connection and return true if it succeeded
+ * with the expected output.
+ */
+static bool
+run_test(struct remctl *r)
+{
+    struct remctl_output *output;
+    const char *command[] = { "test", "test", NULL };
+    bool okay = false;
+
+    if (!remctl_command(r, command))
+        return false;
+    do {
+        output = remctl_output(r);
+        if (output == NULL)
+            return false;
+        if (output->type == REMCTL_OUT_OUTPUT)
+            okay = (output->length == 12
+                    && memcmp(output->data, "hello world\n", 12) == 0);
+    } while (output->type == REMCTL_OUT_OUTPUT);
+    return okay && output->type == REMCTL_OUT_STATUS && output->status == 0;
+}
+
+
+/*
+ * Open a new connection to the server on the given host and run the test
+ * command.  Returns true if that succeeded and false otherwise.
+ */
+static bool
+try_connection(struct kerberos_config *config, const char *host)
+{
+    struct remctl *r;
+    bool okay;
+
+    r = remctl_new();
+    if (r == NULL)
+        bail("cannot allocate memory");
+    okay = remctl_open(r, host, 14373, config->principal) && run_test(r);
+    remctl_close(r);
+    return okay;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl *first, *second;
+    time_t start;
+    bool opened;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld = remctld_start(config, "data/conf-simple", "-c", "1", NULL);
+
+    plan(7);
+
+    /* Open one connection, which uses up the limit. */
+    first = remctl_new();
+    second = remctl_new();
+    if (first == NULL || second == NULL)
+        bail("cannot allocate memory");
+    ok(remctl_open(first, "localhost", 14373, config->principal),
+       "first connection accepted");
+
+    /*
+     * A second connection is closed without being handled.  Depending on the
+     * GSS-API mechanism, the client may not notice until it sends a command.
+     */
+    opened = remctl_open(second, "localhost", 14373, config->principal);
+    ok(!opened || !run_test(second), "second connection refused");
+    remctl_close(second);
+
+    /* The first connection still works. */
+    ok(run_test(first), "first connection still runs commands");
+    remctl_close(first);
+
+    /*
+     * Once the first connection is closed, new connections are accepted
+     * again.  The server may take a moment to notice that its child exited.
+     */
+    start = time(NULL);
+    do {
+        opened = try_connection(config, "localhost");
+        if (!opened)
+            sleep(1);
+    } while (!opened && time(NULL) - start < 10);
+    ok(opened, "new connection accepted after the first closes");
+    process_stop(remctld);
+
+    /* Denied networks are refused, even if they're also allowed. */
+    remctld = remctld_start(config, "data/conf-simple", "-A", "127.0.0.0/8",
+                            "-D", "127.0.0.1", NULL);
+    ok(!try_connection(config, "127.0.0.1"), "denied address refused");
+    process_stop(remctld);
+
+    /* If there are allowed networks, other addresses are refused. */
+    remctld = remctld_start(config, "data/conf-simple", "-A", "192.0.2.0/24",
+                            "-A", "2001:db8::/32", NULL);
+    ok(!try_connection(config, "127.0.0.1"), "address not allowed refused");
+    process_stop(remctld);
+    remctld = remctld_start(config, "data/conf-simple", "-A", "192.0.2.0/24",
+                            "-A", "127.0.0.0/255.0.0.0", "-D", "10.0.0.0/8",
+                            NULL);
+    ok(try_connection(config, "127.0.0.1"), "allowed address accepted");
+
+    /* Clean up. */
+    process_stop(remctld);
+    return 0;
+}
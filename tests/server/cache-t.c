@@ -0,0 +1,403 @@
+/*
+ * Test suite for the remctld result cache and single-flight commands.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/wait.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Run a test command with the given subcommand and argument using the simple
+ * interface and return the result, bailing on failure.
+ */
+static struct remctl_result *
+run_command(struct kerberos_config *config, const char *subcommand,
+            const char *arg)
+{
+    struct remctl_result *result;
+    const char *command[] = { "test", NULL, NULL, NULL };
+
+    command[1] = subcommand;
+    command[2] = arg;
+    result = remctl("localhost", 14373, config->principal, command);
+    if (result == NULL)
+        bail("cannot allocate memory");
+    return result;
+}
+
+
+/*
+ * Run the cache test command with protocol version 1 and return the output,
+ * which combines standard output and standard error.  The caller is
+ * responsible for freeing the result.
+ */
+static char *
+run_command_v1(struct kerberos_config *config)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    char *data = NULL;
+    const char *command[] = { "test", "cache", "v1", NULL };
+
+    r = remctl_new();
+    if (r == NULL)
+        bail("cannot allocate memory");
+    r->protocol = 1;
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot contact remctld: %s", remctl_error(r));
+    if (!remctl_command(r, command))
+        bail("cannot send command: %s", remctl_error(r));
+    output = remctl_output(r);
+    if (output != NULL && output->type == REMCTL_OUT_OUTPUT)
+        data = bstrndup(output->data, output->length);
+    remctl_close(r);
+    return data;
+}
+
+
+/*
+ * Start the single-flight test command with the given directory as its
+ * argument in a child process.  Returns the file descriptor from which its
+ * standard output can be read and stores the process ID in child.  If
+ * inherited is not -1, it is a file descriptor that the child should close.
+ */
+static int
+start_flight(struct kerberos_config *config, const char *dir, int inherited,
+             pid_t *child)
+{
+    struct remctl_result *result;
+    int fds[2];
+
+    if (pipe(fds) < 0)
+        sysbail("cannot create pipe");
+    *child = fork();
+    if (*child < 0)
+        sysbail("cannot fork");
+    else if (*child == 0) {
+        close(fds[0]);
+        if (inherited != -1)
+            close(inherited);
+        result = run_command(config, "flight", dir);
+        if (result->stdout_buf != NULL)
+            if (write(fds[1], result->stdout_buf, result->stdout_len) < 0)
+                _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+
+/*
+ * Given the file descriptor and process ID returned by start_flight, read the
+ * standard output of the command and wait for the child to exit.  Returns the
+ * output, which the caller is responsible for freeing.
+ */
+static char *
+finish_flight(int fd, pid_t child)
+{
+    char buffer[BUFSIZ];
+    ssize_t count;
+    size_t length = 0;
+
+    do {
+        count = read(fd, buffer + length, sizeof(buffer) - length - 1);
+        if (count > 0)
+            length += (size_t) count;
+    } while (count > 0 && length < sizeof(buffer) - 1);
+    close(fd);
+    waitpid(child, NULL, 0);
+    return bstrndup(buffer, length);
+}
+
+
+/*
+ * Wait for a second process to start following the output of a single-flight
+ * command, which it shows by taking a read lock on the second byte of the run
+ * file in the cache directory.  Bails if that doesn't happen within ten
+ * seconds.
+ */
+static void
+wait_for_follower(const char *cachedir)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct flock lock;
+    char *file;
+    size_t length;
+    int fd, i;
+
+    for (i = 0; i < 1000; i++) {
+        dir = opendir(cachedir);
+        if (dir == NULL)
+            sysbail("cannot open %s", cachedir);
+        while ((entry = readdir(dir)) != NULL) {
+            length = strlen(entry->d_name);
+            if (length < 4 || strcmp(entry->d_name + length - 4, ".run") != 0)
+                continue;
+            basprintf(&file, "%s/%s", cachedir, entry->d_name);
+            fd = open(file, O_RDWR);
+            free(file);
+            if (fd < 0)
+                continue;
+            memset(&lock, 0, sizeof(lock));
+            lock.l_type = F_WRLCK;
+            lock.l_whence = SEEK_SET;
+            lock.l_start = 1;
+            lock.l_len = 1;
+            if (fcntl(fd, F_GETLK, &lock) < 0)
+                sysbail("cannot check lock on %s", entry->d_name);
+            close(fd);
+            if (lock.l_type == F_RDLCK) {
+                closedir(dir);
+                return;
+            }
+        }
+        closedir(dir);
+        usleep(10000);
+    }
+    bail("no process followed the single-flight command");
+}
+
+
+/*
+ * Create a fake cache entry in the cache directory with the given name that
+ * expires at the given time.
+ */
+static void
+fake_entry(const char *cachedir, const char *name, time_t expires)
+{
+    struct utimbuf times;
+    char *path;
+    int fd;
+
+    basprintf(&path, "%s/%s", cachedir, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        sysbail("cannot create %s", path);
+    close(fd);
+    times.actime = expires;
+    times.modtime = expires;
+    if (utime(path, &times) < 0)
+        sysbail("cannot set times on %s", path);
+    free(path);
+}
+
+
+/*
+ * Count the lines in a file.
+ */
+static unsigned long
+count_lines(const char *path)
+{
+    FILE *file;
+    int c;
+    unsigned long count = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    while ((c = getc(file)) != EOF)
+        if (c == '\n')
+            count++;
+    fclose(file);
+    return count;
+}
+
+
+/*
+ * Count the entries in the cache directory, ignoring dot files and the
+ * shared state files for limits and hostnames, and remove them if remove is
+ * true.
+ */
+static unsigned long
+cache_entries(const char *path, bool remove)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char *file;
+    unsigned long count = 0;
+
+    dir = opendir(path);
+    if (dir == NULL)
+        sysbail("cannot open %s", path);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (strstr(entry->d_name, ".state") == NULL)
+            count++;
+        if (remove) {
+            basprintf(&file, "%s/%s", path, entry->d_name);
+            unlink(file);
+            free(file);
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl_result *first, *second, *other;
+    char *tmpdir, *cachedir, *flightdir, *go, *runs, *stale;
+    char *v1_first, *v1_second, *name;
+    char *flight_first, *flight_second, *flight_later;
+    pid_t leader, follower;
+    int leader_fd, follower_fd, go_fd;
+    unsigned long i;
+    time_t now;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    /* Start remctld with a cache directory. */
+    tmpdir = test_tmpdir();
+    basprintf(&cachedir, "%s/cache", tmpdir);
+    remctld = remctld_start(config, "data/conf-simple", "-C", cachedir, NULL);
+
+    plan(18);
+
+    /* The first run of the command caches its result. */
+    first = run_command(config, "cache", "foo");
+    ok(first->error == NULL, "first command");
+    is_int(2, first->status, "...with the right status");
+    ok(first->stderr_len == 6 && memcmp(first->stderr_buf, "error\n", 6) == 0,
+       "...and standard error");
+
+    /* The second run gets the same output, so it wasn't run again. */
+    second = run_command(config, "cache", "foo");
+    ok(second->error == NULL, "second command");
+    is_int(2, second->status, "...has the cached status");
+    ok(second->stdout_len == first->stdout_len
+           && memcmp(second->stdout_buf, first->stdout_buf,
+                     first->stdout_len) == 0,
+       "...and the cached output");
+    ok(second->stderr_len == 6
+           && memcmp(second->stderr_buf, "error\n", 6) == 0,
+       "...and the cached standard error");
+
+    /* Different arguments are cached separately. */
+    other = run_command(config, "cache", "bar");
+    ok(other->error == NULL, "command with other arguments");
+    ok(other->stdout_len != first->stdout_len
+           || memcmp(other->stdout_buf, first->stdout_buf,
+                     first->stdout_len) != 0,
+       "...is not answered from the cache");
+    is_int(2, (long) cache_entries(cachedir, false),
+           "two results in the cache");
+    remctl_result_free(first);
+    remctl_result_free(second);
+    remctl_result_free(other);
+
+    /* Protocol version 1 clients always run the command. */
+    v1_first = run_command_v1(config);
+    v1_second = run_command_v1(config);
+    ok(v1_first != NULL && v1_second != NULL
+           && strcmp(v1_first, v1_second) != 0,
+       "protocol version 1 results are not cached");
+    free(v1_first);
+    free(v1_second);
+
+    /*
+     * Concurrent runs of a single-flight command share the output.  The
+     * command waits until it can read from a FIFO, so hold it until a second
+     * process is following its output.  Opening the FIFO for writing doesn't
+     * finish until the command has started.
+     */
+    basprintf(&flightdir, "%s/flight", tmpdir);
+    basprintf(&go, "%s/go", flightdir);
+    basprintf(&runs, "%s/runs", flightdir);
+    if (mkdir(flightdir, 0700) < 0)
+        sysbail("cannot create %s", flightdir);
+    if (mkfifo(go, 0600) < 0)
+        sysbail("cannot create FIFO %s", go);
+    leader_fd = start_flight(config, flightdir, -1, &leader);
+    go_fd = open(go, O_WRONLY);
+    if (go_fd < 0)
+        sysbail("cannot open %s", go);
+    follower_fd = start_flight(config, flightdir, go_fd, &follower);
+    wait_for_follower(cachedir);
+    close(go_fd);
+    flight_first = finish_flight(leader_fd, leader);
+    flight_second = finish_flight(follower_fd, follower);
+    ok(flight_first[0] != '\0' && strcmp(flight_first, flight_second) == 0,
+       "concurrent single-flight commands share output");
+    is_int(1, (long) count_lines(runs), "...from one run of the command");
+    is_int(2, (long) cache_entries(cachedir, false),
+           "...and the run file is removed");
+
+    /* Once the command has finished, it's run again. */
+    unlink(go);
+    go_fd = open(go, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (go_fd < 0)
+        sysbail("cannot create %s", go);
+    close(go_fd);
+    other = run_command(config, "flight", flightdir);
+    flight_later = bstrndup(other->stdout_buf, other->stdout_len);
+    ok(strcmp(flight_later, flight_first) != 0,
+       "...and later commands run again");
+    remctl_result_free(other);
+    free(flight_later);
+    free(flight_first);
+    free(flight_second);
+    unlink(go);
+    unlink(runs);
+    rmdir(flightdir);
+    free(go);
+    free(runs);
+    free(flightdir);
+
+    /*
+     * Before storing a result, expired results are removed, and if the cache
+     * is still full, the results expiring soonest.  remctld keeps at most
+     * 1024 results.  Fill the cache with fake results, one already expired,
+     * and check that storing a new result keeps it at that size.
+     */
+    now = time(NULL);
+    for (i = 0; i < 1024; i++) {
+        basprintf(&name, "fake%04lu", i);
+        fake_entry(cachedir, name, now + 3600);
+        free(name);
+    }
+    fake_entry(cachedir, "stale", now - 1);
+    other = run_command(config, "cache", "full");
+    ok(other->error == NULL, "command with a full cache");
+    is_int(1024, (long) cache_entries(cachedir, false),
+           "...keeps the cache at its maximum size");
+    basprintf(&stale, "%s/stale", cachedir);
+    ok(access(stale, F_OK) < 0, "...and removes expired results");
+    free(stale);
+    remctl_result_free(other);
+
+    /* Clean up. */
+    process_stop(remctld);
+    cache_entries(cachedir, true);
+    rmdir(cachedir);
+    free(cachedir);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,425 @@
+/*
+ * Test suite for capability negotiation in the server.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/gssapi.h>
+#include <portable/socket.h>
+#include <portable/uio.h>
+
+#include <fcntl.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <client/internal.h>
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+#include <util/compress.h>
+#include <util/gss-tokens.h>
+#include <util/messages.h>
+#include <util/protocol.h>
+#include <util/tokens.h>
+
+
+/*
+ * Build a capabilities token asking for a single capability with the given
+ * value and send it to the server, storing the server reply in tok.  Returns
+ * the flags of the reply and bails on any failure.
+ */
+static int
+send_capabilities(struct remctl *r, OM_uint32 capability, OM_uint32 value,
+                  gss_buffer_t tok)
+{
+    char buffer[2 + 4 + 8];
+    OM_uint32 data, major, minor;
+    gss_buffer_desc send_tok;
+    int flags, status;
+
+    buffer[0] = 4;
+    buffer[1] = MESSAGE_CAPABILITIES;
+    data = htonl(1);
+    memcpy(buffer + 2, &data, 4);
+    data = htonl(capability);
+    memcpy(buffer + 6, &data, 4);
+    data = htonl(value);
+    memcpy(buffer + 10, &data, 4);
+    send_tok.length = sizeof(buffer);
+    send_tok.value = buffer;
+    status = token_send_priv(r->fd, r->context, TOKEN_DATA | TOKEN_PROTOCOL,
+                             &send_tok, 0, &major, &minor);
+    if (status != TOKEN_OK)
+        bail("cannot send token");
+    status = token_recv_priv(r->fd, r->context, &flags, tok, 1024 * 64, 0,
+                             &major, &minor);
+    if (status != TOKEN_OK)
+        bail("cannot receive token");
+    return flags;
+}
+
+
+/*
+ * Given a capabilities reply, check that it grants the expected value for a
+ * single capability.
+ */
+static void
+check_reply(gss_buffer_t tok, OM_uint32 capability, OM_uint32 expected,
+            const char *what)
+{
+    OM_uint32 data;
+    const char *p = tok->value;
+
+    is_int(2 + 4 + 8, tok->length, "%s: reply has correct length", what);
+    if (tok->length != 2 + 4 + 8) {
+        ok_block(4, false, "%s: reply is well-formed", what);
+        return;
+    }
+    is_int(4, p[0], "%s: protocol version is 4", what);
+    is_int(MESSAGE_CAPABILITIES, p[1], "%s: capabilities message", what);
+    memcpy(&data, p + 6, 4);
+    is_int(capability, ntohl(data), "%s: capability", what);
+    memcpy(&data, p + 10, 4);
+    is_int(expected, ntohl(data), "%s: granted value", what);
+}
+
+
+/*
+ * Accept a single connection on port 14374, establish a context, agree to
+ * integrity-only output, and then reply to the first command with a status
+ * token that has only integrity protection, which the client should reject.
+ * We run this in a subprocess as the foil for the client.
+ */
+static void
+fake_server(const char *pidfile)
+{
+    struct sockaddr_in saddr;
+    socket_type s, conn;
+    int fd, flags;
+    int on = 1;
+    const void *onaddr = &on;
+    gss_buffer_desc send_tok, recv_tok;
+    OM_uint32 data, major, minor, ret_flags;
+    gss_ctx_id_t context;
+    gss_name_t client;
+    gss_OID doid;
+    char reply[2 + 4 + 8];
+    char status[3] = { 4, MESSAGE_STATUS, 0 };
+
+    /* Create the socket and accept the connection. */
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(14374);
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET)
+        sysdie("error creating socket");
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, onaddr, sizeof(on));
+    if (bind(s, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+        sysdie("error binding socket");
+    if (listen(s, 1) < 0)
+        sysdie("error listening to socket");
+    fd = open(pidfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        sysdie("cannot create sentinal");
+    close(fd);
+    conn = accept(s, NULL, 0);
+    if (conn == INVALID_SOCKET)
+        sysdie("error accepting connection");
+
+    /* Do the context negotiation. */
+    if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+        die("cannot recv initial token");
+    free(recv_tok.value);
+    context = GSS_C_NO_CONTEXT;
+    do {
+        if (token_recv(conn, &flags, &recv_tok, 64 * 1024, 0) != TOKEN_OK)
+            die("cannot recv subsequent token");
+        major = gss_accept_sec_context(&minor, &context, GSS_C_NO_CREDENTIAL,
+                       &recv_tok, GSS_C_NO_CHANNEL_BINDINGS, &client, &doid,
+                       &send_tok, &ret_flags, NULL, NULL);
+        if (major != GSS_S_COMPLETE && major != GSS_S_CONTINUE_NEEDED)
+            die("GSS-API failure: %ld %ld\n", (long) major, (long) minor);
+        free(recv_tok.value);
+        if (send_tok.length != 0) {
+            flags = TOKEN_CONTEXT | TOKEN_PROTOCOL;
+            if (token_send(conn, flags, &send_tok, 0) != TOKEN_OK)
+                die("cannot send subsequent token");
+            gss_release_buffer(&minor, &send_tok);
+        }
+    } while (major == GSS_S_CONTINUE_NEEDED);
+
+    /* Agree to integrity-only output. */
+    if (token_recv_priv(conn, context, &flags, &recv_tok, 64 * 1024, 0,
+                        &major, &minor)
+        != TOKEN_OK)
+        die("cannot recv capabilities token");
+    gss_release_buffer(&minor, &recv_tok);
+    reply[0] = 4;
+    reply[1] = MESSAGE_CAPABILITIES;
+    data = htonl(1);
+    memcpy(reply + 2, &data, 4);
+    data = htonl(CAPABILITY_INTEGRITY);
+    memcpy(reply + 6, &data, 4);
+    data = htonl(1);
+    memcpy(reply + 10, &data, 4);
+    send_tok.length = sizeof(reply);
+    send_tok.value = reply;
+    if (token_send_priv(conn, context, TOKEN_DATA | TOKEN_PROTOCOL, &send_tok,
+                        0, &major, &minor)
+        != TOKEN_OK)
+        die("cannot send capabilities token");
+
+    /* Reply to the command with an unencrypted status token. */
+    if (token_recv_priv(conn, context, &flags, &recv_tok, 64 * 1024, 0,
+                        &major, &minor)
+        != TOKEN_OK)
+        die("cannot recv command token");
+    gss_release_buffer(&minor, &recv_tok);
+    send_tok.length = sizeof(status);
+    send_tok.value = status;
+    major = gss_wrap(&minor, context, 0, GSS_C_QOP_DEFAULT, &send_tok, NULL,
+                     &recv_tok);
+    if (major != GSS_S_COMPLETE)
+        die("cannot wrap status token");
+    if (token_send(conn, TOKEN_DATA | TOKEN_PROTOCOL, &recv_tok, 0)
+        != TOKEN_OK)
+        die("cannot send status token");
+    gss_release_buffer(&minor, &recv_tok);
+
+    /* All done.  Clean up memory. */
+    gss_release_name(&minor, &client);
+    gss_delete_sec_context(&minor, &context, GSS_C_NO_BUFFER);
+    socket_close(conn);
+    socket_close(s);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct remctl *r;
+    struct remctl_output *output;
+    gss_buffer_desc tok;
+    OM_uint32 major, minor;
+    int flags, status, type;
+    bool encrypted, output_encrypted, status_encrypted;
+    size_t total, largest;
+    char *stdin_data, *path, *pidfile;
+    const char *p;
+    pid_t child;
+    struct timeval tv;
+    struct iovec stdin_command[4];
+    const char *command[] = { "test", "large-output", "1728361", NULL };
+    const char *integrity[] = { "test", "integrity", "1728361", NULL };
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld_start(config, "data/conf-simple", NULL);
+
+    plan(59);
+
+    /* Open the connection to the site. */
+    r = remctl_new();
+    ok(r != NULL, "remctl_new");
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(remctl_open(r, "localhost", 14373, config->principal), "remctl_open");
+
+    /* Ask for a larger size and check the server grants it. */
+    flags = send_capabilities(r, CAPABILITY_MAX_DATA, 1024 * 1024, &tok);
+    is_int(TOKEN_DATA | TOKEN_PROTOCOL, flags, "reply has correct flags");
+    check_reply(&tok, CAPABILITY_MAX_DATA, 1024 * 1024, "larger size");
+    gss_release_buffer(&minor, &tok);
+
+    /* Sizes outside the supported range are clamped. */
+    send_capabilities(r, CAPABILITY_MAX_DATA, 1024, &tok);
+    check_reply(&tok, CAPABILITY_MAX_DATA, TOKEN_MAX_DATA, "small size");
+    gss_release_buffer(&minor, &tok);
+    send_capabilities(r, CAPABILITY_MAX_DATA, TOKEN_MAX_DATA_LIMIT * 2, &tok);
+    check_reply(&tok, CAPABILITY_MAX_DATA, TOKEN_MAX_DATA_LIMIT, "huge size");
+    gss_release_buffer(&minor, &tok);
+
+    /* The server only agrees to compression methods that it supports. */
+    send_capabilities(r, CAPABILITY_COMPRESSION, 0xff, &tok);
+    check_reply(&tok, CAPABILITY_COMPRESSION, (OM_uint32) compress_methods(),
+                "compression");
+    gss_release_buffer(&minor, &tok);
+
+    /* Any non-zero integrity-only setting is agreed to as 1. */
+    send_capabilities(r, CAPABILITY_INTEGRITY, 5, &tok);
+    check_reply(&tok, CAPABILITY_INTEGRITY, 1, "integrity");
+    gss_release_buffer(&minor, &tok);
+    remctl_close(r);
+
+    /* Check remctl_set_token_size validation. */
+    r = remctl_new();
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(!remctl_set_token_size(r, 1024), "remctl_set_token_size too small");
+    is_string("invalid token size 1024 (must be between 65536 and 4194304)",
+              remctl_error(r), "...with correct error");
+    ok(!remctl_set_token_size(r, TOKEN_MAX_DATA_LIMIT + 1),
+       "remctl_set_token_size too large");
+    ok(remctl_set_token_size(r, 0), "remctl_set_token_size to default");
+
+    /* Now, negotiate through the library and run a command. */
+    ok(remctl_set_token_size(r, 1024 * 1024), "remctl_set_token_size");
+    ok(remctl_open(r, "localhost", 14373, config->principal),
+       "remctl_open with larger tokens");
+    is_int(1024 * 1024, r->max_data, "...and negotiated size");
+    ok(remctl_command(r, command), "remctl_command large-output");
+    total = 0;
+    largest = 0;
+    output = remctl_output(r);
+    while (output != NULL) {
+        if (output->type == REMCTL_OUT_OUTPUT) {
+            total += output->length;
+            if (output->length > largest)
+                largest = output->length;
+        } else if (output->type == REMCTL_OUT_STATUS) {
+            is_int(0, output->status, "...correct exit status");
+            break;
+        } else {
+            is_int(REMCTL_OUT_OUTPUT, output->type, "Incorrect output type");
+            break;
+        }
+        output = remctl_output(r);
+    }
+    is_int(1728361, total, "...correct total size");
+    ok(largest <= TOKEN_MAX_OUTPUT_FOR(1024 * 1024),
+       "...and no output token larger than negotiated");
+    remctl_close(r);
+
+    /* Run a command whose output is sent with integrity protection only. */
+    r = remctl_new();
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(remctl_set_integrity_only(r, 1), "remctl_set_integrity_only");
+    ok(remctl_open(r, "localhost", 14373, config->principal),
+       "remctl_open with integrity-only output");
+    ok(r->integrity_ok, "...and server agreed");
+    ok(remctl_command(r, integrity), "remctl_command integrity");
+    total = 0;
+    output = remctl_output(r);
+    while (output != NULL && output->type == REMCTL_OUT_OUTPUT) {
+        total += output->length;
+        output = remctl_output(r);
+    }
+    is_int(1728361, total, "...correct total size");
+
+    /*
+     * Do that again, reading the tokens directly, and check that only the
+     * output tokens were sent without encryption.
+     */
+    ok(remctl_command(r, integrity), "remctl_command integrity again");
+    output_encrypted = false;
+    status_encrypted = false;
+    total = 0;
+    do {
+        status = token_reader_recv_priv(r->reader, r->context, &flags, &tok,
+                                        TOKEN_MAX_LENGTH_FOR(r->max_data), 0,
+                                        &encrypted, &major, &minor);
+        if (status != TOKEN_OK)
+            bail("cannot receive token");
+        p = tok.value;
+        type = p[1];
+        if (type == MESSAGE_OUTPUT) {
+            total += tok.length - 2 - 1 - 4;
+            if (encrypted)
+                output_encrypted = true;
+        } else if (encrypted)
+            status_encrypted = true;
+        gss_release_buffer(&minor, &tok);
+    } while (type == MESSAGE_OUTPUT);
+    is_int(1728361, total, "...correct total size");
+    ok(!output_encrypted, "...and output was not encrypted");
+    ok(status_encrypted, "...but status was");
+    remctl_close(r);
+
+    /* The client rejects other tokens that aren't encrypted. */
+    path = test_tmpdir();
+    basprintf(&pidfile, "%s/pid", path);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        fake_server(pidfile);
+        exit(0);
+    }
+    alarm(1);
+    while (access(pidfile, F_OK) < 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 50000;
+        select(0, NULL, NULL, NULL, &tv);
+    }
+    alarm(0);
+    r = remctl_new();
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    remctl_set_integrity_only(r, 1);
+    ok(remctl_open(r, "127.0.0.1", 14374, config->principal),
+       "remctl_open to fake server");
+    ok(remctl_command(r, integrity), "remctl_command to fake server");
+    ok(remctl_output(r) == NULL, "...and unencrypted status rejected");
+    is_string("unencrypted token from server", remctl_error(r),
+              "...with correct error");
+    remctl_close(r);
+    waitpid(child, NULL, 0);
+    unlink(pidfile);
+    free(pidfile);
+    test_tmpdir_free(path);
+
+    /* Check compression through the library, if supported. */
+    if (compress_methods() == 0) {
+        skip_block(7, "compression not supported");
+        return 0;
+    }
+    r = remctl_new();
+    if (r == NULL)
+        bail("remctl_new returned NULL");
+    ok(remctl_set_compression(r, 1), "remctl_set_compression");
+    ok(remctl_open(r, "localhost", 14373, config->principal),
+       "remctl_open with compression");
+    is_int(compress_methods(), r->compression, "...and negotiated methods");
+    total = 0;
+    ok(remctl_command(r, command), "remctl_command large-output");
+    output = remctl_output(r);
+    while (output != NULL && output->type == REMCTL_OUT_OUTPUT) {
+        total += output->length;
+        output = remctl_output(r);
+    }
+    is_int(1728361, total, "...correct total size");
+
+    /* Send a large, compressible command. */
+    stdin_data = bmalloc(1024 * 1024);
+    memset(stdin_data, 'A', 1024 * 1024);
+    stdin_command[0].iov_base = (char *) "test";
+    stdin_command[0].iov_len = strlen("test");
+    stdin_command[1].iov_base = (char *) "stdin";
+    stdin_command[1].iov_len = strlen("stdin");
+    stdin_command[2].iov_base = (char *) "large";
+    stdin_command[2].iov_len = strlen("large");
+    stdin_command[3].iov_base = stdin_data;
+    stdin_command[3].iov_len = 1024 * 1024;
+    ok(remctl_commandv(r, stdin_command, 4), "remctl_commandv stdin");
+    output = remctl_output(r);
+    if (output == NULL || output->type != REMCTL_OUT_OUTPUT)
+        ok(false, "...got output");
+    else
+        ok(output->length == 4 && memcmp(output->data, "Okay", 4) == 0,
+           "...got correct output");
+    free(stdin_data);
+    remctl_close(r);
+    return 0;
+}
@@ -48,7 +48,7 @@ main(void)
 {
     struct config *config;
 
-    plan(49);
+    plan(87);
     if (chdir(getenv("C_TAP_SOURCE")) < 0)
         sysbail("can't chdir to C_TAP_SOURCE");
 
@@ -64,6 +64,7 @@ main(void)
     ok(config->rules[0]->logmask == NULL, "logmask 1");
     is_string("data/acl-nonexistent", config->rules[0]->acls[0], "acl 1");
     ok(config->rules[0]->acls[1] == NULL, "...and only one acl");
+    ok(!config->rules[0]->integrity, "integrity-only 1");
 
     is_string("test", config->rules[1]->command, "command 2");
     is_string("bar", config->rules[1]->subcommand, "subcommand 2");
@@ -73,6 +74,17 @@ main(void)
     is_string("data/acl-nonexistent", config->rules[1]->acls[0], "acl 2 1");
     is_string("data/acl-no-such-file", config->rules[1]->acls[1], "acl 2 2");
     ok(config->rules[1]->acls[2] == NULL, "...and only two acls");
+    is_int(4096, config->rules[1]->coalesce, "coalesce 2");
+    is_int(50, config->rules[1]->coalesce_delay, "coalesce-delay 2");
+    ok(config->rules[1]->single_flight, "single-flight 2");
+    ok(config->rules[1]->single_flight_user, "...per user");
+    is_int(10, config->rules[1]->rate_count, "rate-limit 2");
+    is_int(60, config->rules[1]->rate_period, "...per period");
+    is_int(2, config->rules[1]->user_rate_count, "user-rate-limit 2");
+    is_int(5, config->rules[1]->user_rate_period, "...per period");
+    is_int(4, config->rules[1]->max_concurrent, "max-concurrent 2");
+    is_int(0, config->rules[1]->max_queued, "max-queued 2");
+    is_int(30, config->rules[1]->queue_timeout, "queue-timeout 2");
 
     is_string("test", config->rules[2]->command, "command 3");
     is_string("baz", config->rules[2]->subcommand, "subcommand 3");
@@ -85,6 +97,12 @@ main(void)
     ok(config->rules[2]->acls[1] == NULL, "...and only one acl");
     is_string("data/cmd-hello", config->rules[2]->summary, "summary 3");
     is_string("data/command-hello", config->rules[2]->help, "help 3");
+    ok(config->rules[2]->integrity, "integrity-only 3");
+    is_int(60, config->rules[2]->cache, "cache 3");
+    ok(config->rules[2]->cache_per_user, "cache-per-user 3");
+    ok(!config->rules[2]->single_flight, "single-flight 3");
+    is_int(0, config->rules[2]->rate_count, "rate-limit 3");
+    is_int(-1, config->rules[2]->max_queued, "max-queued 3");
 
     is_string("foo", config->rules[3]->command, "command 4");
     is_string("ALL", config->rules[3]->subcommand, "subcommand 4");
@@ -114,6 +132,34 @@ main(void)
                " found\n");
     test_error("data/configs/bad-user-1",
                "data/configs/bad-user-1:1: invalid user value nonexistent\n");
+    test_error("data/configs/bad-integrity-1",
+               "data/configs/bad-integrity-1:1: invalid integrity-only value"
+               " maybe\n");
+    test_error("data/configs/bad-coalesce-1",
+               "data/configs/bad-coalesce-1:1: invalid coalesce value 0\n");
+    test_error("data/configs/bad-cache-1",
+               "data/configs/bad-cache-1:1: invalid cache value 1h\n");
+    test_error("data/configs/bad-cache-2",
+               "data/configs/bad-cache-2:1: invalid cache-per-user value"
+               " maybe\n");
+    test_error("data/configs/bad-single-flight-1",
+               "data/configs/bad-single-flight-1:1: invalid single-flight"
+               " value maybe\n");
+    test_error("data/configs/bad-rate-limit-1",
+               "data/configs/bad-rate-limit-1:1: invalid rate-limit value"
+               " 10\n");
+    test_error("data/configs/bad-rate-limit-2",
+               "data/configs/bad-rate-limit-2:1: invalid user-rate-limit"
+               " value 10/0\n");
+    test_error("data/configs/bad-max-concurrent-1",
+               "data/configs/bad-max-concurrent-1:1: invalid max-concurrent"
+               " value 2000\n");
+    test_error("data/configs/bad-max-queued-1",
+               "data/configs/bad-max-queued-1:1: invalid max-queued value"
+               " -1\n");
+    test_error("data/configs/bad-builtin-1",
+               "data/configs/bad-builtin-1:1: invalid builtin value"
+               " stats\n");
 
     return 0;
 }
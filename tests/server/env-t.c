@@ -16,6 +16,7 @@
 #include <client/remctl.h>
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
 #include <tests/tap/remctl.h>
 #include <tests/tap/string.h>
 
@@ -70,15 +71,16 @@ int
 main(void)
 {
     struct kerberos_config *config;
-    char *expected, *value;
+    char *expected, *value, *hostname, *host;
     struct remctl *r;
+    struct process *remctld;
     time_t expires;
 
     /* Unless we have Kerberos available, we can't really do anything. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
-    remctld_start(config, "data/conf-simple", NULL);
+    remctld = remctld_start(config, "data/conf-simple", NULL);
 
-    plan(5);
+    plan(8);
 
     /* Run the tests. */
     r = remctl_new();
@@ -97,10 +99,12 @@ main(void)
     else
         is_string("127.0.0.1\n", value, "value for REMOTE_ADDR");
     free(value);
-    value = test_env(r, "REMOTE_HOST");
-    ok(strcmp(value, "\n") == 0 || strstr(value, "localhost") != NULL,
+    hostname = test_env(r, "REMOTE_HOST");
+    ok(strcmp(hostname, "\n") == 0 || strstr(hostname, "localhost") != NULL,
        "value for REMOTE_HOST");
-    free(value);
+    host = test_env(r, "REMOTE_HOST");
+    is_string(hostname, host, "...and the same for a second command");
+    free(host);
     value = test_env(r, "REMOTE_EXPIRES");
     expires = strtol(value, NULL, 10);
     free(value);
@@ -108,6 +112,29 @@ main(void)
        (unsigned long) expires);
 
     remctl_close(r);
+
+    /* A new connection gets the same hostname, from the shared table. */
+    r = remctl_new();
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot contact remctld");
+    host = test_env(r, "REMOTE_HOST");
+    is_string(hostname, host, "REMOTE_HOST for a new connection");
+    free(host);
+    free(hostname);
+    remctl_close(r);
+    process_stop(remctld);
+
+    /* With -N, the hostname isn't looked up. */
+    remctld = remctld_start(config, "data/conf-simple", "-N", NULL);
+    r = remctl_new();
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot contact remctld");
+    host = test_env(r, "REMOTE_HOST");
+    is_string("\n", host, "REMOTE_HOST not set with -N");
+    free(host);
+    remctl_close(r);
+
+    process_stop(remctld);
     free(expected);
     return 0;
 }
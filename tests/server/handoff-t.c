@@ -0,0 +1,180 @@
+/*
+ * Test suite for handing off connections to a running remctld.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+#include <util/fdpass.h>
+
+
+/*
+ * Fork a client that connects to port 14374 on localhost and runs the test
+ * command.  It exits with status 0 if the command produced the expected
+ * output.  Returns the PID of the client.
+ */
+static pid_t
+start_client(struct kerberos_config *config)
+{
+    struct remctl_result *result;
+    const char *command[] = { "test", "test", NULL };
+    pid_t child;
+    bool okay;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child > 0)
+        return child;
+    result = remctl("localhost", 14374, config->principal, command);
+    okay = (result != NULL && result->error == NULL && result->status == 0
+            && result->stdout_len == 12
+            && memcmp(result->stdout_buf, "hello world\n", 12) == 0);
+    remctl_result_free(result);
+    _exit(okay ? 0 : 1);
+}
+
+
+/*
+ * Wait for a process and return true if it exited with status 0.
+ */
+static bool
+exited_ok(pid_t pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) != pid)
+        return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+/*
+ * Run remctld as if from inetd on the given connection, with the given
+ * configuration file and handoff socket.  Returns true if it exited with
+ * status 0.
+ */
+static bool
+run_inetd(struct kerberos_config *config, socket_type fd, const char *conf,
+          const char *path)
+{
+    pid_t child;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        if (dup2(fd, 0) < 0 || dup2(fd, 1) < 0)
+            _exit(1);
+        close(fd);
+        execl(PATH_REMCTLD, PATH_REMCTLD, "-s", config->principal, "-f",
+              conf, "-H", path, (char *) 0);
+        _exit(1);
+    }
+    return exited_ok(child);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct sockaddr_in sin;
+    struct sockaddr_un sun;
+    socket_type listener, fd, sock;
+    char *tmpdir, *path, *conf;
+    char ack;
+    pid_t client;
+    int on = 1;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/handoff", tmpdir);
+    conf = test_file_path("data/conf-simple");
+    if (conf == NULL)
+        bail("cannot find data/conf-simple");
+    remctld = remctld_start(config, "data/conf-simple", "-H", path, NULL);
+
+    plan(6);
+
+    /* Accept the client connections ourselves, on a different port. */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(14374);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET)
+        sysbail("cannot create socket");
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (void *) &on, sizeof(on));
+    if (bind(listener, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        sysbail("cannot bind to port 14374");
+    if (listen(listener, 5) < 0)
+        sysbail("cannot listen on port 14374");
+
+    /* Pass a connection to the server directly. */
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path))
+        bail("handoff socket path %s too long", path);
+    strcpy(sun.sun_path, path);
+    client = start_client(config);
+    fd = accept(listener, NULL, NULL);
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot accept connection");
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        sysbail("cannot create socket");
+    if (connect(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+        sysbail("cannot connect to %s", path);
+    ok(fdpass_send(sock, fd) && read(sock, &ack, 1) == 1,
+       "server acknowledges handed off connection");
+    close(sock);
+    close(fd);
+    ok(exited_ok(client), "...and runs the command");
+
+    /*
+     * remctld run from inetd with -H passes its connection on without reading
+     * its configuration, so a nonexistent configuration file doesn't matter.
+     */
+    client = start_client(config);
+    fd = accept(listener, NULL, NULL);
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot accept connection");
+    ok(run_inetd(config, fd, "/nonexistent", path), "inetd remctld exits");
+    close(fd);
+    ok(exited_ok(client), "...and the server runs the command");
+
+    /* If the server isn't running, remctld handles the connection itself. */
+    process_stop(remctld);
+    client = start_client(config);
+    fd = accept(listener, NULL, NULL);
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot accept connection");
+    ok(run_inetd(config, fd, conf, path), "inetd remctld without server");
+    close(fd);
+    ok(exited_ok(client), "...runs the command itself");
+
+    /* Clean up. */
+    close(listener);
+    test_file_path_free(conf);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
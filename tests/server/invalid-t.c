@@ -110,6 +110,9 @@ main(void)
         2, MESSAGE_COMMAND, 1, 0,
         0, 0, 0, 0
     };
+    static const char token_capabilities[] = {
+        3, MESSAGE_CAPABILITIES, 0, 0, 0, 0
+    };
     static const char data_trunc[] = {
         0, 0, 0, 2,
         0, 0, 0, 1, 't'
@@ -156,7 +159,7 @@ main(void)
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
     remctld_start(config, "data/conf-simple", NULL);
 
-    plan(11 * 8);
+    plan(12 * 8);
 
     /* Test basic token errors. */
     test_bad_token(config, token_message, sizeof(token_message),
@@ -168,6 +171,9 @@ main(void)
     test_bad_token(config, token_argv0, sizeof(token_argv0),
                    ERROR_UNKNOWN_COMMAND, "Unknown command",
                    "empty command");
+    test_bad_token(config, token_capabilities, sizeof(token_capabilities),
+                   ERROR_UNKNOWN_MESSAGE, "Unknown message",
+                   "capabilities with protocol version 3");
 
     /* Test a bunch of malformatted commands. */
     test_bad_command(config, data_trunc, sizeof(data_trunc),
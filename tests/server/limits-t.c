@@ -0,0 +1,236 @@
+/*
+ * Test suite for remctld rate and concurrency limits.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+#include <util/protocol.h>
+
+
+/*
+ * Run a test command with the given subcommand and optional argument and
+ * return the error code from the server, or 0 if the command was run.  Bails
+ * on any failure to talk to the server.
+ */
+static int
+run_command(struct kerberos_config *config, const char *subcommand,
+            const char *arg)
+{
+    struct remctl *r;
+    struct remctl_output *output;
+    const char *command[] = { "test", NULL, NULL, NULL };
+    int error = -1;
+
+    command[1] = subcommand;
+    command[2] = arg;
+    r = remctl_new();
+    if (r == NULL)
+        bail("cannot allocate memory");
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot contact remctld: %s", remctl_error(r));
+    if (!remctl_command(r, command))
+        bail("cannot send command: %s", remctl_error(r));
+    do {
+        output = remctl_output(r);
+        if (output == NULL)
+            bail("cannot read output: %s", remctl_error(r));
+        if (output->type == REMCTL_OUT_STATUS)
+            error = 0;
+        else if (output->type == REMCTL_OUT_ERROR)
+            error = output->error;
+    } while (output->type != REMCTL_OUT_STATUS
+             && output->type != REMCTL_OUT_ERROR
+             && output->type != REMCTL_OUT_DONE);
+    remctl_close(r);
+    return error;
+}
+
+
+/*
+ * Start a test command with the given subcommand and argument in a child
+ * process.  Returns the process ID, which can be passed to finish_command.
+ * If inherited is not -1, it is a file descriptor that the child should
+ * close.
+ */
+static pid_t
+start_command(struct kerberos_config *config, const char *subcommand,
+              const char *arg, int inherited)
+{
+    pid_t child;
+
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        if (inherited != -1)
+            close(inherited);
+        _exit(run_command(config, subcommand, arg));
+    }
+    return child;
+}
+
+
+/*
+ * Wait for a command started by start_command and return its result, the
+ * same as the return value of run_command.
+ */
+static int
+finish_command(pid_t child)
+{
+    int status;
+
+    if (waitpid(child, &status, 0) < 0)
+        sysbail("cannot wait for child");
+    if (!WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    char *tmpdir, *cachedir, *holddir, *go, *path;
+    DIR *dir;
+    struct dirent *entry;
+    pid_t holder, waiter;
+    int go_fd;
+    time_t start;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+
+    /*
+     * Start remctld with a cache directory, which also holds the rate limits,
+     * so that we can check that cached results aren't limited.
+     */
+    tmpdir = test_tmpdir();
+    basprintf(&cachedir, "%s/cache", tmpdir);
+    remctld = remctld_start(config, "data/conf-simple", "-C", cachedir, NULL);
+
+    plan(18);
+
+    /* The rate-limit command may be run twice before it's refused. */
+    is_int(0, run_command(config, "rate-limit", NULL),
+           "first limited command");
+    is_int(0, run_command(config, "rate-limit", NULL),
+           "second limited command");
+    is_int(ERROR_RATE_LIMITED, run_command(config, "rate-limit", NULL),
+           "third limited command is refused");
+    is_int(0, run_command(config, "test", NULL),
+           "...but other commands work");
+
+    /* The per-user limit allows one command. */
+    is_int(0, run_command(config, "user-rate-limit", NULL),
+           "first user command");
+    is_int(ERROR_RATE_LIMITED, run_command(config, "user-rate-limit", NULL),
+           "second user command is refused");
+
+    /* Limits are refilled over their period. */
+    is_int(0, run_command(config, "rate-refill", NULL),
+           "first refilled command");
+    is_int(ERROR_RATE_LIMITED, run_command(config, "rate-refill", NULL),
+           "...refused at first");
+    sleep(1);
+    is_int(0, run_command(config, "rate-refill", NULL),
+           "...and allowed later");
+
+    /* Results answered from the cache don't count against the limit. */
+    is_int(0, run_command(config, "rate-cache", NULL),
+           "first cached command");
+    is_int(0, run_command(config, "rate-cache", NULL),
+           "...and from the cache");
+
+    /* The limits are kept in the cache directory. */
+    basprintf(&path, "%s/limits.state", cachedir);
+    ok(access(path, F_OK) == 0, "limits table is in cache directory");
+    free(path);
+
+    /*
+     * The concurrency command allows one run at a time and one waiting run.
+     * Hold the first run by having it wait until it can read from a FIFO.
+     * Opening the FIFO for writing doesn't finish until the command has
+     * started.  Then start a second run, which has to wait, and give it a
+     * second to join the queue.  A third run finds the queue full and is
+     * refused right away, and the second gives up when its timeout passes.
+     */
+    basprintf(&holddir, "%s/hold", tmpdir);
+    basprintf(&go, "%s/go", holddir);
+    if (mkdir(holddir, 0700) < 0)
+        sysbail("cannot create %s", holddir);
+    if (mkfifo(go, 0600) < 0)
+        sysbail("cannot create FIFO %s", go);
+    holder = start_command(config, "concurrency", holddir, -1);
+    go_fd = open(go, O_WRONLY);
+    if (go_fd < 0)
+        sysbail("cannot open %s", go);
+    waiter = start_command(config, "concurrency", "none", go_fd);
+    sleep(1);
+    start = time(NULL);
+    is_int(ERROR_BUSY, run_command(config, "concurrency", "none"),
+           "run with a full queue is refused");
+    ok(time(NULL) - start < 2, "...without waiting");
+    is_int(ERROR_BUSY, finish_command(waiter), "queued run times out");
+
+    /* Once the first run finishes, the command can be run again. */
+    close(go_fd);
+    is_int(0, finish_command(holder), "first concurrent run finishes");
+    is_int(0, run_command(config, "concurrency", "none"),
+           "...and the command can be run again");
+
+    /* A queued run starts when the run before it finishes. */
+    holder = start_command(config, "concurrency-wait", holddir, -1);
+    go_fd = open(go, O_WRONLY);
+    if (go_fd < 0)
+        sysbail("cannot open %s", go);
+    waiter = start_command(config, "concurrency-wait", "none", go_fd);
+    sleep(1);
+    close(go_fd);
+    is_int(0, finish_command(waiter), "queued run starts after the first");
+    finish_command(holder);
+    unlink(go);
+    basprintf(&path, "%s/runs", holddir);
+    unlink(path);
+    free(path);
+    rmdir(holddir);
+    free(go);
+    free(holddir);
+
+    /* Clean up. */
+    process_stop(remctld);
+    dir = opendir(cachedir);
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+            basprintf(&path, "%s/%s", cachedir, entry->d_name);
+            unlink(path);
+            free(path);
+        }
+        closedir(dir);
+    }
+    rmdir(cachedir);
+    free(cachedir);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -22,7 +22,8 @@ main(void)
 {
     struct rule rule = {
         NULL, 0, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0, 0, NULL,
-        NULL, NULL
+        NULL, NULL, false, 0, 0, 0, false, false, false,
+        0, 0, 0, 0, 0, 0, 0, BUILTIN_NONE
     };
     struct iovec **command;
     int i;
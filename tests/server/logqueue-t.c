@@ -0,0 +1,185 @@
+/*
+ * Test suite for queued logging in remctld.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Run test test against the server, bailing if it fails.
+ */
+static void
+run_test(struct kerberos_config *config)
+{
+    struct remctl_result *result;
+    const char *command[] = { "test", "test", NULL };
+
+    result = remctl("localhost", 14373, config->principal, command);
+    if (result == NULL)
+        bail("cannot allocate memory");
+    if (result->error != NULL)
+        bail("test test failed: %s", result->error);
+    remctl_result_free(result);
+}
+
+
+/*
+ * Read all data from a file descriptor into a newly allocated string until
+ * the data contains the given string or end of file.
+ */
+static char *
+read_until(int fd, const char *want)
+{
+    char *data;
+    size_t size = 0;
+    ssize_t status;
+
+    data = bmalloc(1024 * 1024);
+    data[0] = '\0';
+    do {
+        status = read(fd, data + size, 1024 * 1024 - 1 - size);
+        if (status > 0)
+            size += (size_t) status;
+        data[size] = '\0';
+    } while (status > 0 && size < 1024 * 1024 - 1
+             && strstr(data, want) == NULL);
+    return data;
+}
+
+
+/*
+ * Wait for up to ten seconds for a file to contain the given string and
+ * return its contents as a newly allocated string, or NULL if it never does.
+ */
+static char *
+wait_file(const char *path, const char *want)
+{
+    char *data;
+    time_t start;
+    int fd;
+
+    start = time(NULL);
+    do {
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            data = read_until(fd, want);
+            close(fd);
+            if (strstr(data, want) != NULL)
+                return data;
+            free(data);
+        }
+        sleep(1);
+    } while (time(NULL) - start < 10);
+    return NULL;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct sockaddr_un addr;
+    char *tmpdir, *path, *dest, *want, *data, *line;
+    socket_type fd, conn;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    tmpdir = test_tmpdir();
+
+    /* Log to a file. */
+    basprintf(&path, "%s/remctld.log", tmpdir);
+    basprintf(&dest, "file:%s", path);
+    remctld = remctld_start(config, "data/conf-simple", "-l", dest, NULL);
+
+    plan(6);
+
+    /* The command should be logged to the file. */
+    run_test(config);
+    basprintf(&want, "notice: COMMAND from %s: test test\n",
+              config->principal);
+    data = wait_file(path, want);
+    ok(data != NULL, "command logged to file");
+    line = (data == NULL) ? NULL : strstr(data, want);
+    while (line != NULL && line > data && line[-1] != '\n')
+        line--;
+    ok(line != NULL && strncmp(line + 19, ".", 1) == 0
+           && strncmp(line + 26, "Z remctld[", 10) == 0,
+       "...with time and process");
+    free(data);
+    free(want);
+    process_stop(remctld);
+    unlink(path);
+    free(path);
+    free(dest);
+
+    /* Log to a Unix socket as JSON. */
+    basprintf(&path, "%s/log.sock", tmpdir);
+    if (strlen(path) >= sizeof(addr.sun_path))
+        bail("socket path %s too long", path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot create socket");
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        sysbail("cannot bind to %s", path);
+    if (listen(fd, 1) < 0)
+        sysbail("cannot listen on %s", path);
+    basprintf(&dest, "json:%s", path);
+    remctld = remctld_start(config, "data/conf-simple", "-l", dest, NULL);
+
+    /* The log writer connects when it has something to send. */
+    run_test(config);
+    alarm(30);
+    conn = accept(fd, NULL, NULL);
+    ok(conn != INVALID_SOCKET, "log writer connects to socket");
+    if (conn == INVALID_SOCKET)
+        sysdiag("accept failed");
+    basprintf(&want, "\"message\":\"COMMAND from %s: test test\"}\n",
+              config->principal);
+    data = (conn == INVALID_SOCKET) ? bstrdup("") : read_until(conn, want);
+    alarm(0);
+    line = strstr(data, want);
+    ok(line != NULL, "command logged as JSON");
+    while (line != NULL && line > data && line[-1] != '\n')
+        line--;
+    ok(line != NULL && strncmp(line, "{\"time\":\"", 9) == 0,
+       "...with time");
+    ok(line != NULL && strstr(line, ",\"level\":\"notice\",") != NULL,
+       "...and level");
+    free(data);
+    free(want);
+
+    /* Clean up. */
+    process_stop(remctld);
+    if (conn != INVALID_SOCKET)
+        close(conn);
+    close(fd);
+    unlink(path);
+    free(path);
+    free(dest);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Test suite for remctld metrics.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Run a command on an open connection, discarding the output, and return the
+ * exit status or -1 on an error from the server.  If output is not NULL,
+ * store the standard output there as a newly allocated nul-terminated
+ * string.
+ */
+static int
+run_command(struct remctl *r, const char *subcommand, const char *arg,
+            char **output)
+{
+    struct remctl_output *out;
+    const char *command[] = { "test", NULL, NULL, NULL };
+    char *result = NULL;
+    size_t length = 0;
+    int status = -1;
+
+    command[1] = subcommand;
+    command[2] = arg;
+    if (!remctl_command(r, command))
+        bail("cannot send command: %s", remctl_error(r));
+    do {
+        out = remctl_output(r);
+        if (out == NULL)
+            bail("cannot read output: %s", remctl_error(r));
+        if (out->type == REMCTL_OUT_OUTPUT && out->stream == 1) {
+            result = brealloc(result, length + out->length + 1);
+            memcpy(result + length, out->data, out->length);
+            length += out->length;
+            result[length] = '\0';
+        } else if (out->type == REMCTL_OUT_STATUS)
+            status = out->status;
+    } while (out->type == REMCTL_OUT_OUTPUT);
+    if (output != NULL)
+        *output = (result == NULL) ? bstrdup("") : result;
+    else
+        free(result);
+    return status;
+}
+
+
+/*
+ * Return true if the metrics include the given line.
+ */
+static bool
+has_line(const char *metrics, const char *line)
+{
+    const char *p;
+    size_t length = strlen(line);
+
+    for (p = metrics; p != NULL && *p != '\0'; p = strchr(p, '\n')) {
+        if (*p == '\n')
+            p++;
+        if (strncmp(p, line, length) == 0 && p[length] == '\n')
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Read the contents of a file into a newly allocated string, returning NULL
+ * if it doesn't exist.
+ */
+static char *
+read_file(const char *path)
+{
+    char *data;
+    size_t size = 0;
+    ssize_t status;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    data = bmalloc(1024 * 1024);
+    do {
+        status = read(fd, data + size, 1024 * 1024 - 1 - size);
+        if (status > 0)
+            size += (size_t) status;
+    } while (status > 0 && size < 1024 * 1024 - 1);
+    close(fd);
+    data[size] = '\0';
+    return data;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl *r;
+    char *tmpdir, *path, *metrics;
+    time_t start;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/metrics.prom", tmpdir);
+    remctld = remctld_start(config, "data/conf-simple", "-M", path, NULL);
+
+    plan(13);
+
+    /* Run a few commands with different results. */
+    r = remctl_new();
+    if (r == NULL)
+        bail("cannot allocate memory");
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot contact remctld: %s", remctl_error(r));
+    is_int(0, run_command(r, "test", NULL, NULL), "test succeeds");
+    is_int(2, run_command(r, "status", "2", NULL), "status fails");
+    is_int(-1, run_command(r, "noauth", NULL, NULL), "noauth is denied");
+    is_int(-1, run_command(r, "unknown", NULL, NULL), "unknown command");
+
+    /* Check the metrics. */
+    is_int(0, run_command(r, "metrics", NULL, &metrics), "metrics succeeds");
+    ok(has_line(metrics, "remctld_connections_total 1"), "...connections");
+    ok(has_line(metrics, "remctld_unknown_commands_total 1"),
+       "...unknown commands");
+    ok(has_line(metrics, "remctld_log_dropped_total 0"), "...log drops");
+    ok(has_line(metrics, "remctld_commands_total{command=\"test\","
+                         "subcommand=\"test\"} 1"),
+       "...commands for a rule");
+    ok(has_line(metrics, "remctld_command_results_total{command=\"test\","
+                         "subcommand=\"status\",result=\"failure\"} 1"),
+       "...results");
+    ok(has_line(metrics, "remctld_command_denied_total{command=\"test\","
+                         "subcommand=\"noauth\"} 1"),
+       "...denials");
+    ok(has_line(metrics, "remctld_command_sent_bytes_total{command=\"test\","
+                         "subcommand=\"test\"} 12"),
+       "...output bytes");
+    free(metrics);
+    remctl_close(r);
+
+    /*
+     * The metrics are written to the file after the connection closes, but
+     * the server may take a moment to notice.
+     */
+    start = time(NULL);
+    do {
+        metrics = read_file(path);
+        if (metrics == NULL)
+            sleep(1);
+    } while (metrics == NULL && time(NULL) - start < 10);
+    ok(metrics != NULL
+           && has_line(metrics, "remctld_command_duration_seconds_count{"
+                                "command=\"test\",subcommand=\"test\"} 1"),
+       "metrics written to file");
+    free(metrics);
+
+    /* Clean up. */
+    process_stop(remctld);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
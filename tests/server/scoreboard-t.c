@@ -0,0 +1,191 @@
+/*
+ * Test suite for the remctld scoreboard.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <client/remctl.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Read the output of a command from an open connection and return the exit
+ * status or -1 on an error from the server.  If output is not NULL, store the
+ * standard output there as a newly allocated nul-terminated string.
+ */
+static int
+read_output(struct remctl *r, char **output)
+{
+    struct remctl_output *out;
+    char *result = NULL;
+    size_t length = 0;
+    int status = -1;
+
+    do {
+        out = remctl_output(r);
+        if (out == NULL)
+            bail("cannot read output: %s", remctl_error(r));
+        if (out->type == REMCTL_OUT_OUTPUT && out->stream == 1) {
+            result = brealloc(result, length + out->length + 1);
+            memcpy(result + length, out->data, out->length);
+            length += out->length;
+            result[length] = '\0';
+        } else if (out->type == REMCTL_OUT_STATUS)
+            status = out->status;
+    } while (out->type == REMCTL_OUT_OUTPUT);
+    if (output != NULL)
+        *output = (result == NULL) ? bstrdup("") : result;
+    else
+        free(result);
+    return status;
+}
+
+
+/*
+ * Send a test command on an open connection.
+ */
+static void
+send_command(struct remctl *r, const char *subcommand)
+{
+    const char *command[] = { "test", NULL, NULL };
+
+    command[1] = subcommand;
+    if (!remctl_command(r, command))
+        bail("cannot send command: %s", remctl_error(r));
+}
+
+
+/*
+ * Retrieve the scoreboard over an open connection, returning it as a newly
+ * allocated string.
+ */
+static char *
+scoreboard(struct remctl *r)
+{
+    char *output;
+
+    send_command(r, "scoreboard");
+    if (read_output(r, &output) != 0)
+        bail("scoreboard command failed");
+    return output;
+}
+
+
+/*
+ * Return true if the scoreboard has a line for a process in the given state
+ * whose line ends in the given string.
+ */
+static bool
+has_worker(const char *board, const char *state, const char *end)
+{
+    const char *line, *eol;
+    size_t length = strlen(end);
+
+    for (line = board; *line != '\0'; line = eol + 1) {
+        eol = strchr(line, '\n');
+        if (eol == NULL)
+            break;
+        if (strstr(line, state) == NULL || strstr(line, state) > eol)
+            continue;
+        if ((size_t) (eol - line) >= length
+            && strncmp(eol - length, end, length) == 0)
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Wait for up to ten seconds for the scoreboard to have or not have a line
+ * for a process in the given state whose line ends in the given string.
+ * Returns true if it reached that condition.
+ */
+static bool
+wait_worker(struct remctl *r, const char *state, const char *end, bool want)
+{
+    char *board;
+    bool found;
+    time_t start;
+
+    start = time(NULL);
+    do {
+        board = scoreboard(r);
+        found = has_worker(board, state, end);
+        free(board);
+        if (found == want)
+            return true;
+        sleep(1);
+    } while (time(NULL) - start < 10);
+    return false;
+}
+
+
+int
+main(void)
+{
+    struct kerberos_config *config;
+    struct process *remctld;
+    struct remctl *r, *busy;
+    char *board, *self;
+
+    /* Unless we have Kerberos available, we can't really do anything. */
+    config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
+    remctld = remctld_start(config, "data/conf-simple", NULL);
+
+    plan(8);
+
+    /* Open two connections and start a slow command on one of them. */
+    r = remctl_new();
+    busy = remctl_new();
+    if (r == NULL || busy == NULL)
+        bail("cannot allocate memory");
+    if (!remctl_open(r, "localhost", 14373, config->principal))
+        bail("cannot contact remctld: %s", remctl_error(r));
+    if (!remctl_open(busy, "localhost", 14373, config->principal))
+        bail("cannot contact remctld: %s", remctl_error(busy));
+    send_command(busy, "sleep");
+
+    /* The scoreboard should show both connections. */
+    ok(wait_worker(r, " running ", " test sleep", true),
+       "scoreboard shows running command");
+    board = scoreboard(r);
+    ok(strncmp(board, "0 handshake, 0 idle, 2 running, 0 sending\n",
+               strlen("0 handshake, 0 idle, 2 running, 0 sending\n"))
+           == 0,
+       "...with count of processes in each state");
+    ok(strstr(board, "\nPID ") != NULL, "...and a header");
+    basprintf(&self, " %s test scoreboard", config->principal);
+    ok(has_worker(board, " running ", self), "...and itself");
+    ok(has_worker(board, " 127.0.0.1 ", self)
+           || has_worker(board, " ::1 ", self),
+       "...with the client address");
+    free(board);
+
+    /* Once the command finishes, that connection is idle. */
+    is_int(0, read_output(busy, NULL), "slow command finishes");
+    ok(wait_worker(r, " idle ", " test sleep", true),
+       "...and its connection is idle");
+
+    /* Once the connection closes, it disappears. */
+    remctl_close(busy);
+    ok(wait_worker(r, " test sleep", " test sleep", false),
+       "...and disappears when closed");
+
+    /* Clean up. */
+    free(self);
+    remctl_close(r);
+    process_stop(remctld);
+    return 0;
+}
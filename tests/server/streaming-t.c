@@ -16,24 +16,58 @@
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
 #include <tests/tap/remctl.h>
+#include <tests/tap/string.h>
 #include <util/protocol.h>
 
 
+/*
+ * Check that an output token from the server has the right type, stream, and
+ * data.  Always runs four tests.
+ */
+static void
+is_output(const struct remctl_output *output, int stream, const char *data,
+          const char *description)
+{
+    size_t length = strlen(data);
+
+    if (output == NULL) {
+        ok_block(4, false, "%s", description);
+        return;
+    }
+    is_int(REMCTL_OUT_OUTPUT, output->type, "%s", description);
+    is_int(stream, output->stream, "...right stream");
+    is_int(length, output->length, "...right length");
+    ok(output->length == length && memcmp(data, output->data, length) == 0,
+       "...right data");
+}
+
+
 int
 main(void)
 {
     struct kerberos_config *config;
     struct remctl *r;
     struct remctl_output *output;
-    size_t total;
+    size_t total, errors;
+    char *tmpdir, *done;
     const char *command_streaming[] = { "test", "streaming", NULL };
     const char *command_cat[] = { "test", "large-output", "1728361", NULL };
+    const char *command_coalesce[] = { "test", "coalesce", NULL };
+    const char *command_coalesce_stdout[] = {
+        "test", "coalesce", "stdout", NULL
+    };
+    const char *command_coalesce_cat[] = {
+        "test", "coalesce-large", "1728361", NULL
+    };
+    const char *command_throttle[] = {
+        "test", "throttle", "512", NULL, NULL
+    };
 
     /* Unless we have Kerberos available, we can't really do anything. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
     remctld_start(config, "data/conf-simple", NULL);
 
-    plan(45);
+    plan(76);
 
     /* First, version 2. */
     r = remctl_new();
@@ -115,6 +149,89 @@ main(void)
         output = remctl_output(r);
     }
     is_int(1728361, total, "...correct total size");
+
+    /*
+     * With coalescing and a long delay, output is held until the command
+     * switches streams, so the output still arrives in order.
+     */
+    ok(remctl_command(r, command_coalesce), "remctl_command coalesce");
+    output = remctl_output(r);
+    is_output(output, 1, "This is the first line\n", "coalesced output");
+    output = remctl_output(r);
+    is_output(output, 2, "This is the second line\n",
+              "coalesced error output");
+    output = remctl_output(r);
+    is_output(output, 1, "This is the third line\n", "coalesced third line");
+    output = remctl_output(r);
+    if (output == NULL)
+        ok_block(2, false, "coalesced status");
+    else {
+        is_int(REMCTL_OUT_STATUS, output->type, "coalesced status");
+        is_int(0, output->status, "...and is right status");
+    }
+
+    /* If all the output is to one stream, it's sent as one token. */
+    ok(remctl_command(r, command_coalesce_stdout),
+       "remctl_command coalesce stdout");
+    output = remctl_output(r);
+    is_output(output, 1,
+              "This is the first line\nThis is the second line\n"
+              "This is the third line\n",
+              "coalesced stdout");
+    output = remctl_output(r);
+    if (output == NULL)
+        ok_block(2, false, "coalesced stdout status");
+    else {
+        is_int(REMCTL_OUT_STATUS, output->type, "coalesced stdout status");
+        is_int(0, output->status, "...and is right status");
+    }
+
+    /* Large output with coalescing still arrives intact. */
+    ok(remctl_command(r, command_coalesce_cat), "remctl_command coalesce cat");
+    output = remctl_output(r);
+    total = 0;
+    while (output != NULL && output->type == REMCTL_OUT_OUTPUT) {
+        total += output->length;
+        output = remctl_output(r);
+    }
+    if (output == NULL)
+        ok(false, "...exit status");
+    else
+        is_int(0, output->status, "...exit status");
+    is_int(1728361, total, "...correct total size");
+
+    /*
+     * If the client stops reading, the server should stop reading from the
+     * command once enough output is queued, so the command blocks writing its
+     * 32MB of output and doesn't finish.  Once the client reads again, all of
+     * the output, the standard error, and the exit status should arrive.
+     */
+    tmpdir = test_tmpdir();
+    basprintf(&done, "%s/throttle-done", tmpdir);
+    command_throttle[3] = done;
+    ok(remctl_command(r, command_throttle), "remctl_command throttle");
+    sleep(2);
+    ok(access(done, F_OK) < 0, "...command blocks while client isn't reading");
+    output = remctl_output(r);
+    total = 0;
+    errors = 0;
+    while (output != NULL && output->type == REMCTL_OUT_OUTPUT) {
+        if (output->stream == 1)
+            total += output->length;
+        else if (output->length == 5 && memcmp(output->data, "done\n", 5) == 0)
+            errors++;
+        output = remctl_output(r);
+    }
+    if (output == NULL)
+        ok(false, "...exit status");
+    else
+        is_int(3, output->status, "...exit status");
+    is_int(32 * 1024 * 1024, total, "...correct total size");
+    is_int(1, errors, "...and standard error");
+    ok(access(done, F_OK) == 0, "...and the command finished");
+    unlink(done);
+    free(done);
+    test_tmpdir_free(tmpdir);
     remctl_close(r);
 
     /* Now, version 1. */
@@ -0,0 +1,134 @@
+/*
+ * Test suite for per-command timing.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/messages.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Spend the given number of milliseconds in a phase.
+ */
+static void
+spend(enum timing_phase phase, long msec)
+{
+    struct timeval tv;
+
+    tv.tv_sec = msec / 1000;
+    tv.tv_usec = (msec % 1000) * 1000;
+    server_timing_begin(phase);
+    select(0, NULL, NULL, NULL, &tv);
+    server_timing_end(phase);
+}
+
+
+/*
+ * Return the value in whole milliseconds of the given key in the captured
+ * log message, or -1 if it isn't present.
+ */
+static long
+logged_msec(const char *key)
+{
+    char *search;
+    const char *p;
+    long msec;
+
+    if (errors == NULL)
+        return -1;
+    basprintf(&search, " %s=", key);
+    p = strstr(errors, search);
+    free(search);
+    if (p == NULL)
+        return -1;
+    msec = strtol(p + strlen(key) + 2, NULL, 10);
+    return msec;
+}
+
+
+int
+main(void)
+{
+    struct client client;
+    char user[] = "test@EXAMPLE.ORG";
+    const char prefix[] = "slow command: user=test@EXAMPLE.ORG command=foo"
+                          " subcommand=bar status=1 total=";
+
+    plan(13);
+
+    memset(&client, 0, sizeof(client));
+    client.user = user;
+
+    /* Nothing is logged by default. */
+    server_timing_connect();
+    server_timing_start();
+    spend(TIMING_CONFIG, 0);
+    errors_capture();
+    server_timing_finish(&client, "foo", "bar", 1);
+    errors_uncapture();
+    is_string(NULL, errors, "nothing logged without a threshold");
+
+    /* With a threshold of zero, every command is logged. */
+    server_timing_setup(0);
+    server_timing_connect();
+    spend(TIMING_GSS, 10);
+    server_timing_start();
+    spend(TIMING_CONFIG, 0);
+    spend(TIMING_ACL, 10);
+    spend(TIMING_ACL, 10);
+    server_timing_begin(TIMING_SPAWN);
+    server_timing_end(TIMING_RUN);
+    errors_capture();
+    server_timing_finish(&client, "foo", "bar", 1);
+    errors_uncapture();
+    ok(errors != NULL && strncmp(errors, prefix, strlen(prefix)) == 0,
+       "slow command logged");
+    ok(logged_msec("total") >= 20, "...with total time");
+    ok(logged_msec("gss") >= 10, "...with GSS-API time");
+    ok(logged_msec("config") >= 0, "...with configuration lookup time");
+    ok(logged_msec("acl") >= 20, "...with ACL time added up");
+    is_int(-1, logged_msec("spawn"), "...without unfinished phases");
+    is_int(-1, logged_msec("run"), "...or phases never entered");
+
+    /* GSS-API time is kept for each command until the next connection. */
+    server_timing_start();
+    errors_capture();
+    server_timing_finish(&client, "foo", NULL, 0);
+    errors_uncapture();
+    ok(errors != NULL && strstr(errors, "subcommand") == NULL,
+       "command without subcommand logged");
+    ok(logged_msec("gss") >= 10, "...with GSS-API time of connection");
+    is_int(-1, logged_msec("acl"), "...but not times of previous command");
+    server_timing_connect();
+    server_timing_start();
+    errors_capture();
+    server_timing_finish(&client, "foo", NULL, 0);
+    errors_uncapture();
+    is_int(-1, logged_msec("gss"), "GSS-API time cleared for new connection");
+
+    /* Fast commands aren't logged. */
+    server_timing_setup(60 * 1000);
+    server_timing_start();
+    spend(TIMING_ACL, 0);
+    errors_capture();
+    server_timing_finish(&client, "foo", "bar", 0);
+    errors_uncapture();
+    is_string(NULL, errors, "fast command not logged");
+
+    /* Clean up. */
+    free(errors);
+    errors = NULL;
+    return 0;
+}
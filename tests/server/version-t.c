@@ -76,7 +76,7 @@ main(void)
     is_int(3, tok.length, "token had correct length");
     is_int(2, ((char *) tok.value)[0], "protocol version is 2");
     is_int(MESSAGE_VERSION, ((char *) tok.value)[1], "message version code");
-    is_int(3, ((char *) tok.value)[2], "highest supported version is 3");
+    is_int(4, ((char *) tok.value)[2], "highest supported version is 4");
 
     /*
      * Send the token again and get another response to ensure that the server
@@ -0,0 +1,147 @@
+/*
+ * Test suite for compression of protocol messages.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <tests/tap/basic.h>
+#include <util/compress.h>
+#include <util/protocol.h>
+
+/* Size of the test data. */
+#define DATA_SIZE (100 * 1024)
+
+
+/*
+ * Run the tests for a single compression method, given the decompression
+ * state to use and compressible data and incompressible data of DATA_SIZE
+ * octets each.
+ */
+static void
+test_method(struct decompressor *decompressor, int method, const char *name,
+            const char *text, const char *noise)
+{
+    struct compressor *compressor;
+    struct iovec iov[3];
+    char *out, *result;
+    size_t length;
+
+    /* Skip all the tests if this method isn't supported. */
+    if ((compress_methods() & (unsigned long) method) == 0) {
+        skip_block(11, "%s not supported", name);
+        return;
+    }
+    compressor = compressor_new(method);
+    ok(compressor != NULL, "%s: compressor_new", name);
+    if (compressor == NULL)
+        bail("cannot create %s compressor", name);
+    is_int(method, compressor_method(compressor), "%s: method", name);
+
+    /* Compress text split over several iovecs and check the round trip. */
+    iov[0].iov_base = (char *) text;
+    iov[0].iov_len = 10;
+    iov[1].iov_base = (char *) text + 10;
+    iov[1].iov_len = 0;
+    iov[2].iov_base = (char *) text + 10;
+    iov[2].iov_len = DATA_SIZE - 10;
+    out = bcalloc(1, DATA_SIZE);
+    result = bcalloc(1, DATA_SIZE);
+    length = DATA_SIZE;
+    ok(compressor_compress(compressor, iov, 3, out, &length),
+       "%s: compress text", name);
+    ok(length < DATA_SIZE / 10, "%s: text compresses well", name);
+    ok(decompressor_decompress(decompressor, method, out, length, result,
+                               DATA_SIZE),
+       "%s: decompress text", name);
+    ok(memcmp(text, result, DATA_SIZE) == 0, "%s: data matches", name);
+
+    /* Decompression must produce exactly the expected length. */
+    ok(!decompressor_decompress(decompressor, method, out, length, result,
+                                DATA_SIZE - 1),
+       "%s: decompress with short length fails", name);
+    ok(!decompressor_decompress(decompressor, method, out, length / 2, result,
+                                DATA_SIZE),
+       "%s: decompress truncated data fails", name);
+
+    /* Incompressible data doesn't fit in a smaller buffer. */
+    iov[0].iov_base = (char *) noise;
+    iov[0].iov_len = DATA_SIZE;
+    length = DATA_SIZE - COMPRESSION_HEADER_SIZE - 1;
+    ok(!compressor_compress(compressor, iov, 1, out, &length),
+       "%s: compress noise fails", name);
+
+    /* The compressor and decompressor are still usable after a failure. */
+    iov[0].iov_base = (char *) text;
+    length = DATA_SIZE;
+    ok(compressor_compress(compressor, iov, 1, out, &length),
+       "%s: compress text again", name);
+    memset(result, 0, DATA_SIZE);
+    ok(decompressor_decompress(decompressor, method, out, length, result,
+                               DATA_SIZE)
+           && memcmp(text, result, DATA_SIZE) == 0,
+       "%s: second round trip", name);
+
+    compressor_free(compressor);
+    free(out);
+    free(result);
+}
+
+
+int
+main(void)
+{
+    struct decompressor *decompressor;
+    char *text, *noise;
+    char buffer[16];
+    size_t i;
+    unsigned long seed;
+    const char line[] = "host.example.com: some inventory data\n";
+
+    plan(5 + 11 * 2);
+
+    /* Generic tests that work regardless of the supported methods. */
+    is_int(0, compress_choose(0), "choose with no methods");
+    ok(compressor_new(0) == NULL, "compressor_new with no method");
+    decompressor = decompressor_new();
+    ok(decompressor != NULL, "decompressor_new");
+    if (decompressor == NULL)
+        bail("cannot create decompressor");
+    ok(!decompressor_decompress(decompressor, 0, "foo", 3, buffer,
+                                sizeof(buffer)),
+       "decompress with no method");
+    if ((compress_methods() & COMPRESSION_ZSTD) != 0)
+        is_int(COMPRESSION_ZSTD,
+               compress_choose(COMPRESSION_ZLIB | COMPRESSION_ZSTD),
+               "zstd is preferred");
+    else
+        is_int((compress_methods() & COMPRESSION_ZLIB) ? COMPRESSION_ZLIB : 0,
+               compress_choose(COMPRESSION_ZLIB | COMPRESSION_ZSTD),
+               "zlib is used if zstd is not available");
+
+    /* Build compressible and incompressible test data. */
+    text = bmalloc(DATA_SIZE);
+    for (i = 0; i < DATA_SIZE; i++)
+        text[i] = line[i % (sizeof(line) - 1)];
+    noise = bmalloc(DATA_SIZE);
+    seed = 1;
+    for (i = 0; i < DATA_SIZE; i++) {
+        seed = seed * 1103515245UL + 12345UL;
+        noise[i] = (char) ((seed >> 16) & 0xff);
+    }
+
+    /* Test each method. */
+    test_method(decompressor, COMPRESSION_ZLIB, "zlib", text, noise);
+    test_method(decompressor, COMPRESSION_ZSTD, "zstd", text, noise);
+    decompressor_free(decompressor);
+
+    free(text);
+    free(noise);
+    return 0;
+}
@@ -33,6 +33,9 @@ int recv_flags;
 /* If set to true, return timeout from the fake token functions. */
 bool fail_timeout = false;
 
+/* If set to true, act as if gss_wrap_iov isn't supported. */
+bool fail_wrap_iov = false;
+
 
 /*
  * Accept a token write request and store it into the buffer.
@@ -52,6 +55,22 @@ fake_token_send(socket_type fd UNUSED, int flags, gss_buffer_t tok,
 }
 
 
+/*
+ * Accept a token write request for a token in a buffer after space for the
+ * token framing and store it into the buffer.
+ */
+enum token_status
+fake_token_send_buffer(socket_type fd, int flags, char *buffer, size_t length,
+                       time_t timeout)
+{
+    gss_buffer_desc tok;
+
+    tok.value = buffer + TOKEN_HEADER_SIZE;
+    tok.length = length;
+    return fake_token_send(fd, flags, &tok, timeout);
+}
+
+
 /*
  * Receive a token from the stored buffer and return it.
  */
@@ -71,3 +90,22 @@ fake_token_recv(socket_type fd UNUSED, int *flags, gss_buffer_t tok,
     *flags = recv_flags;
     return TOKEN_OK;
 }
+
+
+#ifdef HAVE_GSS_WRAP_IOV_LENGTH
+/*
+ * Calculate the lengths for gss_wrap_iov, unless fail_wrap_iov is set, in
+ * which case fail the way a mechanism without gss_wrap_iov support would.
+ */
+OM_uint32
+fake_gss_wrap_iov_length(OM_uint32 *minor, gss_ctx_id_t ctx, int conf,
+                         gss_qop_t qop, int *state, gss_iov_buffer_desc *iov,
+                         int count)
+{
+    if (fail_wrap_iov) {
+        *minor = 0;
+        return GSS_S_FAILURE;
+    }
+    return gss_wrap_iov_length(minor, ctx, conf, qop, state, iov, count);
+}
+#endif
@@ -26,6 +26,8 @@ BEGIN_DECLS
 
 /* Replacement functions called instead of normal utility functions. */
 enum token_status fake_token_send(socket_type, int, gss_buffer_t, time_t);
+enum token_status fake_token_send_buffer(socket_type, int, char *, size_t,
+                                         time_t);
 enum token_status fake_token_recv(socket_type, int *, gss_buffer_t, size_t,
                                   time_t);
 
@@ -42,6 +44,17 @@ extern int recv_flags;
 /* If set to true, return timeout from the fake token functions. */
 extern bool fail_timeout;
 
+/*
+ * Replacement for gss_wrap_iov_length that calls the real function unless
+ * fail_wrap_iov is true, in which case it fails as if the mechanism didn't
+ * support gss_wrap_iov.
+ */
+#ifdef HAVE_GSS_WRAP_IOV_LENGTH
+OM_uint32 fake_gss_wrap_iov_length(OM_uint32 *, gss_ctx_id_t, int, gss_qop_t,
+                                   int *, gss_iov_buffer_desc *, int);
+#endif
+extern bool fail_wrap_iov;
+
 END_DECLS
 
 #endif /* !TESTS_UTIL_FAKEWRITE_H */
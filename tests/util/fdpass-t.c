@@ -0,0 +1,69 @@
+/*
+ * Test suite for passing file descriptors between processes.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <util/fdpass.h>
+
+
+int
+main(void)
+{
+    int fds[2], pipefds[2];
+    int fd;
+    char buffer[5];
+    time_t start;
+
+    plan(9);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        sysbail("cannot create socket pair");
+    if (pipe(pipefds) < 0)
+        sysbail("cannot create pipe");
+
+    /* Pass the read end of the pipe and read data written to it. */
+    ok(fdpass_send(fds[0], pipefds[0]), "send file descriptor");
+    fd = fdpass_recv(fds[1], 5);
+    ok(fd >= 0, "receive file descriptor");
+    ok(fd != pipefds[0], "...which is a new descriptor");
+    ok(fcntl(fd, F_GETFD) & FD_CLOEXEC, "...and close-on-exec");
+    close(pipefds[0]);
+    if (write(pipefds[1], "test", 4) != 4)
+        sysbail("cannot write to pipe");
+    memset(buffer, 0, sizeof(buffer));
+    is_int(4, read(fd, buffer, sizeof(buffer)), "read from descriptor");
+    is_string("test", buffer, "...with the right data");
+    close(fd);
+    close(pipefds[1]);
+
+    /* Receiving with nothing sent times out. */
+    start = time(NULL);
+    errno = 0;
+    fd = fdpass_recv(fds[1], 1);
+    ok(fd < 0 && errno == ETIMEDOUT, "receive times out");
+    ok(time(NULL) - start < 3, "...promptly");
+
+    /* Data without a file descriptor is rejected. */
+    if (write(fds[0], "x", 1) != 1)
+        sysbail("cannot write to socket");
+    errno = 0;
+    fd = fdpass_recv(fds[1], 5);
+    ok(fd < 0 && errno == EPROTO, "data without a descriptor is rejected");
+
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
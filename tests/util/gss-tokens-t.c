@@ -12,6 +12,7 @@
 #include <config.h>
 #include <portable/system.h>
 #include <portable/gssapi.h>
+#include <portable/uio.h>
 
 #include <tests/tap/basic.h>
 #include <tests/tap/kerberos.h>
@@ -29,10 +30,14 @@ main(void)
     OM_uint32 c_stat, c_min_stat, s_stat, s_min_stat, ret_flags;
     gss_OID doid;
     int status, flags;
+    struct iovec iov[3];
+    char *buffer = NULL;
+    size_t i, size = 0;
+    const char *method;
 
     /* Unless we have Kerberos available, we can't really do anything. */
     config = kerberos_setup(TAP_KRB_NEEDS_KEYTAB);
-    plan(28);
+    plan(28 + 11);
 
     /*
      * We have to set up a context first in order to do this test, which is
@@ -127,6 +132,48 @@ main(void)
     ok(memcmp(server_tok.value, "hello", 5) == 0, "...and data");
     gss_release_buffer(&c_min_stat, &server_tok);
 
+    /*
+     * Send a token built from several iovecs, first wrapping it in place with
+     * gss_wrap_iov if available and then forcing the fallback to gss_wrap.
+     */
+    iov[0].iov_base = (char *) "hel";
+    iov[0].iov_len = 3;
+    iov[1].iov_base = (char *) "";
+    iov[1].iov_len = 0;
+    iov[2].iov_base = (char *) "lo";
+    iov[2].iov_len = 2;
+    for (i = 0; i < 2; i++) {
+        fail_wrap_iov = (i == 1);
+        method = fail_wrap_iov ? "gss_wrap" : "gss_wrap_iov";
+        status = token_send_priv_iov(0, server_ctx, 3, iov, 3, &buffer, &size,
+                                     0, &s_stat, &s_min_stat);
+        is_int(TOKEN_OK, status, "sent an iovec token with %s", method);
+        is_int(3, send_flags, "...with the right flags");
+        server_tok.value = send_buffer;
+        server_tok.length = send_length;
+        c_stat = gss_unwrap(&c_min_stat, client_ctx, &server_tok,
+                            &client_tok, NULL, NULL);
+        is_int(GSS_S_COMPLETE, c_stat, "...and it unwrapped");
+        ok(client_tok.length == 5 && memcmp(client_tok.value, "hello", 5) == 0,
+           "...to the right data");
+        gss_release_buffer(&c_min_stat, &client_tok);
+    }
+
+    /* The gss_wrap fallback wraps a single iovec without copying it first. */
+    status = token_send_priv_iov(0, server_ctx, 3, iov, 1, &buffer, &size, 0,
+                                 &s_stat, &s_min_stat);
+    is_int(TOKEN_OK, status, "sent a single iovec token with gss_wrap");
+    server_tok.value = send_buffer;
+    server_tok.length = send_length;
+    c_stat = gss_unwrap(&c_min_stat, client_ctx, &server_tok, &client_tok,
+                        NULL, NULL);
+    is_int(GSS_S_COMPLETE, c_stat, "...and it unwrapped");
+    ok(client_tok.length == 3 && memcmp(client_tok.value, "hel", 3) == 0,
+       "...to the right data");
+    gss_release_buffer(&c_min_stat, &client_tok);
+    fail_wrap_iov = false;
+    free(buffer);
+
     /* Test the stupid protocol v1 MIC stuff. */
     server_tok.value = (char *) "hello";
     server_tok.length = 5;
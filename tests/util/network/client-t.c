@@ -37,6 +37,7 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <time.h>
 
 #include <tests/tap/basic.h>
 #include <util/macros.h>
@@ -296,6 +297,67 @@ test_timeout_ipv4(void)
 }
 
 
+/*
+ * Fill in an addrinfo struct and the IPv4 sockaddr it points to for the given
+ * address and port.
+ */
+static void
+make_addrinfo(struct addrinfo *ai, struct sockaddr_in *sin, const char *addr,
+              unsigned short port)
+{
+    memset(ai, 0, sizeof(*ai));
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    if (!inet_aton(addr, &sin->sin_addr))
+        bail("cannot parse address %s", addr);
+    ai->ai_family = AF_INET;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_addr = (struct sockaddr *) sin;
+    ai->ai_addrlen = sizeof(*sin);
+}
+
+
+/*
+ * Test that network_connect doesn't wait for the full timeout on an address
+ * that doesn't respond before trying the next one.  The first address is in
+ * a range reserved for documentation, so the connection attempt either hangs
+ * or fails immediately, and the second is a listening socket on the loopback
+ * address.
+ */
+static void
+test_race_ipv4(void)
+{
+    socket_type fd, c;
+    struct addrinfo ai[2];
+    struct sockaddr_in sin[2];
+    time_t start;
+
+    fd = network_bind_ipv4(SOCK_STREAM, "127.0.0.1", 11119);
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot create or bind socket");
+    if (listen(fd, 5) < 0)
+        sysbail("cannot listen to socket");
+    make_addrinfo(&ai[0], &sin[0], "192.0.2.1", 11119);
+    make_addrinfo(&ai[1], &sin[1], "127.0.0.1", 11119);
+    ai[0].ai_next = &ai[1];
+
+    /* The second address should win well before the timeout. */
+    start = time(NULL);
+    c = network_connect(ai, NULL, 10);
+    ok(c != INVALID_SOCKET, "Race: connection to second address worked");
+    ok(difftime(time(NULL), start) < 5, "...without waiting for the first");
+    if (c != INVALID_SOCKET)
+        socket_close(c);
+    socket_close(fd);
+
+    /* With nothing listening, the connection fails with the last error. */
+    c = network_connect(&ai[1], NULL, 10);
+    ok(c == INVALID_SOCKET, "Race: connection to closed port fails");
+    is_int(ECONNREFUSED, socket_errno, "...with correct error code");
+}
+
+
 /*
  * Test the network read function with a timeout.  We fork off a child process
  * that runs delay_writer, and then we read from the network twice, once with
@@ -437,7 +499,7 @@ int
 main(void)
 {
     /* Set up the plan. */
-    plan(22);
+    plan(26);
 
     /* Test network_client_create. */
     test_create_ipv4(NULL);
@@ -445,6 +507,7 @@ main(void)
 
     /* Test network_connect with a timeout. */
     test_timeout_ipv4();
+    test_race_ipv4();
 
     /* Test network_read and network_write. */
     test_network_read();
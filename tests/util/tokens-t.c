@@ -140,10 +140,11 @@ main(void)
     char buffer[20];
     ssize_t length;
     gss_buffer_desc result;
+    struct token_reader *reader;
 
     alarm(20);
 
-    plan(12);
+    plan(27);
     if (chdir(getenv("C_TAP_BUILD")) < 0)
         sysbail("can't chdir to C_TAP_BUILD");
 
@@ -282,6 +283,106 @@ main(void)
         waitpid(child, NULL, 0);
     }
 
+    /*
+     * Send several tokens in a single write and read them back with a
+     * buffered reader, followed by a truncated token.
+     */
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        char stream[sizeof(token) * 2 + 5 + 5];
+
+        memcpy(stream, token, sizeof(token));
+        memcpy(stream + sizeof(token), "\4\0\0\0\0", 5);
+        memcpy(stream + sizeof(token) + 5, token, sizeof(token));
+        memcpy(stream + sizeof(token) * 2 + 5, "\0\0\0\0\1", 5);
+        server = create_server();
+        socket_xwrite(server, stream, sizeof(stream));
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        reader = token_reader_new(client);
+        if (reader == NULL)
+            sysbail("cannot allocate token reader");
+        status = token_reader_recv(reader, &flags, &result, 5, 0);
+        is_int(TOKEN_OK, status, "reader received first token");
+        is_int(3, flags, "...with right flags");
+        is_int(5, result.length, "...and right length");
+        ok(memcmp(result.value, "hello", 5) == 0, "...and right data");
+        status = token_reader_recv(reader, &flags, &result, 5, 0);
+        is_int(TOKEN_OK, status, "reader received empty token");
+        is_int(4, flags, "...with right flags");
+        is_int(0, result.length, "...and right length");
+        status = token_reader_recv(reader, &flags, &result, 5, 1);
+        is_int(TOKEN_OK, status, "reader received third token");
+        ok(memcmp(result.value, "hello", 5) == 0, "...with right data");
+        status = token_reader_recv(reader, &flags, &result, 200, 0);
+        is_int(TOKEN_FAIL_EOF, status, "reader detects truncated token");
+        token_reader_free(reader);
+        waitpid(child, NULL, 0);
+        socket_close(client);
+    }
+
+    /* Too-large tokens and timeouts with a buffered reader. */
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        send_hand_token(server);
+        sleep(3);
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        reader = token_reader_new(client);
+        if (reader == NULL)
+            sysbail("cannot allocate token reader");
+        status = token_reader_recv(reader, &flags, &result, 4, 0);
+        is_int(TOKEN_FAIL_LARGE, status, "reader rejects too-large token");
+        token_reader_free(reader);
+        reader = token_reader_new(client);
+        if (reader == NULL)
+            sysbail("cannot allocate token reader");
+        status = token_reader_recv(reader, &flags, &result, 200, 1);
+        is_int(TOKEN_FAIL_TIMEOUT, status, "reader times out");
+        token_reader_free(reader);
+        socket_close(client);
+        waitpid(child, NULL, 0);
+    }
+
+    /* Read a token larger than the initial reader buffer. */
+    unlink("server-ready");
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        server = create_server();
+        result.value = bmalloc(100 * 1024);
+        memset(result.value, 'b', 100 * 1024);
+        result.length = 100 * 1024;
+        token_send(server, 3, &result, 0);
+        free(result.value);
+        socket_close(server);
+        exit(0);
+    } else {
+        client = create_client();
+        reader = token_reader_new(client);
+        if (reader == NULL)
+            sysbail("cannot allocate token reader");
+        status = token_reader_recv(reader, &flags, &result, 200 * 1024, 0);
+        is_int(TOKEN_OK, status, "reader received large token");
+        is_int(3, flags, "...with right flags");
+        is_int(100 * 1024, result.length, "...with right length");
+        token_reader_free(reader);
+        waitpid(child, NULL, 0);
+        socket_close(client);
+    }
+
     /* Special test for error handling when sending tokens. */
     server = open("/dev/full", O_RDWR);
     if (server < 0)
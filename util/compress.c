@@ -0,0 +1,379 @@
+/*
+ * Compression of protocol messages.
+ *
+ * Thin wrappers around zlib and zstd used to compress MESSAGE_COMPRESSED
+ * payloads.  Either or both libraries may be missing, in which case the
+ * corresponding method is simply not supported.  These functions are used by
+ * the client library, so they never call xmalloc or report errors; failure
+ * is reported to the caller, which falls back on sending data uncompressed.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+#include <portable/uio.h>
+
+#include <limits.h>
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#include <util/compress.h>
+#include <util/macros.h>
+#include <util/protocol.h>
+
+/* State for compressing messages with a particular method. */
+struct compressor {
+    int method;
+#ifdef HAVE_ZLIB
+    z_stream zlib;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+};
+
+/*
+ * State for decompressing messages.  The state for each method is set up the
+ * first time a message compressed with that method is seen.
+ */
+struct decompressor {
+    unsigned long methods;      /* Methods whose state has been set up. */
+#ifdef HAVE_ZLIB
+    z_stream zlib;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+};
+
+
+/*
+ * Return the mask of supported compression methods.
+ */
+unsigned long
+compress_methods(void)
+{
+    unsigned long methods = 0;
+
+#ifdef HAVE_ZLIB
+    methods |= COMPRESSION_ZLIB;
+#endif
+#ifdef HAVE_ZSTD
+    methods |= COMPRESSION_ZSTD;
+#endif
+    return methods;
+}
+
+
+/*
+ * Choose the method to use for sending from a mask of methods the other end
+ * accepts.  zstd is generally both faster and better than zlib, so prefer it.
+ */
+int
+compress_choose(unsigned long methods)
+{
+    methods &= compress_methods();
+    if (methods & COMPRESSION_ZSTD)
+        return COMPRESSION_ZSTD;
+    else if (methods & COMPRESSION_ZLIB)
+        return COMPRESSION_ZLIB;
+    else
+        return 0;
+}
+
+
+/*
+ * Create the compression state for a method.  Returns NULL if the method
+ * isn't supported or on allocation failure.
+ */
+struct compressor *
+compressor_new(int method)
+{
+    struct compressor *compressor;
+
+    if (compress_choose((unsigned long) method) != method)
+        return NULL;
+    compressor = calloc(1, sizeof(struct compressor));
+    if (compressor == NULL)
+        return NULL;
+    compressor->method = method;
+    switch (method) {
+#ifdef HAVE_ZLIB
+    case COMPRESSION_ZLIB:
+        if (deflateInit(&compressor->zlib, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            free(compressor);
+            return NULL;
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        compressor->zstd = ZSTD_createCCtx();
+        if (compressor->zstd == NULL) {
+            free(compressor);
+            return NULL;
+        }
+        break;
+#endif
+    default:
+        free(compressor);
+        return NULL;
+    }
+    return compressor;
+}
+
+
+/*
+ * Free the compression state.
+ */
+void
+compressor_free(struct compressor *compressor)
+{
+    if (compressor == NULL)
+        return;
+#ifdef HAVE_ZLIB
+    if (compressor->method == COMPRESSION_ZLIB)
+        deflateEnd(&compressor->zlib);
+#endif
+#ifdef HAVE_ZSTD
+    if (compressor->method == COMPRESSION_ZSTD)
+        ZSTD_freeCCtx(compressor->zstd);
+#endif
+    free(compressor);
+}
+
+
+/*
+ * Return the method of a compressor.
+ */
+int
+compressor_method(const struct compressor *compressor)
+{
+    return compressor->method;
+}
+
+
+/*
+ * Create the decompression state.  Returns NULL on allocation failure.
+ */
+struct decompressor *
+decompressor_new(void)
+{
+    return calloc(1, sizeof(struct decompressor));
+}
+
+
+/*
+ * Free the decompression state.
+ */
+void
+decompressor_free(struct decompressor *decompressor)
+{
+    if (decompressor == NULL)
+        return;
+#ifdef HAVE_ZLIB
+    if (decompressor->methods & COMPRESSION_ZLIB)
+        inflateEnd(&decompressor->zlib);
+#endif
+#ifdef HAVE_ZSTD
+    if (decompressor->methods & COMPRESSION_ZSTD)
+        ZSTD_freeDCtx(decompressor->zstd);
+#endif
+    free(decompressor);
+}
+
+
+#ifdef HAVE_ZLIB
+/*
+ * Compress data with zlib.  If the output buffer fills before all of the
+ * input has been consumed, the data doesn't compress well enough to be worth
+ * it and we give up.
+ */
+static bool
+compress_zlib(z_stream *stream, const struct iovec *iov, size_t count,
+              void *out, size_t *length)
+{
+    size_t i;
+
+    if (deflateReset(stream) != Z_OK)
+        return false;
+    stream->next_out = out;
+    stream->avail_out = (*length > UINT_MAX) ? UINT_MAX : (uInt) *length;
+    for (i = 0; i < count; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        if (iov[i].iov_len > UINT_MAX)
+            return false;
+        stream->next_in = iov[i].iov_base;
+        stream->avail_in = (uInt) iov[i].iov_len;
+        if (deflate(stream, Z_NO_FLUSH) != Z_OK || stream->avail_in > 0)
+            return false;
+    }
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+        return false;
+    *length = stream->total_out;
+    return true;
+}
+#endif /* HAVE_ZLIB */
+
+
+#ifdef HAVE_ZSTD
+/*
+ * Compress data with zstd.  As with zlib, give up if we run out of room in
+ * the output buffer.
+ */
+static bool
+compress_zstd(ZSTD_CCtx *ctx, const struct iovec *iov, size_t count,
+              void *out, size_t *length)
+{
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t i, status;
+
+    if (ZSTD_isError(ZSTD_CCtx_reset(ctx, ZSTD_reset_session_only)))
+        return false;
+    output.dst = out;
+    output.size = *length;
+    output.pos = 0;
+    for (i = 0; i < count; i++) {
+        input.src = iov[i].iov_base;
+        input.size = iov[i].iov_len;
+        input.pos = 0;
+        while (input.pos < input.size) {
+            status = ZSTD_compressStream2(ctx, &output, &input,
+                                          ZSTD_e_continue);
+            if (ZSTD_isError(status) || output.pos == output.size)
+                return false;
+        }
+    }
+    input.src = NULL;
+    input.size = 0;
+    input.pos = 0;
+    do {
+        status = ZSTD_compressStream2(ctx, &output, &input, ZSTD_e_end);
+        if (ZSTD_isError(status))
+            return false;
+        if (status != 0 && output.pos == output.size)
+            return false;
+    } while (status != 0);
+    *length = output.pos;
+    return true;
+}
+#endif /* HAVE_ZSTD */
+
+
+#if !defined(HAVE_ZLIB) && !defined(HAVE_ZSTD)
+
+/*
+ * Without any compression library, compressor_new never succeeds, so these
+ * are never called and exist only to satisfy the linker.
+ */
+bool
+compressor_compress(struct compressor *compressor UNUSED,
+                    const struct iovec *iov UNUSED, size_t count UNUSED,
+                    void *out UNUSED, size_t *length UNUSED)
+{
+    return false;
+}
+
+bool
+decompressor_decompress(struct decompressor *decompressor UNUSED,
+                        int method UNUSED, const void *input UNUSED,
+                        size_t inlen UNUSED, void *out UNUSED,
+                        size_t length UNUSED)
+{
+    return false;
+}
+
+#else /* HAVE_ZLIB || HAVE_ZSTD */
+
+/*
+ * Compress the data in an iovec array into out.  Returns false if it doesn't
+ * fit in *length octets or on any other failure.
+ */
+bool
+compressor_compress(struct compressor *compressor, const struct iovec *iov,
+                    size_t count, void *out, size_t *length)
+{
+    switch (compressor->method) {
+#ifdef HAVE_ZLIB
+    case COMPRESSION_ZLIB:
+        return compress_zlib(&compressor->zlib, iov, count, out, length);
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        return compress_zstd(compressor->zstd, iov, count, out, length);
+#endif
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * Decompress a buffer, which must expand to exactly length octets.  The
+ * expected length comes from the message header, so this also protects
+ * against data that decompresses to far more than the protocol allows.  The
+ * state for the method is kept in the decompressor and reset for each
+ * message rather than allocated anew.
+ */
+bool
+decompressor_decompress(struct decompressor *decompressor, int method,
+                        const void *input, size_t inlen, void *out,
+                        size_t length)
+{
+#ifdef HAVE_ZLIB
+    z_stream *stream;
+#endif
+#ifdef HAVE_ZSTD
+    size_t status;
+#endif
+
+    switch (method) {
+#ifdef HAVE_ZLIB
+    case COMPRESSION_ZLIB:
+        if (inlen > UINT_MAX || length > UINT_MAX)
+            return false;
+        stream = &decompressor->zlib;
+        if (!(decompressor->methods & COMPRESSION_ZLIB)) {
+            if (inflateInit(stream) != Z_OK)
+                return false;
+            decompressor->methods |= COMPRESSION_ZLIB;
+        } else if (inflateReset(stream) != Z_OK)
+            return false;
+        stream->next_in = (Bytef *) input;
+        stream->avail_in = (uInt) inlen;
+        stream->next_out = out;
+        stream->avail_out = (uInt) length;
+        if (inflate(stream, Z_FINISH) != Z_STREAM_END)
+            return false;
+        return (stream->avail_out == 0);
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        if (!(decompressor->methods & COMPRESSION_ZSTD)) {
+            decompressor->zstd = ZSTD_createDCtx();
+            if (decompressor->zstd == NULL)
+                return false;
+            decompressor->methods |= COMPRESSION_ZSTD;
+        }
+        status = ZSTD_decompressDCtx(decompressor->zstd, out, length, input,
+                                     inlen);
+        if (ZSTD_isError(status))
+            return false;
+        return (status == length);
+#endif
+    default:
+        return false;
+    }
+}
+
+#endif /* HAVE_ZLIB || HAVE_ZSTD */
@@ -0,0 +1,88 @@
+/*
+ * Prototypes for compression of protocol messages.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef UTIL_COMPRESS_H
+#define UTIL_COMPRESS_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+#include <sys/types.h>
+
+/* Forward declarations to avoid extra includes. */
+struct compressor;
+struct decompressor;
+struct iovec;
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all util functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Returns the mask of compression methods (from enum compression_methods in
+ * util/protocol.h) supported by this build, which may be zero.
+ */
+unsigned long compress_methods(void);
+
+/*
+ * Given a mask of compression methods, returns the one we prefer to use when
+ * sending data, or 0 if none of them are supported.
+ */
+int compress_choose(unsigned long methods);
+
+/*
+ * Create or free the state for compressing data with a given method.  The
+ * state is kept between messages so that the compression library doesn't
+ * have to allocate its working memory each time.  compressor_new returns
+ * NULL if the method isn't supported or on memory allocation failure.
+ */
+struct compressor *compressor_new(int method)
+    __attribute__((__malloc__));
+void compressor_free(struct compressor *);
+
+/* Returns the compression method used by a compressor. */
+int compressor_method(const struct compressor *);
+
+/*
+ * Compress the data described by an array of iovecs into out, which has room
+ * for *length octets.  On success, returns true and sets *length to the
+ * compressed length.  Returns false if compression fails or if the result
+ * wouldn't fit, in which case the caller should send the data uncompressed.
+ */
+bool compressor_compress(struct compressor *, const struct iovec *,
+                         size_t count, void *out, size_t *length)
+    __attribute__((__nonnull__(1, 4, 5)));
+
+/*
+ * Create or free the state for decompressing data.  As with compressors, the
+ * state is kept between messages, for any method.  decompressor_new returns
+ * NULL on memory allocation failure.
+ */
+struct decompressor *decompressor_new(void)
+    __attribute__((__malloc__));
+void decompressor_free(struct decompressor *);
+
+/*
+ * Decompress the data in input, compressed with the given method, into out.
+ * The data must decompress to exactly length octets.  Returns false if the
+ * method isn't supported, if the data is corrupt, if it decompresses to some
+ * other length, or on memory allocation failure.
+ */
+bool decompressor_decompress(struct decompressor *, int method,
+                             const void *input, size_t inlen, void *out,
+                             size_t length)
+    __attribute__((__nonnull__));
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* UTIL_COMPRESS_H */
@@ -0,0 +1,138 @@
+/*
+ * Pass file descriptors between processes.
+ *
+ * Uses SCM_RIGHTS control messages over UNIX domain stream sockets, which
+ * give the receiving process its own copy of an open file descriptor of the
+ * sending process.  A single byte of data is sent with each descriptor, since
+ * some systems don't deliver control messages without data.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <util/fdflag.h>
+#include <util/fdpass.h>
+
+/* Space for a control message carrying one file descriptor. */
+union fdpass_control {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+};
+
+
+/*
+ * Send a file descriptor over a socket.  Returns true on success and false on
+ * failure, setting errno.
+ */
+bool
+fdpass_send(int sock, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union fdpass_control control;
+    char byte = 0;
+    ssize_t status;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    do {
+        status = sendmsg(sock, &msg, 0);
+    } while (status < 0 && errno == EINTR);
+    return status == 1;
+}
+
+
+/*
+ * Receive a file descriptor from a socket, waiting at most timeout seconds if
+ * timeout isn't 0.  Returns the file descriptor or -1 on failure, setting
+ * errno.
+ */
+int
+fdpass_recv(int sock, time_t timeout)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union fdpass_control control;
+    struct timeval tv;
+    fd_set readfds;
+    char byte;
+    ssize_t status;
+    int fd = -1;
+
+    /* Wait for the message if there's a timeout. */
+    if (timeout > 0) {
+        do {
+            FD_ZERO(&readfds);
+            FD_SET(sock, &readfds);
+            tv.tv_sec = timeout;
+            tv.tv_usec = 0;
+            status = select(sock + 1, &readfds, NULL, NULL, &tv);
+        } while (status < 0 && errno == EINTR);
+        if (status < 0)
+            return -1;
+        if (status == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    /* Read the byte of data and the control message with it. */
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    do {
+        status = recvmsg(sock, &msg, 0);
+    } while (status < 0 && errno == EINTR);
+    if (status < 0)
+        return -1;
+
+    /*
+     * Find the file descriptor.  If the message was truncated, any
+     * descriptors that didn't fit were closed by the kernel, but we may still
+     * have received one we need to close.
+     */
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (status == 1 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    if (fd >= 0 && (msg.msg_flags & MSG_CTRUNC) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    fdflag_close_exec(fd, true);
+    return fd;
+}
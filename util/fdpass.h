@@ -0,0 +1,44 @@
+/*
+ * Prototypes for passing file descriptors between processes.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026 agent <agent@local>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef UTIL_FDPASS_H
+#define UTIL_FDPASS_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+#include <sys/types.h>
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all util functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Send a file descriptor over a connected UNIX domain stream socket, along
+ * with a single byte of data.  Returns true on success and false on failure,
+ * setting errno.  The caller still has its copy of the file descriptor.
+ */
+bool fdpass_send(int sock, int fd);
+
+/*
+ * Receive a file descriptor sent with fdpass_send, waiting at most timeout
+ * seconds (or indefinitely if timeout is 0).  Returns the new file
+ * descriptor, which is close-on-exec, or -1 on failure, setting errno.  errno
+ * is set to ETIMEDOUT on timeout and to EPROTO if no file descriptor was
+ * received.
+ */
+int fdpass_recv(int sock, time_t timeout);
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* UTIL_FDPASS_H */
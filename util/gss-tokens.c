@@ -5,7 +5,9 @@
  * apply integrity and privacy protection to the token data before sending.
  * token_send_priv and token_recv_priv are similar to token_send and
  * token_recv except that they also take a GSS-API context and a GSS-API major
- * and minor status to report errors.
+ * and minor status to report errors.  token_send_priv_iov builds the wrapped
+ * token for a payload given as iovecs directly in a reusable send buffer, and
+ * token_wrap_priv_iov does the same without sending it.
  *
  * Originally written by Anton Ushakov
  * Extensive modifications by Russ Allbery <eagle@eyrie.org>
@@ -19,6 +21,7 @@
 #include <portable/gssapi.h>
 #include <portable/socket.h>
 #include <portable/system.h>
+#include <portable/uio.h>
 
 #include <time.h>
 
@@ -31,10 +34,17 @@
  * functions.
  */
 #if TESTING
-# define token_send fake_token_send
-# define token_recv fake_token_recv
+# define token_send        fake_token_send
+# define token_send_buffer fake_token_send_buffer
+# define token_recv        fake_token_recv
 enum token_status token_send(int, int, gss_buffer_t, time_t);
+enum token_status token_send_buffer(int, int, char *, size_t, time_t);
 enum token_status token_recv(int, int *, gss_buffer_t, size_t, time_t);
+# ifdef HAVE_GSS_WRAP_IOV_LENGTH
+#  define gss_wrap_iov_length fake_gss_wrap_iov_length
+OM_uint32 gss_wrap_iov_length(OM_uint32 *, gss_ctx_id_t, int, gss_qop_t,
+                              int *, gss_iov_buffer_desc *, int);
+# endif
 #endif
 
 
@@ -46,6 +56,10 @@ enum token_status token_recv(int, int *, gss_buffer_t, size_t, time_t);
  * returned, the major and minor status variables will be set to something
  * useful.
  *
+ * The token may be as large as TOKEN_MAX_DATA_LIMIT.  Callers are responsible
+ * for staying within the default TOKEN_MAX_DATA unless a larger size has been
+ * negotiated.
+ *
  * As a hack to support remctl v1, look to see if the flags includes
  * TOKEN_SEND_MIC and don't include TOKEN_PROTOCOL.  If so, expect the remote
  * side to reply with a MIC, which we then verify.
@@ -58,7 +72,7 @@ token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
     int state, micflags;
     enum token_status status;
 
-    if (tok->length > TOKEN_MAX_DATA)
+    if (tok->length > TOKEN_MAX_DATA_LIMIT)
         return TOKEN_FAIL_LARGE;
     *major = gss_wrap(minor, ctx, 1, GSS_C_QOP_DEFAULT, tok, &state, &out);
     if (*major != GSS_S_COMPLETE)
@@ -87,34 +101,209 @@ token_send_priv(socket_type fd, gss_ctx_id_t ctx, int flags, gss_buffer_t tok,
 
 
 /*
- * Receives and unwraps a data payload token.  Takes the file descriptor,
- * GSS-API context, a pointer into which to storge the flags, a buffer for the
- * message, and a place to put GSS-API major and minor status.  Returns
- * TOKEN_OK on success or one of the TOKEN_FAIL_* statuses on failure.  On
- * success, tok will contain newly allocated memory and should be freed when
- * no longer needed using gss_release_buffer.  On failure, any allocated
- * memory will be freed.
+ * Wraps with integrity protection only and sends a data payload token.  This
+ * is the same as token_send_priv except that the token is not encrypted, and
+ * the remctl v1 TOKEN_SEND_MIC hack is not supported.  The peer must have
+ * agreed to accept such tokens.
+ */
+enum token_status
+token_send_integ(socket_type fd, gss_ctx_id_t ctx, int flags,
+                 gss_buffer_t tok, time_t timeout, OM_uint32 *major,
+                 OM_uint32 *minor)
+{
+    gss_buffer_desc out;
+    int state;
+    enum token_status status;
+
+    if (tok->length > TOKEN_MAX_DATA_LIMIT)
+        return TOKEN_FAIL_LARGE;
+    *major = gss_wrap(minor, ctx, 0, GSS_C_QOP_DEFAULT, tok, &state, &out);
+    if (*major != GSS_S_COMPLETE)
+        return TOKEN_FAIL_GSSAPI;
+    status = token_send(fd, flags, &out, timeout);
+    gss_release_buffer(minor, &out);
+    return status;
+}
+
+
+/*
+ * Make sure that the caller's send buffer can hold at least size bytes,
+ * reallocating it if necessary.  Returns false with errno set on allocation
+ * failure.
+ */
+static bool
+ensure_buffer(char **buffer, size_t *size, size_t needed)
+{
+    char *p;
+
+    if (*size >= needed)
+        return true;
+    p = realloc(*buffer, needed);
+    if (p == NULL)
+        return false;
+    *buffer = p;
+    *size = needed;
+    return true;
+}
+
+
+/*
+ * Wraps and encrypts a data payload whose contents are the concatenation of
+ * an array of iovecs, leaving the wrapped token in a send buffer following
+ * TOKEN_HEADER_SIZE bytes of space reserved for the token framing and storing
+ * its length in wrapped.  The send buffer and its allocated size are owned by
+ * the caller and reused (and grown as needed) across calls.
  *
- * As a hack to support remctl v1, look to see if the flags includes
- * TOKEN_SEND_MIC and do not include TOKEN_PROTOCOL.  If so, calculate a MIC
- * and send it back.
+ * If the GSS-API library supports gss_wrap_iov, the payload is copied once
+ * into the send buffer between the GSS-API header, padding, and trailer and
+ * encrypted in place.  The concatenation of those pieces is a normal wrap
+ * token, so the other end just uses gss_unwrap.  Otherwise, fall back on
+ * gss_wrap, gathering the payload in the send buffer first if it's in more
+ * than one piece, and then copy the wrapped token into the send buffer.
  */
 enum token_status
-token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
-                gss_buffer_t tok, size_t max, time_t timeout,
-                OM_uint32 *major, OM_uint32 *minor)
+token_wrap_priv_iov(gss_ctx_id_t ctx, const struct iovec *iov, size_t count,
+                    char **buffer, size_t *size, size_t *wrapped,
+                    OM_uint32 *major, OM_uint32 *minor)
 {
-    gss_buffer_desc in, mic;
+    size_t i, length, offset;
+    gss_buffer_desc in, out;
+    OM_uint32 tmp;
     int state;
+#if defined(HAVE_GSS_WRAP_IOV) && defined(HAVE_GSS_WRAP_IOV_LENGTH)
+    gss_iov_buffer_desc wrap[4];
+    size_t total;
+    char *p;
+#endif
+
+    length = 0;
+    for (i = 0; i < count; i++)
+        length += iov[i].iov_len;
+    if (length > TOKEN_MAX_DATA_LIMIT)
+        return TOKEN_FAIL_LARGE;
+
+#if defined(HAVE_GSS_WRAP_IOV) && defined(HAVE_GSS_WRAP_IOV_LENGTH)
+    memset(wrap, 0, sizeof(wrap));
+    wrap[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    wrap[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    wrap[1].buffer.length = length;
+    wrap[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+    wrap[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+    *major = gss_wrap_iov_length(minor, ctx, 1, GSS_C_QOP_DEFAULT, NULL,
+                                 wrap, 4);
+    if (*major == GSS_S_COMPLETE) {
+        total = TOKEN_HEADER_SIZE;
+        for (i = 0; i < 4; i++)
+            total += wrap[i].buffer.length;
+        if (!ensure_buffer(buffer, size, total))
+            return TOKEN_FAIL_SYSTEM;
+        p = *buffer + TOKEN_HEADER_SIZE;
+        for (i = 0; i < 4; i++) {
+            wrap[i].buffer.value = p;
+            p += wrap[i].buffer.length;
+        }
+        for (i = 0, p = wrap[1].buffer.value; i < count; i++) {
+            if (iov[i].iov_len > 0)
+                memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        *major = gss_wrap_iov(minor, ctx, 1, GSS_C_QOP_DEFAULT, &state,
+                              wrap, 4);
+        if (*major != GSS_S_COMPLETE)
+            return TOKEN_FAIL_GSSAPI;
+
+        /* Padding may have shrunk; if so, close the gap before the trailer. */
+        p = (char *) wrap[2].buffer.value + wrap[2].buffer.length;
+        if (p != wrap[3].buffer.value && wrap[3].buffer.length > 0)
+            memmove(p, wrap[3].buffer.value, wrap[3].buffer.length);
+        total = (size_t) (p - *buffer) + wrap[3].buffer.length;
+        *wrapped = total - TOKEN_HEADER_SIZE;
+        return TOKEN_OK;
+    }
+#endif
+
+    /* No gss_wrap_iov support, so use gss_wrap. */
+    if (count == 1) {
+        in.value = iov[0].iov_base;
+        in.length = length;
+    } else {
+        if (!ensure_buffer(buffer, size, length > 0 ? length : 1))
+            return TOKEN_FAIL_SYSTEM;
+        for (i = 0, offset = 0; i < count; i++) {
+            if (iov[i].iov_len > 0)
+                memcpy(*buffer + offset, iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        in.value = *buffer;
+        in.length = length;
+    }
+    *major = gss_wrap(minor, ctx, 1, GSS_C_QOP_DEFAULT, &in, &state, &out);
+    if (*major != GSS_S_COMPLETE)
+        return TOKEN_FAIL_GSSAPI;
+    if (!ensure_buffer(buffer, size, TOKEN_HEADER_SIZE + out.length)) {
+        gss_release_buffer(&tmp, &out);
+        return TOKEN_FAIL_SYSTEM;
+    }
+    memcpy(*buffer + TOKEN_HEADER_SIZE, out.value, out.length);
+    *wrapped = out.length;
+    gss_release_buffer(&tmp, &out);
+    return TOKEN_OK;
+}
+
+
+/*
+ * Wraps, encrypts, and sends a data payload token whose contents are the
+ * concatenation of an array of iovecs.  Takes the same arguments as
+ * token_send_priv plus a send buffer and its allocated size, as for
+ * token_wrap_priv_iov.  The wrapped token is built in the send buffer and
+ * sent with a single write.
+ *
+ * The remctl v1 TOKEN_SEND_MIC hack is not supported.
+ */
+enum token_status
+token_send_priv_iov(socket_type fd, gss_ctx_id_t ctx, int flags,
+                    const struct iovec *iov, size_t count, char **buffer,
+                    size_t *size, time_t timeout, OM_uint32 *major,
+                    OM_uint32 *minor)
+{
     enum token_status status;
+    size_t length;
 
-    status = token_recv(fd, flags, &in, max, timeout);
+    status = token_wrap_priv_iov(ctx, iov, count, buffer, size, &length,
+                                 major, minor);
     if (status != TOKEN_OK)
         return status;
-    *major = gss_unwrap(minor, ctx, &in, tok, &state, NULL);
-    free(in.value);
+    return token_send_buffer(fd, flags, *buffer, length, timeout);
+}
+
+
+/*
+ * Unwraps a data payload token that has already been read.  Takes the file
+ * descriptor (used only for the remctl v1 MIC reply), the GSS-API context,
+ * the flags of the token, the wrapped token, a buffer for the unwrapped
+ * message, the timeout, where to store whether the token was encrypted, and a
+ * place to put GSS-API major and minor status.  Returns TOKEN_OK or one of
+ * the TOKEN_FAIL_* statuses.  The wrapped token is not freed.  If encrypted
+ * is NULL, we don't report whether the token was encrypted.
+ *
+ * As a hack to support remctl v1, look to see if the flags includes
+ * TOKEN_SEND_MIC and do not include TOKEN_PROTOCOL.  If so, calculate a MIC
+ * and send it back.
+ */
+static enum token_status
+unwrap_token(socket_type fd, gss_ctx_id_t ctx, int *flags, gss_buffer_t in,
+             gss_buffer_t tok, time_t timeout, bool *encrypted,
+             OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_buffer_desc mic;
+    int state;
+    enum token_status status;
+
+    *major = gss_unwrap(minor, ctx, in, tok, &state, NULL);
     if (*major != GSS_S_COMPLETE)
         return TOKEN_FAIL_GSSAPI;
+    if (encrypted != NULL)
+        *encrypted = (state != 0);
     if ((*flags & TOKEN_SEND_MIC) && !(*flags & TOKEN_PROTOCOL)) {
         *major = gss_get_mic(minor, ctx, GSS_C_QOP_DEFAULT, tok, &mic);
         if (*major != GSS_S_COMPLETE) {
@@ -132,3 +321,52 @@ token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
     }
     return TOKEN_OK;
 }
+
+
+/*
+ * Receives and unwraps a data payload token.  Takes the file descriptor,
+ * GSS-API context, a pointer into which to storge the flags, a buffer for the
+ * message, and a place to put GSS-API major and minor status.  Returns
+ * TOKEN_OK on success or one of the TOKEN_FAIL_* statuses on failure.  On
+ * success, tok will contain newly allocated memory and should be freed when
+ * no longer needed using gss_release_buffer.  On failure, any allocated
+ * memory will be freed.
+ */
+enum token_status
+token_recv_priv(socket_type fd, gss_ctx_id_t ctx, int *flags,
+                gss_buffer_t tok, size_t max, time_t timeout,
+                OM_uint32 *major, OM_uint32 *minor)
+{
+    gss_buffer_desc in;
+    enum token_status status;
+
+    status = token_recv(fd, flags, &in, max, timeout);
+    if (status != TOKEN_OK)
+        return status;
+    status = unwrap_token(fd, ctx, flags, &in, tok, timeout, NULL, major,
+                          minor);
+    free(in.value);
+    return status;
+}
+
+
+/*
+ * The same as token_recv_priv, but reads the token through a buffered token
+ * reader.  The unwrapped token is newly allocated as with token_recv_priv.
+ * If encrypted is not NULL, it is set to whether the token was encrypted.
+ */
+enum token_status
+token_reader_recv_priv(struct token_reader *reader, gss_ctx_id_t ctx,
+                       int *flags, gss_buffer_t tok, size_t max,
+                       time_t timeout, bool *encrypted, OM_uint32 *major,
+                       OM_uint32 *minor)
+{
+    gss_buffer_desc in;
+    enum token_status status;
+
+    status = token_reader_recv(reader, flags, &in, max, timeout);
+    if (status != TOKEN_OK)
+        return status;
+    return unwrap_token(reader->fd, ctx, flags, &in, tok, timeout, encrypted,
+                        major, minor);
+}
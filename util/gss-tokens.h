@@ -15,9 +15,13 @@
 #include <config.h>
 #include <portable/gssapi.h>
 #include <portable/macros.h>
+#include <portable/stdbool.h>
 #include <portable/socket.h>
 #include <util/tokens.h>
 
+/* Forward declarations to avoid extra includes. */
+struct iovec;
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
@@ -37,6 +41,46 @@ enum token_status token_recv_priv(socket_type, gss_ctx_id_t, int *flags,
                                   gss_buffer_t, size_t max, time_t,
                                   OM_uint32 *, OM_uint32 *);
 
+/*
+ * Send a token with only GSS-API integrity protection, without encryption.
+ * Only usable once the other end has agreed to accept such tokens.
+ */
+enum token_status token_send_integ(socket_type, gss_ctx_id_t, int flags,
+                                   gss_buffer_t, time_t, OM_uint32 *,
+                                   OM_uint32 *);
+
+/*
+ * Send a token with a GSS-API protection layer whose data is the
+ * concatenation of an array of iovecs.  The caller provides a send buffer and
+ * its size, which are grown as needed and should be reused between calls and
+ * freed by the caller.  Not usable for remctl v1 tokens that expect a MIC.
+ */
+enum token_status token_send_priv_iov(socket_type, gss_ctx_id_t, int flags,
+                                      const struct iovec *, size_t count,
+                                      char **buffer, size_t *size, time_t,
+                                      OM_uint32 *, OM_uint32 *);
+
+/*
+ * The same as token_send_priv_iov, but only build the wrapped token in the
+ * send buffer after TOKEN_HEADER_SIZE bytes of reserved space, storing its
+ * length in the sixth argument, instead of sending it.
+ */
+enum token_status token_wrap_priv_iov(gss_ctx_id_t, const struct iovec *,
+                                      size_t count, char **buffer,
+                                      size_t *size, size_t *wrapped,
+                                      OM_uint32 *, OM_uint32 *);
+
+/*
+ * Receive a token with a GSS-API protection layer through a buffered token
+ * reader.  The returned token is newly allocated, as with token_recv_priv.
+ * If encrypted is not NULL, it is set to whether the token was encrypted so
+ * that the caller can reject tokens with only integrity protection.
+ */
+enum token_status token_reader_recv_priv(struct token_reader *, gss_ctx_id_t,
+                                         int *flags, gss_buffer_t, size_t max,
+                                         time_t, bool *encrypted, OM_uint32 *,
+                                         OM_uint32 *);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
@@ -73,6 +73,12 @@
 # define sin6_set_length(s)     /* empty */
 #endif
 
+/*
+ * How long to wait, in milliseconds, for a connection attempt to finish before
+ * starting the next one in network_connect.  RFC 8305 recommends 250.
+ */
+#define CONNECT_DELAY 250
+
 /*
  * Windows requires a different function when sending to sockets, but can't
  * return short writes on blocking sockets.
@@ -488,96 +494,222 @@ network_source(socket_type fd, int family, const char *source)
 
 
 /*
- * Internal helper function that waits for a non-blocking connect to complete
- * on a socket.  Takes the file descriptor and the timeout.  Returns 0 on a
- * successful completion of the connect within the timeout and -1 on failure.
- * On failure, sets the socket errno.
+ * Order the addresses in a linked list of addrinfo structs for connection
+ * attempts, alternating between address families starting with the family of
+ * the first address as recommended by RFC 8305 but otherwise keeping the
+ * order from the resolver.  Takes the list and an array with room for all of
+ * its entries and returns the number of entries.
  */
-static int
-connect_wait(socket_type fd, time_t timeout)
+static size_t
+connect_order(const struct addrinfo *ai, const struct addrinfo **order)
 {
-    int status, err;
-    socklen_t length;
-    struct timeval tv;
-    fd_set set;
-
-    /*
-     * Use select to poll the file descriptor.  Loop if interrupted by a
-     * caught signal.  This means we could wait for longer than the timeout
-     * when interrupted, but there's no good way of recovering the elapsed
-     * time that's worth the hassle.
-     */
-    do {
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
-        status = select(fd + 1, NULL, &set, NULL, &tv);
-    } while (status < 0 && socket_errno == EINTR);
-
-    /*
-     * If we timed out, set errno appropriately.  If the connection completes,
-     * retrieve the actual status from the socket.
-     */
-    if (status == 0 && !FD_ISSET(fd, &set)) {
-        status = -1;
-        socket_set_errno(ETIMEDOUT);
-    } else if (status > 0 && FD_ISSET(fd, &set)) {
-        length = sizeof(err);
-        status = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &length);
-        if (status == 0) {
-            status = (err == 0) ? 0 : -1;
-            socket_set_errno(err);
+    const struct addrinfo *first, *other;
+    size_t count = 0;
+    int family = ai->ai_family;
+
+    first = ai;
+    other = ai;
+    while (first != NULL || other != NULL) {
+        while (first != NULL && first->ai_family != family)
+            first = first->ai_next;
+        if (first != NULL) {
+            order[count++] = first;
+            first = first->ai_next;
+        }
+        while (other != NULL && other->ai_family == family)
+            other = other->ai_next;
+        if (other != NULL) {
+            order[count++] = other;
+            other = other->ai_next;
         }
     }
-    return status;
+    return count;
+}
+
+
+/*
+ * Internal helper function that creates a socket for an address, binds it to
+ * the source address, and starts a non-blocking connect.  Sets connected to
+ * true if the connect completed immediately.  Returns the socket or
+ * INVALID_SOCKET on failure, with the error in the socket errno.
+ */
+static socket_type
+connect_start(const struct addrinfo *ai, const char *source, bool *connected)
+{
+    socket_type fd;
+    int oerrno;
+
+    *connected = false;
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    if (!network_source(fd, ai->ai_family, source))
+        goto fail;
+    fdflag_nonblocking(fd, true);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        *connected = true;
+    else if (socket_errno != EINPROGRESS)
+        goto fail;
+    return fd;
+
+fail:
+    oerrno = socket_errno;
+    socket_close(fd);
+    socket_set_errno(oerrno);
+    return INVALID_SOCKET;
 }
 
 
 /*
  * Given a linked list of addrinfo structs representing the remote service,
  * try to create a local socket and connect to that service.  Takes an
- * optional source address.  Try each address in turn until one of them
- * connects.  Returns the file descriptor of the open socket on success, or
+ * optional source address.
+ *
+ * Rather than waiting for each address to fail before trying the next one,
+ * start a new connection attempt every CONNECT_DELAY milliseconds, or as soon
+ * as an attempt fails, and keep all of them running until one connects (the
+ * "Happy Eyeballs" algorithm from RFC 8305).  This way, an unreachable
+ * address only delays the connection by CONNECT_DELAY rather than by the
+ * whole timeout, which applies to the connection as a whole.
+ *
+ * Returns the file descriptor of the open socket on success, or
  * INVALID_SOCKET on failure.  Tries to leave the reason for the failure in
  * errno.
  */
 socket_type
 network_connect(const struct addrinfo *ai, const char *source, time_t timeout)
 {
+    const struct addrinfo *p;
+    const struct addrinfo **order = NULL;
+    socket_type *fds = NULL;
     socket_type fd = INVALID_SOCKET;
-    int oerrno, status;
+    socket_type maxfd;
+    size_t count, next, pending, i;
+    long remaining, wait;
+    int status, err, oerrno;
+    bool connected, start;
+    socklen_t length;
+    struct timeval tv;
+    fd_set set;
+
+    /* Put the addresses in the order in which to try them. */
+    for (count = 0, p = ai; p != NULL; p = p->ai_next)
+        count++;
+    order = calloc(count, sizeof(*order));
+    fds = calloc(count, sizeof(*fds));
+    if (order == NULL || fds == NULL) {
+        free(order);
+        free(fds);
+        return INVALID_SOCKET;
+    }
+    count = connect_order(ai, order);
+    for (i = 0; i < count; i++)
+        fds[i] = INVALID_SOCKET;
 
-    for (status = -1; status != 0 && ai != NULL; ai = ai->ai_next) {
-        if (fd != INVALID_SOCKET)
-            socket_close(fd);
-        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if (fd == INVALID_SOCKET)
+    /*
+     * The remaining time is only reduced when select times out, so we may
+     * wait longer than the timeout if attempts keep failing or we keep being
+     * interrupted by caught signals, but there's no portable way of getting
+     * the elapsed time that's worth the hassle.
+     */
+    remaining = (timeout == 0) ? -1 : (long) timeout * 1000;
+    err = 0;
+    next = 0;
+    pending = 0;
+    start = true;
+    while (fd == INVALID_SOCKET) {
+        if (start && next < count) {
+            start = false;
+            fds[next] = connect_start(order[next], source, &connected);
+            if (fds[next] == INVALID_SOCKET) {
+                err = socket_errno;
+                start = true;
+                next++;
+                continue;
+            } else if (connected) {
+                fd = fds[next];
+                fds[next] = INVALID_SOCKET;
+                break;
+            }
+            next++;
+            pending++;
+        }
+        if (pending == 0) {
+            if (next >= count)
+                break;
+            start = true;
             continue;
-        if (!network_source(fd, ai->ai_family, source))
+        }
+        if (remaining == 0) {
+            err = ETIMEDOUT;
+            break;
+        }
+
+        /* Wait for a pending attempt to finish or for the next delay. */
+        wait = (next < count) ? CONNECT_DELAY : remaining;
+        if (remaining > 0 && wait > remaining)
+            wait = remaining;
+        FD_ZERO(&set);
+        maxfd = 0;
+        for (i = 0; i < next; i++)
+            if (fds[i] != INVALID_SOCKET) {
+                FD_SET(fds[i], &set);
+                if (fds[i] > maxfd)
+                    maxfd = fds[i];
+            }
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+        status = select(maxfd + 1, NULL, &set, NULL, wait < 0 ? NULL : &tv);
+        if (status < 0 && socket_errno == EINTR)
+            continue;
+        else if (status < 0) {
+            err = socket_errno;
+            break;
+        } else if (status == 0) {
+            if (remaining > 0)
+                remaining -= wait;
+            start = true;
             continue;
-        if (timeout == 0)
-            status = connect(fd, ai->ai_addr, ai->ai_addrlen);
-        else {
-            fdflag_nonblocking(fd, true);
-            status = connect(fd, ai->ai_addr, ai->ai_addrlen);
-            if (status < 0 && socket_errno == EINPROGRESS)
-                status = connect_wait(fd, timeout);
-            oerrno = socket_errno;
-            fdflag_nonblocking(fd, false);
-            socket_set_errno(oerrno);
         }
-    }
-    if (status == 0)
-        return fd;
-    else {
-        if (fd != INVALID_SOCKET) {
-            oerrno = socket_errno;
-            socket_close(fd);
-            socket_set_errno(oerrno);
+
+        /*
+         * Check the result of each attempt that finished.  The first one that
+         * succeeded wins, and a failure starts the next attempt right away.
+         */
+        for (i = 0; i < next && fd == INVALID_SOCKET; i++) {
+            if (fds[i] == INVALID_SOCKET || !FD_ISSET(fds[i], &set))
+                continue;
+            length = sizeof(status);
+            if (getsockopt(fds[i], SOL_SOCKET, SO_ERROR, (void *) &status,
+                           &length) < 0)
+                status = socket_errno;
+            if (status == 0) {
+                fd = fds[i];
+                fds[i] = INVALID_SOCKET;
+            } else {
+                err = status;
+                socket_close(fds[i]);
+                fds[i] = INVALID_SOCKET;
+                pending--;
+                start = true;
+            }
         }
+    }
+
+    /* Close the losing attempts and return the winner, if any. */
+    for (i = 0; i < next; i++)
+        if (fds[i] != INVALID_SOCKET)
+            socket_close(fds[i]);
+    free(order);
+    free(fds);
+    if (fd == INVALID_SOCKET) {
+        socket_set_errno(err);
         return INVALID_SOCKET;
     }
+    oerrno = socket_errno;
+    fdflag_nonblocking(fd, false);
+    socket_set_errno(oerrno);
+    return fd;
 }
 
 
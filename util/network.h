@@ -99,9 +99,12 @@ socket_type network_accept_any(socket_type fds[], unsigned int count,
  * Create a socket and connect it to the remote service given by the linked
  * list of addrinfo structs.  Returns the new file descriptor on success and
  * INVALID_SOCKET on failure, with the error left in errno.  Takes an optional
- * source address and a timeout in seconds, which may be 0 for no timeout.
- * (Source may also be "all" or "any", which mean the same thing as NULL: do
- * not use any particular source address.)
+ * source address and a timeout in seconds for the whole connection, which may
+ * be 0 for no timeout.  (Source may also be "all" or "any", which mean the
+ * same thing as NULL: do not use any particular source address.)
+ *
+ * If there are several addresses, a new connection attempt is started every
+ * 250ms, alternating between address families, until one of them connects.
  */
 socket_type network_connect(const struct addrinfo *, const char *source,
                             time_t)
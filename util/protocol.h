@@ -27,17 +27,59 @@
 #define TOKEN_MAX_OUTPUT        (TOKEN_MAX_DATA - 1 - 1 - 1 - 4)
 #define TOKEN_MAX_OUTPUT_V1     (TOKEN_MAX_DATA - 4 - 4)
 
+/*
+ * The largest data payload that client and server may agree on with
+ * MESSAGE_CAPABILITIES.  The _FOR macros give the maximum token length and
+ * MESSAGE_OUTPUT payload for a negotiated data size, keeping the same room
+ * for GSS-API overhead as the default limits.
+ */
+#define TOKEN_MAX_DATA_LIMIT    (4 * 1024 * 1024)
+#define TOKEN_MAX_LENGTH_FOR(d) ((d) + TOKEN_MAX_LENGTH - TOKEN_MAX_DATA)
+#define TOKEN_MAX_OUTPUT_FOR(d) ((d) - 1 - 1 - 1 - 4)
+
+/* The highest protocol version we support. */
+#define PROTOCOL_VERSION        4
+
 /* Message types. */
 enum message_types {
-    MESSAGE_COMMAND = 1,
-    MESSAGE_QUIT    = 2,
-    MESSAGE_OUTPUT  = 3,
-    MESSAGE_STATUS  = 4,
-    MESSAGE_ERROR   = 5,
-    MESSAGE_VERSION = 6,
-    MESSAGE_NOOP    = 7
+    MESSAGE_COMMAND      = 1,
+    MESSAGE_QUIT         = 2,
+    MESSAGE_OUTPUT       = 3,
+    MESSAGE_STATUS       = 4,
+    MESSAGE_ERROR        = 5,
+    MESSAGE_VERSION      = 6,
+    MESSAGE_NOOP         = 7,
+    MESSAGE_CAPABILITIES = 8,
+    MESSAGE_COMPRESSED   = 9
+};
+
+/* Capabilities that can be negotiated with MESSAGE_CAPABILITIES. */
+enum capabilities {
+    CAPABILITY_MAX_DATA    = 1, /* Maximum data payload of a token. */
+    CAPABILITY_COMPRESSION = 2, /* Mask of supported compression methods. */
+    CAPABILITY_INTEGRITY   = 3  /* Accept integrity-only OUTPUT messages. */
+};
+
+/*
+ * Compression methods for MESSAGE_COMPRESSED.  Each is a single bit so that
+ * they can be combined into a mask for CAPABILITY_COMPRESSION.
+ */
+enum compression_methods {
+    COMPRESSION_ZLIB = (1 << 0),
+    COMPRESSION_ZSTD = (1 << 1)
 };
 
+/*
+ * Messages shorter than this are never compressed, since the savings are
+ * unlikely to be worth the cost.  The header of MESSAGE_COMPRESSED is the
+ * version, type, method, and uncompressed length.
+ */
+#define COMPRESSION_MIN_SIZE    1024
+#define COMPRESSION_HEADER_SIZE (1 + 1 + 1 + 4)
+
+/* Maximum number of capabilities in a MESSAGE_CAPABILITIES message. */
+#define CAPABILITY_MAX_COUNT    64
+
 /* Windows uses this for something else. */
 #ifdef _WIN32
 # undef ERROR_BAD_COMMAND
@@ -54,7 +96,9 @@ enum error_codes {
     ERROR_TOOMANY_ARGS       = 7,  /* Argument count exceeds server limit. */
     ERROR_TOOMUCH_DATA       = 8,  /* Argument size exceeds server limit. */
     ERROR_UNEXPECTED_MESSAGE = 9,  /* Message type not valid now. */
-    ERROR_NO_HELP            = 10  /* No help defined for this command. */
+    ERROR_NO_HELP            = 10, /* No help defined for this command. */
+    ERROR_RATE_LIMITED       = 11, /* Command is over its rate limit. */
+    ERROR_BUSY               = 12  /* Too many concurrent runs of command. */
 };
 
 #endif /* UTIL_PROTOCOL_H */
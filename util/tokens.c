@@ -3,7 +3,8 @@
  *
  * Low-level routines to send and receive remctl tokens.  token_send and
  * token_recv do not do anything to their provided input or output except
- * wrapping flags and a length around them.
+ * wrapping flags and a length around them.  token_reader_recv is a buffered
+ * variant of token_recv for reading a stream of tokens from one connection.
  *
  * Originally written by Anton Ushakov
  * Extensive modifications by Russ Allbery <eagle@eyrie.org>
@@ -20,6 +21,12 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
 #include <time.h>
 
 #include <util/messages.h>
@@ -27,6 +34,9 @@
 #include <util/tokens.h>
 #include <util/xwrite.h>
 
+/* Initial size of the read-ahead buffer of a token reader. */
+#define TOKEN_READER_SIZE (16 * 1024)
+
 
 /*
  * Given a socket errno, map it to one of our error codes.
@@ -55,28 +65,61 @@ map_socket_error(int err)
 enum token_status
 token_send(socket_type fd, int flags, gss_buffer_t tok, time_t timeout)
 {
-    size_t buflen;
     char *buffer;
-    bool okay;
-    unsigned char char_flags = (unsigned char) flags;
-    OM_uint32 len;
+    enum token_status status;
 
     /* Send out the whole message in a single write. */
-    if (tok->length > UINT32_MAX - 1 - sizeof(OM_uint32)) {
+    if (tok->length > UINT32_MAX - TOKEN_HEADER_SIZE) {
         errno = ENOMEM;
         return TOKEN_FAIL_SYSTEM;
     }
-    buflen = 1 + sizeof(OM_uint32) + tok->length;
-    buffer = malloc(buflen);
+    buffer = malloc(TOKEN_HEADER_SIZE + tok->length);
     if (buffer == NULL)
         return TOKEN_FAIL_SYSTEM;
+    memcpy(buffer + TOKEN_HEADER_SIZE, tok->value, tok->length);
+    status = token_send_buffer(fd, flags, buffer, tok->length, timeout);
+    free(buffer);
+    return status;
+}
+
+
+/*
+ * Fill in the flags and length of a token whose data of the given length
+ * follows TOKEN_HEADER_SIZE bytes of reserved space in buffer.  Returns false
+ * and sets errno if the length is too large to represent.
+ */
+bool
+token_frame(char *buffer, int flags, size_t length)
+{
+    unsigned char char_flags = (unsigned char) flags;
+    OM_uint32 len;
+
+    if (length > UINT32_MAX - TOKEN_HEADER_SIZE) {
+        errno = ENOMEM;
+        return false;
+    }
     memcpy(buffer, &char_flags, 1);
-    len = htonl((OM_uint32) tok->length);
+    len = htonl((OM_uint32) length);
     memcpy(buffer + 1, &len, sizeof(OM_uint32));
-    memcpy(buffer + 1 + sizeof(OM_uint32), tok->value, tok->length);
-    okay = network_write(fd, buffer, buflen, timeout);
-    free(buffer);
-    return okay ? TOKEN_OK : map_socket_error(socket_errno);
+    return true;
+}
+
+
+/*
+ * Send a token whose data is already in a buffer, following TOKEN_HEADER_SIZE
+ * bytes of space for the flags and length.  Fills in the framing and sends
+ * the token with a single write.  Returns the same status codes as
+ * token_send.
+ */
+enum token_status
+token_send_buffer(socket_type fd, int flags, char *buffer, size_t length,
+                  time_t timeout)
+{
+    if (!token_frame(buffer, flags, length))
+        return TOKEN_FAIL_SYSTEM;
+    if (!network_write(fd, buffer, TOKEN_HEADER_SIZE + length, timeout))
+        return map_socket_error(socket_errno);
+    return TOKEN_OK;
 }
 
 
@@ -135,3 +178,268 @@ token_recv(socket_type fd, int *flags, gss_buffer_t tok, size_t max,
     }
     return TOKEN_OK;
 }
+
+
+/*
+ * Create a new buffered token reader for a file descriptor.  Returns NULL
+ * with errno set on memory allocation failure.
+ */
+struct token_reader *
+token_reader_new(socket_type fd)
+{
+    struct token_reader *reader;
+
+    reader = calloc(1, sizeof(struct token_reader));
+    if (reader == NULL)
+        return NULL;
+    reader->buffer = malloc(TOKEN_READER_SIZE);
+    if (reader->buffer == NULL) {
+        free(reader);
+        return NULL;
+    }
+    reader->fd = fd;
+    reader->size = TOKEN_READER_SIZE;
+    return reader;
+}
+
+
+/*
+ * Free a buffered token reader.  Any unparsed data is discarded.
+ */
+void
+token_reader_free(struct token_reader *reader)
+{
+    if (reader == NULL)
+        return;
+    free(reader->buffer);
+    free(reader);
+}
+
+
+/*
+ * Make room for at least need bytes of unparsed data in the reader's buffer,
+ * shifting unparsed data to the front and growing the buffer if needed.
+ * Returns false on memory allocation failure.
+ */
+static bool
+reader_reserve(struct token_reader *reader, size_t need)
+{
+    size_t size;
+    char *buffer;
+
+    if (reader->size - reader->start < need) {
+        memmove(reader->buffer, reader->buffer + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->size < need) {
+        size = reader->size;
+        while (size < need)
+            size *= 2;
+        buffer = realloc(reader->buffer, size);
+        if (buffer == NULL)
+            return false;
+        reader->buffer = buffer;
+        reader->size = size;
+    }
+    return true;
+}
+
+
+/*
+ * Ensure that at least need bytes of unparsed data are in the reader's
+ * buffer, growing the buffer if needed.  Each read takes as much data as the
+ * socket has available, so later tokens are usually already buffered.  The
+ * timeout (in seconds, or 0 for none) applies to the whole operation, as with
+ * network_read.  Returns TOKEN_OK on success or a TOKEN_FAIL_* code.
+ */
+static enum token_status
+reader_fill(struct token_reader *reader, size_t need, time_t timeout)
+{
+    time_t start, now;
+    fd_set set;
+    struct timeval tv;
+    ssize_t status;
+
+    if (reader->end - reader->start >= need)
+        return TOKEN_OK;
+    if (!reader_reserve(reader, need))
+        return TOKEN_FAIL_SYSTEM;
+
+    /*
+     * Wait for data and read as much as will fit.  If either select or read
+     * fails with EINTR, restart the loop, and rely on the overall timeout to
+     * limit how long we wait without forward progress.
+     */
+    start = time(NULL);
+    now = start;
+    while (reader->end - reader->start < need) {
+        if (timeout > 0 && now - start >= timeout) {
+            socket_set_errno(ETIMEDOUT);
+            return TOKEN_FAIL_TIMEOUT;
+        }
+        FD_ZERO(&set);
+        FD_SET(reader->fd, &set);
+        tv.tv_sec = timeout - (now - start);
+        if (tv.tv_sec < 1)
+            tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        status = select(reader->fd + 1, &set, NULL, NULL,
+                        timeout == 0 ? NULL : &tv);
+        if (status < 0) {
+            if (socket_errno == EINTR) {
+                now = time(NULL);
+                continue;
+            }
+            return map_socket_error(socket_errno);
+        } else if (status == 0) {
+            socket_set_errno(ETIMEDOUT);
+            return TOKEN_FAIL_TIMEOUT;
+        }
+        status = socket_read(reader->fd, reader->buffer + reader->end,
+                             reader->size - reader->end);
+        if (status < 0) {
+            if (socket_errno != EINTR && socket_errno != EAGAIN)
+                return map_socket_error(socket_errno);
+        } else if (status == 0) {
+            socket_set_errno(EPIPE);
+            return TOKEN_FAIL_EOF;
+        } else {
+            reader->end += status;
+        }
+        now = time(NULL);
+    }
+    return TOKEN_OK;
+}
+
+
+/*
+ * Receive a token using a buffered reader.  Takes the same arguments and
+ * returns the same status codes as token_recv, but on success the value
+ * member of the token points into the reader's buffer and remains valid only
+ * until the next call to token_reader_recv.  It must not be freed.
+ */
+enum token_status
+token_reader_recv(struct token_reader *reader, int *flags, gss_buffer_t tok,
+                  size_t max, time_t timeout)
+{
+    OM_uint32 len;
+    enum token_status status;
+    const size_t header = TOKEN_HEADER_SIZE;
+
+    status = reader_fill(reader, header, timeout);
+    if (status != TOKEN_OK)
+        return status;
+    *flags = (unsigned char) reader->buffer[reader->start];
+    memcpy(&len, reader->buffer + reader->start + 1, sizeof(OM_uint32));
+    tok->length = ntohl(len);
+    if (tok->length > max) {
+        reader->start += header;
+        return TOKEN_FAIL_LARGE;
+    }
+    if (tok->length == 0) {
+        reader->start += header;
+        tok->value = NULL;
+        return TOKEN_OK;
+    }
+
+    /* Read the payload, which may move the buffered header. */
+    status = reader_fill(reader, header + tok->length, timeout);
+    if (status != TOKEN_OK)
+        return status;
+    tok->value = reader->buffer + reader->start + header;
+    reader->start += header + tok->length;
+    if (reader->start == reader->end) {
+        reader->start = 0;
+        reader->end = 0;
+    }
+    return TOKEN_OK;
+}
+
+
+/*
+ * Determine how many bytes of unparsed data the reader needs before it holds
+ * the next complete token, which is zero if it already does.  Returns
+ * TOKEN_FAIL_LARGE if the next token is longer than max.
+ */
+static enum token_status
+reader_needed(struct token_reader *reader, size_t max, size_t *need)
+{
+    OM_uint32 len;
+    size_t length;
+    const size_t header = TOKEN_HEADER_SIZE;
+
+    *need = header;
+    if (reader->end - reader->start >= header) {
+        memcpy(&len, reader->buffer + reader->start + 1, sizeof(OM_uint32));
+        length = ntohl(len);
+        if (length > max)
+            return TOKEN_FAIL_LARGE;
+        *need = header + length;
+    }
+    if (reader->end - reader->start >= *need)
+        *need = 0;
+    return TOKEN_OK;
+}
+
+
+/*
+ * Return whether the reader already holds a complete token, without reading
+ * from the network.
+ */
+bool
+token_reader_buffered(struct token_reader *reader)
+{
+    size_t need;
+
+    if (reader == NULL)
+        return false;
+    if (reader_needed(reader, SIZE_MAX, &need) != TOKEN_OK)
+        return false;
+    return need == 0;
+}
+
+
+/*
+ * Read whatever data is available without waiting and report whether the
+ * reader now holds a complete token of at most max bytes, so that the next
+ * token_reader_recv will return without reading from the network.  The file
+ * descriptor must be non-blocking.  Reads until a complete token is buffered
+ * or no more data is available.  Returns TOKEN_OK, setting ready, or one of
+ * the TOKEN_FAIL_* codes on a network error, end of file, or a token that is
+ * too large.
+ */
+enum token_status
+token_reader_poll(struct token_reader *reader, size_t max, bool *ready)
+{
+    enum token_status status;
+    ssize_t count;
+    size_t need;
+
+    *ready = false;
+    for (;;) {
+        status = reader_needed(reader, max, &need);
+        if (status != TOKEN_OK)
+            return status;
+        if (need == 0) {
+            *ready = true;
+            return TOKEN_OK;
+        }
+        if (!reader_reserve(reader, need))
+            return TOKEN_FAIL_SYSTEM;
+        count = socket_read(reader->fd, reader->buffer + reader->end,
+                            reader->size - reader->end);
+        if (count < 0) {
+            if (socket_errno == EINTR)
+                continue;
+            if (socket_errno == EAGAIN)
+                return TOKEN_OK;
+            return map_socket_error(socket_errno);
+        } else if (count == 0) {
+            socket_set_errno(EPIPE);
+            return TOKEN_FAIL_EOF;
+        }
+        reader->end += (size_t) count;
+    }
+}
@@ -16,6 +16,7 @@
 #include <portable/gssapi.h>
 #include <portable/macros.h>
 #include <portable/socket.h>
+#include <portable/stdbool.h>
 #include <sys/types.h>
 
 /* Token types and flags. */
@@ -29,6 +30,9 @@ enum token_flags {
     TOKEN_PROTOCOL      = (1 << 6)
 };
 
+/* Size of the flags and length that precede the data of every token. */
+#define TOKEN_HEADER_SIZE (1 + 4)
+
 /* Failure return codes from token_send and token_recv. */
 enum token_status {
     TOKEN_OK = 0,
@@ -41,6 +45,21 @@ enum token_status {
     TOKEN_FAIL_TIMEOUT = -7     /* Timeout sending or receiving token */
 };
 
+/*
+ * A buffered reader for the tokens arriving on a single connection.  Rather
+ * than reading the flags, length, and payload with separate system calls, it
+ * reads whatever is available into its buffer and parses tokens out of that.
+ * Once a reader is in use for a connection, all reads from that connection
+ * must go through it or buffered data will be lost.
+ */
+struct token_reader {
+    socket_type fd;             /* Connection to read from. */
+    char *buffer;               /* Read-ahead buffer. */
+    size_t size;                /* Allocated size of buffer. */
+    size_t start;               /* Offset of the first unparsed byte. */
+    size_t end;                 /* Offset just past the last byte read. */
+};
+
 BEGIN_DECLS
 
 /* Default to a hidden visibility for all util functions. */
@@ -56,6 +75,53 @@ enum token_status token_send(socket_type, int flags, gss_buffer_t,
 enum token_status token_recv(socket_type, int *flags, gss_buffer_t,
                              size_t max, time_t timeout);
 
+/*
+ * Send a token whose data of the given length is already in buffer following
+ * TOKEN_HEADER_SIZE bytes of reserved space.  The flags and length are
+ * written into that space and the token is sent with a single write, without
+ * copying the data.
+ */
+enum token_status token_send_buffer(socket_type, int flags, char *buffer,
+                                    size_t length, time_t timeout);
+
+/*
+ * Fill in the flags and length of a token whose data of the given length
+ * follows TOKEN_HEADER_SIZE bytes of reserved space in buffer, as
+ * token_send_buffer does, without sending it.  Returns false with errno set
+ * if the length is too large.
+ */
+bool token_frame(char *buffer, int flags, size_t length);
+
+/*
+ * Create and free a buffered token reader for a file descriptor.
+ * token_reader_new returns NULL and sets errno if memory allocation fails.
+ * Freeing the reader does not close the file descriptor.
+ */
+struct token_reader *token_reader_new(socket_type)
+    __attribute__((__malloc__));
+void token_reader_free(struct token_reader *);
+
+/*
+ * Receive a token using a buffered reader.  The semantics are the same as
+ * token_recv except that the value member of the token points into the
+ * reader's buffer.  It must not be freed and is only valid until the next
+ * call to token_reader_recv or token_reader_free.
+ */
+enum token_status token_reader_recv(struct token_reader *, int *flags,
+                                    gss_buffer_t, size_t max, time_t timeout);
+
+/*
+ * Read whatever is available from a non-blocking file descriptor into a
+ * buffered reader without waiting, and set ready to whether a complete token
+ * of at most max bytes is now buffered.  If so, the next token_reader_recv
+ * will not touch the network.
+ */
+enum token_status token_reader_poll(struct token_reader *, size_t max,
+                                    bool *ready);
+
+/* Return whether a complete token is buffered, without reading. */
+bool token_reader_buffered(struct token_reader *);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 